@@ -12,6 +12,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include "Tools.h"
@@ -28,6 +31,8 @@ enum CModeType{
 /*
  * m_headersize -- 文件头的大小
  * m_pre_extend_itemcap---扩容前的大小，默认是0，表示没有扩展
+ * m_hashid/m_hashseed -- 上层hash结构使用的hash函数ID和seed, 0表示未设置
+ * m_bucketnum -- 上层hash结构当前使用的bucket个数(线性hash会逐个增加), 0表示未设置
  */
 struct CMmapHeader{
     size_t m_headersize;
@@ -37,15 +42,75 @@ struct CMmapHeader{
     size_t m_realcapacity;
     size_t m_pre_extend_itemcap; 
     size_t m_nextwritepos;
+    size_t m_hashid;
+    size_t m_hashseed;
+    size_t m_bucketnum;
     CMmapHeader():m_headersize(0),m_version(0),m_itemsize(0),
     m_itemcount(0),m_realcapacity(0),m_pre_extend_itemcap(0),
-    m_nextwritepos(0){
+    m_nextwritepos(0),m_hashid(0),m_hashseed(0),m_bucketnum(0){
     }
 };
 
 const int HEADER_SIZE = sizeof( CMmapHeader );
-const int HEADER_VERSION = 100;
+const int HEADER_VERSION = 102;
 const int EXTEND_SIZE = 10*1024*1024;
+const size_t HUGE_PAGE_SIZE = 2*1024*1024;
+//记录修改范围的分块个数上限,文件很大时每块按2的幂变大
+const size_t DIRTY_MAX_SLOTS = 65536;
+
+class CFlusher;
+
+/*
+ * 文件扩容策略
+ * m_factor -- >1.0时每次扩容为当前文件大小的(m_factor-1)倍(几何增长),否则按构造/打开时确定的固定大小
+ * m_minstep/m_maxstep -- 每次扩容的最小/最大字节数, 0表示不限制
+ * m_fallocate -- 用posix_fallocate预先分配磁盘块,不产生稀疏文件;不支持时退回ftruncate
+ */
+struct CGrowthPolicy{
+    double m_factor;
+    size_t m_minstep;
+    size_t m_maxstep;
+    bool m_fallocate;
+    CGrowthPolicy():m_factor(0),m_minstep(0),m_maxstep(0),m_fallocate(false){
+    }
+};
+
+/*
+ * 文件的映射方式
+ * m_populate -- MAP_POPULATE,映射时把整个文件读进内存,之后访问不再缺页
+ * m_hugepage -- madvise(MADV_HUGEPAGE),文件在tmpfs/hugetlbfs上时可以用透明大页,减少TLB miss;
+ *               预留地址空间时起始地址按2M对齐
+ * m_advice -- MADV_NORMAL/MADV_RANDOM(随机访问的索引文件,关闭预读)/MADV_SEQUENTIAL(顺序扫描)
+ * m_willneed -- madvise(MADV_WILLNEED),映射后异步预读
+ */
+struct CMapPolicy{
+    bool m_populate;
+    bool m_hugepage;
+    int m_advice;
+    bool m_willneed;
+    CMapPolicy():m_populate(false),m_hugepage(false),m_advice(MADV_NORMAL),m_willneed(false){
+    }
+};
+
+/*
+ * 一段已经映射的内存,用于预热等只读的遍历
+ */
+struct CMapRegion{
+    string m_name;
+    const char* m_addr;
+    size_t m_len;
+};
+
+/*
+ * 扩容统计: 次数,扩容的总字节数,耗时(包括msync/重新映射)
+ */
+struct CExtendStats{
+    size_t m_count;
+    size_t m_bytes;
+    double m_seconds;
+    CExtendStats():m_count(0),m_bytes(0),m_seconds(0){
+    }
+};
 
 class CBaseMmap{
 public:
@@ -67,13 +132,37 @@ private:
 
     void* m_vmStartAddr;
     CMmapHeader* m_pheader;
+    size_t m_reserveSize; //预留的虚拟地址空间大小,0表示不预留
+    CGrowthPolicy m_growth;
+    CExtendStats m_stats;
+    CMapPolicy m_mappolicy;
+    std::vector<std::pair<void*,size_t> > m_retired; //预留空间用完后换下来的旧映射,关闭文件时才释放
+    CFlusher* m_flusher;  //后台刷盘,NULL时由SaveAllModifyData/Sync刷盘
+    bool m_trackDirty;    //false时不记录修改范围,每轮刷整个映射
+    const std::atomic<uint64_t>* m_epoch;  //flusher当前的修改序号
+    std::atomic<uint64_t>* m_dirty;  //每个分块最后一次修改时的序号,0表示没有修改
+    size_t m_dirtySlots;
+    size_t m_dirtyShift;  //分块大小为1<<m_dirtyShift字节
+    std::vector<uint64_t> m_dirtySeen;
+    std::mutex m_dirtyLock;  //刷盘和扩容(重新映射)互斥
 private:
     bool InitHeader();
     bool CreateAndInitFile();
     bool ExtendFile( size_t len );
+    size_t NextExtendSize() const;
+    bool DoExtend( size_t len );
     bool MapFile();
+    bool MapTail( size_t oldsize );
+    int MapFlags() const;
+    void AdviseRange( void* addr, size_t len ) const;
+    bool ReserveAndMap( int fd );
+    void UnmapAll();
     bool SaveData( char *syn_buf_start, size_t syn_buf_len, int sync_flag = MS_ASYNC );
     bool Myclose();
+    void AttachFlusher();
+    void DetachFlusher();
+    void ResizeDirty();
+    void NoteDirty();
 public:
     bool CreateAndMapFile( const string& filename );
     bool OpenAndMapFile(const string& filename );
@@ -82,16 +171,62 @@ public:
     int WriteData( void* data, size_t count, bool sysncflag = false );
     bool WriteData( size_t offset,void* data, size_t count, bool sysncflag = false );
     bool SaveAllModifyData();
+    //同步写回整个映射(MS_SYNC),返回时数据已经落盘,用于journal的checkpoint
+    bool Sync();
     //从偏移量data_offset,读取count个自己到buf中
     //buf由使用方来进行分配和释放
     bool ReadData( size_t data_offset, void* buf, size_t count );
     bool ExtendFileAndMap(size_t count = 0);
+    /*
+     *  文件缩小到刚好放下count个条目(按页取整),截掉的部分从映射中去掉;
+     *  调用方保证截掉的部分没有数据,并且读进程不再访问它(读进程旧的映射访问到文件末尾之后会收到SIGBUS)
+     */
+    bool ShrinkFileAndMap( size_t count );
+    //其他进程扩容过文件时,按当前的文件大小重新映射(文件没有变大时什么都不做)
+    bool RemapFile();
 
     //文件是否已经被mmap
     bool IsBeenMmap() const {
         return m_vmStartAddr==MAP_FAILED?false:true;
     }
 
+    /*
+     *  打开文件之前调用: 预留reservesize字节的虚拟地址空间(PROT_NONE,不占内存),文件映射在预留空间的开头,
+     *  扩容时只把新增的部分MAP_FIXED映射到原来映射的后面,起始地址不变,之前返回的指针一直有效;
+     *  文件超过预留大小时另外预留一块翻倍的空间重新映射,旧的映射保留到关闭文件,旧指针仍然可用
+     */
+    void SetReserveSize( const size_t reservesize ){
+        m_reserveSize = (reservesize + m_pageSize - 1) & ~(m_pageSize - 1);
+    }
+    bool IsReserved() const { return m_reserveSize > 0; }
+    void SetGrowthPolicy( const CGrowthPolicy& policy ){ m_growth = policy; }
+    //创建文件之前调用,修改每个item的字节数;打开已有文件时以文件头中的为准
+    void SetItemSize( size_t itemsize ){ m_itemsize = itemsize; }
+    const CExtendStats& GetExtendStats() const { return m_stats; }
+    //打开文件之前调用,之后每次映射(包括扩容新增的部分)都按这个方式
+    void SetMapPolicy( const CMapPolicy& policy ){ m_mappolicy = policy; }
+    //修改已映射部分的访问方式(MADV_*),如全量扫描前改成MADV_SEQUENTIAL,扫描完再改回来
+    bool Advise( int advice );
+    //当前映射的范围(包括文件头),name用来在预热profile中标识这个文件
+    CMapRegion GetRegion( const string& name ) const{
+        CMapRegion r;
+        r.m_name = name;
+        r.m_addr = IsBeenMmap() ? (const char*)m_vmStartAddr : NULL;
+        r.m_len = IsBeenMmap() ? m_totalSize : 0;
+        return r;
+    }
+    /*
+     *  打开文件之前调用: 由flusher在后台把修改过的范围写回磁盘(见CFlusher),之后SaveAllModifyData和扩容不再msync整个文件;
+     *  track为false时不记录修改范围,每轮刷整个映射,用于直接通过指针修改而不调用MarkDirty的文件
+     */
+    void SetFlusher( CFlusher* flusher, bool track = true ){ m_flusher = flusher; m_trackDirty = track; }
+    //记录[offset, offset+len)被修改过(offset包括文件头); WriteData会调用,直接通过指针修改时由调用方调用
+    inline void MarkDirty( size_t offset, size_t len );
+    /*
+     *  flusher调用: 把修改过的分块按连续的段同步写回(MS_SYNC),没有修改时什么都不做;
+     *  之后清掉序号小于epoch的记录,bytes累加修改过的分块的字节数
+     */
+    bool FlushDirty( uint64_t epoch, size_t& bytes );
     void SetExtendSize( const size_t extendsize ){ m_extendSize = extendsize; }
     void SetInitSize( const size_t initsize ){ m_initSize = initsize; }
     //重新设置下次需要写入的位置
@@ -106,12 +241,35 @@ public:
     inline size_t GetCapacity();
 };
 
+/*
+ *  只在分块的序号变化时写,同一次修改反复写同一块不产生额外的cache line写;
+ *  分块第一次变脏时计入flusher的字节预算
+ */
+inline void CBaseMmap::MarkDirty( size_t offset, size_t len ){
+    if ( m_dirty == nullptr || len == 0 )
+        return;
+    uint64_t epoch = m_epoch->load( std::memory_order_relaxed );
+    size_t last = (offset + len - 1) >> m_dirtyShift;
+    if ( last >= m_dirtySlots )
+        last = m_dirtySlots - 1;
+    for ( size_t i = offset >> m_dirtyShift; i <= last; i++ ){
+        uint64_t old = m_dirty[i].load( std::memory_order_relaxed );
+        if ( old != epoch ){
+            m_dirty[i].store( epoch, std::memory_order_relaxed );
+            if ( old == 0 )
+                NoteDirty();
+        }
+    }
+}
+
 inline void CBaseMmap::SetNextWritepos( const size_t pos){
     m_pheader->m_nextwritepos = pos;
+    MarkDirty( 0, HEADER_SIZE );
 }
 
 inline void CBaseMmap::SetItemCount( const size_t itemcount ){
     m_pheader->m_itemcount = itemcount;
+    MarkDirty( 0, HEADER_SIZE );
 }
 
 inline void* CBaseMmap::GetvmAddr(){
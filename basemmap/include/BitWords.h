@@ -0,0 +1,32 @@
+/*
+ *    功能说明: bit位文件按64位的字处理的工具函数
+ *    位置pos对应第pos/64个字的第pos%64位(小端下就是第pos/8个字节的第pos%8位)
+ *    全量扫描一次处理一个字(AVX2时一次4个字),全为0的字直接跳过,不再逐位判断
+ */
+
+#ifndef _H_BIT_WORDS_H__
+#define _H_BIT_WORDS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace shm{
+
+/*
+ *    前nbits位中为1的位数
+ */
+size_t PopcountWords( const uint64_t* words, size_t nbits );
+
+/*
+ *    从start开始(包括start)第一个为1的位置,nbits之前没有时返回SIZE_MAX
+ */
+size_t NextSetBit( const uint64_t* words, size_t nbits, size_t start );
+
+/*
+ *    前nbits位中最后一个为1的位置,没有时返回SIZE_MAX
+ */
+size_t PrevSetBit( const uint64_t* words, size_t nbits );
+
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ *    功能说明: 基于CBaseMmap的分块bloom filter,用来在查索引之前过滤掉不存在的key
+ *    每个block 64字节(一个cache line),一个key的所有bit都在同一个block里,查询只访问一个cache line
+ *    数据区第一个64字节保存CBloomMeta,block从之后第一个64字节对齐的位置开始
+ *
+ *    bloom filter不能删除,删除key时只计数(m_deletedcount),bit保留,误判率会升高,
+ *    key或删除次数太多时由上层调用Reset按新的容量重建
+ *    Reset写临时文件,Add完所有key后Publish用rename覆盖,旧文件标记为retired,
+ *    其他进程还在用旧文件时MayContain一律返回true,不会漏判
+ */
+
+#ifndef _H_BLOOM_FILTER_H__
+#define _H_BLOOM_FILTER_H__
+
+#include <stdint.h>
+#include <string>
+#include "BaseMmap.h"
+
+using std::string;
+
+namespace shm{
+
+const size_t BLOOM_BLOCK_SIZE = 64;
+const size_t BLOOM_MIN_CAPACITY = 1024;
+
+struct CBloomMeta{
+    uint64_t m_magic;
+    uint64_t m_blocknum;
+    uint64_t m_hashnum;      //每个key设置的bit数
+    uint64_t m_capacity;     //按这个key个数和m_fpr计算的大小
+    uint64_t m_keycount;
+    uint64_t m_deletedcount;
+    double m_fpr;
+    uint64_t m_retired;
+};
+
+class CBloomFilter{
+public:
+    CBloomFilter( const string& filename, CModeType modetype = M_READWRITE );
+    ~CBloomFilter();
+
+    /*
+     *    打开已有文件(参数以文件中为准),不存在时按capacity/fpr创建
+     *    capacity -- 预计的key个数
+     *    fpr -- 期望的误判率,如0.01
+     */
+    bool Init( size_t capacity, double fpr );
+
+    //hash是key的64位hash
+    void Add( uint64_t hash );
+    bool MayContain( uint64_t hash ) const;
+    void MarkDeleted();
+
+    /*
+     *    按新的容量在临时文件中创建一个空的filter,之后Add的key都写到新filter中,
+     *    重新Add完所有key后调用Publish替换当前文件
+     *    fpr<=0表示沿用当前的误判率
+     */
+    bool Reset( size_t capacity, double fpr = 0 );
+    bool Publish();
+
+    size_t GetKeyCount() const;
+    size_t GetDeletedCount() const;
+    size_t GetCapacity() const;
+    size_t GetBlockNum() const;
+    double GetFpr() const;
+    bool SaveToDisk();
+
+    //读进程使用: 当前文件已经被Reset替换时重新打开
+    bool Refresh();
+    //Init之前调用,之后打开/重建的文件都按这个方式映射
+    void SetMapPolicy( const CMapPolicy& policy );
+
+private:
+    bool Open( const string& filename, size_t capacity, double fpr );
+    void Close();
+    inline const uint64_t* Block( uint64_t hash, uint64_t& mix ) const;
+
+private:
+    string m_filename;
+    CModeType m_modetype;
+    CBaseMmap* m_mmap;
+    CBloomMeta* m_meta;
+    uint64_t* m_blocks;
+    CMapPolicy m_mappolicy;
+    CBaseMmap* m_oldmmap;   //Reset之后Publish之前,还在其他进程使用中的旧文件
+};
+
+}
+#endif
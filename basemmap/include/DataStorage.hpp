@@ -4,7 +4,15 @@
  *   bit位的数据会尽量分配,目前第一次分配是传入数量的8倍,
  *
  *   第一版不支持并发写
+ *   一写多读: 数据写完后才设置bit位(release),读进程看到bit位时数据是完整的;
+ *   写进程扩容后读进程调用Refresh重新映射
+ *   并发写: BeginConcurrent之后InsertData(不指定pos)可以被多个线程同时调用,
+ *   位置用原子操作从已用区域的末尾往后分配(不复用删除的位置),容量不够时返回STO_FULL,
+ *   由上层在没有其他线程访问时调用EnsureCapacity扩容(扩容会重新mmap)
  *   m_ratio  >=1.0-- 表示不扩容
+ *   带标记的布局(SetInlineTag): 数据文件中每个位置前面加8字节的标记,非0表示有数据,
+ *   读进程查找时只访问数据文件,标记和数据在同一个cache line(item较大时至少和头部在一起);
+ *   bit位文件照常维护,写进程分配位置/统计/遍历仍然使用bit位
  */
 
 #ifndef _H_DATA_STORAGE_H__
@@ -17,6 +25,8 @@
 #include <atomic>
 #include <iostream>
 #include "BaseMmap.h"
+#include "SlotSummary.h"
+#include "BitWords.h"
 
 using std::string;
 using std::vector;
@@ -26,13 +36,17 @@ namespace shm{
 
 #define SEQ_INSERT_FLAG (-1)
 
+//带标记的布局中每个位置前面的标记大小
+const size_t OCCUPY_TAG_SIZE = 8;
+
 enum STO_RESULT{
     STO_OK = 0,
     STO_FAIL = -1, //处理失败
     STO_EXIST = -2, // 冲突--传入的位置已经存在数据
     STO_ILLEGAL_POS = -3, // pos非法
     STO_NORESULT = -4, //表示查找pos无数据
-    STO_NOWRITE = -5 //不可写
+    STO_NOWRITE = -5, //不可写
+    STO_FULL = -6 //并发写模式下容量不够,需要上层扩容后重试
 };
 
 //针对插入的冲突外部的调用来解决
@@ -72,6 +86,13 @@ public:
      */
     const T* FindDataPtr( size_t pos);
 
+    /*
+     *  返回pos位置数据的可写指针,只读模式或者pos没有数据时返回NULL
+     *  用于对单个字段做原子更新(如链表的next指针),不经过UpdateData的整体拷贝
+     *  使用flusher时这里就记录pos被修改,之后通过指针的写入算在当前这次修改里
+     */
+    T* FindWritePtr( size_t pos);
+
     /*
      *    参数说明： 
      *    pos --查找的数据所在的下标
@@ -105,6 +126,22 @@ public:
      */
     inline bool ChangeExist( size_t pos);
 
+    /*
+     *    从startpos开始(包括startpos)下一个有数据的位置,没有时返回SIZE_MAX
+     *    按字跳过没有数据的部分,全量遍历: for(i=NextUsedPos(0); i!=SIZE_MAX; i=NextUsedPos(i+1))
+     */
+    inline size_t NextUsedPos( size_t startpos );
+
+    /*
+     *    按bit位统计的数据个数(popcount),不修改文件头
+     */
+    size_t CountItems();
+
+    /*
+     *    最后一个有数据的位置加1,没有数据时返回0
+     */
+    size_t GetUsedEnd();
+
     /*
      *    获取mmap的容量
      */
@@ -119,23 +156,115 @@ public:
      *  获取下次能够写入的数据位置
      */
     inline size_t GetNextWritePos();
+
+    /*
+     *  获取数据文件的文件头,上层用来保存自己的元信息(如hash函数ID)
+     */
+    inline CMmapHeader* GetDataHeader();
+
+    /*
+     *  预取pos位置的bit位和数据到cache,只发出prefetch指令不等待,
+     *  批量查询时先对一批下标调用,再依次FindDataPtr,用来掩盖内存访问延迟
+     */
+    inline void Prefetch( size_t pos );
     /*
      *  数据同步到disk
      */
     STO_RESULT SaveToDisk();
 
+    /*
+     *  数据文件和bit位文件同步写回磁盘(MS_SYNC),返回时已经落盘
+     */
+    STO_RESULT Sync();
+
+    /*
+     *  崩溃恢复使用: 按bit位重新统计数据个数,重新确定下次写入的位置,写回文件头
+     *  (数据个数只在部分操作时写到文件头,异常退出后文件头中的值可能不准),带标记时按bit位补上缺少的标记
+     *  返回数据个数
+     */
+    size_t RecountItems();
+
     /*
      *  扩展mmap的大小(bitmmap/datammap)
      */
     bool ExtendSize();
+
+    /*
+     *    数据文件截短到最后一个有数据的位置之后(按页取整,并按扩容比例留出余量,避免马上又扩容),
+     *    bit位文件不变;只能在写进程非并发模式下调用。
+     *    读进程需要Refresh,截掉的部分不能再访问(之前取得的指向截掉部分的指针失效)
+     */
+    bool Shrink();
+
+    /*
+     *  Init之前调用,数据文件预留datasize字节的地址空间(bit位文件按比例预留),
+     *  之后扩容原地进行,FindDataPtr返回的指针在扩容后仍然有效,见CBaseMmap::SetReserveSize
+     */
+    void SetReserveSize( size_t datasize );
+
+    /*
+     *  Init之前调用,设置扩容策略;bit位文件的最小/最大步长按数据文件的1/(8*itemsize)折算
+     */
+    void SetGrowthPolicy( const CGrowthPolicy& policy );
+
+    /*
+     *  扩容统计,数据文件和bit位文件之和
+     */
+    CExtendStats GetExtendStats() const;
+
+    /*
+     *  Init之前调用,数据文件和bit位文件改由flusher在后台写回修改过的范围,见CFlusher
+     */
+    void SetFlusher( CFlusher* flusher );
+
+    /*
+     *  Init之前调用,新建数据文件时使用带标记的布局;打开已有的文件时按文件头中的item大小判断,
+     *  原来不带标记的文件照常读写
+     */
+    void SetInlineTag( bool tagged );
+    bool IsInlineTag() const { return m_tagged; }
+
+    /*
+     *  Init之前调用,数据文件和bit位文件的映射方式(MAP_POPULATE/大页/madvise),见CMapPolicy
+     */
+    void SetMapPolicy( const CMapPolicy& policy );
+
+    /*
+     *  修改已映射部分的访问方式(MADV_*),如全量扫描之前设置MADV_SEQUENTIAL
+     */
+    bool Advise( int advice );
+
+    /*
+     *  数据文件和bit位文件当前的映射范围,按文件名(不含目录)标识,用于预热
+     */
+    void GetMapRegions( vector<CMapRegion>& regions ) const;
+
+    /*
+     *  读进程使用: 写进程扩容后重新映射数据和bit位文件,并从文件头同步容量和数据个数
+     */
+    bool Refresh();
+
+    /*
+     *  进入/退出并发写模式,调用时不能有其他线程在访问
+     */
+    void BeginConcurrent();
+    void EndConcurrent();
+
+    /*
+     *  并发写模式下分配位置已经到达容量时扩容,调用时不能有其他线程在访问
+     */
+    bool EnsureCapacity();
 private:
+    STO_RESULT InsertConcurrent( T& data, size_t& realstoragepos );
     void Set( size_t pos );
     bool Get( size_t pos );
     void Del( size_t pos );
+    //读进程判断pos是否有数据: 带标记时读标记,否则读bit位
+    inline bool Occupied( size_t pos );
+    inline uint64_t* TagAddr( size_t pos );
     /*
-     *  往右侧查找空闲位置,如果查找失败，则从左侧查找一个空闲位置
-     *  一定会查找到一个空闲位置,此处返回的结果不做0值判断
-     *    ( ratio = 0.8 ) 会扩展mmap的大大小，不会存在写满的情况
+     *  往右侧查找空闲位置,如果查找失败，则从头查找一个空闲位置
+     *  通过m_slots按字跳过已经写满的部分,不再逐位扫描;都已写满时返回容量大小
      */
     size_t GetIdlepos( size_t startpos );
     inline size_t Getoffset( size_t pos );
@@ -143,11 +272,14 @@ private:
 private:
     size_t m_itemcapacity;
     size_t m_itemsize;
-    size_t  m_deletepos;//维护删除的位置，保留最新删除的位置
+    size_t m_slotsize;  //数据文件中每个位置的字节数,带标记时包括标记和对齐
+    bool m_tagged;
     CModeType m_modetype;
     double m_ratio;
     atomic<size_t> m_storageItemcount;
     size_t m_nextwritepos;
+    bool m_concurrent;
+    atomic<size_t> m_reservepos;  //并发写模式下下一个分配的位置
     string m_datafilename; 
     string m_bitfilename;
     char* m_bitdataAddr;
@@ -155,6 +287,7 @@ private:
     void* m_dataAddr;
     CBaseMmap m_datammap;
     CBaseMmap m_bitmmap;
+    CSlotSummary m_slots;  //写进程的空闲位置索引,m_nextwritepos之前的位置都已使用
 };
 
 /*
@@ -162,8 +295,9 @@ private:
  */
 template<typename T>
 CDataStorage<T>::CDataStorage(string& datafilename,string& bitfilename,size_t itemcapacity,
-         CModeType modetype,double ratio ):m_itemcapacity(itemcapacity),m_itemsize(sizeof(T)),m_deletepos(SIZE_MAX),
-    m_modetype(modetype),m_ratio(ratio),m_storageItemcount(0),m_nextwritepos(0),m_datafilename(datafilename), 
+         CModeType modetype,double ratio ):m_itemcapacity(itemcapacity),m_itemsize(sizeof(T)),
+    m_slotsize(sizeof(T)),m_tagged(false),
+    m_modetype(modetype),m_ratio(ratio),m_storageItemcount(0),m_nextwritepos(0),m_concurrent(false),m_reservepos(0),m_datafilename(datafilename), 
     m_bitfilename(bitfilename),m_bitdataAddr(nullptr),m_bitAddr(nullptr),m_dataAddr(nullptr),
     m_datammap(sizeof(T),itemcapacity,EXTEND_SIZE,modetype), m_bitmmap(1, itemcapacity,EXTEND_SIZE, modetype){
 }
@@ -175,63 +309,80 @@ CDataStorage<T>::~CDataStorage(){
     m_datammap.CloseFile();
 }
 
+/*
+ *  bit位按64位的字原子修改,多个线程同时设置同一个字里的不同位不会互相覆盖
+ *  (小端下第pos/64个字的第pos%64位就是第pos/8个字节的第pos%8位,和Get一致)
+ */
 template<typename T>
 void CDataStorage<T>::Set( size_t pos ){
-    int bkt = pos/8;
-    int offset = pos%8;
-    char* ptr = m_bitdataAddr + bkt;
-    *ptr |= ( 1 << offset );
+    uint64_t* word = (uint64_t*)m_bitdataAddr + pos/64;
+    __atomic_fetch_or( word, 1ull << (pos%64), __ATOMIC_RELEASE );
+    m_bitmmap.MarkDirty( HEADER_SIZE + pos/8, 1 );
+    //先设置bit位再设置标记,删除时顺序相反,异常退出后有标记的位置一定有bit位
+    if( m_tagged ){
+        __atomic_store_n( TagAddr( pos ), 1, __ATOMIC_RELEASE );
+        m_datammap.MarkDirty( HEADER_SIZE + pos * m_slotsize, OCCUPY_TAG_SIZE );
+    }
 }
 
 template<typename T>
 bool CDataStorage<T>::Get( size_t pos ){
-    int bkt = pos/8;
-    int offset = pos%8;
-    char* ptr = m_bitdataAddr + bkt;
-    return (*ptr & (1 << offset)) == 0 ? false : true;
+    const uint64_t* word = (const uint64_t*)m_bitdataAddr + pos/64;
+    return (__atomic_load_n( word, __ATOMIC_RELAXED ) >> (pos%64)) & 1;
 }
 
 template<typename T>
 void CDataStorage<T>::Del( size_t pos ){
-    int bkt = pos/8;
-    int offset = pos%8;
-    char* ptr = m_bitdataAddr + bkt;
-    *ptr ^= (1 << offset);
+    if( m_tagged ){
+        __atomic_store_n( TagAddr( pos ), 0, __ATOMIC_RELEASE );
+        m_datammap.MarkDirty( HEADER_SIZE + pos * m_slotsize, OCCUPY_TAG_SIZE );
+    }
+    uint64_t* word = (uint64_t*)m_bitdataAddr + pos/64;
+    __atomic_fetch_and( word, ~(1ull << (pos%64)), __ATOMIC_RELEASE );
+    m_bitmmap.MarkDirty( HEADER_SIZE + pos/8, 1 );
 }
 
 template<typename T>
-size_t CDataStorage<T>::GetIdlepos( size_t startpos ){
-    if (m_deletepos != SIZE_MAX)
-        return m_deletepos;
-    size_t i = startpos++;
-    for( ; i<m_itemcapacity; i++  ){
-        if( Get(i) )
-            continue;
-        break;
-    }
+inline uint64_t* CDataStorage<T>::TagAddr( size_t pos ){
+    return (uint64_t*)((char*)m_dataAddr + HEADER_SIZE + pos * m_slotsize);
+}
 
-    if( i >= m_itemcapacity ){
-        for( i = startpos--; i >=0; i--){
-            if( Get(i) )
-                continue;
-            break;
-        }
-    }
-    //return i == 0 ? -1: i;
-    return i;
+template<typename T>
+inline bool CDataStorage<T>::Occupied( size_t pos ){
+    if( !m_tagged )
+        return Get( pos );
+    if( pos >= m_itemcapacity )
+        return false;
+    return __atomic_load_n( TagAddr( pos ), __ATOMIC_RELAXED ) != 0;
+}
+
+template<typename T>
+size_t CDataStorage<T>::GetIdlepos( size_t startpos ){
+    const uint64_t* words = (const uint64_t*)m_bitdataAddr;
+    size_t pos = m_slots.FindFree( words, startpos );
+    if( pos == SIZE_MAX && startpos > 0 )
+        pos = m_slots.FindFree( words, 0 );
+    //已经写满,返回容量大小,下次插入前会先扩容
+    if( pos == SIZE_MAX || pos >= m_itemcapacity )
+        return m_itemcapacity;
+    return pos;
 }
 
 template<typename T>
 inline size_t CDataStorage<T>::Getoffset( size_t pos ){
-    return pos * m_itemsize + HEADER_SIZE;
+    return pos * m_slotsize + HEADER_SIZE + (m_tagged ? OCCUPY_TAG_SIZE : 0);
 }
 
 template<typename T>
 void CDataStorage<T>::WriteHeaderInfo(){
+    size_t next = m_nextwritepos;
+    if( m_concurrent ){
+        next = m_reservepos.load() < m_itemcapacity ? m_reservepos.load() : m_itemcapacity;
+    }
     m_bitmmap.SetItemCount( m_storageItemcount.load() );
     m_datammap.SetItemCount( m_storageItemcount.load() );
-    m_bitmmap.SetNextWritepos( m_nextwritepos );
-    m_datammap.SetNextWritepos(  m_nextwritepos  );
+    m_bitmmap.SetNextWritepos( next );
+    m_datammap.SetNextWritepos( next );
 }
 
 template<typename T>
@@ -250,7 +401,22 @@ bool CDataStorage<T>::Init(){
     m_nextwritepos = m_bitmmap.GetHeaderaddr()->m_nextwritepos;
     m_storageItemcount.store(m_bitmmap.GetHeaderaddr()->m_itemcount);
     m_itemcapacity = m_datammap.GetHeaderaddr()->m_realcapacity;
-    m_itemsize =m_datammap.GetHeaderaddr()->m_itemsize;
+    m_slotsize = m_datammap.GetHeaderaddr()->m_itemsize;
+    m_tagged = m_slotsize == ((sizeof(T) + 7) & ~(size_t)7) + OCCUPY_TAG_SIZE;
+    m_itemsize = m_tagged ? sizeof(T) : m_slotsize;
+    if( m_modetype != M_READ ){
+        //按bit位重建空闲位置索引,从最小的空闲位置开始写
+        m_slots.Build( (const uint64_t*)m_bitdataAddr, m_itemcapacity );
+        m_nextwritepos = GetIdlepos( 0 );
+        //文件头中的数据个数只在部分操作时写入,和bit位不一致时以bit位为准
+        size_t count = CountItems();
+        if( count != m_storageItemcount.load() ){
+            printf( "%s item count %zu in header, %zu in bitmap\n", m_bitfilename.c_str(),
+                    m_storageItemcount.load(), count );
+            m_storageItemcount.store( count );
+            WriteHeaderInfo();
+        }
+    }
     return true;
 }
 
@@ -265,19 +431,22 @@ STO_RESULT CDataStorage<T>::InsertData( T& data, size_t& realstoragepos, size_t
     }
     if ( m_modetype == M_READ )
         return STO_NOWRITE;
+    if( m_concurrent && pos == SIZE_MAX )
+        return InsertConcurrent( data, realstoragepos );
     STO_RESULT ret = STO_OK;
     //插入到内部的指定位置
     if( pos == SIZE_MAX ){
-        int result = m_datammap.WriteData( &data, m_itemsize);
-        if( result < 0 )
+        if( m_nextwritepos >= m_itemcapacity && !ExtendSize() )
             return STO_FAIL;
+        if( !m_datammap.WriteData( Getoffset( m_nextwritepos ), &data, m_itemsize ) )
+            return STO_FAIL;
+        //数据写完之后才能设置bit位,其他进程看到bit位时数据一定是完整的
+        __atomic_thread_fence( __ATOMIC_RELEASE );
         {
             realstoragepos = m_nextwritepos;
             Set( m_nextwritepos );
+            m_slots.Update( (const uint64_t*)m_bitdataAddr, m_nextwritepos );
             m_storageItemcount++;
-            if(m_nextwritepos==m_deletepos) {
-                m_deletepos = SIZE_MAX;
-            }
             m_nextwritepos = GetIdlepos( m_nextwritepos );
             WriteHeaderInfo();
         }
@@ -289,13 +458,12 @@ STO_RESULT CDataStorage<T>::InsertData( T& data, size_t& realstoragepos, size_t
         }else{
             //写入到入参的指定位置
             if( m_datammap.WriteData( Getoffset( pos ), &data, m_itemsize ) ){
+                __atomic_thread_fence( __ATOMIC_RELEASE );
                 m_storageItemcount++;
                 Set( pos );
+                m_slots.Update( (const uint64_t*)m_bitdataAddr, pos );
                 realstoragepos = pos;
                 if ( m_nextwritepos == pos ){
-                    if(m_nextwritepos==m_deletepos) {
-                        m_deletepos = SIZE_MAX;
-                    }
                     m_nextwritepos = GetIdlepos( m_nextwritepos );
                     WriteHeaderInfo();
                 }
@@ -321,17 +489,30 @@ const T* CDataStorage<T>::FindDataPtr( size_t pos){
     if( pos < 0 || pos > m_itemcapacity )   
         return NULL;
 
-    if( Get( pos )){
+    if( Occupied( pos )){
+       __atomic_thread_fence( __ATOMIC_ACQUIRE );
        return (T*)((char*)m_dataAddr + Getoffset(pos));
     }
     return NULL;
 }
 
+template<typename T>
+T* CDataStorage<T>::FindWritePtr( size_t pos){
+    if( m_modetype == M_READ || pos >= m_itemcapacity )
+        return NULL;
+    if( Get( pos ) ){
+        m_datammap.MarkDirty( Getoffset(pos), m_itemsize );
+        return (T*)((char*)m_dataAddr + Getoffset(pos));
+    }
+    return NULL;
+}
+
 template<typename T>
 STO_RESULT CDataStorage<T>::FindData( size_t pos, void* buf, size_t readcount){
     if( pos < 0 || pos > m_itemcapacity)   
         return STO_ILLEGAL_POS;
-    if( Get(pos) ){
+    if( Occupied(pos) ){
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
         if( m_datammap.ReadData( Getoffset(pos),buf,readcount ) )
             return STO_OK;
         return STO_FAIL;
@@ -348,7 +529,12 @@ STO_RESULT CDataStorage<T>::DeleteData( size_t pos){
     if( Get(pos) ){
         Del( pos );
         m_storageItemcount --;
-        m_deletepos = pos;
+        //并发写模式下删除的位置等退出后重建索引时再复用
+        if( !m_concurrent ){
+            m_slots.Update( (const uint64_t*)m_bitdataAddr, pos );
+            if( pos < m_nextwritepos )
+                m_nextwritepos = pos;
+        }
     }
     return STO_OK;
 }
@@ -383,7 +569,23 @@ STO_RESULT CDataStorage<T>::InsertAndUpdateData( T& data, size_t pos){
 
 template<typename T>
 inline bool CDataStorage<T>::ChangeExist( size_t pos){
-    return Get(pos);
+    return Occupied(pos);
+}
+
+template<typename T>
+inline size_t CDataStorage<T>::NextUsedPos( size_t startpos ){
+    return NextSetBit( (const uint64_t*)m_bitdataAddr, m_itemcapacity, startpos );
+}
+
+template<typename T>
+size_t CDataStorage<T>::CountItems(){
+    return PopcountWords( (const uint64_t*)m_bitdataAddr, m_itemcapacity );
+}
+
+template<typename T>
+size_t CDataStorage<T>::GetUsedEnd(){
+    size_t last = PrevSetBit( (const uint64_t*)m_bitdataAddr, m_itemcapacity );
+    return last == SIZE_MAX ? 0 : last + 1;
 }
 
 template<typename T>
@@ -401,6 +603,88 @@ inline size_t CDataStorage<T>::GetNextWritePos(){
     return m_nextwritepos;
 }
 
+template<typename T>
+inline CMmapHeader* CDataStorage<T>::GetDataHeader(){
+    return m_datammap.GetHeaderaddr();
+}
+
+template<typename T>
+bool CDataStorage<T>::Refresh(){
+    if( !m_datammap.RemapFile() || !m_bitmmap.RemapFile() )
+        return false;
+    m_dataAddr = m_datammap.GetvmAddr();
+    m_bitAddr = m_bitmmap.GetvmAddr();
+    m_bitdataAddr = (char*)m_bitmmap.GetDataStartAddr();
+    size_t cap = m_datammap.GetHeaderaddr()->m_realcapacity;
+    size_t mapped = (m_datammap.GetDataSize()) / m_slotsize;
+    size_t bits = m_bitmmap.GetDataSize() * 8;
+    cap = cap < mapped ? cap : mapped;
+    m_itemcapacity = cap < bits ? cap : bits;
+    m_storageItemcount.store( m_bitmmap.GetHeaderaddr()->m_itemcount );
+    m_nextwritepos = m_bitmmap.GetHeaderaddr()->m_nextwritepos;
+    return true;
+}
+
+/*
+ *  CAS分配位置而不是fetch_add,容量不够时不会把分配位置推到容量之外
+ */
+template<typename T>
+STO_RESULT CDataStorage<T>::InsertConcurrent( T& data, size_t& realstoragepos ){
+    size_t pos = m_reservepos.load( std::memory_order_relaxed );
+    do{
+        if( pos >= m_itemcapacity )
+            return STO_FULL;
+    }while( !m_reservepos.compare_exchange_weak( pos, pos+1, std::memory_order_relaxed ) );
+    if( !m_datammap.WriteData( Getoffset( pos ), &data, m_itemsize ) )
+        return STO_FAIL;
+    Set( pos );
+    m_storageItemcount++;
+    realstoragepos = pos;
+    return STO_OK;
+}
+
+/*
+ *  从已经使用的最后一个位置之后开始分配,中间删除留下的空位等退出并发模式后再复用
+ */
+template<typename T>
+void CDataStorage<T>::BeginConcurrent(){
+    m_reservepos.store( GetUsedEnd() );
+    m_concurrent = true;
+}
+
+template<typename T>
+void CDataStorage<T>::EndConcurrent(){
+    if( !m_concurrent )
+        return;
+    m_concurrent = false;
+    m_slots.Build( (const uint64_t*)m_bitdataAddr, m_itemcapacity );
+    m_nextwritepos = GetIdlepos( 0 );
+    WriteHeaderInfo();
+}
+
+template<typename T>
+bool CDataStorage<T>::EnsureCapacity(){
+    while( m_concurrent && m_reservepos.load() >= m_itemcapacity ){
+        if( !ExtendSize() )
+            return false;
+    }
+    return true;
+}
+
+template<typename T>
+inline void CDataStorage<T>::Prefetch( size_t pos ){
+    if( pos >= m_itemcapacity )
+        return;
+    //带标记时标记就在数据前面,不需要访问bit位
+    if( !m_tagged )
+        __builtin_prefetch( m_bitdataAddr + pos/8 );
+    const char* ptr = (char*)m_dataAddr + HEADER_SIZE + pos * m_slotsize;
+    //大的item最多预取4个cache line,entry的头部字段和前几个item都在里面
+    size_t len = m_slotsize < 256 ? m_slotsize : 256;
+    for( size_t i=0; i<len; i+=64 )
+        __builtin_prefetch( ptr + i );
+}
+
 template<typename T>
 STO_RESULT CDataStorage<T>::SaveToDisk(){
     if ( m_modetype == M_READ )
@@ -411,6 +695,93 @@ STO_RESULT CDataStorage<T>::SaveToDisk(){
     return STO_OK;
 }
 
+template<typename T>
+STO_RESULT CDataStorage<T>::Sync(){
+    if ( m_modetype == M_READ )
+        return STO_NOWRITE;
+    WriteHeaderInfo();
+    if( !m_bitmmap.Sync() || !m_datammap.Sync() )
+        return STO_FAIL;
+    return STO_OK;
+}
+
+template<typename T>
+size_t CDataStorage<T>::RecountItems(){
+    size_t count = CountItems();
+    m_storageItemcount.store( count );
+    //插入时先设置bit位再设置标记,异常退出后可能有bit位没有标记,按bit位补上
+    if( m_tagged && m_modetype != M_READ ){
+        for( size_t i = NextUsedPos( 0 ); i != SIZE_MAX; i = NextUsedPos( i + 1 ) ){
+            if( !Occupied( i ) )
+                Set( i );
+        }
+    }
+    if( m_modetype != M_READ )
+        m_slots.Build( (const uint64_t*)m_bitdataAddr, m_itemcapacity );
+    m_nextwritepos = GetIdlepos( 0 );
+    if( m_modetype != M_READ )
+        WriteHeaderInfo();
+    return count;
+}
+
+template<typename T>
+void CDataStorage<T>::SetReserveSize( size_t datasize ){
+    m_datammap.SetReserveSize( datasize );
+    m_bitmmap.SetReserveSize( datasize/m_slotsize/8 + EXTEND_SIZE );
+}
+
+template<typename T>
+void CDataStorage<T>::SetGrowthPolicy( const CGrowthPolicy& policy ){
+    m_datammap.SetGrowthPolicy( policy );
+    CGrowthPolicy bitpolicy = policy;
+    bitpolicy.m_minstep /= m_slotsize*8;
+    bitpolicy.m_maxstep /= m_slotsize*8;
+    if( policy.m_maxstep > 0 && bitpolicy.m_maxstep == 0 )
+        bitpolicy.m_maxstep = 1;
+    m_bitmmap.SetGrowthPolicy( bitpolicy );
+}
+
+template<typename T>
+void CDataStorage<T>::SetFlusher( CFlusher* flusher ){
+    m_datammap.SetFlusher( flusher );
+    m_bitmmap.SetFlusher( flusher );
+}
+
+template<typename T>
+void CDataStorage<T>::SetInlineTag( bool tagged ){
+    m_tagged = tagged;
+    m_slotsize = tagged ? ((sizeof(T) + 7) & ~(size_t)7) + OCCUPY_TAG_SIZE : sizeof(T);
+    m_datammap.SetItemSize( m_slotsize );
+}
+
+template<typename T>
+void CDataStorage<T>::SetMapPolicy( const CMapPolicy& policy ){
+    m_datammap.SetMapPolicy( policy );
+    m_bitmmap.SetMapPolicy( policy );
+}
+
+template<typename T>
+bool CDataStorage<T>::Advise( int advice ){
+    bool ok = m_datammap.Advise( advice );
+    return m_bitmmap.Advise( advice ) && ok;
+}
+
+template<typename T>
+void CDataStorage<T>::GetMapRegions( vector<CMapRegion>& regions ) const{
+    regions.push_back( m_bitmmap.GetRegion( m_bitfilename.substr( m_bitfilename.rfind('/') + 1 ) ) );
+    regions.push_back( m_datammap.GetRegion( m_datafilename.substr( m_datafilename.rfind('/') + 1 ) ) );
+}
+
+template<typename T>
+CExtendStats CDataStorage<T>::GetExtendStats() const{
+    CExtendStats st = m_datammap.GetExtendStats();
+    const CExtendStats& bit = m_bitmmap.GetExtendStats();
+    st.m_count += bit.m_count;
+    st.m_bytes += bit.m_bytes;
+    st.m_seconds += bit.m_seconds;
+    return st;
+}
+
 template<typename T>
 bool CDataStorage<T>::ExtendSize(){
     //首先扩展数据mmap的大小
@@ -422,7 +793,10 @@ bool CDataStorage<T>::ExtendSize(){
         m_dataAddr = m_datammap.GetvmAddr();
         m_itemcapacity = extendItemnm;
         if( m_itemcapacity > bitmmapcount*8 ){
-            flag = m_bitmmap.ExtendFileAndMap();
+            //数据文件按几何增长时一次可能扩很多,bit位文件扩到能覆盖为止
+            while( flag && m_itemcapacity > m_bitmmap.GetDataSize()*8 ){
+                flag = m_bitmmap.ExtendFileAndMap();
+            }
             if( flag ){
                 m_bitAddr = m_bitmmap.GetvmAddr();
                 m_bitdataAddr=(char*)m_bitmmap.GetDataStartAddr(); 
@@ -433,8 +807,31 @@ bool CDataStorage<T>::ExtendSize(){
             //触发一下bitmmap的数据同步
             m_bitmmap.SaveAllModifyData();
         }
+        if( flag )
+            m_slots.Resize( (const uint64_t*)m_bitdataAddr, m_itemcapacity );
     }
     return flag;
 }
+
+template<typename T>
+bool CDataStorage<T>::Shrink(){
+    if( m_modetype == M_READ || m_concurrent )
+        return false;
+    size_t keep = GetUsedEnd();
+    if( m_ratio > 0 && m_ratio < 1 ){
+        size_t need = (size_t)(m_storageItemcount.load() / m_ratio) + 1;
+        keep = keep > need ? keep : need;
+    }
+    if( !m_datammap.ShrinkFileAndMap( keep ) )
+        return false;
+    m_dataAddr = m_datammap.GetvmAddr();
+    size_t cap = m_datammap.GetCapacity();
+    size_t bits = m_bitmmap.GetDataSize() * 8;
+    m_itemcapacity = cap < bits ? cap : bits;
+    m_slots.Build( (const uint64_t*)m_bitdataAddr, m_itemcapacity );
+    m_nextwritepos = GetIdlepos( 0 );
+    WriteHeaderInfo();
+    return true;
+}
 }
 #endif
@@ -0,0 +1,102 @@
+/*
+ *    功能说明: 后台刷盘线程,代替每次扩容/关闭/SaveToDisk时msync整个文件
+ *    注册到flusher的CBaseMmap记录自己被修改过的分块(见CBaseMmap::MarkDirty),
+ *    flusher每隔一段时间,或者新修改的字节数达到预算时,把这些范围msync(MS_SYNC)写回磁盘
+ *
+ *    序号: 上层每完成一次修改调用EndWrite,返回这次修改的序号;修改过程中记录的分块都带着当前的序号。
+ *    一轮刷盘开始时取当前序号epoch,写回所有被修改过的范围,之后只清掉序号小于epoch的记录
+ *    (这些修改在本轮开始前已经完成),还在进行中的修改下一轮会再写一次。
+ *    因此一轮结束后序号小于epoch的修改都已经落盘,FlushUntil(seq)等待到这样的一轮结束
+ *
+ *    并发写时多个线程的修改都用同一个序号,期间不调用EndWrite,记录不会被清掉,结束之后再EndWrite
+ */
+
+#ifndef _H_FLUSHER_H__
+#define _H_FLUSHER_H__
+
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include "BaseMmap.h"
+
+using std::vector;
+
+namespace shm{
+
+/*
+ * 刷盘统计: 轮数,写回的字节数(按记录的分块计算,是实际写盘字节数的上限),耗时,失败的轮数
+ */
+struct CFlushStats{
+    size_t m_rounds;
+    size_t m_bytes;
+    double m_seconds;
+    size_t m_failures;
+    CFlushStats():m_rounds(0),m_bytes(0),m_seconds(0),m_failures(0){
+    }
+};
+
+class CFlusher{
+public:
+    CFlusher();
+    ~CFlusher();
+
+    /*
+     *    启动后台线程
+     *    intervalms -- 每隔多少毫秒刷一轮, 0表示不按时间
+     *    budgetbytes -- 新修改的字节数达到这么多时立即刷一轮, 0表示不按字节数
+     *    两个都是0时不启动线程,只在FlushUntil时由调用线程刷盘
+     */
+    bool Start( size_t intervalms, size_t budgetbytes );
+    //停止线程,并把所有修改刷一遍
+    void Stop();
+
+    //CBaseMmap打开/关闭文件时调用,Remove时把这个文件的修改全部写回
+    void Add( CBaseMmap* mm );
+    void Remove( CBaseMmap* mm );
+
+    //当前进行中的修改的序号,CBaseMmap记录分块时使用
+    const std::atomic<uint64_t>* GetEpochAddr() const;
+    //一次修改完成,返回它的序号
+    uint64_t EndWrite();
+    //最后一次完成的修改的序号, 0表示还没有
+    uint64_t GetWriteSeq() const;
+    //序号不超过这个值的修改都已经落盘
+    uint64_t GetFlushedSeq() const;
+
+    /*
+     *    等待序号不超过seq的修改落盘(没有后台线程时在当前线程刷一轮),
+     *    seq大于GetWriteSeq时按GetWriteSeq处理; 刷盘失败返回false
+     */
+    bool FlushUntil( uint64_t seq );
+
+    //CBaseMmap有新的分块被修改时调用,累计达到预算后唤醒后台线程
+    void AddDirtyBytes( size_t bytes );
+
+    CFlushStats GetStats() const;
+
+private:
+    bool Round();
+    void Run();
+
+private:
+    vector<CBaseMmap*> m_mmaps;
+    std::mutex m_roundLock;   //同一时间只有一轮刷盘,同时保护m_mmaps
+    mutable std::mutex m_lock;
+    std::condition_variable m_cv;      //唤醒后台线程
+    std::condition_variable m_doneCv;  //一轮结束,唤醒FlushUntil
+    std::thread m_thread;
+    std::atomic<uint64_t> m_epoch;
+    std::atomic<uint64_t> m_flushed;
+    std::atomic<size_t> m_dirtyBytes;
+    size_t m_interval;
+    size_t m_budget;
+    bool m_stop;
+    bool m_wake;
+    CFlushStats m_stats;
+};
+
+}
+#endif
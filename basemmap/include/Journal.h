@@ -0,0 +1,108 @@
+/*
+ *    功能说明: 追加写的redo日志(journal),配合mmap的数据文件使用
+ *    上层每做一次修改追加一条记录,记录先放在内存缓冲中,攒够一批(字节数或条数)后
+ *    一次write+fdatasync写到文件(group commit),Commit返回时之前追加的记录都已落盘
+ *
+ *    checkpoint: 上层把数据文件全部同步到磁盘(msync MS_SYNC)后调用Reset清空日志
+ *    m_dirty: 打开写之后置1并落盘,正常关闭(checkpoint之后)才清0;
+ *    打开时为1说明上次没有正常关闭,上层需要先修复数据文件再重放日志中的记录
+ *
+ *    文件格式: [CJournalHeader] 之后每条记录 [uint32_t 长度][uint32_t crc][uint64_t seq][uint8_t 类型][内容]
+ *    crc覆盖seq/类型/内容,重放时遇到不完整或crc不对的记录就结束(崩溃时最后一批可能只写了一部分)
+ *    记录的类型和内容由上层定义
+ */
+
+#ifndef _H_JOURNAL_H__
+#define _H_JOURNAL_H__
+
+#include <stdint.h>
+#include <string>
+#include "BaseMmap.h"
+
+using std::string;
+
+namespace shm{
+
+struct CJournalHeader{
+    uint64_t m_magic;
+    uint64_t m_version;
+    uint64_t m_dirty;
+    uint64_t m_checkpoints;  //Reset的次数
+};
+
+const size_t JOURNAL_RECORD_HEAD = 17;
+
+class CJournal{
+public:
+    CJournal( const string& filename );
+    ~CJournal();
+
+    /*
+     *    打开日志文件,不存在时创建
+     */
+    bool Open();
+    bool IsOpen() const;
+
+    /*
+     *    group commit的条件: 缓冲中的字节数达到groupbytes或记录数达到groupops时自动Commit,
+     *    0表示不按这个条件提交
+     */
+    void SetGroupCommit( size_t groupbytes, size_t groupops );
+
+    /*
+     *    追加一条记录(内容是data1和data2拼起来),返回记录的序号
+     *    满足group commit条件时在这里提交,提交失败返回0
+     */
+    uint64_t Append( uint8_t type, const void* data1, size_t len1, const void* data2 = NULL, size_t len2 = 0 );
+
+    /*
+     *    把缓冲中的记录写到文件并fdatasync
+     */
+    bool Commit();
+
+    /*
+     *    上层数据文件已经全部落盘: 丢弃缓冲和文件中的所有记录
+     */
+    bool Reset();
+
+    //上次是否没有正常关闭
+    bool IsDirty() const;
+    bool MarkDirty();
+    bool MarkClean();
+
+    /*
+     *    重放: 从第一条记录开始依次读取,没有更多完整的记录时返回false
+     */
+    void BeginReplay();
+    bool ReadNext( uint8_t& type, string& payload );
+
+    //文件中已经提交的字节数(不含缓冲)
+    size_t GetFileSize() const;
+    size_t GetPendingBytes() const;
+    //最后追加的记录序号和已经落盘的最后一条记录序号
+    uint64_t GetSeq() const;
+    uint64_t GetSyncedSeq() const;
+    size_t GetCommitCount() const;
+    size_t GetCheckpointCount() const;
+
+private:
+    bool WriteHeader();
+    static uint32_t Crc32c( const char* data, size_t len );
+
+private:
+    string m_filename;
+    int m_fd;
+    CJournalHeader m_header;
+    string m_buffer;
+    size_t m_pendingOps;
+    size_t m_groupBytes;
+    size_t m_groupOps;
+    size_t m_fileSize;
+    size_t m_readOffset;
+    uint64_t m_seq;
+    uint64_t m_syncedSeq;
+    size_t m_commits;
+};
+
+}
+#endif
@@ -0,0 +1,76 @@
+/*
+ *    功能说明: 变长key的存储区,基于CBaseMmap,只追加不修改
+ *    每条记录的格式: [uint32_t 长度][key的内容],记录的偏移量从数据区起始位置开始计算
+ *    文件头中 m_nextwritepos -- 下次写入的字节偏移, m_itemcount -- 记录条数
+ *
+ *    删除key时不回收空间
+ */
+
+#ifndef _H_KEY_ARENA_H__
+#define _H_KEY_ARENA_H__
+
+#include <stdint.h>
+#include <string>
+#include "BaseMmap.h"
+
+using std::string;
+
+namespace shm{
+
+class CKeyArena{
+public:
+    /*
+     *    filename -- 文件名
+     *    capacity -- 初始的字节数
+     */
+    CKeyArena( const string& filename, size_t capacity, CModeType modetype = M_READWRITE );
+    ~CKeyArena();
+
+    bool Init();
+
+    /*
+     *    追加一个key,返回记录的偏移量,失败返回SIZE_MAX
+     */
+    size_t Append( const char* key, size_t len );
+
+    /*
+     *    剩余空间能否放下长度为len的key,不够时Append会扩容(重新mmap),
+     *    多线程写入时上层先用HasRoom检查,不够就在没有其他线程访问时调用Reserve扩容
+     */
+    bool HasRoom( size_t len ) const;
+    bool Reserve( size_t len );
+
+    /*
+     *    获取offset位置的key内容,len返回key的长度,offset非法返回NULL
+     *    返回的指针在下次Append扩容之前有效
+     */
+    const char* Get( size_t offset, size_t* len = NULL ) const;
+
+    //已经使用的字节数
+    size_t GetUsedSize() const;
+    size_t GetItemCount() const;
+    bool SaveToDisk();
+    //同步写回磁盘,返回时已经落盘
+    bool Sync();
+    //读进程使用,写进程扩容后重新映射
+    bool Refresh();
+    //Init之前调用,预留地址空间后扩容不再改变Get返回的指针,见CBaseMmap::SetReserveSize
+    void SetReserveSize( size_t size );
+    //Init之前调用,设置扩容策略
+    void SetGrowthPolicy( const CGrowthPolicy& policy );
+    const CExtendStats& GetExtendStats() const;
+    //Init之前调用,设置映射方式
+    void SetMapPolicy( const CMapPolicy& policy );
+    //Init之前调用,由flusher在后台写回追加的内容,见CFlusher
+    void SetFlusher( CFlusher* flusher );
+    //当前的映射范围,用于预热
+    CMapRegion GetMapRegion() const;
+
+private:
+    string m_filename;
+    CModeType m_modetype;
+    mutable CBaseMmap m_mmap;
+};
+
+}
+#endif
@@ -0,0 +1,67 @@
+/*
+ *    功能说明: bit位文件之上的多级空闲位置索引,查找空闲位置不再逐位扫描
+ *    bit位文件按64位的字划分,第0级第w位为1表示bit位文件的第w个字中还有空闲位置(为0的位),
+ *    第i+1级第j位为1表示第i级的第j个字不为0,最上一级只有一个字;
+ *    查找时在各级上用ctz找下一个不为0的位,只访问每一级的一两个字,容量10亿时也只有5级
+ *
+ *    索引只在写进程的内存中,不写文件: 打开时按bit位文件逐字重建(AVX2时一次比较4个字),
+ *    之后由写进程在设置/清除bit位后调用Update维护
+ */
+
+#ifndef _H_SLOT_SUMMARY_H__
+#define _H_SLOT_SUMMARY_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+using std::vector;
+
+namespace shm{
+
+class CSlotSummary{
+public:
+    CSlotSummary();
+
+    /*
+     *    按bit位重建索引
+     *    words -- bit位文件数据区的起始地址(按64位的字访问)
+     *    nbits -- 有效的位数(容量),之后的位不算空闲
+     */
+    void Build( const uint64_t* words, size_t nbits );
+
+    /*
+     *    容量变大(扩容)后调用,只重新计算原来最后一个字及之后的部分
+     */
+    void Resize( const uint64_t* words, size_t nbits );
+
+    /*
+     *    pos所在的字被修改(设置或清除了bit位)后调用
+     */
+    void Update( const uint64_t* words, size_t pos );
+
+    /*
+     *    从start开始(包括start)查找第一个空闲的位置,没有时返回SIZE_MAX
+     */
+    size_t FindFree( const uint64_t* words, size_t start ) const;
+
+    size_t GetBits() const { return m_nbits; }
+
+private:
+    //word中有效(小于容量)的位
+    uint64_t ValidMask( size_t word ) const;
+    bool HasFree( const uint64_t* words, size_t word ) const;
+    //第level级中第一个不小于x的为1的位,没有时返回SIZE_MAX
+    size_t NextSet( size_t level, size_t x ) const;
+    void SetBit( size_t level, size_t idx );
+    void ClearBit( size_t level, size_t idx );
+    void Layout( size_t nbits );
+
+private:
+    size_t m_nbits;
+    size_t m_nwords;
+    vector<vector<uint64_t> > m_levels;
+};
+
+}
+#endif
@@ -0,0 +1,88 @@
+/*
+ *    功能说明: 启动时把映射的文件并行读入内存(预热),避免重启后的查询都落在缺页上
+ *    每个区域按chunksize切成任务,多个线程取任务,对任务范围先madvise(MADV_WILLNEED),
+ *    再每页读一个字节确保建立映射;进度和完成时间可以随时查询
+ *
+ *    profile: SaveProfile用mincore记录每个区域中当前在内存中的块(WARMUP_PROFILE_CHUNK大小),
+ *    下次启动时只预热profile中记录的块,长时间运行后的读进程内存中基本就是热点数据
+ *    格式: [magic][区域个数] 每个区域 [名字长度][名字][块大小][块个数][bitmap]
+ */
+
+#ifndef _H_WARMUP_H__
+#define _H_WARMUP_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include "BaseMmap.h"
+
+using std::string;
+using std::vector;
+
+namespace shm{
+
+const size_t WARMUP_CHUNK_SIZE = 4*1024*1024;
+const size_t WARMUP_PROFILE_CHUNK = 64*1024;
+
+class CWarmup{
+public:
+    CWarmup();
+    ~CWarmup();
+
+    /*
+     *    regions -- 要预热的区域,预热期间这些映射不能被释放
+     *    threads -- 线程数, 0表示按cpu个数
+     *    chunksize -- 每个任务的字节数
+     *    profile -- 非空时只预热profile文件中记录的块,文件不存在时全部预热
+     *    async -- true时在后台线程中预热,Start立即返回; false时预热完才返回
+     *    verbose -- 每完成10%打印一次进度,完成时打印耗时
+     */
+    bool Start( const vector<CMapRegion>& regions, size_t threads, size_t chunksize = WARMUP_CHUNK_SIZE,
+            const string& profile = "", bool async = false, bool verbose = false );
+
+    //中止没有开始的任务,等待线程退出
+    void Stop();
+    //等待预热完成
+    void Wait();
+
+    bool IsReady() const;
+    //已完成的比例 0~1
+    double GetProgress() const;
+    //从Start到预热完成的秒数,没有完成时返回0
+    double GetReadySeconds() const;
+    size_t GetTotalBytes() const;
+
+    /*
+     *    用mincore记录regions中在内存中的块,写到path
+     */
+    static bool SaveProfile( const string& path, const vector<CMapRegion>& regions );
+
+private:
+    struct CWarmTask{
+        const char* m_addr;
+        size_t m_len;
+    };
+    bool LoadProfile( const string& path, const vector<CMapRegion>& regions, size_t chunksize );
+    void AddTasks( const char* addr, size_t len, size_t chunksize );
+    void Run();
+    void Finish();
+
+private:
+    vector<CWarmTask> m_tasks;
+    vector<std::thread> m_threads;
+    std::atomic<size_t> m_next;
+    std::atomic<size_t> m_done;
+    std::atomic<size_t> m_doneBytes;
+    std::atomic<int> m_reported;
+    std::atomic<bool> m_stop;
+    std::atomic<bool> m_ready;
+    size_t m_totalBytes;
+    bool m_verbose;
+    double m_startTime;
+    std::atomic<double> m_readySeconds;
+};
+
+}
+#endif
@@ -1,4 +1,8 @@
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
 #include "BaseMmap.h"
+#include "Flusher.h"
 
 using namespace shm;
 
@@ -6,9 +10,11 @@ long CBaseMmap::m_pageSize = 4096;
 
 CBaseMmap::CBaseMmap( size_t itemsize, size_t itemcapacity,size_t extend_sz /*10*1024*1024*/,CModeType modetype /*= 1*/ ):
     m_itemsize(itemsize),m_itemcapacity(itemcapacity),m_realitemcap(0),m_initSize(0),m_totalSize(0), 
-    m_extendSize( extend_sz ),m_modetype(modetype),m_pheader(nullptr){
+    m_extendSize( extend_sz ),m_modetype(modetype),m_pheader(nullptr),m_reserveSize(0),
+    m_flusher(nullptr),m_trackDirty(true),m_epoch(nullptr),m_dirty(nullptr),m_dirtySlots(0){
     long pagesize = sysconf(_SC_PAGE_SIZE);
     m_pageSize = pagesize==-1?4096:pagesize;
+    m_dirtyShift = __builtin_ctzl( m_pageSize );
     m_filename[0] = '\0';
     m_fd = -1;
     m_vmStartAddr = (void*)MAP_FAILED;
@@ -27,12 +33,93 @@ bool CBaseMmap::MapFile(){
     }else{
         prot = PROT_READ|PROT_WRITE;
     }
-    if ((m_vmStartAddr=mmap(nullptr, m_totalSize, prot,MAP_SHARED, m_fd, 0)) == MAP_FAILED)
+    if ( IsReserved() )
+        return ReserveAndMap( m_fd );
+    if ((m_vmStartAddr=mmap(nullptr, m_totalSize, prot,MapFlags(), m_fd, 0)) == MAP_FAILED)
         return false;
+    AdviseRange( m_vmStartAddr, m_totalSize );
     m_pheader = (CMmapHeader*)m_vmStartAddr;
     return true;
 }
 
+int CBaseMmap::MapFlags() const{
+    return m_mappolicy.m_populate ? MAP_SHARED|MAP_POPULATE : MAP_SHARED;
+}
+
+//按映射策略对新映射的一段调用madvise,失败(如文件系统不支持大页)不影响使用
+void CBaseMmap::AdviseRange( void* addr, size_t len ) const{
+    if ( m_mappolicy.m_hugepage )
+        madvise( addr, len, MADV_HUGEPAGE );
+    if ( m_mappolicy.m_advice != MADV_NORMAL )
+        madvise( addr, len, m_mappolicy.m_advice );
+    if ( m_mappolicy.m_willneed )
+        madvise( addr, len, MADV_WILLNEED );
+}
+
+bool CBaseMmap::Advise( int advice ){
+    if ( !IsBeenMmap() )
+        return false;
+    m_mappolicy.m_advice = advice;
+    return madvise( m_vmStartAddr, m_totalSize, advice ) == 0;
+}
+
+/*
+ *  预留地址空间,再把整个文件MAP_FIXED映射到预留空间的开头
+ *  预留空间不够放下文件时按文件大小的2倍预留
+ */
+bool CBaseMmap::ReserveAndMap( int fd ){
+    size_t need = (m_totalSize + m_pageSize - 1) & ~(m_pageSize - 1);
+    size_t reserve = m_reserveSize < need ? need * 2 : m_reserveSize;
+    //使用大页时多预留2M,把起始地址对齐到2M,再释放两头多出来的部分
+    size_t align = m_mappolicy.m_hugepage ? HUGE_PAGE_SIZE : 0;
+    char* raw = (char*)mmap(nullptr, reserve + align, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if ( raw == MAP_FAILED )
+        return false;
+    char* base = raw;
+    if ( align > 0 ){
+        base = (char*)(((size_t)raw + align - 1) & ~(align - 1));
+        if ( base > raw )
+            munmap( raw, base - raw );
+        if ( base + reserve < raw + reserve + align )
+            munmap( base + reserve, raw + reserve + align - (base + reserve) );
+    }
+    int prot = m_modetype == M_READ ? PROT_READ : PROT_READ|PROT_WRITE;
+    if ( mmap(base, m_totalSize, prot, MapFlags()|MAP_FIXED, fd, 0) == MAP_FAILED ){
+        munmap(base, reserve);
+        return false;
+    }
+    AdviseRange( base, m_totalSize );
+    m_reserveSize = reserve;
+    m_vmStartAddr = base;
+    m_pheader = (CMmapHeader*)m_vmStartAddr;
+    return true;
+}
+
+/*
+ *  文件从oldsize变大到m_totalSize后,把新增部分映射到预留空间中原来映射的后面
+ *  oldsize不一定按页对齐,从它所在的页开始重新映射(同一个文件的同一页,内容不变)
+ */
+bool CBaseMmap::MapTail( size_t oldsize ){
+    size_t start = oldsize & ~(m_pageSize - 1);
+    int prot = m_modetype == M_READ ? PROT_READ : PROT_READ|PROT_WRITE;
+    void* addr = (char*)m_vmStartAddr + start;
+    if ( mmap(addr, m_totalSize - start, prot, MapFlags()|MAP_FIXED, m_fd, start) != addr )
+        return false;
+    AdviseRange( addr, m_totalSize - start );
+    return true;
+}
+
+void CBaseMmap::UnmapAll(){
+    if (IsBeenMmap()) {
+        munmap(m_vmStartAddr, IsReserved() ? m_reserveSize : m_totalSize);
+        m_vmStartAddr = (void*)MAP_FAILED;
+    }
+    for (size_t i = 0; i < m_retired.size(); i++) {
+        munmap(m_retired[i].first, m_retired[i].second);
+    }
+    m_retired.clear();
+}
+
 bool CBaseMmap::InitHeader(){
     m_pheader->m_headersize = HEADER_SIZE;
     m_pheader->m_version = HEADER_VERSION;
@@ -41,6 +128,9 @@ bool CBaseMmap::InitHeader(){
     m_pheader->m_realcapacity = m_itemcapacity;
     m_pheader->m_pre_extend_itemcap = 0;
     m_pheader->m_nextwritepos = 0;
+    m_pheader->m_hashid = 0;
+    m_pheader->m_hashseed = 0;
+    m_pheader->m_bucketnum = 0;
     return true;
 }
 
@@ -77,6 +167,17 @@ bool CBaseMmap::ExtendFile( size_t len ){
          else
              return false;
      }
+     //预先分配磁盘块,文件系统不支持时按原来的方式扩展
+     if (m_growth.m_fallocate) {
+        int err = posix_fallocate(m_fd, m_totalSize, len);
+        if (err == 0) {
+            m_totalSize += len;
+            return true;
+        }
+        if (err != EOPNOTSUPP && err != EINVAL) {
+            return false;
+        }
+     }
      if (ftruncate(m_fd, m_totalSize+len) == 0) {
         m_totalSize += len;
         char buf[1] = "";
@@ -131,6 +232,7 @@ bool CBaseMmap::CreateAndMapFile( const string& filename ){
         return ret;
     }
     Myclose();
+    AttachFlusher();
     return ret;
 }
 
@@ -154,12 +256,22 @@ bool CBaseMmap::OpenAndMapFile(const string& filename ){
     m_initSize = fileSize;
     m_extendSize = m_initSize;
     ret = MapFile();
+    //文件头格式不一致时不能直接使用,避免按错误的偏移量解析数据
+    if( ret && ((size_t)fileSize < (size_t)HEADER_SIZE
+            || m_pheader->m_headersize != (size_t)HEADER_SIZE
+            || m_pheader->m_version != (size_t)HEADER_VERSION) ){
+        UnmapAll();
+        m_pheader = nullptr;
+        ret = false;
+    }
     if( ret ){
         m_itemsize = m_pheader->m_itemsize;
         m_itemcapacity = m_pheader->m_realcapacity;
         m_realitemcap = m_pheader->m_realcapacity;
     }
     Myclose();
+    if( ret )
+        AttachFlusher();
     return ret;
 }
 
@@ -180,11 +292,9 @@ bool CBaseMmap::SampleMapFile( const string& filename ){
 }
 
 void CBaseMmap::CloseFile(){
+    DetachFlusher();
     SaveAllModifyData();
-    if (IsBeenMmap()) {
-        munmap(m_vmStartAddr, m_totalSize);
-        m_vmStartAddr = (void*)MAP_FAILED;
-    }
+    UnmapAll();
     Myclose();
 }
 
@@ -196,6 +306,7 @@ int CBaseMmap::WriteData( void* data, size_t count, bool sysncflag /*= false*/ )
     }
     size_t offset = m_pheader->m_nextwritepos*m_pheader->m_itemsize+m_pheader->m_headersize;
     memcpy((char*)m_vmStartAddr+ offset, data, count);
+    MarkDirty(offset, count);
     if( sysncflag ){
         char *syncaddr = (char*)m_vmStartAddr + 
             (offset&~(m_pageSize-1));
@@ -211,6 +322,7 @@ bool CBaseMmap::WriteData( size_t offset,void* data, size_t count, bool sysncfla
         return false;
     }
     memcpy((char*)m_vmStartAddr+offset, data, count);
+    MarkDirty(offset, count);
     if( sysncflag ){
         char *syncaddr = (char*)m_vmStartAddr + 
             (offset&~(m_pageSize-1));
@@ -226,6 +338,9 @@ bool CBaseMmap::SaveAllModifyData(){
 
     if( m_modetype == M_READ )
         return false;
+    //修改过的范围由flusher写回
+    if( m_flusher != nullptr )
+        return true;
 
     if (msync(m_vmStartAddr, m_totalSize, MS_ASYNC) == 0) {
         fflush(NULL);
@@ -234,6 +349,13 @@ bool CBaseMmap::SaveAllModifyData(){
     return false;
 }
 
+bool CBaseMmap::Sync(){
+    if (m_vmStartAddr == MAP_FAILED) {
+        return false;
+    }
+    return SaveData(nullptr, 0, MS_SYNC);
+}
+
 //buf需要外部定义好之后传入
 //该dataoffset包含mmap头的长度了已经
 bool CBaseMmap::ReadData( size_t data_offset, void* buf, size_t count ){
@@ -244,24 +366,277 @@ bool CBaseMmap::ReadData( size_t data_offset, void* buf, size_t count ){
     return true;
 }
 
+/*
+ *  下一次扩容的字节数: 按扩容策略计算,并向上取整到页大小
+ */
+size_t CBaseMmap::NextExtendSize() const{
+    size_t len = m_extendSize;
+    if ( m_growth.m_factor > 1.0 )
+        len = (size_t)(m_totalSize * (m_growth.m_factor - 1.0));
+    if ( m_growth.m_minstep > 0 && len < m_growth.m_minstep )
+        len = m_growth.m_minstep;
+    if ( m_growth.m_maxstep > 0 && len > m_growth.m_maxstep )
+        len = m_growth.m_maxstep;
+    if ( len < m_itemsize )
+        len = m_itemsize;
+    return (len + m_pageSize - 1) & ~(m_pageSize - 1);
+}
+
 //扩张mmap的文件
-//默认的扩展方式是空间翻一倍
+//每次扩展的大小由扩容策略决定(见CGrowthPolicy),count>0时至少扩展count个条目
 bool CBaseMmap::ExtendFileAndMap(size_t count){
     if (m_vmStartAddr == (char*)MAP_FAILED) {
         return false;
     }
-    SaveAllModifyData();
-    if (munmap(m_vmStartAddr, m_totalSize) < 0){
-        return false;
+    size_t len = NextExtendSize();
+    if ( count > 0 && len < count * m_itemsize )
+        len = (count * m_itemsize + m_pageSize - 1) & ~(m_pageSize - 1);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ret = DoExtend( len );
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if ( ret ){
+        m_stats.m_count++;
+        m_stats.m_bytes += len;
     }
-    m_vmStartAddr = (void*)MAP_FAILED;
-    if( !ExtendFile(m_extendSize)){
-        Myclose();
-        return false;
+    m_stats.m_seconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return ret;
+}
+
+//预留了地址空间并且放得下时原地扩展: 不需要msync/munmap,映射的起始地址不变
+//重新映射期间flusher不能访问映射,持有m_dirtyLock
+bool CBaseMmap::DoExtend( size_t len ){
+    std::lock_guard<std::mutex> guard( m_dirtyLock );
+    if ( IsReserved() && m_totalSize + len <= m_reserveSize ){
+        size_t oldsize = m_totalSize;
+        if( !ExtendFile(len) || !MapTail(oldsize) ){
+            Myclose();
+            return false;
+        }
+    }else if ( IsReserved() ){
+        //预留空间用完: 旧的映射保留(之前返回的指针仍然有效),在新预留的空间中重新映射
+        SaveAllModifyData();
+        m_retired.push_back(std::make_pair(m_vmStartAddr, m_reserveSize));
+        m_vmStartAddr = (void*)MAP_FAILED;
+        if( !ExtendFile(len) || !MapFile() ){
+            Myclose();
+            return false;
+        }
+    }else{
+        SaveAllModifyData();
+        if (munmap(m_vmStartAddr, m_totalSize) < 0){
+            return false;
+        }
+        m_vmStartAddr = (void*)MAP_FAILED;
+        if( !ExtendFile(len) || !MapFile() ){
+            Myclose();
+            return false;
+        }
     }
-    MapFile();
     m_pheader->m_pre_extend_itemcap = m_pheader->m_realcapacity;
-    m_pheader->m_realcapacity  += m_extendSize/m_itemsize ;
+    m_pheader->m_realcapacity  += len/m_itemsize ;
     Myclose();
+    ResizeDirty();
+    MarkDirty( 0, HEADER_SIZE );
+    return true;
+}
+
+//预留了地址空间时截掉的部分重新变成预留(PROT_NONE),之后扩容仍然原地映射
+bool CBaseMmap::ShrinkFileAndMap( size_t count ){
+    if ( !IsBeenMmap() || m_modetype == M_READ )
+        return false;
+    size_t newsize = (HEADER_SIZE + count * m_itemsize + m_pageSize - 1) & ~(m_pageSize - 1);
+    if ( newsize >= m_totalSize )
+        return true;
+    std::lock_guard<std::mutex> guard( m_dirtyLock );
+    char* tail = (char*)m_vmStartAddr + newsize;
+    size_t taillen = m_totalSize - newsize;
+    if ( IsReserved() ){
+        if ( mmap(tail, taillen, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED, -1, 0) == MAP_FAILED )
+            return false;
+    }else if ( munmap(tail, taillen) < 0 ){
+        return false;
+    }
+    m_totalSize = newsize;
+    m_initSize = newsize;
+    m_pheader->m_realcapacity = (newsize - HEADER_SIZE) / m_itemsize;
+    m_pheader->m_pre_extend_itemcap = m_pheader->m_realcapacity;
+    m_itemcapacity = m_pheader->m_realcapacity;
+    m_realitemcap = m_pheader->m_realcapacity;
+    MarkDirty( 0, HEADER_SIZE );
+    int fd = open(m_filename, O_RDWR);
+    if ( fd == -1 )
+        return false;
+    int ret = ftruncate(fd, newsize);
+    close(fd);
+    return ret == 0;
+}
+
+/*
+ *  读进程使用: 写进程扩容后文件变大,旧的映射只覆盖原来的大小,
+ *  先映射新的大小再释放旧的映射,失败时旧的映射仍然可用
+ */
+bool CBaseMmap::RemapFile(){
+    if (!IsBeenMmap()) {
+        return false;
+    }
+    //文件头中的容量没有超出当前映射时不需要打开文件,读进程可以频繁调用
+    if (HEADER_SIZE + m_pheader->m_realcapacity * m_itemsize <= m_totalSize) {
+        return true;
+    }
+    int fd = open(m_filename, O_RDWR);
+    if (fd == -1) {
+        return false;
+    }
+    off_t fileSize = lseek(fd, 0, SEEK_END);
+    if (fileSize == (off_t)-1 || (size_t)fileSize <= m_totalSize) {
+        close(fd);
+        return fileSize != (off_t)-1;
+    }
+    if (IsReserved()) {
+        size_t oldsize = m_totalSize;
+        bool ok;
+        m_totalSize = fileSize;
+        if ((size_t)fileSize <= m_reserveSize) {
+            m_fd = fd;
+            ok = MapTail(oldsize);
+            m_fd = -1;
+        } else {
+            void* old = m_vmStartAddr;
+            size_t oldreserve = m_reserveSize;
+            ok = ReserveAndMap(fd);
+            if (ok)
+                m_retired.push_back(std::make_pair(old, oldreserve));
+        }
+        close(fd);
+        if (!ok) {
+            m_totalSize = oldsize;
+            return false;
+        }
+    } else {
+        int prot = m_modetype == M_READ ? PROT_READ : PROT_READ|PROT_WRITE;
+        void* addr = mmap(nullptr, fileSize, prot, MapFlags(), fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        AdviseRange(addr, fileSize);
+        munmap(m_vmStartAddr, m_totalSize);
+        m_vmStartAddr = addr;
+    }
+    m_totalSize = fileSize;
+    m_initSize = fileSize;
+    m_pheader = (CMmapHeader*)m_vmStartAddr;
+    //文件已经变大但写进程还没来得及更新文件头时,按实际映射的大小限制容量
+    size_t mapped = (m_totalSize - HEADER_SIZE) / m_itemsize;
+    m_itemcapacity = m_pheader->m_realcapacity < mapped ? m_pheader->m_realcapacity : mapped;
+    m_realitemcap = m_itemcapacity;
+    return true;
+}
+
+void CBaseMmap::AttachFlusher(){
+    if ( m_flusher == nullptr )
+        return;
+    if ( m_modetype == M_READ ){
+        m_flusher = nullptr;
+        return;
+    }
+    m_epoch = m_flusher->GetEpochAddr();
+    {
+        std::lock_guard<std::mutex> guard( m_dirtyLock );
+        ResizeDirty();
+    }
+    //新建的文件头还没有写回过
+    MarkDirty( 0, HEADER_SIZE );
+    m_flusher->Add( this );
+}
+
+void CBaseMmap::DetachFlusher(){
+    if ( m_flusher == nullptr )
+        return;
+    m_flusher->Remove( this );
+    std::lock_guard<std::mutex> guard( m_dirtyLock );
+    delete[] m_dirty;
+    m_dirty = nullptr;
+    m_dirtySlots = 0;
+    m_dirtySeen.clear();
+}
+
+/*
+ *  按文件大小重新分配分块(调用时持有m_dirtyLock,并且没有其他线程在MarkDirty),
+ *  分块个数超过DIRTY_MAX_SLOTS时分块大小翻倍,原来的记录合并到新的分块中(取较大的序号)
+ */
+void CBaseMmap::ResizeDirty(){
+    if ( m_flusher == nullptr || !m_trackDirty )
+        return;
+    size_t shift = m_dirtyShift;
+    while ( (m_totalSize >> shift) >= DIRTY_MAX_SLOTS )
+        shift++;
+    size_t slots = (m_totalSize >> shift) + 1;
+    if ( m_dirty != nullptr && slots <= m_dirtySlots && shift == m_dirtyShift )
+        return;
+    std::atomic<uint64_t>* dirty = new std::atomic<uint64_t>[slots];
+    for ( size_t i = 0; i < slots; i++ )
+        dirty[i].store( 0, std::memory_order_relaxed );
+    for ( size_t i = 0; i < m_dirtySlots; i++ ){
+        uint64_t v = m_dirty[i].load( std::memory_order_relaxed );
+        size_t j = (i << m_dirtyShift) >> shift;
+        if ( v > dirty[j].load( std::memory_order_relaxed ) )
+            dirty[j].store( v, std::memory_order_relaxed );
+    }
+    delete[] m_dirty;
+    m_dirty = dirty;
+    m_dirtySlots = slots;
+    m_dirtyShift = shift;
+    m_dirtySeen.assign( slots, 0 );
+}
+
+void CBaseMmap::NoteDirty(){
+    m_flusher->AddDirtyBytes( (size_t)1 << m_dirtyShift );
+}
+
+/*
+ *  每一段连续的修改过的分块msync一次,没有修改的部分不同步;
+ *  文件头不单独记录(有些字段直接通过指针修改),有任何修改时文件头所在的分块总会写回
+ */
+bool CBaseMmap::FlushDirty( uint64_t epoch, size_t& bytes ){
+    std::lock_guard<std::mutex> guard( m_dirtyLock );
+    if ( !IsBeenMmap() || m_modetype == M_READ )
+        return true;
+    if ( !m_trackDirty ){
+        bytes += m_totalSize;
+        return msync( m_vmStartAddr, m_totalSize, MS_SYNC ) == 0;
+    }
+    bool any = false;
+    for ( size_t i = 0; i < m_dirtySlots; i++ ){
+        m_dirtySeen[i] = m_dirty[i].load( std::memory_order_relaxed );
+        if ( m_dirtySeen[i] != 0 )
+            any = true;
+    }
+    if ( !any )
+        return true;
+    for ( size_t i = 0; i < m_dirtySlots; ){
+        if ( i != 0 && m_dirtySeen[i] == 0 ){
+            i++;
+            continue;
+        }
+        size_t j = i + 1;
+        while ( j < m_dirtySlots && m_dirtySeen[j] != 0 )
+            j++;
+        size_t begin = i << m_dirtyShift;
+        size_t end = std::min( j << m_dirtyShift, m_totalSize );
+        if ( begin < end ){
+            bytes += end - begin;
+            if ( msync( (char*)m_vmStartAddr + begin, end - begin, MS_SYNC ) != 0 )
+                return false;
+        }
+        i = j;
+    }
+    //本轮开始之后又被修改的分块序号不小于epoch,或者已经变了,保留到下一轮
+    for ( size_t i = 0; i < m_dirtySlots; i++ ){
+        uint64_t v = m_dirtySeen[i];
+        if ( v != 0 && v < epoch )
+            m_dirty[i].compare_exchange_strong( v, 0, std::memory_order_relaxed );
+    }
     return true;
 }
@@ -0,0 +1,90 @@
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "Tools.h"
+#include "BitWords.h"
+
+namespace shm {
+
+static inline uint64_t LoadWord( const uint64_t* words, size_t i ){
+    return __atomic_load_n( words + i, __ATOMIC_RELAXED );
+}
+
+#ifdef __AVX2__
+/*
+ *  32个字节按4位查表求popcount,再用sad按8个字节累加
+ */
+static inline __m256i Popcount256( __m256i v ){
+    const __m256i table = _mm256_setr_epi8( 0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                            0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4 );
+    const __m256i low = _mm256_set1_epi8( 0x0f );
+    __m256i lo = _mm256_shuffle_epi8( table, _mm256_and_si256( v, low ) );
+    __m256i hi = _mm256_shuffle_epi8( table, _mm256_and_si256( _mm256_srli_epi16( v, 4 ), low ) );
+    return _mm256_sad_epu8( _mm256_add_epi8( lo, hi ), _mm256_setzero_si256() );
+}
+#endif
+
+size_t PopcountWords( const uint64_t* words, size_t nbits ){
+    size_t full = nbits / 64;
+    size_t count = 0;
+    size_t i = 0;
+#ifdef __AVX2__
+    __m256i acc = _mm256_setzero_si256();
+    for( ; i + 4 <= full; i += 4 ){
+        __m256i v = _mm256_loadu_si256( (const __m256i*)(words + i) );
+        acc = _mm256_add_epi64( acc, Popcount256( v ) );
+    }
+    count = _mm256_extract_epi64( acc, 0 ) + _mm256_extract_epi64( acc, 1 )
+        + _mm256_extract_epi64( acc, 2 ) + _mm256_extract_epi64( acc, 3 );
+#endif
+    for( ; i < full; i++ )
+        count += __builtin_popcountll( LoadWord( words, i ) );
+    if( nbits % 64 != 0 )
+        count += __builtin_popcountll( LoadWord( words, full ) & ((1ull << (nbits % 64)) - 1) );
+    return count;
+}
+
+size_t NextSetBit( const uint64_t* words, size_t nbits, size_t start ){
+    if( start >= nbits )
+        return SIZE_MAX;
+    size_t nwords = (nbits + 63) / 64;
+    size_t i = start / 64;
+    uint64_t w = LoadWord( words, i ) & (~0ull << (start % 64));
+    while( w == 0 ){
+        i++;
+#ifdef __AVX2__
+        //4个字都是0时一起跳过
+        while( i + 4 <= nwords ){
+            __m256i v = _mm256_loadu_si256( (const __m256i*)(words + i) );
+            if( !_mm256_testz_si256( v, v ) )
+                break;
+            i += 4;
+        }
+#endif
+        if( i >= nwords )
+            return SIZE_MAX;
+        w = LoadWord( words, i );
+    }
+    size_t pos = i * 64 + __builtin_ctzll( w );
+    return pos < nbits ? pos : SIZE_MAX;
+}
+
+size_t PrevSetBit( const uint64_t* words, size_t nbits ){
+    size_t i = (nbits + 63) / 64;
+    uint64_t w = 0;
+    if( nbits % 64 != 0 ){
+        i--;
+        w = LoadWord( words, i ) & ((1ull << (nbits % 64)) - 1);
+        if( w != 0 )
+            return i * 64 + 63 - __builtin_clzll( w );
+    }
+    while( i > 0 ){
+        i--;
+        w = LoadWord( words, i );
+        if( w != 0 )
+            return i * 64 + 63 - __builtin_clzll( w );
+    }
+    return SIZE_MAX;
+}
+
+}
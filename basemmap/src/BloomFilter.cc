@@ -0,0 +1,203 @@
+#include <math.h>
+#include <stdint.h>
+#include "BloomFilter.h"
+
+using namespace shm;
+
+static const uint64_t BLOOM_MAGIC = 0x4d4f4f4c42485353ull;
+
+CBloomFilter::CBloomFilter( const string& filename, CModeType modetype /*= M_READWRITE*/ ):
+    m_filename(filename),m_modetype(modetype),m_mmap(NULL),m_meta(NULL),m_blocks(NULL),m_oldmmap(NULL){
+}
+
+CBloomFilter::~CBloomFilter(){
+    Publish();
+    SaveToDisk();
+    Close();
+}
+
+bool CBloomFilter::Init( size_t capacity, double fpr ){
+    return Open( m_filename, capacity, fpr );
+}
+
+/*
+ *  bits_per_key = -ln(fpr)/ln2^2, 分块后误判率会高一些,多给10%的bit
+ *  每个key设置的bit数 k = bits_per_key*ln2
+ */
+void CBloomFilter::SetMapPolicy( const CMapPolicy& policy ){
+    m_mappolicy = policy;
+}
+
+bool CBloomFilter::Open( const string& filename, size_t capacity, double fpr ){
+    if( capacity < BLOOM_MIN_CAPACITY )
+        capacity = BLOOM_MIN_CAPACITY;
+    if( fpr <= 0 || fpr >= 1 )
+        fpr = 0.01;
+    double bits_per_key = -log(fpr) / (M_LN2 * M_LN2) * 1.1;
+    size_t blocknum = (size_t)(capacity * bits_per_key / (BLOOM_BLOCK_SIZE*8)) + 1;
+    //meta占一个block,对齐再占一个
+    CBaseMmap* mm = new CBaseMmap( BLOOM_BLOCK_SIZE, blocknum+2, EXTEND_SIZE, m_modetype );
+    mm->SetMapPolicy( m_mappolicy );
+    if( !mm->SampleMapFile( filename ) ){
+        delete mm;
+        return false;
+    }
+    CBloomMeta* meta = (CBloomMeta*)mm->GetDataStartAddr();
+    if( meta->m_magic != BLOOM_MAGIC ){
+        if( m_modetype == M_READ ){
+            delete mm;
+            return false;
+        }
+        meta->m_blocknum = blocknum;
+        meta->m_hashnum = (uint64_t)(bits_per_key * M_LN2 + 0.5);
+        if( meta->m_hashnum < 1 )
+            meta->m_hashnum = 1;
+        if( meta->m_hashnum > 16 )
+            meta->m_hashnum = 16;
+        meta->m_capacity = capacity;
+        meta->m_keycount = 0;
+        meta->m_deletedcount = 0;
+        meta->m_fpr = fpr;
+        meta->m_retired = 0;
+        meta->m_magic = BLOOM_MAGIC;
+    }
+    Close();
+    m_mmap = mm;
+    m_meta = meta;
+    m_blocks = (uint64_t*)( ((uintptr_t)meta + sizeof(CBloomMeta) + BLOOM_BLOCK_SIZE - 1) & ~(uintptr_t)(BLOOM_BLOCK_SIZE-1) );
+    return true;
+}
+
+void CBloomFilter::Close(){
+    if( m_mmap != NULL ){
+        delete m_mmap;
+        m_mmap = NULL;
+        m_meta = NULL;
+        m_blocks = NULL;
+    }
+}
+
+/*
+ *  用hash的高位选block(乘法取高位),再把hash打散,低32位和高32位做double hashing得到block内的bit
+ */
+inline const uint64_t* CBloomFilter::Block( uint64_t hash, uint64_t& mix ) const{
+    uint64_t b = (uint64_t)(((__uint128_t)hash * m_meta->m_blocknum) >> 64);
+    mix = (hash ^ (hash >> 31)) * 0xbf58476d1ce4e5b9ull;
+    mix ^= mix >> 32;
+    return m_blocks + b * (BLOOM_BLOCK_SIZE/8);
+}
+
+void CBloomFilter::Add( uint64_t hash ){
+    if( m_meta == NULL || m_modetype == M_READ )
+        return;
+    uint64_t mix;
+    uint64_t* blk = (uint64_t*)Block( hash, mix );
+    uint32_t a = (uint32_t)mix;
+    uint32_t d = (uint32_t)(mix >> 32) | 1;
+    //先在本地拼好block中每个字要设置的位,再原子地或上去,多个线程同时Add不会丢位
+    uint64_t bits[BLOOM_BLOCK_SIZE/8] = {0};
+    for( uint64_t i = 0; i < m_meta->m_hashnum; i++ ){
+        uint32_t bit = (a + i * d) & (BLOOM_BLOCK_SIZE*8 - 1);
+        bits[bit/64] |= 1ull << (bit%64);
+    }
+    for( size_t w = 0; w < BLOOM_BLOCK_SIZE/8; w++ ){
+        if( bits[w] != 0 )
+            __atomic_fetch_or( blk + w, bits[w], __ATOMIC_RELAXED );
+    }
+    __atomic_fetch_add( &m_meta->m_keycount, 1, __ATOMIC_RELAXED );
+}
+
+bool CBloomFilter::MayContain( uint64_t hash ) const{
+    if( m_meta == NULL || m_meta->m_retired )
+        return true;
+    uint64_t mix;
+    const uint64_t* blk = Block( hash, mix );
+    uint32_t a = (uint32_t)mix;
+    uint32_t d = (uint32_t)(mix >> 32) | 1;
+    for( uint64_t i = 0; i < m_meta->m_hashnum; i++ ){
+        uint32_t bit = (a + i * d) & (BLOOM_BLOCK_SIZE*8 - 1);
+        if( (blk[bit/64] & (1ull << (bit%64))) == 0 )
+            return false;
+    }
+    return true;
+}
+
+void CBloomFilter::MarkDeleted(){
+    if( m_meta != NULL && m_modetype != M_READ )
+        __atomic_fetch_add( &m_meta->m_deletedcount, 1, __ATOMIC_RELAXED );
+}
+
+bool CBloomFilter::Reset( size_t capacity, double fpr /*= 0*/ ){
+    if( m_modetype == M_READ || m_meta == NULL || m_oldmmap != NULL )
+        return false;
+    if( fpr <= 0 )
+        fpr = m_meta->m_fpr;
+    string tmpfile = m_filename + ".tmp";
+    unlink( tmpfile.c_str() );
+    CBloomMeta* old = m_meta;
+    CBaseMmap* oldmm = m_mmap;
+    //先摘下旧的映射,Open成功后留到Publish时再释放,失败时恢复
+    m_mmap = NULL;
+    if( !Open( tmpfile, capacity, fpr ) ){
+        m_mmap = oldmm;
+        m_meta = old;
+        return false;
+    }
+    m_oldmmap = oldmm;
+    return true;
+}
+
+/*
+ *  新filter中已经有全部的key了,rename之后其他进程Refresh时打开的就是完整的filter
+ */
+bool CBloomFilter::Publish(){
+    if( m_oldmmap == NULL )
+        return true;
+    CBloomMeta* old = (CBloomMeta*)m_oldmmap->GetDataStartAddr();
+    string tmpfile = m_filename + ".tmp";
+    if( rename( tmpfile.c_str(), m_filename.c_str() ) != 0 ){
+        printf("rename bloom filter %s failed\n", tmpfile.c_str());
+        Close();
+        m_mmap = m_oldmmap;
+        m_meta = old;
+        m_blocks = (uint64_t*)( ((uintptr_t)old + sizeof(CBloomMeta) + BLOOM_BLOCK_SIZE - 1) & ~(uintptr_t)(BLOOM_BLOCK_SIZE-1) );
+        m_oldmmap = NULL;
+        return false;
+    }
+    old->m_retired = 1;
+    delete m_oldmmap;
+    m_oldmmap = NULL;
+    return true;
+}
+
+size_t CBloomFilter::GetKeyCount() const{
+    return m_meta == NULL ? 0 : m_meta->m_keycount;
+}
+
+size_t CBloomFilter::GetDeletedCount() const{
+    return m_meta == NULL ? 0 : m_meta->m_deletedcount;
+}
+
+size_t CBloomFilter::GetCapacity() const{
+    return m_meta == NULL ? 0 : m_meta->m_capacity;
+}
+
+size_t CBloomFilter::GetBlockNum() const{
+    return m_meta == NULL ? 0 : m_meta->m_blocknum;
+}
+
+double CBloomFilter::GetFpr() const{
+    return m_meta == NULL ? 0 : m_meta->m_fpr;
+}
+
+bool CBloomFilter::Refresh(){
+    if( m_meta == NULL || !m_meta->m_retired )
+        return true;
+    return Open( m_filename, m_meta->m_capacity, m_meta->m_fpr );
+}
+
+bool CBloomFilter::SaveToDisk(){
+    if( m_modetype == M_READ || m_mmap == NULL )
+        return false;
+    return m_mmap->SaveAllModifyData();
+}
@@ -0,0 +1,155 @@
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include "Flusher.h"
+
+using namespace shm;
+
+static double NowSeconds(){
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+CFlusher::CFlusher():m_epoch(1),m_flushed(0),m_dirtyBytes(0),m_interval(0),m_budget(0),
+    m_stop(false),m_wake(false){
+}
+
+CFlusher::~CFlusher(){
+    Stop();
+}
+
+bool CFlusher::Start( size_t intervalms, size_t budgetbytes ){
+    if( m_thread.joinable() )
+        return false;
+    m_interval = intervalms;
+    m_budget = budgetbytes;
+    m_stop = false;
+    m_wake = false;
+    if( intervalms > 0 || budgetbytes > 0 )
+        m_thread = std::thread( &CFlusher::Run, this );
+    return true;
+}
+
+void CFlusher::Stop(){
+    if( m_thread.joinable() ){
+        {
+            std::lock_guard<std::mutex> guard( m_lock );
+            m_stop = true;
+        }
+        m_cv.notify_one();
+        m_thread.join();
+    }
+    Round();
+}
+
+void CFlusher::Add( CBaseMmap* mm ){
+    std::lock_guard<std::mutex> guard( m_roundLock );
+    m_mmaps.push_back( mm );
+}
+
+void CFlusher::Remove( CBaseMmap* mm ){
+    std::lock_guard<std::mutex> guard( m_roundLock );
+    vector<CBaseMmap*>::iterator it = std::find( m_mmaps.begin(), m_mmaps.end(), mm );
+    if( it == m_mmaps.end() )
+        return;
+    m_mmaps.erase( it );
+    size_t bytes = 0;
+    bool ok = mm->FlushDirty( UINT64_MAX, bytes );
+    std::lock_guard<std::mutex> lk( m_lock );
+    m_stats.m_bytes += bytes;
+    if( !ok )
+        m_stats.m_failures++;
+}
+
+const std::atomic<uint64_t>* CFlusher::GetEpochAddr() const{
+    return &m_epoch;
+}
+
+uint64_t CFlusher::EndWrite(){
+    return m_epoch.fetch_add( 1, std::memory_order_acq_rel );
+}
+
+uint64_t CFlusher::GetWriteSeq() const{
+    return m_epoch.load( std::memory_order_acquire ) - 1;
+}
+
+uint64_t CFlusher::GetFlushedSeq() const{
+    return m_flushed.load( std::memory_order_acquire );
+}
+
+bool CFlusher::FlushUntil( uint64_t seq ){
+    uint64_t last = GetWriteSeq();
+    if( seq > last )
+        seq = last;
+    if( GetFlushedSeq() >= seq )
+        return true;
+    if( !m_thread.joinable() )
+        return Round() && GetFlushedSeq() >= seq;
+    std::unique_lock<std::mutex> lk( m_lock );
+    size_t failures = m_stats.m_failures;
+    m_wake = true;
+    m_cv.notify_one();
+    m_doneCv.wait( lk, [&]{ return GetFlushedSeq() >= seq || m_stop || m_stats.m_failures != failures; } );
+    return GetFlushedSeq() >= seq;
+}
+
+void CFlusher::AddDirtyBytes( size_t bytes ){
+    if( m_budget == 0 )
+        return;
+    size_t before = m_dirtyBytes.fetch_add( bytes, std::memory_order_relaxed );
+    //只在越过预算的那一次唤醒
+    if( before < m_budget && before + bytes >= m_budget ){
+        std::lock_guard<std::mutex> guard( m_lock );
+        m_wake = true;
+        m_cv.notify_one();
+    }
+}
+
+CFlushStats CFlusher::GetStats() const{
+    std::lock_guard<std::mutex> guard( m_lock );
+    return m_stats;
+}
+
+/*
+ *  一轮刷盘: 开始时的序号之前完成的修改,本轮结束后都已落盘
+ */
+bool CFlusher::Round(){
+    std::lock_guard<std::mutex> guard( m_roundLock );
+    uint64_t epoch = m_epoch.load( std::memory_order_acquire );
+    m_dirtyBytes.store( 0, std::memory_order_relaxed );
+    double start = NowSeconds();
+    size_t bytes = 0;
+    bool ok = true;
+    for( size_t i = 0; i < m_mmaps.size(); i++ ){
+        ok = m_mmaps[i]->FlushDirty( epoch, bytes ) && ok;
+    }
+    if( ok && epoch - 1 > m_flushed.load( std::memory_order_relaxed ) )
+        m_flushed.store( epoch - 1, std::memory_order_release );
+    std::lock_guard<std::mutex> lk( m_lock );
+    m_stats.m_rounds++;
+    m_stats.m_bytes += bytes;
+    m_stats.m_seconds += NowSeconds() - start;
+    if( !ok )
+        m_stats.m_failures++;
+    return ok;
+}
+
+void CFlusher::Run(){
+    std::unique_lock<std::mutex> lk( m_lock );
+    while( !m_stop ){
+        if( m_interval > 0 ){
+            m_cv.wait_for( lk, std::chrono::milliseconds( m_interval ), [&]{ return m_stop || m_wake; } );
+        }else{
+            m_cv.wait( lk, [&]{ return m_stop || m_wake; } );
+        }
+        if( m_stop )
+            break;
+        m_wake = false;
+        lk.unlock();
+        Round();
+        lk.lock();
+        m_doneCv.notify_all();
+    }
+    m_doneCv.notify_all();
+}
@@ -0,0 +1,218 @@
+#include <errno.h>
+#include "Journal.h"
+
+using namespace shm;
+
+static const uint64_t JOURNAL_MAGIC = 0x4c4e524a48535353ull;
+static const uint64_t JOURNAL_VERSION = 1;
+
+CJournal::CJournal( const string& filename ):m_filename(filename),m_fd(-1),m_pendingOps(0),
+    m_groupBytes(0),m_groupOps(0),m_fileSize(0),m_readOffset(0),m_seq(0),m_syncedSeq(0),m_commits(0){
+    memset( &m_header, 0, sizeof(m_header) );
+}
+
+CJournal::~CJournal(){
+    Commit();
+    if( m_fd >= 0 ){
+        close( m_fd );
+        m_fd = -1;
+    }
+}
+
+bool CJournal::Open(){
+    if( m_fd >= 0 )
+        return true;
+    if( !MakeDir( m_filename ) )
+        return false;
+    if( (m_fd = open( m_filename.c_str(), O_CREAT|O_RDWR, 00660 )) == -1 )
+        return false;
+    off_t size = lseek( m_fd, 0, SEEK_END );
+    if( size == (off_t)-1 )
+        return false;
+    if( (size_t)size < sizeof(m_header) ){
+        //新文件(或者创建时只写了一半的文件头)
+        m_header.m_magic = JOURNAL_MAGIC;
+        m_header.m_version = JOURNAL_VERSION;
+        if( ftruncate( m_fd, 0 ) != 0 || !WriteHeader() )
+            return false;
+        m_fileSize = sizeof(m_header);
+        return true;
+    }
+    if( pread( m_fd, &m_header, sizeof(m_header), 0 ) != (ssize_t)sizeof(m_header)
+            || m_header.m_magic != JOURNAL_MAGIC || m_header.m_version != JOURNAL_VERSION ){
+        printf( "journal %s header mismatch\n", m_filename.c_str() );
+        return false;
+    }
+    m_fileSize = size;
+    return true;
+}
+
+bool CJournal::IsOpen() const{
+    return m_fd >= 0;
+}
+
+void CJournal::SetGroupCommit( size_t groupbytes, size_t groupops ){
+    m_groupBytes = groupbytes;
+    m_groupOps = groupops;
+}
+
+uint64_t CJournal::Append( uint8_t type, const void* data1, size_t len1, const void* data2, size_t len2 ){
+    if( m_fd < 0 || len1 + len2 > UINT32_MAX )
+        return 0;
+    uint64_t seq = ++m_seq;
+    uint32_t len = len1 + len2;
+    size_t start = m_buffer.size();
+    m_buffer.resize( start + JOURNAL_RECORD_HEAD + len );
+    char* p = &m_buffer[start];
+    memcpy( p, &len, sizeof(len) );
+    memcpy( p + 8, &seq, sizeof(seq) );
+    p[16] = type;
+    if( len1 > 0 )
+        memcpy( p + JOURNAL_RECORD_HEAD, data1, len1 );
+    if( len2 > 0 )
+        memcpy( p + JOURNAL_RECORD_HEAD + len1, data2, len2 );
+    uint32_t crc = Crc32c( p + 8, JOURNAL_RECORD_HEAD - 8 + len );
+    memcpy( p + 4, &crc, sizeof(crc) );
+    m_pendingOps++;
+    if( (m_groupBytes > 0 && m_buffer.size() >= m_groupBytes) || (m_groupOps > 0 && m_pendingOps >= m_groupOps) ){
+        if( !Commit() )
+            return 0;
+    }
+    return seq;
+}
+
+bool CJournal::Commit(){
+    if( m_fd < 0 )
+        return false;
+    if( m_buffer.empty() )
+        return true;
+    size_t done = 0;
+    while( done < m_buffer.size() ){
+        ssize_t n = pwrite( m_fd, m_buffer.data() + done, m_buffer.size() - done, m_fileSize + done );
+        if( n < 0 ){
+            if( errno == EINTR )
+                continue;
+            return false;
+        }
+        done += n;
+    }
+    if( fdatasync( m_fd ) != 0 )
+        return false;
+    m_fileSize += m_buffer.size();
+    m_buffer.clear();
+    m_pendingOps = 0;
+    m_syncedSeq = m_seq;
+    m_commits++;
+    return true;
+}
+
+bool CJournal::Reset(){
+    if( m_fd < 0 )
+        return false;
+    m_buffer.clear();
+    m_pendingOps = 0;
+    if( ftruncate( m_fd, sizeof(m_header) ) != 0 )
+        return false;
+    m_fileSize = sizeof(m_header);
+    m_syncedSeq = m_seq;
+    m_header.m_checkpoints++;
+    return WriteHeader();
+}
+
+bool CJournal::IsDirty() const{
+    return m_header.m_dirty != 0;
+}
+
+bool CJournal::MarkDirty(){
+    m_header.m_dirty = 1;
+    return WriteHeader();
+}
+
+bool CJournal::MarkClean(){
+    m_header.m_dirty = 0;
+    return WriteHeader();
+}
+
+bool CJournal::WriteHeader(){
+    //写整个结构的拷贝: gcc把&m_header当成只有第一个成员大小,会误报-Wstringop-overread
+    CJournalHeader header = m_header;
+    return pwrite( m_fd, &header, sizeof(header), 0 ) == (ssize_t)sizeof(header)
+        && fdatasync( m_fd ) == 0;
+}
+
+void CJournal::BeginReplay(){
+    m_readOffset = sizeof(m_header);
+}
+
+bool CJournal::ReadNext( uint8_t& type, string& payload ){
+    char head[JOURNAL_RECORD_HEAD];
+    if( m_fd < 0 || m_readOffset + JOURNAL_RECORD_HEAD > m_fileSize
+            || pread( m_fd, head, JOURNAL_RECORD_HEAD, m_readOffset ) != (ssize_t)JOURNAL_RECORD_HEAD )
+        return false;
+    uint32_t len, crc;
+    uint64_t seq;
+    memcpy( &len, head, sizeof(len) );
+    memcpy( &crc, head + 4, sizeof(crc) );
+    memcpy( &seq, head + 8, sizeof(seq) );
+    if( m_readOffset + JOURNAL_RECORD_HEAD + len > m_fileSize )
+        return false;
+    string rec( JOURNAL_RECORD_HEAD - 8 + len, '\0' );
+    memcpy( &rec[0], head + 8, JOURNAL_RECORD_HEAD - 8 );
+    if( len > 0 && pread( m_fd, &rec[JOURNAL_RECORD_HEAD - 8], len, m_readOffset + JOURNAL_RECORD_HEAD ) != (ssize_t)len )
+        return false;
+    if( Crc32c( rec.data(), rec.size() ) != crc )
+        return false;
+    type = head[16];
+    payload.assign( rec, JOURNAL_RECORD_HEAD - 8, len );
+    m_readOffset += JOURNAL_RECORD_HEAD + len;
+    if( seq > m_seq ){
+        m_seq = seq;
+        m_syncedSeq = seq;
+    }
+    return true;
+}
+
+size_t CJournal::GetFileSize() const{
+    return m_fileSize;
+}
+
+size_t CJournal::GetPendingBytes() const{
+    return m_buffer.size();
+}
+
+uint64_t CJournal::GetSeq() const{
+    return m_seq;
+}
+
+uint64_t CJournal::GetSyncedSeq() const{
+    return m_syncedSeq;
+}
+
+size_t CJournal::GetCommitCount() const{
+    return m_commits;
+}
+
+size_t CJournal::GetCheckpointCount() const{
+    return m_header.m_checkpoints;
+}
+
+//crc32c(Castagnoli),按字节查表
+struct CCrc32cTable{
+    uint32_t m_table[256];
+    CCrc32cTable(){
+        for( uint32_t i = 0; i < 256; i++ ){
+            uint32_t c = i;
+            for( int k = 0; k < 8; k++ )
+                c = c & 1 ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+            m_table[i] = c;
+        }
+    }
+};
+
+uint32_t CJournal::Crc32c( const char* data, size_t len ){
+    static const CCrc32cTable table;
+    uint32_t crc = 0xFFFFFFFFu;
+    for( size_t i = 0; i < len; i++ )
+        crc = table.m_table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
@@ -0,0 +1,122 @@
+#include "KeyArena.h"
+
+using namespace shm;
+
+CKeyArena::CKeyArena( const string& filename, size_t capacity, CModeType modetype /*= M_READWRITE*/ ):
+    m_filename(filename),m_modetype(modetype),m_mmap(1, capacity, EXTEND_SIZE, modetype){
+}
+
+CKeyArena::~CKeyArena(){
+    SaveToDisk();
+    m_mmap.CloseFile();
+}
+
+void CKeyArena::SetReserveSize( size_t size ){
+    m_mmap.SetReserveSize( size );
+}
+
+void CKeyArena::SetGrowthPolicy( const CGrowthPolicy& policy ){
+    m_mmap.SetGrowthPolicy( policy );
+}
+
+const CExtendStats& CKeyArena::GetExtendStats() const{
+    return m_mmap.GetExtendStats();
+}
+
+void CKeyArena::SetMapPolicy( const CMapPolicy& policy ){
+    m_mmap.SetMapPolicy( policy );
+}
+
+void CKeyArena::SetFlusher( CFlusher* flusher ){
+    m_mmap.SetFlusher( flusher );
+}
+
+CMapRegion CKeyArena::GetMapRegion() const{
+    return m_mmap.GetRegion( m_filename.substr( m_filename.rfind('/') + 1 ) );
+}
+
+bool CKeyArena::Init(){
+    return m_mmap.SampleMapFile( m_filename );
+}
+
+size_t CKeyArena::Append( const char* key, size_t len ){
+    if( m_modetype == M_READ || !m_mmap.IsBeenMmap() || len > UINT32_MAX ){
+        return SIZE_MAX;
+    }
+    CMmapHeader* header = m_mmap.GetHeaderaddr();
+    size_t pos = header->m_nextwritepos;
+    size_t need = sizeof(uint32_t) + len;
+    while( pos + need > m_mmap.GetCapacity() ){
+        if( !m_mmap.ExtendFileAndMap() ){
+            return SIZE_MAX;
+        }
+        header = m_mmap.GetHeaderaddr();
+    }
+    uint32_t keylen = len;
+    m_mmap.WriteData( HEADER_SIZE + pos, &keylen, sizeof(keylen) );
+    if( len > 0 ){
+        m_mmap.WriteData( HEADER_SIZE + pos + sizeof(keylen), (void*)key, len );
+    }
+    //key写完之后再移动写入位置,其他进程按m_nextwritepos判断key是否完整
+    __atomic_store_n( &header->m_nextwritepos, pos + need, __ATOMIC_RELEASE );
+    header->m_itemcount++;
+    return pos;
+}
+
+bool CKeyArena::HasRoom( size_t len ) const{
+    return m_mmap.IsBeenMmap() && m_mmap.GetHeaderaddr()->m_nextwritepos + sizeof(uint32_t) + len <= m_mmap.GetCapacity();
+}
+
+bool CKeyArena::Reserve( size_t len ){
+    if( m_modetype == M_READ || !m_mmap.IsBeenMmap() )
+        return false;
+    while( !HasRoom( len ) ){
+        if( !m_mmap.ExtendFileAndMap() )
+            return false;
+    }
+    return true;
+}
+
+const char* CKeyArena::Get( size_t offset, size_t* len /*= NULL*/ ) const{
+    if( !m_mmap.IsBeenMmap() || offset + sizeof(uint32_t) > m_mmap.GetHeaderaddr()->m_nextwritepos ){
+        return NULL;
+    }
+    //其他进程追加的key可能还不在本进程的映射范围内
+    if( offset + sizeof(uint32_t) > m_mmap.GetDataSize() ){
+        return NULL;
+    }
+    const char* ptr = (const char*)m_mmap.GetDataStartAddr() + offset;
+    uint32_t keylen;
+    memcpy( &keylen, ptr, sizeof(keylen) );
+    if( offset + sizeof(uint32_t) + keylen > m_mmap.GetDataSize() ){
+        return NULL;
+    }
+    if( len != NULL ){
+        *len = keylen;
+    }
+    return ptr + sizeof(uint32_t);
+}
+
+size_t CKeyArena::GetUsedSize() const{
+    return m_mmap.IsBeenMmap() ? m_mmap.GetHeaderaddr()->m_nextwritepos : 0;
+}
+
+size_t CKeyArena::GetItemCount() const{
+    return m_mmap.IsBeenMmap() ? m_mmap.GetHeaderaddr()->m_itemcount : 0;
+}
+
+bool CKeyArena::Refresh(){
+    return m_mmap.RemapFile();
+}
+
+bool CKeyArena::Sync(){
+    if( m_modetype == M_READ )
+        return false;
+    return m_mmap.Sync();
+}
+
+bool CKeyArena::SaveToDisk(){
+    if( m_modetype == M_READ )
+        return false;
+    return m_mmap.SaveAllModifyData();
+}
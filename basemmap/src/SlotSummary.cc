@@ -0,0 +1,167 @@
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#include "SlotSummary.h"
+
+using namespace shm;
+
+/*
+ *  words开始的64个字中全为1(没有空闲位置)的字,第k位对应words[k]
+ */
+static uint64_t FullWords64( const uint64_t* words ){
+    uint64_t m = 0;
+#if defined(__AVX2__)
+    const __m256i ones = _mm256_set1_epi64x( -1 );
+    for( int k = 0; k < 64; k += 4 ){
+        __m256i v = _mm256_loadu_si256( (const __m256i*)(words + k) );
+        m |= (uint64_t)_mm256_movemask_pd( _mm256_castsi256_pd( _mm256_cmpeq_epi64( v, ones ) ) ) << k;
+    }
+#elif defined(__SSE2__)
+    //SSE2没有64位比较,两个32位都相等才算
+    const __m128i ones = _mm_set1_epi32( -1 );
+    for( int k = 0; k < 64; k += 2 ){
+        __m128i v = _mm_loadu_si128( (const __m128i*)(words + k) );
+        int eq = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32( v, ones ) ) );
+        if( (eq & 3) == 3 )
+            m |= 1ull << k;
+        if( (eq >> 2) == 3 )
+            m |= 1ull << (k + 1);
+    }
+#else
+    for( int k = 0; k < 64; k++ ){
+        if( words[k] == ~0ull )
+            m |= 1ull << k;
+    }
+#endif
+    return m;
+}
+
+CSlotSummary::CSlotSummary():m_nbits(0),m_nwords(0){
+}
+
+uint64_t CSlotSummary::ValidMask( size_t word ) const{
+    if( word < m_nbits / 64 )
+        return ~0ull;
+    if( word == m_nbits / 64 && m_nbits % 64 != 0 )
+        return (1ull << (m_nbits % 64)) - 1;
+    return 0;
+}
+
+bool CSlotSummary::HasFree( const uint64_t* words, size_t word ) const{
+    return (~words[word] & ValidMask( word )) != 0;
+}
+
+/*
+ *  按位数确定每一级的大小,已有的内容保留
+ */
+void CSlotSummary::Layout( size_t nbits ){
+    m_nbits = nbits;
+    m_nwords = (nbits + 63) / 64;
+    size_t n = m_nwords;
+    size_t level = 0;
+    do{
+        n = (n + 63) / 64;
+        if( m_levels.size() <= level )
+            m_levels.push_back( vector<uint64_t>() );
+        m_levels[level].resize( n, 0 );
+        level++;
+    }while( n > 1 );
+    m_levels.resize( level );
+}
+
+void CSlotSummary::Build( const uint64_t* words, size_t nbits ){
+    m_levels.clear();
+    m_nbits = 0;
+    m_nwords = 0;
+    Resize( words, nbits );
+}
+
+void CSlotSummary::Resize( const uint64_t* words, size_t nbits ){
+    size_t from = m_nwords > 0 ? m_nwords - 1 : 0;
+    if( !m_levels.empty() && nbits <= m_nbits )
+        return;
+    Layout( nbits );
+    vector<uint64_t>& lv = m_levels[0];
+    size_t full = m_nbits / 64;
+    for( size_t w = from; w < m_nwords; ){
+        //对齐的64个字一次比较
+        if( w % 64 == 0 && w + 64 <= full ){
+            lv[w / 64] = ~FullWords64( words + w );
+            w += 64;
+            continue;
+        }
+        if( HasFree( words, w ) )
+            lv[w / 64] |= 1ull << (w % 64);
+        else
+            lv[w / 64] &= ~(1ull << (w % 64));
+        w++;
+    }
+    //上面各级按下一级重新计算
+    for( size_t i = 1; i < m_levels.size(); i++ ){
+        vector<uint64_t>& up = m_levels[i];
+        const vector<uint64_t>& down = m_levels[i-1];
+        for( size_t j = 0; j < up.size(); j++ )
+            up[j] = 0;
+        for( size_t j = 0; j < down.size(); j++ ){
+            if( down[j] != 0 )
+                up[j / 64] |= 1ull << (j % 64);
+        }
+    }
+}
+
+void CSlotSummary::SetBit( size_t level, size_t idx ){
+    uint64_t& w = m_levels[level][idx / 64];
+    bool wasempty = w == 0;
+    w |= 1ull << (idx % 64);
+    if( wasempty && level + 1 < m_levels.size() )
+        SetBit( level + 1, idx / 64 );
+}
+
+void CSlotSummary::ClearBit( size_t level, size_t idx ){
+    uint64_t& w = m_levels[level][idx / 64];
+    if( w == 0 )
+        return;
+    w &= ~(1ull << (idx % 64));
+    if( w == 0 && level + 1 < m_levels.size() )
+        ClearBit( level + 1, idx / 64 );
+}
+
+void CSlotSummary::Update( const uint64_t* words, size_t pos ){
+    size_t word = pos / 64;
+    if( word >= m_nwords )
+        return;
+    if( HasFree( words, word ) )
+        SetBit( 0, word );
+    else
+        ClearBit( 0, word );
+}
+
+size_t CSlotSummary::NextSet( size_t level, size_t x ) const{
+    const vector<uint64_t>& lv = m_levels[level];
+    size_t wi = x / 64;
+    if( wi >= lv.size() )
+        return SIZE_MAX;
+    uint64_t m = lv[wi] & (~0ull << (x % 64));
+    if( m != 0 )
+        return wi * 64 + __builtin_ctzll( m );
+    if( level + 1 >= m_levels.size() )
+        return SIZE_MAX;
+    //这个字后面的部分没有,到上一级找下一个不为0的字
+    size_t next = NextSet( level + 1, wi + 1 );
+    if( next == SIZE_MAX )
+        return SIZE_MAX;
+    return next * 64 + __builtin_ctzll( lv[next] );
+}
+
+size_t CSlotSummary::FindFree( const uint64_t* words, size_t start ) const{
+    if( start >= m_nbits || m_levels.empty() )
+        return SIZE_MAX;
+    size_t word = start / 64;
+    uint64_t m = ~words[word] & ValidMask( word ) & (~0ull << (start % 64));
+    if( m != 0 )
+        return word * 64 + __builtin_ctzll( m );
+    word = NextSet( 0, word + 1 );
+    if( word == SIZE_MAX )
+        return SIZE_MAX;
+    return word * 64 + __builtin_ctzll( ~words[word] & ValidMask( word ) );
+}
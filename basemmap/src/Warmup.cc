@@ -0,0 +1,236 @@
+#include <time.h>
+#include <stdio.h>
+#include "Warmup.h"
+
+using namespace shm;
+
+static const uint64_t WARMUP_MAGIC = 0x464f525057524d57ull;
+
+static double NowSeconds(){
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+CWarmup::CWarmup():m_next(0),m_done(0),m_doneBytes(0),m_reported(0),m_stop(false),m_ready(false),
+    m_totalBytes(0),m_verbose(false),m_startTime(0),m_readySeconds(0){
+}
+
+CWarmup::~CWarmup(){
+    Stop();
+}
+
+bool CWarmup::Start( const vector<CMapRegion>& regions, size_t threads, size_t chunksize,
+        const string& profile, bool async, bool verbose ){
+    Stop();
+    m_tasks.clear();
+    m_next = 0;
+    m_done = 0;
+    m_doneBytes = 0;
+    m_reported = 0;
+    m_stop = false;
+    m_ready = false;
+    m_totalBytes = 0;
+    m_verbose = verbose;
+    m_readySeconds = 0;
+    m_startTime = NowSeconds();
+    if( chunksize < (size_t)sysconf(_SC_PAGE_SIZE) )
+        chunksize = WARMUP_CHUNK_SIZE;
+    if( profile.empty() || !LoadProfile( profile, regions, chunksize ) ){
+        m_tasks.clear();
+        m_totalBytes = 0;
+        for( size_t i = 0; i < regions.size(); i++ ){
+            AddTasks( regions[i].m_addr, regions[i].m_len, chunksize );
+        }
+    }
+    if( m_tasks.empty() ){
+        Finish();
+        return true;
+    }
+    if( threads == 0 )
+        threads = std::thread::hardware_concurrency();
+    if( threads == 0 )
+        threads = 1;
+    if( threads > m_tasks.size() )
+        threads = m_tasks.size();
+    //同步预热时当前线程也参与
+    size_t spawn = async ? threads : threads - 1;
+    for( size_t i = 0; i < spawn; i++ ){
+        m_threads.push_back( std::thread( &CWarmup::Run, this ) );
+    }
+    if( !async ){
+        Run();
+        Wait();
+    }
+    return true;
+}
+
+void CWarmup::Stop(){
+    m_stop = true;
+    Wait();
+}
+
+void CWarmup::Wait(){
+    for( size_t i = 0; i < m_threads.size(); i++ ){
+        if( m_threads[i].joinable() )
+            m_threads[i].join();
+    }
+    m_threads.clear();
+}
+
+bool CWarmup::IsReady() const{
+    return m_ready.load( std::memory_order_acquire );
+}
+
+double CWarmup::GetProgress() const{
+    return m_totalBytes == 0 ? 1.0 : (double)m_doneBytes.load() / m_totalBytes;
+}
+
+double CWarmup::GetReadySeconds() const{
+    return m_readySeconds.load();
+}
+
+size_t CWarmup::GetTotalBytes() const{
+    return m_totalBytes;
+}
+
+//按页对齐切成chunksize大小的任务
+void CWarmup::AddTasks( const char* addr, size_t len, size_t chunksize ){
+    if( addr == NULL || len == 0 )
+        return;
+    for( size_t off = 0; off < len; off += chunksize ){
+        CWarmTask t;
+        t.m_addr = addr + off;
+        t.m_len = len - off < chunksize ? len - off : chunksize;
+        m_tasks.push_back( t );
+        m_totalBytes += t.m_len;
+    }
+}
+
+void CWarmup::Run(){
+    size_t page = sysconf(_SC_PAGE_SIZE);
+    for( size_t i = m_next.fetch_add(1); i < m_tasks.size() && !m_stop.load(); i = m_next.fetch_add(1) ){
+        const CWarmTask& t = m_tasks[i];
+        char* begin = (char*)((size_t)t.m_addr & ~(page - 1));
+        madvise( begin, t.m_addr + t.m_len - begin, MADV_WILLNEED );
+        volatile char sum = 0;
+        for( size_t off = 0; off < t.m_len; off += page ){
+            sum += *(volatile const char*)(t.m_addr + off);
+        }
+        (void)sum;
+        size_t done = m_doneBytes.fetch_add( t.m_len ) + t.m_len;
+        if( m_verbose ){
+            int decile = (int)(done * 10 / m_totalBytes);
+            int last = m_reported.load();
+            while( decile > last && decile < 10 ){
+                if( m_reported.compare_exchange_weak( last, decile ) ){
+                    printf( "warmup %d%% (%zu/%zu bytes) %.2fs\n", decile*10, done, m_totalBytes, NowSeconds() - m_startTime );
+                    break;
+                }
+            }
+        }
+        if( m_done.fetch_add(1) + 1 == m_tasks.size() )
+            Finish();
+    }
+}
+
+void CWarmup::Finish(){
+    m_readySeconds = NowSeconds() - m_startTime;
+    m_ready.store( true, std::memory_order_release );
+    if( m_verbose ){
+        printf( "warmup ready %zu bytes in %.3fs\n", m_totalBytes, m_readySeconds.load() );
+    }
+}
+
+bool CWarmup::SaveProfile( const string& path, const vector<CMapRegion>& regions ){
+    string tmp = path + ".tmp";
+    FILE* fp = fopen( tmp.c_str(), "wb" );
+    if( fp == NULL )
+        return false;
+    size_t page = sysconf(_SC_PAGE_SIZE);
+    uint64_t head[2] = { WARMUP_MAGIC, regions.size() };
+    bool ok = fwrite( head, sizeof(head), 1, fp ) == 1;
+    for( size_t r = 0; ok && r < regions.size(); r++ ){
+        const CMapRegion& rg = regions[r];
+        uint64_t chunks = (rg.m_len + WARMUP_PROFILE_CHUNK - 1) / WARMUP_PROFILE_CHUNK;
+        vector<unsigned char> bits( (chunks + 7) / 8, 0 );
+        if( rg.m_addr != NULL && rg.m_len > 0 ){
+            vector<unsigned char> resident( (rg.m_len + page - 1) / page, 0 );
+            if( mincore( (void*)rg.m_addr, rg.m_len, &resident[0] ) == 0 ){
+                for( size_t p = 0; p < resident.size(); p++ ){
+                    if( resident[p] & 1 ){
+                        size_t c = p * page / WARMUP_PROFILE_CHUNK;
+                        bits[c/8] |= 1 << (c%8);
+                    }
+                }
+            }
+        }
+        uint64_t namelen = rg.m_name.size();
+        uint64_t meta[2] = { WARMUP_PROFILE_CHUNK, chunks };
+        ok = fwrite( &namelen, sizeof(namelen), 1, fp ) == 1
+            && fwrite( rg.m_name.data(), 1, namelen, fp ) == namelen
+            && fwrite( meta, sizeof(meta), 1, fp ) == 1
+            && fwrite( bits.data(), 1, bits.size(), fp ) == bits.size();
+    }
+    ok = fclose( fp ) == 0 && ok;
+    return ok && rename( tmp.c_str(), path.c_str() ) == 0;
+}
+
+/*
+ *  按profile生成任务,相邻的热点块合并后再按chunksize切分;
+ *  profile中没有的区域(新增的文件)全部预热
+ */
+bool CWarmup::LoadProfile( const string& path, const vector<CMapRegion>& regions, size_t chunksize ){
+    FILE* fp = fopen( path.c_str(), "rb" );
+    if( fp == NULL )
+        return false;
+    uint64_t head[2];
+    if( fread( head, sizeof(head), 1, fp ) != 1 || head[0] != WARMUP_MAGIC ){
+        fclose( fp );
+        return false;
+    }
+    vector<bool> seen( regions.size(), false );
+    bool ok = true;
+    for( uint64_t r = 0; r < head[1]; r++ ){
+        uint64_t namelen, meta[2];
+        if( fread( &namelen, sizeof(namelen), 1, fp ) != 1 || namelen > PATH_MAX ){
+            ok = false;
+            break;
+        }
+        string name( namelen, '\0' );
+        if( fread( &name[0], 1, namelen, fp ) != namelen || fread( meta, sizeof(uint64_t), 2, fp ) != 2 || meta[0] == 0 ){
+            ok = false;
+            break;
+        }
+        vector<unsigned char> bits( (meta[1] + 7) / 8 );
+        if( fread( bits.data(), 1, bits.size(), fp ) != bits.size() ){
+            ok = false;
+            break;
+        }
+        for( size_t i = 0; i < regions.size(); i++ ){
+            if( seen[i] || regions[i].m_name != name || regions[i].m_addr == NULL )
+                continue;
+            seen[i] = true;
+            size_t runstart = SIZE_MAX;
+            for( uint64_t c = 0; c <= meta[1]; c++ ){
+                bool hot = c < meta[1] && (bits[c/8] & (1 << (c%8))) && c * meta[0] < regions[i].m_len;
+                if( hot && runstart == SIZE_MAX )
+                    runstart = c * meta[0];
+                if( !hot && runstart != SIZE_MAX ){
+                    size_t end = c * meta[0] < regions[i].m_len ? c * meta[0] : regions[i].m_len;
+                    AddTasks( regions[i].m_addr + runstart, end - runstart, chunksize );
+                    runstart = SIZE_MAX;
+                }
+            }
+            break;
+        }
+    }
+    fclose( fp );
+    if( !ok )
+        return false;
+    for( size_t i = 0; i < regions.size(); i++ ){
+        if( !seen[i] )
+            AddTasks( regions[i].m_addr, regions[i].m_len, chunksize );
+    }
+    return true;
+}
@@ -0,0 +1,135 @@
+/*
+ *并发写模式的扩展性测试: 线程数从1到max_threads(按2倍增加),
+ *每一轮新建目录,BeginConcurrentInsert后各线程插入自己的一段key,EndConcurrentInsert后停止计时,
+ *SharedHashMap每次操作是insertObj+map,SharedHashSet是insert,输出每个线程数的吞吐和相对单线程的加速比
+ *
+ *用法: concurrent_insert [目录] [key个数] [最大线程数] [初始bucket个数]
+ *默认 /tmp/shm_bench_concurrent 2000000 32 key个数/4, bucket偏少时包含拆分bucket和文件扩容的开销
+ *线程数超过cpu个数的部分加速比没有意义,会单独标出来
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include "../shared_hash_map.h"
+#include "../shared_hash_set.h"
+
+using namespace shm;
+
+struct BenchDoc {
+    uint32_t id;
+    char pad[28];
+};
+
+HASH_MAP_CONF(BenchMapEntry,16,4);
+HASH_SET_CONF(BenchSetEntry,16);
+
+static std::vector<std::string> g_keys;
+
+static void clearDir(const string &path) {
+    string cmd="rm -rf "+path;
+    if(0!=system(cmd.c_str())) {
+        printf("remove %s failed!\n",path.c_str());
+    }
+}
+
+//[begin,end)平均分给threads个线程
+template<typename F>
+static double runThreads(size_t threads,F f) {
+    std::vector<std::thread> ts;
+    size_t n=g_keys.size();
+    auto t0=std::chrono::steady_clock::now();
+    for(size_t t=0;t<threads;t++) {
+        size_t begin=n*t/threads;
+        size_t end=n*(t+1)/threads;
+        ts.push_back(std::thread(f,begin,end));
+    }
+    for(size_t t=0;t<ts.size();t++) {
+        ts[t].join();
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+}
+
+static double benchMap(string path,size_t threads,size_t bucket_num) {
+    clearDir(path);
+    SharedHashMap<BenchMapEntry,BenchDoc> m(path,M_READWRITE,bucket_num);
+    if(!m.Init() || !m.BeginConcurrentInsert()) {
+        printf("init map %s failed!\n",path.c_str());
+        return -1;
+    }
+    double s=runThreads(threads,[&](size_t begin,size_t end) {
+        for(size_t i=begin;i<end;i++) {
+            BenchDoc d;
+            d.id=i;
+            size_t pos=m.insertObj(d);
+            m.map(g_keys[i],pos,i%256);
+        }
+    });
+    auto t0=std::chrono::steady_clock::now();
+    m.EndConcurrentInsert();
+    s+=std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+    if(m.hashSize()!=g_keys.size()) {
+        printf("map size %zu, expect %zu!\n",m.hashSize(),g_keys.size());
+    }
+    return s;
+}
+
+static double benchSet(string path,size_t threads,size_t bucket_num) {
+    clearDir(path);
+    SharedHashSet<BenchSetEntry> st(path,M_READWRITE,bucket_num);
+    if(!st.Init() || !st.BeginConcurrentInsert()) {
+        printf("init set %s failed!\n",path.c_str());
+        return -1;
+    }
+    double s=runThreads(threads,[&](size_t begin,size_t end) {
+        for(size_t i=begin;i<end;i++) {
+            st.insert(g_keys[i]);
+        }
+    });
+    auto t0=std::chrono::steady_clock::now();
+    st.EndConcurrentInsert();
+    s+=std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+    if(st.hashSize()!=g_keys.size()) {
+        printf("set size %zu, expect %zu!\n",st.hashSize(),g_keys.size());
+    }
+    return s;
+}
+
+template<typename F>
+static void sweep(const char *name,size_t max_threads,F f) {
+    size_t cpus=std::thread::hardware_concurrency();
+    printf("%s: %zu keys, %zu cpus\n",name,g_keys.size(),cpus);
+    printf("%8s %10s %12s %10s\n","threads","seconds","Mops/s","speedup");
+    double base=0;
+    for(size_t t=1;t<=max_threads;t*=2) {
+        double s=f(t);
+        if(s<=0) {
+            return;
+        }
+        if(1==t) {
+            base=s;
+        }
+        printf("%8zu %10.3f %12.3f %10.2f%s\n",t,s,g_keys.size()/s/1e6,base/s,t>cpus?"  (threads > cpus)":"");
+    }
+}
+
+int main(int argc,char **argv) {
+    string path=argc>1?argv[1]:"/tmp/shm_bench_concurrent";
+    size_t n=argc>2?strtoull(argv[2],NULL,10):2000000;
+    size_t max_threads=argc>3?strtoull(argv[3],NULL,10):32;
+    size_t bucket_num=argc>4?strtoull(argv[4],NULL,10):n/4+1;
+    g_keys.reserve(n);
+    for(size_t i=0;i<n;i++) {
+        g_keys.push_back("key_"+std::to_string(i*2654435761u%n)+"_"+std::to_string(i));
+    }
+    sweep("SharedHashMap insertObj+map",max_threads,[&](size_t t) {
+        return benchMap(path+"/map",t,bucket_num);
+    });
+    sweep("SharedHashSet insert",max_threads,[&](size_t t) {
+        return benchSet(path+"/set",t,bucket_num);
+    });
+    clearDir(path);
+    return 0;
+}
@@ -0,0 +1,210 @@
+/*
+ *映射方式(SharedHashOptions.index_map/doc_map)对查询的影响:
+ *先用写进程建一个目录,然后每种配置fork一个新的只读进程,Init后随机查询,
+ *输出Init耗时、每次查询的平均/p99延迟、查询期间的缺页次数和dTLB miss
+ *
+ *dTLB miss用perf_event_open读本进程的计数器(PERF_COUNT_HW_CACHE_DTLB读miss),
+ *没有权限时显示n/a,可以调小/proc/sys/kernel/perf_event_paranoid(<=2),
+ *或者整体用 perf stat -e dTLB-load-misses,dTLB-loads ./map_policy 查看
+ *hugepage需要透明大页打开: /sys/kernel/mm/transparent_hugepage/enabled为always或madvise,
+ *目录在tmpfs上时还要看/sys/kernel/mm/transparent_hugepage/shmem_enabled
+ *
+ *用法: map_policy [目录] [key个数] [查询次数]
+ *默认 /dev/shm/shm_bench_policy 2000000 1000000
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "../shared_hash_map.h"
+
+using namespace shm;
+
+struct BenchDoc {
+    uint32_t id;
+    char pad[60];
+};
+
+HASH_MAP_CONF(BenchEntry,16,4);
+
+struct PolicyCase {
+    const char *name;
+    MapOptions index_map;
+    MapOptions doc_map;
+};
+
+static std::string keyOf(size_t i) {
+    return "key_"+std::to_string(i);
+}
+
+static bool build(string path,size_t n) {
+    string cmd="rm -rf "+path;
+    if(0!=system(cmd.c_str())) {
+        printf("remove %s failed!\n",path.c_str());
+        return false;
+    }
+    SharedHashMap<BenchEntry,BenchDoc> m(path,M_READWRITE,n);
+    if(!m.Init()) {
+        printf("init %s failed!\n",path.c_str());
+        return false;
+    }
+    for(size_t i=0;i<n;i++) {
+        BenchDoc d;
+        d.id=i;
+        size_t pos=m.insertObj(d);
+        //每个key 1~4个doc,查询时会访问doc.data中不相邻的位置
+        for(size_t j=0;j<=i%4;j++) {
+            m.map(keyOf(i),j==0?pos:(pos*7+j)%(i+1),j);
+        }
+    }
+    return true;
+}
+
+//本进程的dTLB读miss计数器,打不开时返回-1
+static int openDtlbCounter() {
+    struct perf_event_attr pe;
+    memset(&pe,0,sizeof(pe));
+    pe.type=PERF_TYPE_HW_CACHE;
+    pe.size=sizeof(pe);
+    pe.config=PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ<<8) | (PERF_COUNT_HW_CACHE_RESULT_MISS<<16);
+    pe.disabled=1;
+    pe.exclude_kernel=1;
+    pe.exclude_hv=1;
+    return syscall(__NR_perf_event_open,&pe,0,-1,-1,0);
+}
+
+static long minorFaults() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF,&ru);
+    return ru.ru_minflt;
+}
+
+//在新进程中运行,映射和页表都是新的
+static void runCase(string path,const PolicyCase &c,size_t n,size_t queries) {
+    std::mt19937_64 rng(12345);
+    std::vector<std::string> keys;
+    keys.reserve(queries);
+    for(size_t i=0;i<queries;i++) {
+        keys.push_back(keyOf(rng()%n));
+    }
+    std::vector<uint32_t> lat(queries);
+    SharedHashOptions opt;
+    opt.index_map=c.index_map;
+    opt.doc_map=c.doc_map;
+    auto t0=std::chrono::steady_clock::now();
+    SharedHashMap<BenchEntry,BenchDoc> m(path,M_READ,n,DEFAULT_HASH_SEED,opt);
+    if(!m.Init()) {
+        printf("%-28s init failed!\n",c.name);
+        return;
+    }
+    double init_ms=std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now()-t0).count();
+    int fd=openDtlbCounter();
+    if(fd>=0) {
+        ioctl(fd,PERF_EVENT_IOC_RESET,0);
+        ioctl(fd,PERF_EVENT_IOC_ENABLE,0);
+    }
+    long faults=minorFaults();
+    uint64_t sum=0;
+    auto start=std::chrono::steady_clock::now();
+    for(size_t i=0;i<queries;i++) {
+        auto q0=std::chrono::steady_clock::now();
+        DocView<BenchDoc> view=m.getView(keys[i]);
+        for(DocView<BenchDoc>::iterator it=view.begin();it!=view.end();++it) {
+            sum+=it->doc->id;
+        }
+        lat[i]=std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-q0).count();
+    }
+    double total_ns=std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now()-start).count();
+    faults=minorFaults()-faults;
+    long long misses=-1;
+    if(fd>=0) {
+        ioctl(fd,PERF_EVENT_IOC_DISABLE,0);
+        if(read(fd,&misses,sizeof(misses))!=sizeof(misses)) {
+            misses=-1;
+        }
+        close(fd);
+    }
+    std::sort(lat.begin(),lat.end());
+    char tlb[32];
+    if(misses>=0) {
+        snprintf(tlb,sizeof(tlb),"%.3f",double(misses)/queries);
+    }else {
+        snprintf(tlb,sizeof(tlb),"n/a");
+    }
+    printf("%-28s %10.1f %10.1f %10u %10ld %12s   (checksum %llu)\n",c.name,init_ms,total_ns/queries,
+        lat[queries*99/100],faults,tlb,(unsigned long long)sum);
+}
+
+int main(int argc,char **argv) {
+    string path=argc>1?argv[1]:"/dev/shm/shm_bench_policy";
+    size_t n=argc>2?strtoull(argv[2],NULL,10):2000000;
+    size_t queries=argc>3?strtoull(argv[3],NULL,10):1000000;
+    if(0==n || 0==queries || !build(path,n)) {
+        return 1;
+    }
+    std::vector<PolicyCase> cases;
+    PolicyCase c;
+    c.name="default";
+    cases.push_back(c);
+    c=PolicyCase();
+    c.name="index+doc random";
+    c.index_map.advice=ADVICE_RANDOM;
+    c.doc_map.advice=ADVICE_RANDOM;
+    cases.push_back(c);
+    c=PolicyCase();
+    c.name="index populate";
+    c.index_map.populate=true;
+    cases.push_back(c);
+    c=PolicyCase();
+    c.name="index+doc populate";
+    c.index_map.populate=true;
+    c.doc_map.populate=true;
+    cases.push_back(c);
+    c=PolicyCase();
+    c.name="index hugepage";
+    c.index_map.hugepage=true;
+    cases.push_back(c);
+    c=PolicyCase();
+    c.name="index+doc hugepage populate";
+    c.index_map.hugepage=true;
+    c.index_map.populate=true;
+    c.doc_map.hugepage=true;
+    c.doc_map.populate=true;
+    cases.push_back(c);
+    c=PolicyCase();
+    c.name="index willneed";
+    c.index_map.willneed=true;
+    cases.push_back(c);
+    printf("%zu keys, %zu random lookups (getView + read every doc), %s\n",n,queries,path.c_str());
+    int fd=openDtlbCounter();
+    if(fd<0) {
+        printf("dTLB counter unavailable (%s): lower kernel.perf_event_paranoid, "
+            "or run under: perf stat -e dTLB-load-misses,dTLB-loads\n",strerror(errno));
+    }else {
+        close(fd);
+    }
+    printf("%-28s %10s %10s %10s %10s %12s\n","policy","init ms","avg ns","p99 ns","faults","dTLB miss/op");
+    for(size_t i=0;i<cases.size();i++) {
+        fflush(stdout);
+        pid_t pid=fork();
+        if(0==pid) {
+            runCase(path,cases[i],n,queries);
+            fflush(stdout);
+            _exit(0);
+        }
+        int status;
+        waitpid(pid,&status,0);
+    }
+    return 0;
+}
@@ -0,0 +1,499 @@
+#ifndef SHARED_HASH_BUILDER_H
+#define SHARED_HASH_BUILDER_H
+
+#include <stdio.h>
+#include <unistd.h>
+#include <iostream>
+#include <vector>
+#include <queue>
+#include <thread>
+#include <algorithm>
+#include <string_view>
+#include "shared_hash_map.h"
+
+/*离线批量构建SharedHashMap目录
+ *
+ *逐条insertObj+map时,每个map都要查一遍链表、拷贝entry,文件每涨10M还要munmap/msync/重新mmap.
+ *builder先把(key,doc,score)记在内存里,超过内存上限就按bucket排好序写成一个临时run文件,
+ *最后多路归并所有run,按bucket顺序一次性顺序写出value.data/bucket.data/key.data(/posting.data),
+ *同一个bucket的entry在value.data中连续存放,冲突链就是相邻的几个entry.
+ *
+ *使用方法:
+ *string path="/data/shm";
+ *SharedHashBuilder<entry,A> *b=new SharedHashBuilder<entry,A>(path,bucket_num);
+ *if(!b->Init()) {...}
+ *size_t offset=b->addDoc(a);
+ *b->add(key,offset,score);     //和SharedHashMap::map含义相同
+ *...
+ *b->finish();                  //归并写出,之后目录可以用SharedHashMap以M_READ打开
+ *
+ *限制:
+ *只能写空目录,只支持IDX_CHAIN索引; bucket_num/seed/HASH必须和读的时候一致
+ *同一个key下同一个doc只保留第一次add的分数,分数相同时先add的排在前面
+ */
+
+namespace shm{
+
+//默认内存上限,超过后写一个run文件
+const size_t BUILD_MEM_LIMIT = 256*1024*1024;
+
+template<typename ENTRY,typename V,typename HASH=WyHasher>
+class SharedHashBuilder {
+private:
+    /*
+     *待排序的记录,key保存在keybuf_中
+     *seq -- add的顺序,分数相同时保持先后顺序
+     */
+    struct BuildRecord {
+        uint64_t hash;
+        size_t key_off;
+        uint32_t key_len;
+        uint8_t score;
+        size_t doc;
+        size_t seq;
+    };
+
+    //run文件中读出的一条记录
+    struct RunItem {
+        uint64_t hash;
+        size_t doc;
+        size_t seq;
+        uint8_t score;
+        string key;
+    };
+
+    struct RunReader {
+        FILE *fp;
+        RunItem cur;
+        bool valid;
+    };
+
+    /*
+     *排序顺序: bucket,hash,key,seq
+     *bucket相同的记录排在一起,按顺序写出时同一个bucket的entry就是连续的
+     */
+    inline bool less(uint64_t h1,const char *k1,size_t l1,size_t s1,
+            uint64_t h2,const char *k2,size_t l2,size_t s2) const {
+        uint64_t b1=h1 & mask_,b2=h2 & mask_;
+        if(b1!=b2) {
+            return b1<b2;
+        }
+        if(h1!=h2) {
+            return h1<h2;
+        }
+        int c=memcmp(k1,k2,std::min(l1,l2));
+        if(0!=c) {
+            return c<0;
+        }
+        if(l1!=l2) {
+            return l1<l2;
+        }
+        return s1<s2;
+    }
+
+public:
+    /*
+     *    datapath -- 输出目录,必须是空目录
+     *    bucket_num -- 同SharedHashMap构造函数的bucket_num
+     *    mem_limit -- 内存中缓存的记录超过这个大小就排序写run文件
+     *    threads -- 排序时的线程数
+     */
+    SharedHashBuilder(string &datapath,size_t bucket_num=10000000,uint64_t seed=DEFAULT_HASH_SEED,
+            const SharedHashOptions &opt=SharedHashOptions(),
+            size_t mem_limit=BUILD_MEM_LIMIT,size_t threads=4)
+        :datapath_(datapath),bucketNum_(bucket_num),seed_(seed),opt_(opt),memLimit_(mem_limit),
+        threads_(threads>0?threads:1),docData_(NULL),hashBucket_(NULL),hashValue_(NULL),postings_(NULL),
+        keys_(NULL),mask_(0),seq_(0),records_(0),finished_(false),pendingPos_(SIZE_MAX),nextEntry_(0),lastBucket_(SIZE_MAX) {
+        string sdocfile=datapath+"/doc.data";
+        string sbitfile=datapath+"/doc.bit";
+        string bkdatafile=datapath+"/bucket.data";
+        string bkbitfile=datapath+"/bucket.bit";
+        docData_ = new CDataStorage<V>(sdocfile,sbitfile,bucket_num,M_READWRITE);
+        hashBucket_ = new CDataStorage<HashBucket>(bkdatafile,bkbitfile,round_up_pow2(bucket_num),M_READWRITE,2);
+        keys_ = new CKeyArena(datapath+"/key.data",KEY_ARENA_INIT_SIZE,M_READWRITE);
+    }
+
+    ~SharedHashBuilder() {
+        for(size_t i=0;i<runs_.size();i++) {
+            unlink(runs_[i].c_str());
+        }
+        if(NULL!=docData_) {
+            delete docData_;
+            docData_=NULL;
+        }
+        if(NULL!=hashBucket_) {
+            delete hashBucket_;
+            hashBucket_=NULL;
+        }
+        if(NULL!=hashValue_) {
+            delete hashValue_;
+            hashValue_=NULL;
+        }
+        if(NULL!=postings_) {
+            delete postings_;
+            postings_=NULL;
+        }
+        if(NULL!=keys_) {
+            delete keys_;
+            keys_=NULL;
+        }
+    }
+
+    bool Init() {
+        if(IDX_CHAIN!=opt_.index_type) {
+            std::cout<<"builder only supports IDX_CHAIN!"<<std::endl;
+            return false;
+        }
+        if(opt_.unbounded_postings && !EntryHasOverflow<ENTRY>::value) {
+            std::cout<<"unbounded_postings needs an entry defined by HASH_MAP_CONF_UNBOUNDED!"<<std::endl;
+            return false;
+        }
+        if(IsExistFile(datapath_+"/value.data") || IsExistFile(datapath_+"/index.swiss")) {
+            std::cout<<"build dir "<<datapath_<<" is not empty!"<<std::endl;
+            return false;
+        }
+        if(!docData_->Init()) {
+            std::cout<<"init doc data failed!"<<std::endl;
+            return false;
+        }
+        if(!hashBucket_->Init()) {
+            std::cout<<"init hash bucket failed!"<<std::endl;
+            return false;
+        }
+        if(!keys_->Init()) {
+            std::cout<<"init key arena failed!"<<std::endl;
+            return false;
+        }
+        //和SharedHashMap::Init一致:取不超过容量的最大2的幂
+        CMmapHeader* hd=hashBucket_->GetDataHeader();
+        hd->m_hashid=HASH::ID;
+        hd->m_hashseed=seed_;
+        hd->m_bucketnum=round_down_pow2(hashBucket_->GetItemCapacity());
+        mask_=hd->m_bucketnum-1;
+        return true;
+    }
+
+    /*
+     *写入原始数据,返回的offset用于add,同SharedHashMap::insertObj
+     */
+    size_t addDoc(V &obj) {
+        size_t offset;
+        if(finished_ || STO_OK!=docData_->InsertData(obj,offset)) {
+            return SIZE_MAX;
+        }
+        return offset;
+    }
+
+    /*
+     *记录key->doc的映射,finish时才真正写出
+     */
+    int add(std::string_view k,size_t obj_offset,uint8_t score=0) {
+        if(finished_ || k.size() > UINT32_MAX) {
+            return -1;
+        }
+        BuildRecord r;
+        r.hash=HASH::hash(k.data(),k.size(),seed_);
+        r.key_off=keybuf_.size();
+        r.key_len=k.size();
+        r.score=score;
+        r.doc=obj_offset;
+        r.seq=seq_++;
+        keybuf_.insert(keybuf_.end(),k.data(),k.data()+k.size());
+        buf_.push_back(r);
+        records_++;
+        if(keybuf_.size()+buf_.size()*sizeof(BuildRecord) >= memLimit_) {
+            return spill()?0:-1;
+        }
+        return 0;
+    }
+
+    /*
+     *归并所有run,顺序写出entry/bucket/overflow块
+     */
+    bool finish() {
+        if(finished_) {
+            return false;
+        }
+        finished_=true;
+        if(!buf_.empty() && !spill()) {
+            return false;
+        }
+        string hmdatafile=datapath_+"/value.data";
+        string hmbitfile=datapath_+"/value.bit";
+        //entry个数不会超过记录数,一次分配好; ratio>=1不按比例扩容,key都不相同时写满也不会中途重新映射
+        hashValue_ = new CDataStorage<ENTRY>(hmdatafile,hmbitfile,records_>0?records_:1,M_READWRITE,2);
+        if(!hashValue_->Init()) {
+            std::cout<<"init hash value failed!"<<std::endl;
+            return false;
+        }
+        if(opt_.unbounded_postings) {
+            string pldatafile=datapath_+"/posting.data";
+            string plbitfile=datapath_+"/posting.bit";
+            postings_ = new CDataStorage<PostingBlock>(pldatafile,plbitfile,bucketNum_/4+1,M_READWRITE);
+            if(!postings_->Init()) {
+                std::cout<<"init posting data failed!"<<std::endl;
+                return false;
+            }
+        }
+        bool ok=merge();
+        for(size_t i=0;i<runs_.size();i++) {
+            unlink(runs_[i].c_str());
+        }
+        runs_.clear();
+        hashBucket_->SaveToDisk();
+        hashValue_->SaveToDisk();
+        docData_->SaveToDisk();
+        keys_->SaveToDisk();
+        if(NULL!=postings_) {
+            postings_->SaveToDisk();
+        }
+        return ok;
+    }
+
+    inline size_t recordCount() const {
+        return records_;
+    }
+
+    inline size_t runCount() const {
+        return runs_.size();
+    }
+
+private:
+    /*
+     *把内存中的记录排好序写成一个run文件
+     *按bucket范围把记录分成threads_段,每段一个线程排序,各段首尾相接就是整体有序的
+     */
+    bool spill() {
+        size_t parts=threads_;
+        std::vector<std::vector<BuildRecord> > part(parts);
+        size_t bucket_num=mask_+1;
+        for(size_t i=0;i<buf_.size();i++) {
+            size_t p=(size_t)((__uint128_t)(buf_[i].hash & mask_)*parts/bucket_num);
+            part[p].push_back(buf_[i]);
+        }
+        buf_.clear();
+        std::vector<BuildRecord>().swap(buf_);
+        std::vector<std::thread> ths;
+        for(size_t p=0;p<parts;p++) {
+            ths.push_back(std::thread([this,&part,p]() {
+                std::sort(part[p].begin(),part[p].end(),[this](const BuildRecord &a,const BuildRecord &b) {
+                    return less(a.hash,keybuf_.data()+a.key_off,a.key_len,a.seq,
+                            b.hash,keybuf_.data()+b.key_off,b.key_len,b.seq);
+                });
+            }));
+        }
+        for(size_t i=0;i<ths.size();i++) {
+            ths[i].join();
+        }
+        string fname=datapath_+"/build.run."+std::to_string(runs_.size());
+        FILE *fp=fopen(fname.c_str(),"wb");
+        if(NULL==fp) {
+            std::cout<<"open run file "<<fname<<" failed!"<<std::endl;
+            return false;
+        }
+        runs_.push_back(fname);
+        bool ok=true;
+        for(size_t p=0;p<parts && ok;p++) {
+            for(size_t i=0;i<part[p].size() && ok;i++) {
+                const BuildRecord &r=part[p][i];
+                ok=1==fwrite(&r.hash,sizeof(r.hash),1,fp) && 1==fwrite(&r.doc,sizeof(r.doc),1,fp)
+                    && 1==fwrite(&r.seq,sizeof(r.seq),1,fp) && 1==fwrite(&r.score,sizeof(r.score),1,fp)
+                    && 1==fwrite(&r.key_len,sizeof(r.key_len),1,fp)
+                    && (0==r.key_len || 1==fwrite(keybuf_.data()+r.key_off,r.key_len,1,fp));
+            }
+        }
+        if(0!=fclose(fp) || !ok) {
+            std::cout<<"write run file "<<fname<<" failed!"<<std::endl;
+            return false;
+        }
+        std::vector<char>().swap(keybuf_);
+        return true;
+    }
+
+    bool readRun(RunReader &r) {
+        RunItem &c=r.cur;
+        uint32_t len;
+        r.valid=1==fread(&c.hash,sizeof(c.hash),1,r.fp) && 1==fread(&c.doc,sizeof(c.doc),1,r.fp)
+            && 1==fread(&c.seq,sizeof(c.seq),1,r.fp) && 1==fread(&c.score,sizeof(c.score),1,r.fp)
+            && 1==fread(&len,sizeof(len),1,r.fp);
+        if(r.valid) {
+            c.key.resize(len);
+            r.valid=0==len || 1==fread(&c.key[0],len,1,r.fp);
+        }
+        return r.valid;
+    }
+
+    /*
+     *多路归并,key相同的记录合并成一个entry
+     */
+    bool merge() {
+        std::vector<RunReader> readers(runs_.size());
+        auto cmp=[this,&readers](size_t a,size_t b) {
+            const RunItem &x=readers[a].cur;
+            const RunItem &y=readers[b].cur;
+            return less(y.hash,y.key.data(),y.key.size(),y.seq,x.hash,x.key.data(),x.key.size(),x.seq);
+        };
+        std::priority_queue<size_t,std::vector<size_t>,decltype(cmp)> heap(cmp);
+        bool ok=true;
+        for(size_t i=0;i<runs_.size();i++) {
+            readers[i].fp=fopen(runs_[i].c_str(),"rb");
+            if(NULL==readers[i].fp) {
+                std::cout<<"open run file "<<runs_[i]<<" failed!"<<std::endl;
+                ok=false;
+                continue;
+            }
+            if(readRun(readers[i])) {
+                heap.push(i);
+            }
+        }
+        string key;
+        uint64_t hash=0;
+        std::vector<RunItem> group;
+        pendingPos_=SIZE_MAX;
+        nextEntry_=0;
+        lastBucket_=SIZE_MAX;
+        while(ok && !heap.empty()) {
+            size_t i=heap.top();
+            heap.pop();
+            RunItem &c=readers[i].cur;
+            if(!group.empty() && (c.hash!=hash || c.key!=key)) {
+                ok=writeEntry(key,hash,group);
+                group.clear();
+            }
+            hash=c.hash;
+            key=c.key;
+            group.push_back(c);
+            if(readRun(readers[i])) {
+                heap.push(i);
+            }
+        }
+        if(ok && !group.empty()) {
+            ok=writeEntry(key,hash,group);
+        }
+        if(ok) {
+            ok=flushPending(SIZE_MAX);
+        }
+        for(size_t i=0;i<readers.size();i++) {
+            if(NULL!=readers[i].fp) {
+                fclose(readers[i].fp);
+            }
+        }
+        return ok;
+    }
+
+    /*
+     *同一个key的所有记录(归并后已经按add顺序排列): 去掉重复的doc,按分数从高到低排列(分数相同按add顺序),
+     *前topk个放进entry,unbounded_postings时剩下的每POSTING_BLOCK_ITEMS个写一个overflow块
+     */
+    bool writeEntry(const string &key,uint64_t hash,std::vector<RunItem> &group) {
+        std::vector<HashValueItem> items;
+        std::set<size_t> seen;
+        for(size_t i=0;i<group.size();i++) {
+            if(seen.insert(group[i].doc).second) {
+                HashValueItem it;
+                it.offset=group[i].doc;
+                it.score=group[i].score;
+                items.push_back(it);
+            }
+        }
+        std::stable_sort(items.begin(),items.end(),[](const HashValueItem &a,const HashValueItem &b) {
+            return a.score>b.score;
+        });
+        ENTRY entry;
+        entry.hash=hash;
+        entry.term_len=key.size();
+        if(key.size()<=sizeof(entry.term)) {
+            memcpy(entry.term,key.data(),key.size());
+        }else {
+            memcpy(entry.term,key.data(),sizeof(entry.term));
+            entry.term_off=keys_->Append(key.data(),key.size());
+            if(SIZE_MAX==entry.term_off) {
+                return false;
+            }
+        }
+        size_t topk=sizeof(entry.item)/sizeof(entry.item[0]);
+        entry.item_num=std::min(topk,items.size());
+        for(size_t i=0;i<entry.item_num;i++) {
+            entry.item[i]=items[i];
+        }
+        if(NULL!=postings_ && items.size()>topk) {
+            for(size_t i=topk;i<items.size();i+=POSTING_BLOCK_ITEMS) {
+                PostingBlock b;
+                b.num=std::min(POSTING_BLOCK_ITEMS,items.size()-i);
+                memcpy(b.item,&items[i],b.num*sizeof(HashValueItem));
+                size_t pos;
+                if(STO_OK!=postings_->InsertData(b,pos)) {
+                    return false;
+                }
+                if(i==topk) {
+                    setEntryOverflow(entry,pos,items.size()-topk);
+                }
+                //新文件顺序写入,下一个块一定写在pos+1
+                b.next=i+POSTING_BLOCK_ITEMS<items.size()?pos+1:SIZE_MAX;
+                postings_->UpdateData(b,pos);
+            }
+        }
+        if(!flushPending(hash & mask_)) {
+            return false;
+        }
+        pending_=entry;
+        pendingPos_=nextEntry_++;
+        return true;
+    }
+
+    /*
+     *entry的next要等下一个entry确定后才知道,所以总是晚一步写出:
+     *下一个entry在同一个bucket时next指向它,否则链表结束
+     */
+    bool flushPending(size_t next_bucket) {
+        if(SIZE_MAX==pendingPos_) {
+            return true;
+        }
+        size_t bucket=pending_.hash & mask_;
+        pending_.next=bucket==next_bucket?pendingPos_+1:SIZE_MAX;
+        size_t pos;
+        if(STO_OK!=hashValue_->InsertData(pending_,pos,pendingPos_)) {
+            std::cout<<"write entry "<<pendingPos_<<" failed!"<<std::endl;
+            return false;
+        }
+        if(bucket!=lastBucket_) {
+            HashBucket b;
+            b.header=pendingPos_;
+            if(STO_OK!=hashBucket_->InsertData(b,pos,bucket)) {
+                std::cout<<"write bucket "<<bucket<<" failed!"<<std::endl;
+                return false;
+            }
+            lastBucket_=bucket;
+        }
+        pendingPos_=SIZE_MAX;
+        return true;
+    }
+
+private:
+    string datapath_;
+    size_t bucketNum_;
+    uint64_t seed_;
+    SharedHashOptions opt_;
+    size_t memLimit_;
+    size_t threads_;
+    CDataStorage<V> *docData_;
+    CDataStorage<HashBucket> *hashBucket_;
+    CDataStorage<ENTRY> *hashValue_;
+    CDataStorage<PostingBlock> *postings_;
+    CKeyArena *keys_;
+    size_t mask_;
+    size_t seq_;
+    size_t records_;
+    bool finished_;
+    std::vector<BuildRecord> buf_;
+    std::vector<char> keybuf_;
+    std::vector<string> runs_;
+    ENTRY pending_;
+    size_t pendingPos_;
+    size_t nextEntry_;
+    size_t lastBucket_;
+};
+
+}
+
+#endif
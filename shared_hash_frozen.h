@@ -0,0 +1,351 @@
+#ifndef SHARED_HASH_FROZEN_H
+#define SHARED_HASH_FROZEN_H
+
+#include <stdio.h>
+#include <unistd.h>
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <string_view>
+#include "shared_hash_map.h"
+#include "shared_hash_set.h"
+#include "shared_hash_mphf.h"
+
+/*只读快照: 把SharedHashMap/SharedHashSet导出成一个紧凑的只读文件,用最小完美hash做索引
+ *
+ *只读的场景下bucket数组、冲突链、next指针和bit位文件都用不到,
+ *快照里只有MPHF(每个key约3bit)、每个key一个slot、key和item、用到的doc,没有空洞
+ *
+ *文件格式(一个CBaseMmap文件,文件头中保存hash函数ID和seed):
+ *[FrozenMeta]
+ *[MPHF]                       ##见shared_hash_mphf.h
+ *[slot x key_num]             ##hash(fingerprint) + 记录在blob中的偏移
+ *[blob]                       ##每个key: [key_len][item_num][key][item...]
+ *[doc x doc_num]              ##只有map有,item中保存的是doc在这里的下标
+ *
+ *查询: MPHF算出slot下标,比较slot中的64位hash,不相等就不存在(不在快照中的key基本都在这一步返回),
+ *相等再比较blob中的key.一次查询只有slot一次随机访问,命中时再加上记录本身
+ *
+ *使用方法:
+ *FrozenHashMap<A>::Export(*shm,"/data/shm.frozen");
+ *FrozenHashMap<A> *fm=new FrozenHashMap<A>("/data/shm.frozen");
+ *if(!fm->Init()) {...}
+ *DocResult<A> docs=fm->get("test");
+ */
+
+namespace shm{
+
+const uint64_t FROZEN_MAGIC = 0x4e455a4f52464853ull;
+
+enum FrozenKind {
+    FROZEN_MAP = 1,
+    FROZEN_SET = 2
+};
+
+/*
+ *所有偏移都是相对数据区起始位置的字节数,按8字节对齐
+ */
+struct FrozenMeta {
+    uint64_t magic;
+    uint64_t kind;
+    uint64_t key_num;
+    uint64_t doc_num;
+    uint64_t doc_size;
+    uint64_t mphf_off;
+    uint64_t mphf_words;
+    uint64_t slot_off;
+    uint64_t blob_off;
+    uint64_t blob_size;
+    uint64_t doc_off;
+};
+
+struct FrozenSlot {
+    uint64_t hash;
+    uint64_t blob;
+};
+
+//blob中的记录头,后面是key(补齐到8字节)和item_num个item
+struct FrozenRecord {
+    uint32_t key_len;
+    uint32_t item_num;
+};
+
+//item: 高56位doc下标,低8位分数
+static inline uint64_t frozen_item(size_t doc,uint8_t score) {
+    return ((uint64_t)doc<<8)|score;
+}
+
+/*
+ *快照文件的打开和查找,FrozenHashMap/FrozenHashSet共用
+ */
+template<typename HASH=WyHasher>
+class FrozenIndex {
+public:
+    FrozenIndex(const string &filename)
+        :filename_(filename),mmap_(1,0,EXTEND_SIZE,M_READ),meta_(NULL),base_(NULL),slots_(NULL),seed_(0) {
+    }
+
+    bool Open(uint64_t kind) {
+        if(!mmap_.SampleMapFile(filename_)) {
+            std::cout<<"open frozen file "<<filename_<<" failed!"<<std::endl;
+            return false;
+        }
+        CMmapHeader* hd=mmap_.GetHeaderaddr();
+        if(hd->m_hashid!=HASH::ID) {
+            std::cout<<"hash function mismatch, file id="<<hd->m_hashid<<", expect id="<<HASH::ID<<std::endl;
+            return false;
+        }
+        base_=(const char*)mmap_.GetDataStartAddr();
+        meta_=(const FrozenMeta*)base_;
+        if(FROZEN_MAGIC!=meta_->magic || kind!=meta_->kind) {
+            std::cout<<"bad frozen file "<<filename_<<std::endl;
+            return false;
+        }
+        if(!mphf_.Attach((const uint64_t*)(base_+meta_->mphf_off),meta_->mphf_words)) {
+            std::cout<<"bad mphf in frozen file "<<filename_<<std::endl;
+            return false;
+        }
+        slots_=(const FrozenSlot*)(base_+meta_->slot_off);
+        seed_=hd->m_hashseed;
+        return true;
+    }
+
+    /*
+     *查找key的记录,不存在返回NULL
+     */
+    inline const FrozenRecord* find(std::string_view key) const {
+        uint64_t h=HASH::hash(key.data(),key.size(),seed_);
+        const FrozenRecord *rec=NULL;
+        mphf_.find(h,[&](size_t idx) {
+            if(idx>=meta_->key_num || slots_[idx].hash!=h) {
+                return false;
+            }
+            const FrozenRecord *r=(const FrozenRecord*)(base_+meta_->blob_off+slots_[idx].blob);
+            if(r->key_len!=key.size() || 0!=memcmp(r+1,key.data(),key.size())) {
+                return false;
+            }
+            rec=r;
+            return true;
+        });
+        return rec;
+    }
+
+    static inline const uint64_t* items(const FrozenRecord *r) {
+        return (const uint64_t*)((const char*)(r+1)+align8(r->key_len));
+    }
+
+    inline const char* doc(size_t idx) const {
+        return base_+meta_->doc_off+idx*meta_->doc_size;
+    }
+
+    inline size_t size() const {
+        return NULL==meta_?0:meta_->key_num;
+    }
+
+    inline const FrozenMeta* meta() const {
+        return meta_;
+    }
+
+    static inline size_t align8(size_t n) {
+        return (n+7)/8*8;
+    }
+
+    /*
+     *写快照文件: 先写临时文件,完成后rename
+     *    items[i] -- 第i个key的item,已经按分数排好序
+     *    docs -- doc_num*doc_size字节
+     */
+    static bool Write(const string &filename,uint64_t kind,uint64_t seed,const std::vector<string> &keys,
+            const std::vector<std::vector<uint64_t> > &items,const char *docs,size_t doc_num,size_t doc_size) {
+        std::vector<uint64_t> hashes(keys.size());
+        for(size_t i=0;i<keys.size();i++) {
+            hashes[i]=HASH::hash(keys[i].data(),keys[i].size(),seed);
+        }
+        std::vector<uint64_t> mphf;
+        std::vector<size_t> order;
+        Mphf::Build(hashes,mphf,order);
+
+        FrozenMeta meta;
+        memset(&meta,0,sizeof(meta));
+        meta.magic=FROZEN_MAGIC;
+        meta.kind=kind;
+        meta.key_num=keys.size();
+        meta.doc_num=doc_num;
+        meta.doc_size=doc_size;
+        meta.mphf_off=align8(sizeof(FrozenMeta));
+        meta.mphf_words=mphf.size();
+        meta.slot_off=meta.mphf_off+mphf.size()*sizeof(uint64_t);
+        meta.blob_off=meta.slot_off+keys.size()*sizeof(FrozenSlot);
+        std::vector<FrozenSlot> slots(keys.size());
+        size_t blob=0;
+        for(size_t i=0;i<keys.size();i++) {
+            slots[order[i]].hash=hashes[i];
+            slots[order[i]].blob=blob;
+            blob+=sizeof(FrozenRecord)+align8(keys[i].size())+items[i].size()*sizeof(uint64_t);
+        }
+        meta.blob_size=blob;
+        meta.doc_off=meta.blob_off+align8(blob);
+        size_t total=meta.doc_off+doc_num*doc_size;
+
+        string tmpfile=filename+".tmp";
+        unlink(tmpfile.c_str());
+        bool ok=false;
+        {
+            CBaseMmap mm(1,total,EXTEND_SIZE,M_READWRITE);
+            if(!mm.SampleMapFile(tmpfile)) {
+                std::cout<<"create frozen file "<<tmpfile<<" failed!"<<std::endl;
+                return false;
+            }
+            char *base=(char*)mm.GetDataStartAddr();
+            memcpy(base,&meta,sizeof(meta));
+            memcpy(base+meta.mphf_off,mphf.data(),mphf.size()*sizeof(uint64_t));
+            memcpy(base+meta.slot_off,slots.data(),slots.size()*sizeof(FrozenSlot));
+            for(size_t i=0;i<keys.size();i++) {
+                char *p=base+meta.blob_off+slots[order[i]].blob;
+                FrozenRecord r;
+                r.key_len=keys[i].size();
+                r.item_num=items[i].size();
+                memcpy(p,&r,sizeof(r));
+                memcpy(p+sizeof(r),keys[i].data(),keys[i].size());
+                memcpy(p+sizeof(r)+align8(keys[i].size()),items[i].data(),items[i].size()*sizeof(uint64_t));
+            }
+            if(doc_num>0) {
+                memcpy(base+meta.doc_off,docs,doc_num*doc_size);
+            }
+            CMmapHeader *hd=mm.GetHeaderaddr();
+            hd->m_hashid=HASH::ID;
+            hd->m_hashseed=seed;
+            hd->m_itemcount=keys.size();
+            hd->m_nextwritepos=total;
+            ok=mm.SaveAllModifyData();
+        }
+        if(!ok || 0!=rename(tmpfile.c_str(),filename.c_str())) {
+            std::cout<<"write frozen file "<<filename<<" failed!"<<std::endl;
+            unlink(tmpfile.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    string filename_;
+    CBaseMmap mmap_;
+    const FrozenMeta *meta_;
+    const char *base_;
+    const FrozenSlot *slots_;
+    uint64_t seed_;
+    Mphf mphf_;
+};
+
+template<typename V,typename HASH=WyHasher>
+class FrozenHashMap {
+public:
+    FrozenHashMap(const string &filename):index_(filename) {
+    }
+
+    bool Init() {
+        if(!index_.Open(FROZEN_MAP)) {
+            return false;
+        }
+        if(index_.meta()->doc_size!=sizeof(V)) {
+            std::cout<<"doc size mismatch, file="<<index_.meta()->doc_size<<" expect="<<sizeof(V)<<std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    /*
+     *同SharedHashMap::get,包括overflow块中的item
+     */
+    inline DocResult<V> get(std::string_view key,size_t topn=SIZE_MAX) const {
+        DocResult<V> dr;
+        const FrozenRecord *r=index_.find(key);
+        if(NULL==r) {
+            return dr;
+        }
+        const uint64_t *it=FrozenIndex<HASH>::items(r);
+        for(size_t i=0;i<r->item_num && dr.docs.size()<topn;i++) {
+            DocValue<V> dv;
+            dv.doc=(const V*)index_.doc(it[i]>>8);
+            dv.score=(uint8_t)it[i];
+            dr.docs.push_back(dv);
+        }
+        return dr;
+    }
+
+    inline bool has(std::string_view key) const {
+        return NULL!=index_.find(key);
+    }
+
+    inline size_t size() const {
+        return index_.size();
+    }
+
+    inline size_t docSize() const {
+        return index_.meta()->doc_num;
+    }
+
+    /*
+     *导出SharedHashMap,只有还能查到的doc会被拷贝,多个key引用同一个doc时只保存一份
+     */
+    template<typename ENTRY>
+    static bool Export(const SharedHashMap<ENTRY,V,HASH> &m,const string &filename) {
+        std::vector<string> keys;
+        std::vector<std::vector<uint64_t> > items;
+        std::vector<V> docs;
+        std::unordered_map<const V*,size_t> docIdx;
+        m.forEach([&](const string &key,DocView<V> view) {
+            keys.push_back(key);
+            items.push_back(std::vector<uint64_t>());
+            for(typename DocView<V>::iterator it=view.begin();it!=view.end();++it) {
+                std::pair<typename std::unordered_map<const V*,size_t>::iterator,bool> ins=
+                    docIdx.insert(std::make_pair(it->doc,docs.size()));
+                if(ins.second) {
+                    docs.push_back(*it->doc);
+                }
+                items.back().push_back(frozen_item(ins.first->second,it->score));
+            }
+        });
+        return FrozenIndex<HASH>::Write(filename,FROZEN_MAP,m.hashSeed(),keys,items,
+                (const char*)docs.data(),docs.size(),sizeof(V));
+    }
+
+private:
+    FrozenIndex<HASH> index_;
+};
+
+template<typename HASH=WyHasher>
+class FrozenHashSet {
+public:
+    FrozenHashSet(const string &filename):index_(filename) {
+    }
+
+    bool Init() {
+        return index_.Open(FROZEN_SET);
+    }
+
+    inline bool has(std::string_view key) const {
+        return NULL!=index_.find(key);
+    }
+
+    inline size_t size() const {
+        return index_.size();
+    }
+
+    template<typename ENTRY>
+    static bool Export(const SharedHashSet<ENTRY,HASH> &s,const string &filename) {
+        std::vector<string> keys;
+        s.forEach([&](const string &key) {
+            keys.push_back(key);
+        });
+        std::vector<std::vector<uint64_t> > items(keys.size());
+        return FrozenIndex<HASH>::Write(filename,FROZEN_SET,s.hashSeed(),keys,items,NULL,0,0);
+    }
+
+private:
+    FrozenIndex<HASH> index_;
+};
+
+}
+
+#endif
@@ -2,25 +2,141 @@
 #define SHARED_HASH_FUN_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
 #include "type.h"
 
+using std::string;
+
 namespace shm{
+
+/*
+ *hash函数族,SharedHashMap/SharedHashSet通过模板参数HASH指定
+ *每个hash函数都有一个唯一的ID,ID和seed会写入bucket.data的文件头,
+ *重新打开目录时会做校验,防止用不同的hash函数打开同一份数据
+ *
+ *hash函数需要提供:
+ *  static const uint32_t ID;
+ *  static uint64_t hash(const char *data,size_t len,uint64_t seed);
+ *ID为0表示未设置,不能使用
+ */
+enum HashFunId{
+    HASH_ID_NONE = 0,
+    HASH_ID_JAVA31 = 1,
+    HASH_ID_WY = 2
+};
+
+const uint64_t DEFAULT_HASH_SEED = 0x9e3779b97f4a7c15ull;
+
+/*
+ *老版本的 h*31+c 算法,只用于兼容,seed不参与计算
+ */
+struct JavaHasher {
+    static const uint32_t ID = HASH_ID_JAVA31;
+    static inline uint64_t hash(const char *data,size_t len,uint64_t /*seed*/) {
+        int32_t hashCode = 0;
+        for(size_t i=0;i<len;i++) {
+            hashCode = hashCode * 31 + data[i];
+        }
+        return hashCode>=0?hashCode:-hashCode;
+    }
+};
+
 /*
-static size_t hash_code(String &value) {
-	int32_t hashCode = 0;
-	for (String::const_iterator ptr = value.begin(); ptr != value.end(); ++ptr) {
-		hashCode = hashCode * 31 + *ptr;
+ *wyhash(final4),64位输出,分布均匀
+ *  len<=16: 两次4字节/8字节读取,没有循环
+ *  len>=48: 三路独立的乘法混合并行处理,每轮48字节,长key的吞吐基本受内存带宽限制
+ */
+struct WyHasher {
+    static const uint32_t ID = HASH_ID_WY;
+
+    static inline void wymum(uint64_t *a,uint64_t *b) {
+        __uint128_t r=*a;
+        r*=*b;
+        *a=(uint64_t)r;
+        *b=(uint64_t)(r>>64);
+    }
+    static inline uint64_t wymix(uint64_t a,uint64_t b) {
+        wymum(&a,&b);
+        return a^b;
+    }
+    static inline uint64_t wyr8(const uint8_t *p) {
+        uint64_t v;
+        memcpy(&v,p,8);
+        return v;
+    }
+    static inline uint64_t wyr4(const uint8_t *p) {
+        uint32_t v;
+        memcpy(&v,p,4);
+        return v;
+    }
+    static inline uint64_t wyr3(const uint8_t *p,size_t k) {
+        return (((uint64_t)p[0])<<16)|(((uint64_t)p[k>>1])<<8)|p[k-1];
+    }
+
+    static inline uint64_t hash(const char *data,size_t len,uint64_t seed) {
+        static const uint64_t s[4]={0x2d358dccaa6c78a5ull,0x8bb84b93962eacc9ull,
+                                    0x4b33a62ed433d4a3ull,0x4d5a2da51de1aa47ull};
+        const uint8_t *p=(const uint8_t*)data;
+        uint64_t a,b;
+        seed^=wymix(seed^s[0],s[1]);
+        if(__builtin_expect(len<=16,1)) {
+            if(len>=4) {
+                a=(wyr4(p)<<32)|wyr4(p+((len>>3)<<2));
+                b=(wyr4(p+len-4)<<32)|wyr4(p+len-4-((len>>3)<<2));
+            }else if(len>0) {
+                a=wyr3(p,len);
+                b=0;
+            }else {
+                a=b=0;
+            }
+        }else {
+            size_t i=len;
+            if(i>=48) {
+                uint64_t see1=seed,see2=seed;
+                do {
+                    seed=wymix(wyr8(p)^s[1],wyr8(p+8)^seed);
+                    see1=wymix(wyr8(p+16)^s[2],wyr8(p+24)^see1);
+                    see2=wymix(wyr8(p+32)^s[3],wyr8(p+40)^see2);
+                    p+=48;
+                    i-=48;
+                }while(i>=48);
+                seed^=see1^see2;
+            }
+            while(i>16) {
+                seed=wymix(wyr8(p)^s[1],wyr8(p+8)^seed);
+                i-=16;
+                p+=16;
+            }
+            a=wyr8(p+i-16);
+            b=wyr8(p+i-8);
+        }
+        a^=s[1];
+        b^=seed;
+        wymum(&a,&b);
+        return wymix(a^s[0]^len,b^s[1]);
+    }
+};
 
-	}
-	return hashCode>=0?hashCode:-hashCode;
+/*
+ *向上取整到2的幂,bucket个数使用2的幂,定位bucket时只需要做一次与运算
+ */
+static inline size_t round_up_pow2(size_t n) {
+    if(n<=1) {
+        return 1;
+    }
+    return ((size_t)1)<<(64-__builtin_clzll(n-1));
 }
-*/
-static size_t hash_code(const string &value) {
-	int32_t hashCode = 0;
-	for (string::const_iterator ptr = value.cbegin(); ptr != value.cend(); ++ptr) {
-		hashCode = hashCode * 31 + *ptr;
-	}
-	return hashCode>=0?hashCode:-hashCode;
+
+/*
+ *向下取整到2的幂
+ */
+static inline size_t round_down_pow2(size_t n) {
+    if(n<=1) {
+        return 1;
+    }
+    return ((size_t)1)<<(63-__builtin_clzll(n));
 }
 
 }
@@ -1,18 +1,37 @@
 #ifndef SHARED_HASH_MAP_H
 #define SHARED_HASH_MAP_H
 
+#include <sched.h>
 #include <iostream>
+#include <mutex>
+#include <shared_mutex>
 #include <set>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <string_view>
+#include <type_traits>
 #include "type.h"
 #include "./basemmap/include/DataStorage.hpp"
+#include "./basemmap/include/KeyArena.h"
+#include "./basemmap/include/BloomFilter.h"
+#include "./basemmap/include/Warmup.h"
+#include "./basemmap/include/Journal.h"
+#include "./basemmap/include/Flusher.h"
 #include "shared_hash_fun.h"
+#include "shared_hash_swiss.h"
 
 /*基于mmap的hash_map实现，key只支持string,其他类型通过转换为唯一string来存储
  *k-v 支持  k对1(default)  1对k(k通过构造函数来控制)
  *通过HASH_MAP_CONF(entry_name,max_query_len,topk)宏来生成一个配置，
  *第一个参数是hash_entry的name，可以自定义
- *第二个参数是max_query_le,代表支持的query的最大长度，考虑到性能和空间，qkey不能任意长，这个参数只能填数字，如:50
+ *第二个参数是max_query_le,代表entry中直接保存的key长度，这个参数只能填数字，如:50
+ *  不超过这个长度的key直接存在entry中; 更长的key在entry中保存前缀,完整的key追加到key.data中,
+ *  key的长度不再受限制,大部分key较短时可以填一个较小的值,减小value.data
  *第三个参数是一个key,最多对应多少value,考虑到性能和空间，一个key暂时不支持对应任意多少value
+ *  SharedHashOptions.unbounded_postings=true时,topk个之外的value按分数有序地放在posting.data的overflow块中,
+ *  不再丢弃,entry中始终保存分数最高的topk个; 这时entry要用HASH_MAP_CONF_UNBOUNDED生成(参数相同),
+ *  多出overflow/overflow_num两个字段,HASH_MAP_CONF生成的entry没有它们,不能打开unbounded_postings
  *
  *使用示例:
  *
@@ -31,9 +50,12 @@
  *
  *string path="/home/test/mmap";
  *size_t bucket_num=10000000;
- *SharedHashMap<test,A> *shm=new SharedHashMap<test,A>(path,bucket_num);  //bucket_num可以省略，默认是10000000,
+ *SharedHashMap<test,A> *shm=new SharedHashMap<test,A>(path,M_READWRITE,bucket_num);  //bucket_num可以省略，默认是10000000,
  *shm->Init();
  *
+ *第三个模板参数是hash函数,默认是WyHasher,也可以用JavaHasher或者自定义(见shared_hash_fun.h)
+ *hash函数的ID和seed会保存在bucket.data的文件头中,用不同的hash函数/seed打开已有目录时Init()会失败
+ *
  *
  *
  *size_t offset_a=shm->insertObj(a);  //插入数据
@@ -42,15 +64,20 @@
  *shm->map(key,offset_a,score);       //score用于选出topk，查询时按照分数排序
  *
  *查询方法：
+ *key都可以用std::string或std::string_view传入,不会拷贝key,已有(const char*,长度)时用std::string_view(p,len)
  *DocResult<A> docs=shm->get("test");
  *docs就是最终查询结果
+ *DocResult<A> top=shm->get("test",20);  //只取分数最高的20个
+ *
  *
+ *索引类型通过SharedHashOptions.index_type在创建时指定(见type.h),默认是IDX_CHAIN,
+ *IDX_SWISS使用开放寻址索引index.swiss(见shared_hash_swiss.h),entry的next不再使用
  *
  *实现原理:
  *
  *
- *bucket   OOOOOOOOOOO     ##bucket 个数从创建后不发生改变,开始时尽量开大一点，可以减少hash冲突，
- *             \           ## 加快访问速度,后续可能加入rehash功能
+ *bucket   OOOOOOOOOOO     ##bucket 初始个数向上取整为2的幂,负载超过max_load_factor后按线性hash
+ *             \           ## 每次插入拆分几个bucket,bucket数组逐步翻倍,不需要停下来全量rehash
  *              \
  *               \
  *hash_entry OOOOOOOOOOOOOOOOOOOOOOOOOOOOOO   ##value in bucket，自动扩容
@@ -70,18 +97,153 @@ struct HashValueItem {
     }
 };
 
+/*
+ *overflow块,unbounded_postings模式下保存entry中放不下的item
+ *同一个key的块组成链表,块内和块之间都按分数从高到低排列,块满时拆成两个
+ */
+const size_t POSTING_BLOCK_ITEMS = 31;
+
+struct PostingBlock {
+    size_t next;
+    uint32_t num;
+    uint32_t seq;  //写进程修改时加1,奇数表示正在修改
+    HashValueItem item[POSTING_BLOCK_ITEMS];
+    PostingBlock() {
+        next=SIZE_MAX;
+        num=0;
+        seq=0;
+    }
+};
+
+/*
+ *doc_refcount时docref.data中和doc.data同一下标的记录
+ *refs -- 引用这个doc的entry个数,减到0时删除doc
+ *keys -- doc_key_index时第一个DocKeyBlock的下标,SIZE_MAX表示没有
+ */
+struct DocRef {
+    size_t refs;
+    size_t keys;
+    DocRef() {
+        refs=0;
+        keys=SIZE_MAX;
+    }
+};
+
+/*
+ *dockey.data中的块,保存引用同一个doc的entry下标,同一个doc的块组成链表;
+ *只有第一个块可能不满,新增时放到第一个块,删除时用第一个块的最后一个补上空位
+ */
+const size_t DOC_KEY_BLOCK_ITEMS = 6;
+
+struct DocKeyBlock {
+    size_t next;
+    size_t num;
+    size_t entry[DOC_KEY_BLOCK_ITEMS];
+    DocKeyBlock() {
+        next=SIZE_MAX;
+        num=0;
+    }
+};
+
+/*
+ *hash/term_len放在entry头部,遍历冲突链时先比较hash和长度,不相等就不需要比较key,
+ *也不会访问到后面的term/item
+ *seq是一写多读用的顺序锁,写进程修改item时先变成奇数,改完再变成偶数,
+ *读进程拷贝前后seq一致且为偶数时拷贝的内容才完整(占用term_len后面的对齐空间,entry大小不变)
+ */
 #define HASH_MAP_CONF(entry_name,max_query_len,topk) \
 struct entry_name {                   \
-    struct HashValueItem item[topk];  \
+    uint64_t hash;                    \
     size_t next;                      \
+    uint32_t term_len;                \
+    uint32_t seq;                     \
+    size_t item_num;                  \
+    size_t term_off;                  \
     char term[max_query_len];         \
+    struct HashValueItem item[topk];  \
+    entry_name() {                    \
+        hash=0;                       \
+        next=SIZE_MAX;                \
+        term_len=0;                   \
+        seq=0;                        \
+        item_num=0;                   \
+        term_off=SIZE_MAX;            \
+    }                                 \
+}
+
+/*
+ *unbounded_postings用的entry,比HASH_MAP_CONF多overflow(第一个overflow块的下标)和overflow_num(overflow块中的item个数)
+ */
+#define HASH_MAP_CONF_UNBOUNDED(entry_name,max_query_len,topk) \
+struct entry_name {                   \
+    uint64_t hash;                    \
+    size_t next;                      \
+    uint32_t term_len;                \
+    uint32_t seq;                     \
     size_t item_num;                  \
+    size_t term_off;                  \
+    size_t overflow;                  \
+    size_t overflow_num;              \
+    char term[max_query_len];         \
+    struct HashValueItem item[topk];  \
     entry_name() {                    \
+        hash=0;                       \
         next=SIZE_MAX;                \
+        term_len=0;                   \
+        seq=0;                        \
         item_num=0;                   \
+        term_off=SIZE_MAX;            \
+        overflow=SIZE_MAX;            \
+        overflow_num=0;               \
     }                                 \
 }
 
+/*
+ *entry是否有overflow字段(HASH_MAP_CONF_UNBOUNDED生成); 没有时overflow链表总是空的,
+ *读写overflow都通过下面几个函数,HASH_MAP_CONF生成的entry也能编译
+ */
+template<typename ENTRY,typename=void>
+struct EntryHasOverflow {
+    static const bool value=false;
+};
+
+template<typename ENTRY>
+struct EntryHasOverflow<ENTRY,std::void_t<decltype(ENTRY::overflow),decltype(ENTRY::overflow_num)> > {
+    static const bool value=true;
+};
+
+template<typename ENTRY>
+inline size_t entryOverflow(const ENTRY &e) {
+    if constexpr(EntryHasOverflow<ENTRY>::value) {
+        return e.overflow;
+    }
+    return SIZE_MAX;
+}
+
+template<typename ENTRY>
+inline size_t entryOverflowNum(const ENTRY &e) {
+    if constexpr(EntryHasOverflow<ENTRY>::value) {
+        return e.overflow_num;
+    }
+    return 0;
+}
+
+template<typename ENTRY>
+inline void setEntryOverflow(ENTRY &e,size_t overflow,size_t overflow_num) {
+    if constexpr(EntryHasOverflow<ENTRY>::value) {
+        e.overflow=overflow;
+        e.overflow_num=overflow_num;
+    }
+}
+
+//读进程可能正在沿链表遍历,链表头用release写
+template<typename ENTRY>
+inline void publishEntryOverflow(ENTRY &e,size_t overflow) {
+    if constexpr(EntryHasOverflow<ENTRY>::value) {
+        __atomic_store_n(&e.overflow,overflow,__ATOMIC_RELEASE);
+    }
+}
+
 template<typename V>
 struct DocValue {
     const V* doc;
@@ -97,30 +259,302 @@ struct DocResult{
     std::vector<DocValue<V> > docs;
 };
 
-template<typename ENTRY,typename V>
+/*
+ *查询结果的视图,不拥有数据,直接指向mmap中entry的item数组和overflow块,
+ *迭代时才通过docData查doc,已经删除的doc会被跳过,整个过程不分配内存
+ *
+ *DocView<A> view=shm->getView("test");
+ *for(DocView<A>::iterator it=view.begin();it!=view.end();++it) {
+ *    const A* a=it->doc;
+ *}
+ */
+template<typename V>
+class DocView {
+public:
+    class iterator {
+    public:
+        iterator():docs_(NULL),postings_(NULL),items_(NULL),num_(0),idx_(0),next_(SIZE_MAX),left_(0) {
+        }
+        iterator(CDataStorage<V> *docs,CDataStorage<PostingBlock> *postings,
+                const HashValueItem *items,size_t num,size_t next,size_t topn)
+            :docs_(docs),postings_(postings),items_(items),num_(num),idx_(0),next_(next),left_(topn) {
+            advance();
+        }
+        inline const DocValue<V>& operator*() const {
+            return cur_;
+        }
+        inline const DocValue<V>* operator->() const {
+            return &cur_;
+        }
+        inline iterator& operator++() {
+            advance();
+            return *this;
+        }
+        inline bool operator==(const iterator &o) const {
+            return items_==o.items_ && idx_==o.idx_;
+        }
+        inline bool operator!=(const iterator &o) const {
+            return !(*this==o);
+        }
+    private:
+        //移动到下一个存在的doc,结束时items_为NULL
+        void advance() {
+            while(left_>0 && NULL!=items_) {
+                if(idx_<num_) {
+                    const HashValueItem &item=items_[idx_++];
+                    const V* v=docs_->FindDataPtr(item.offset);
+                    if(NULL!=v) {
+                        cur_.doc=v;
+                        cur_.score=item.score;
+                        left_--;
+                        return;
+                    }
+                    continue;
+                }
+                const PostingBlock* b=(SIZE_MAX==next_ || NULL==postings_)?NULL:postings_->FindDataPtr(next_);
+                if(NULL==b) {
+                    break;
+                }
+                items_=b->item;
+                num_=b->num;
+                idx_=0;
+                next_=b->next;
+            }
+            items_=NULL;
+            idx_=0;
+        }
+
+        CDataStorage<V> *docs_;
+        CDataStorage<PostingBlock> *postings_;
+        const HashValueItem *items_;
+        size_t num_;
+        size_t idx_;
+        size_t next_;
+        size_t left_;
+        DocValue<V> cur_;
+    };
+
+    DocView():docs_(NULL),postings_(NULL),items_(NULL),num_(0),overflow_(SIZE_MAX),topn_(0) {
+    }
+    DocView(CDataStorage<V> *docs,const HashValueItem *items,size_t num,
+            CDataStorage<PostingBlock> *postings,size_t overflow,size_t topn)
+        :docs_(docs),postings_(postings),items_(items),num_(num),overflow_(overflow),topn_(topn) {
+    }
+
+    inline iterator begin() const {
+        if(NULL==items_) {
+            return iterator();
+        }
+        return iterator(docs_,postings_,items_,num_,overflow_,topn_);
+    }
+    inline iterator end() const {
+        return iterator();
+    }
+    //key是否存在
+    inline bool found() const {
+        return NULL!=items_;
+    }
+    //遍历一遍计算结果个数
+    size_t count() const {
+        size_t n=0;
+        for(iterator it=begin();it!=end();++it) {
+            n++;
+        }
+        return n;
+    }
+
+private:
+    CDataStorage<V> *docs_;
+    CDataStorage<PostingBlock> *postings_;
+    const HashValueItem *items_;
+    size_t num_;
+    size_t overflow_;
+    size_t topn_;
+};
+
+template<typename ENTRY,typename V,typename HASH=WyHasher>
 class SharedHashMap {
 private:
     CDataStorage<V> *docData_;  //底层mmap原始数据(占用空间较小的大部分数据)
     CDataStorage<HashBucket> *hashBucket_; //hash数据入口
     CDataStorage<ENTRY> *hashValue_;  //hash数据
+    CDataStorage<PostingBlock> *postings_;  //overflow块,只有unbounded_postings时使用
+    SwissIndex *swiss_;  //开放寻址索引,只有IDX_SWISS时使用,此时hashBucket_为NULL
+    CKeyArena *keys_;  //超过term长度的key保存在这里
+    CBloomFilter *bloom_;  //bloom_fpr>0或者bloom.data已存在时使用
     ENTRY en;
-    size_t bucketSize_;
+    std::vector<size_t> splitChain_;
+    uint64_t seed_;
+    CModeType mode_;
+    SharedHashOptions opt_;
+    string bkdatafile_;
+    string swissfile_;
+    string bloomfile_;
+    mutable atomic<size_t> probes_;
+    mutable atomic<size_t> fpSkipped_;
+    mutable atomic<size_t> fullCompares_;
+    bool concurrent_;
+    mutable std::shared_mutex growLock_;  //并发写模式: 插入持有共享锁,扩容/拆分bucket持有独占锁
+    std::mutex keyLock_;
+    CWarmup *warmup_;
+    CJournal *journal_;  //opt_.journal且读写打开时使用
+    CFlusher *flusher_;  //opt_.flush_interval_ms或flush_bytes>0且读写打开时使用
+    CDataStorage<DocRef> *docRefs_;  //opt_.doc_refcount/doc_key_index或docref.data已存在,且读写打开时使用
+    CDataStorage<DocKeyBlock> *docKeys_;  //opt_.doc_key_index或dockey.data已存在时使用
+    string docreffile_;
+    string dockeyfile_;
 
 public:
     SharedHashMap(string &datapath,CModeType m=M_READWRITE,
-                      size_t bucket_num=10000000) {
+                      size_t bucket_num=10000000,uint64_t seed=DEFAULT_HASH_SEED,
+                      const SharedHashOptions &opt=SharedHashOptions())
+        :hashBucket_(NULL),postings_(NULL),swiss_(NULL),keys_(NULL),bloom_(NULL),seed_(seed),mode_(m),opt_(opt),
+        probes_(0),fpSkipped_(0),fullCompares_(0),concurrent_(false),warmup_(NULL),journal_(NULL),flusher_(NULL),
+        docRefs_(NULL),docKeys_(NULL) {
         string bkdatafile=datapath+"/bucket.data";
         string bkbitfile = datapath+"/bucket.bit";
         string hmdatafile=datapath+"/value.data";
         string hmbitfile=datapath+"/value.bit";
         string sdocfile=datapath+"/doc.data";
         string sbitfile=datapath+"/doc.bit";
+        bkdatafile_=bkdatafile;
+        swissfile_=datapath+"/index.swiss";
+        bloomfile_=datapath+"/bloom.data";
+        if(opt_.bloom_fpr>0 || IsExistFile(bloomfile_)) {
+            bloom_ = new CBloomFilter(bloomfile_,m);
+        }
+        keys_ = new CKeyArena(datapath+"/key.data",KEY_ARENA_INIT_SIZE,m);
         docData_ = new CDataStorage<V>(sdocfile,sbitfile,bucket_num,m);
-        hashBucket_ = new CDataStorage<HashBucket>(bkdatafile,bkbitfile,bucket_num,m,2);
+        if(IDX_SWISS==opt_.index_type) {
+            swiss_ = new SwissIndex(swissfile_,bucket_num,m);
+        }else {
+            hashBucket_ = new CDataStorage<HashBucket>(bkdatafile,bkbitfile,round_up_pow2(bucket_num),m,2);
+        }
         hashValue_ = new CDataStorage<ENTRY>(hmdatafile,hmbitfile,bucket_num*3,m);
+        string pldatafile=datapath+"/posting.data";
+        string plbitfile=datapath+"/posting.bit";
+        //以前用overflow模式写过的目录,读的时候也要能读到overflow块; entry没有overflow字段时用不到
+        if(EntryHasOverflow<ENTRY>::value && (opt_.unbounded_postings || IsExistFile(pldatafile))) {
+            postings_ = new CDataStorage<PostingBlock>(pldatafile,plbitfile,bucket_num/4+1,m);
+        }
+        //引用计数只有写进程使用
+        docreffile_=datapath+"/docref.data";
+        dockeyfile_=datapath+"/dockey.data";
+        if(M_READWRITE==mode_ && (opt_.doc_refcount || opt_.doc_key_index || IsExistFile(docreffile_))) {
+            string drbitfile=datapath+"/docref.bit";
+            docRefs_ = new CDataStorage<DocRef>(docreffile_,drbitfile,bucket_num,m);
+            if(opt_.doc_key_index || IsExistFile(dockeyfile_)) {
+                string dkbitfile=datapath+"/dockey.bit";
+                docKeys_ = new CDataStorage<DocKeyBlock>(dockeyfile_,dkbitfile,bucket_num,m);
+            }
+        }
+        if(opt_.inline_occupancy) {
+            hashValue_->SetInlineTag(true);
+            if(NULL!=hashBucket_) {
+                hashBucket_->SetInlineTag(true);
+            }
+            if(NULL!=postings_) {
+                postings_->SetInlineTag(true);
+            }
+        }
+        if(opt_.address_reserve>0) {
+            keys_->SetReserveSize(opt_.address_reserve);
+            docData_->SetReserveSize(opt_.address_reserve);
+            hashValue_->SetReserveSize(opt_.address_reserve);
+            if(NULL!=hashBucket_) {
+                hashBucket_->SetReserveSize(opt_.address_reserve);
+            }
+            if(NULL!=postings_) {
+                postings_->SetReserveSize(opt_.address_reserve);
+            }
+        }
+        CGrowthPolicy growth;
+        growth.m_factor=opt_.growth_factor;
+        growth.m_minstep=opt_.growth_min_step;
+        growth.m_maxstep=opt_.growth_max_step;
+        growth.m_fallocate=opt_.growth_fallocate;
+        keys_->SetGrowthPolicy(growth);
+        docData_->SetGrowthPolicy(growth);
+        hashValue_->SetGrowthPolicy(growth);
+        if(NULL!=hashBucket_) {
+            hashBucket_->SetGrowthPolicy(growth);
+        }
+        if(NULL!=postings_) {
+            postings_->SetGrowthPolicy(growth);
+        }
+        if(NULL!=docRefs_) {
+            docRefs_->SetGrowthPolicy(growth);
+        }
+        if(NULL!=docKeys_) {
+            docKeys_->SetGrowthPolicy(growth);
+        }
+        CMapPolicy indexMap=mapPolicy(opt_.index_map);
+        CMapPolicy docMap=mapPolicy(opt_.doc_map);
+        keys_->SetMapPolicy(indexMap);
+        hashValue_->SetMapPolicy(indexMap);
+        docData_->SetMapPolicy(docMap);
+        if(NULL!=hashBucket_) {
+            hashBucket_->SetMapPolicy(indexMap);
+        }
+        if(NULL!=swiss_) {
+            swiss_->setMapPolicy(indexMap);
+        }
+        if(NULL!=bloom_) {
+            bloom_->SetMapPolicy(indexMap);
+        }
+        if(NULL!=postings_) {
+            postings_->SetMapPolicy(docMap);
+        }
+        if(NULL!=docRefs_) {
+            docRefs_->SetMapPolicy(indexMap);
+        }
+        if(NULL!=docKeys_) {
+            docKeys_->SetMapPolicy(indexMap);
+        }
+        if(opt_.journal && M_READWRITE==mode_) {
+            journal_ = new CJournal(datapath+"/journal.data");
+            journal_->SetGroupCommit(opt_.journal_group_bytes,opt_.journal_group_ops);
+        }
+        if((opt_.flush_interval_ms>0 || opt_.flush_bytes>0) && M_READWRITE==mode_) {
+            flusher_ = new CFlusher();
+            keys_->SetFlusher(flusher_);
+            docData_->SetFlusher(flusher_);
+            hashValue_->SetFlusher(flusher_);
+            if(NULL!=hashBucket_) {
+                hashBucket_->SetFlusher(flusher_);
+            }
+            if(NULL!=swiss_) {
+                swiss_->setFlusher(flusher_);
+            }
+            if(NULL!=postings_) {
+                postings_->SetFlusher(flusher_);
+            }
+            if(NULL!=docRefs_) {
+                docRefs_->SetFlusher(flusher_);
+            }
+            if(NULL!=docKeys_) {
+                docKeys_->SetFlusher(flusher_);
+            }
+        }
     }
 
     ~SharedHashMap() {
+        if(NULL!=warmup_) {
+            delete warmup_;
+            warmup_=NULL;
+        }
+        if(NULL!=journal_) {
+            //正常关闭: checkpoint之后清掉dirty标记,下次打开不需要恢复
+            if(Checkpoint()) {
+                journal_->MarkClean();
+            }
+            delete journal_;
+            journal_=NULL;
+        }
+        //先停掉后台线程,各个文件关闭时把剩下的修改写回,最后才能释放flusher
+        if(NULL!=flusher_) {
+            flusher_->Stop();
+        }
         if(NULL!=docData_) {
             delete docData_;
             docData_ = NULL;
@@ -133,14 +567,55 @@ public:
             delete hashValue_;
             hashValue_=NULL;
         }
+        if(NULL!=swiss_) {
+            delete swiss_;
+            swiss_=NULL;
+        }
+        if(NULL!=keys_) {
+            delete keys_;
+            keys_=NULL;
+        }
+        if(NULL!=bloom_) {
+            delete bloom_;
+            bloom_=NULL;
+        }
+        if(NULL!=postings_) {
+            delete postings_;
+            postings_=NULL;
+        }
+        if(NULL!=docRefs_) {
+            delete docRefs_;
+            docRefs_=NULL;
+        }
+        if(NULL!=docKeys_) {
+            delete docKeys_;
+            docKeys_=NULL;
+        }
+        if(NULL!=flusher_) {
+            delete flusher_;
+            flusher_=NULL;
+        }
     }
 
     bool Init() {
+        //目录已经用另一种索引创建过时不能打开
+        if((NULL!=swiss_ && IsExistFile(bkdatafile_)) || (NULL==swiss_ && IsExistFile(swissfile_))) {
+            std::cout<<"index type mismatch!"<<std::endl;
+            return false;
+        }
         if(!docData_->Init()) {
             std::cout<<"init doc data failed!"<<std::endl;
             return false;
         }
-        if(!hashBucket_->Init()) {
+        if(!keys_->Init()) {
+            std::cout<<"init key arena failed!"<<std::endl;
+            return false;
+        }
+        if(NULL!=swiss_ && !swiss_->Init()) {
+            std::cout<<"init swiss index failed!"<<std::endl;
+            return false;
+        }
+        if(NULL!=hashBucket_ && !hashBucket_->Init()) {
             std::cout<<"init hash bucket failed!"<<std::endl;
             return false;
         }
@@ -148,12 +623,96 @@ public:
             std::cout<<"init hash value failed!"<<std::endl;
             return false;
         }
-        bucketSize_=hashBucket_->GetItemCapacity();
+        if(NULL!=postings_ && !postings_->Init()) {
+            std::cout<<"init posting data failed!"<<std::endl;
+            return false;
+        }
+        if(opt_.unbounded_postings && !EntryHasOverflow<ENTRY>::value) {
+            std::cout<<"unbounded_postings needs an entry defined by HASH_MAP_CONF_UNBOUNDED!"<<std::endl;
+            return false;
+        }
+        CMmapHeader* hd=NULL!=swiss_?swiss_->GetHeader():hashBucket_->GetDataHeader();
+        if(HASH_ID_NONE==hd->m_hashid) {
+            if(M_READ==mode_) {
+                std::cout<<"hash function not set in bucket header!"<<std::endl;
+                return false;
+            }
+            hd->m_hashid=HASH::ID;
+            hd->m_hashseed=seed_;
+        }else if(hd->m_hashid!=HASH::ID || hd->m_hashseed!=seed_) {
+            std::cout<<"hash function mismatch, file id="<<hd->m_hashid<<" seed="<<hd->m_hashseed
+                <<", expect id="<<HASH::ID<<" seed="<<seed_<<std::endl;
+            return false;
+        }
+        if(NULL!=hashBucket_ && 0==hd->m_bucketnum) {
+            if(M_READ==mode_) {
+                std::cout<<"bucket num not set in bucket header!"<<std::endl;
+                return false;
+            }
+            //文件中bucket的容量按页对齐过,取不超过容量的最大2的幂作为初始bucket个数
+            hd->m_bucketnum=round_down_pow2(hashBucket_->GetItemCapacity());
+        }
+        if(NULL!=bloom_ && !initBloom()) {
+            std::cout<<"init bloom filter failed!"<<std::endl;
+            return false;
+        }
+        if(NULL!=docRefs_ && !initDocRefs()) {
+            std::cout<<"init doc refs failed!"<<std::endl;
+            return false;
+        }
+        if(NULL!=journal_ && !openJournal()) {
+            std::cout<<"open journal failed!"<<std::endl;
+            return false;
+        }
+        if(NULL!=flusher_) {
+            flusher_->Start(opt_.flush_interval_ms,opt_.flush_bytes);
+        }
         return true;
     }
 
+    /*
+     *打开后并行预热映射的文件,见WarmupPolicy
+     *异步预热期间可以查询,只是还会缺页;没有预留地址空间时Refresh会等预热结束(重新映射会释放旧的映射)
+     */
+    bool Init(const WarmupPolicy &wp) {
+        if(!Init()) {
+            return false;
+        }
+        std::vector<CMapRegion> regions;
+        warmRegions(regions,wp.docs);
+        if(NULL==warmup_) {
+            warmup_=new CWarmup();
+        }
+        return warmup_->Start(regions,wp.threads,wp.chunk_size,wp.profile,wp.async && M_READ==mode_,wp.verbose);
+    }
+
+    //预热是否完成,没有预热时总是true
+    inline bool isReady() const {
+        return NULL==warmup_ || warmup_->IsReady();
+    }
+
+    //预热进度 0~1
+    double warmupProgress() const {
+        return NULL==warmup_?1.0:warmup_->GetProgress();
+    }
+
+    //从Init到预热完成的秒数
+    double warmupSeconds() const {
+        return NULL==warmup_?0:warmup_->GetReadySeconds();
+    }
+
+    /*
+     *记录当前在内存中的块,下次Init时WarmupPolicy.profile指向这个文件就只预热这些块;
+     *应当在运行了一段时间的读进程中调用
+     */
+    bool SaveWarmupProfile(const string &path) const {
+        std::vector<CMapRegion> regions;
+        warmRegions(regions,true);
+        return CWarmup::SaveProfile(path,regions);
+    }
+
     bool empty() const {
-        return 0==hashBucket_->GetStorageItemCount();
+        return 0==hashValue_->GetStorageItemCount();
     }
 
     inline size_t hashSize() const {
@@ -168,35 +727,127 @@ public:
         return docData_->GetItemCapacity();
     }
 
-    inline const ENTRY* getValue(const string &k,size_t &entry_offset) {
-        size_t offset = getBucket(k);
-        const HashBucket* b=hashBucket_->FindDataPtr(offset);
-        //std::cout<<"bucket "<<offset<<std::endl;
-        if(NULL==b) {
-            //std::cout<<"bucket "<<offset<<" is null"<<std::endl;
+    inline const ENTRY* getValue(std::string_view k,size_t &entry_offset) const {
+        return findEntry(k.data(),k.size(),hashKey(k.data(),k.size()),entry_offset);
+    }
+
+    /*
+     *先比较entry中保存的hash和key长度,都相等时才做一次完整的key比较
+     *长key先比较term中的前缀,前缀相同再去key.data中比较完整的key
+     */
+    inline bool keyEqual(const ENTRY *v,const char *k,size_t len,uint64_t h) const {
+        if(!opt_.lookup_stats) {
+            return v->hash==h && v->term_len==len && keyBytesEqual(v,k,len);
+        }
+        probes_.fetch_add(1,std::memory_order_relaxed);
+        if(v->hash!=h || v->term_len!=len) {
+            fpSkipped_.fetch_add(1,std::memory_order_relaxed);
+            return false;
+        }
+        fullCompares_.fetch_add(1,std::memory_order_relaxed);
+        return keyBytesEqual(v,k,len);
+    }
+
+    //hash和长度已经相等,比较key的内容
+    inline bool keyBytesEqual(const ENTRY *v,const char *k,size_t len) const {
+        if(len<=sizeof(v->term)) {
+            return 0==memcmp(v->term,k,len);
+        }
+        if(0!=memcmp(v->term,k,sizeof(v->term))) {
+            return false;
+        }
+        const char *full=keys_->Get(v->term_off);
+        return NULL!=full && 0==memcmp(full,k,len);
+    }
+
+    /*
+     *entry中key的完整内容,短key直接在term中,长key在key.data中
+     */
+    inline string entryKey(const ENTRY *v) const {
+        if(v->term_len<=sizeof(v->term)) {
+            return string(v->term,v->term_len);
+        }
+        const char *full=keys_->Get(v->term_off);
+        return NULL==full?string(v->term,sizeof(v->term)):string(full,v->term_len);
+    }
+
+    /*
+     *填充新entry的key,返回false表示长key写入key.data失败
+     */
+    inline bool setEntryKey(ENTRY &entry,const char *k,size_t len,uint64_t h) {
+        entry.hash=h;
+        entry.term_len=len;
+        if(len<=sizeof(entry.term)) {
+            memcpy(entry.term,k,len);
+            return true;
+        }
+        memcpy(entry.term,k,sizeof(entry.term));
+        entry.term_off=keys_->Append(k,len);
+        return SIZE_MAX!=entry.term_off;
+    }
+
+    inline const ENTRY* findEntry(const char *k,size_t len,uint64_t h,size_t &entry_offset) const {
+        //bloom filter判断不存在时不用再访问索引
+        if(NULL!=bloom_ && !bloom_->MayContain(h)) {
             return NULL;
         }
-        //std::cout<<"get value found bucket "<<offset<<"header="<<b->header<<std::endl;
-        const ENTRY* v=hashValue_->FindDataPtr(b->header);
-        entry_offset=b->header;
-        while(v!=NULL) {
-            if(v->term == k) {
-                //std::cout<<" get value found value offset "<<entry_offset<<std::endl;
-                break;
+        if(NULL!=swiss_) {
+            const ENTRY* v=NULL;
+            entry_offset=swiss_->find(h,[&](size_t pos) {
+                v=hashValue_->FindDataPtr(pos);
+                return NULL!=v && keyEqual(v,k,len,h);
+            });
+            return SIZE_MAX==entry_offset?NULL:v;
+        }
+        //写进程正在拆分bucket或者删除entry时,读进程可能走到别的链表上,从bucket头重新查
+        for(int retry=0;;retry++) {
+            size_t n=bucketNum();
+            size_t offset = bucketOf(h,n);
+            const HashBucket* b=hashBucket_->FindDataPtr(offset);
+            //std::cout<<"bucket "<<offset<<std::endl;
+            if(NULL==b) {
+                //std::cout<<"bucket "<<offset<<" is null"<<std::endl;
+                if(retry<SWMR_MAX_RETRY && n!=bucketNum()) {
+                    continue;
+                }
+                return NULL;
             }
-            if(v->next!=SIZE_MAX) {
-                entry_offset=v->next;
-                //std::cout<<"value offset "<<entry_offset<<std::endl;
-                v=hashValue_->FindDataPtr(v->next);
-            }else {
-                v=NULL;
+            //std::cout<<"get value found bucket "<<offset<<"header="<<b->header<<std::endl;
+            entry_offset=__atomic_load_n(&b->header,__ATOMIC_ACQUIRE);
+            const ENTRY* v=hashValue_->FindDataPtr(entry_offset);
+            bool restart=false;
+            while(v!=NULL) {
+                if(keyEqual(v,k,len,h)) {
+                    //std::cout<<" get value found value offset "<<entry_offset<<std::endl;
+                    return v;
+                }
+                size_t next=__atomic_load_n(&v->next,__ATOMIC_ACQUIRE);
+                if(retry<SWMR_MAX_RETRY && (bucketOf(v->hash,n)!=offset || n!=bucketNum())) {
+                    restart=true;
+                    break;
+                }
+                if(next!=SIZE_MAX) {
+                    entry_offset=next;
+                    //std::cout<<"value offset "<<entry_offset<<std::endl;
+                    v=hashValue_->FindDataPtr(next);
+                    //next指向的entry已经被删除
+                    restart=(NULL==v && retry<SWMR_MAX_RETRY);
+                }else {
+                    v=NULL;
+                }
+            }
+            //查找期间bucket被拆分过,按新的bucket个数再查一次
+            if(!restart && (retry>=SWMR_MAX_RETRY || n==bucketNum())) {
+                return NULL;
             }
         }
-        return v;
     }
 
-    inline const ENTRY* getValueEntry(const string &k,size_t &entry_offset) {
-      size_t offset = getBucket(k);
+    inline const ENTRY* getValueEntry(std::string_view k,size_t &entry_offset) const {
+        return getBucketEntry(getBucket(k),entry_offset);
+    }
+
+    inline const ENTRY* getBucketEntry(size_t offset,size_t &entry_offset) const {
         const HashBucket* b=hashBucket_->FindDataPtr(offset);
         if(NULL==b) {
             return NULL;
@@ -206,52 +857,255 @@ public:
         return v;
     }
 
-    inline size_t getBucket(const string &k) {
-        size_t hashCode = hash_code(k);
-        return hashCode % bucketSize_;
+    inline uint64_t hashKey(const char *k,size_t len) const {
+        return HASH::hash(k,len,seed_);
     }
 
-    inline size_t insertObj(V& v) const{
-        size_t pos;
+    /*
+     *当前使用的bucket个数,保存在bucket.data的文件头中,拆分bucket时加1
+     */
+    inline size_t bucketNum() const {
+        return NULL==hashBucket_?0:__atomic_load_n(&hashBucket_->GetDataHeader()->m_bucketnum,__ATOMIC_ACQUIRE);
+    }
+
+    /*
+     *线性hash定位bucket: n=base+split,低于split的bucket已经拆分过,需要多用一位hash
+     */
+    inline size_t bucketOf(uint64_t h) const {
+        return bucketOf(h,bucketNum());
+    }
+
+    static inline size_t bucketOf(uint64_t h,size_t n) {
+        size_t base=round_down_pow2(n);
+        size_t b=h & (base-1);
+        if(b < n-base) {
+            b=h & (2*base-1);
+        }
+        return b;
+    }
+
+    /*
+     *增量rehash,最多拆分steps个bucket,返回实际拆分的个数
+     *只对IDX_CHAIN有效,IDX_SWISS的索引自己会扩容
+     */
+    size_t rehashStep(size_t steps=1) {
+        size_t n=0;
+        if(NULL==hashBucket_ || M_READ==mode_ || concurrent_) {
+            return 0;
+        }
+        for(;n<steps;n++) {
+            if(!splitBucket()) {
+                break;
+            }
+        }
+        endWrite();
+        return n;
+    }
+
+    inline size_t getBucket(std::string_view k) const {
+        return bucketOf(hashKey(k.data(),k.size()));
+    }
+
+    inline size_t insertObj(V& v) {
+        size_t pos=SIZE_MAX;
+        if(concurrent_) {
+            concurrentRun([&]() {
+                STO_RESULT r=docData_->InsertData(v,pos);
+                return STO_OK==r?0:(STO_FULL==r?RETRY_EXTEND:-1);
+            },0);
+            return pos;
+        }
         if(STO_OK!=docData_->InsertData(v,pos)) {
             //std::cout<<"insert data failed!"<<std::endl;
             return SIZE_MAX;
         }
+        endWrite();
+        if(NULL!=journal_ && !logJournal(JOURNAL_DOC,&pos,sizeof(pos),&v,sizeof(V))) {
+            return SIZE_MAX;
+        }
         return pos;
     }
 
+    /*
+     *并发写模式: BeginConcurrentInsert之后多个线程可以同时调用insertObj/map,
+     *新key用CAS挂到bucket链表头,同一个key的item修改用entry的seq锁互斥,
+     *文件扩容和bucket拆分时加独占锁,其余时间线程之间只有原子操作.
+     *只支持IDX_CHAIN,打开了journal时不能使用; 期间不能调用del/rehashStep/RebuildBloom,
+     *本进程内的查询也要等EndConcurrentInsert之后(扩容会重新mmap),其他进程按一写多读的方式读.
+     *Begin/End本身不能和其他操作同时调用
+     */
+    bool BeginConcurrentInsert() {
+        if(M_READ==mode_ || NULL==hashBucket_ || concurrent_ || NULL!=journal_ || NULL!=docRefs_) {
+            return false;
+        }
+        //链表头要能CAS,先把所有bucket建好(空bucket的header为SIZE_MAX)
+        for(size_t i=0;i<bucketNum();i++) {
+            if(!hashBucket_->ChangeExist(i) && !publishHeader(i,SIZE_MAX)) {
+                return false;
+            }
+        }
+        docData_->BeginConcurrent();
+        hashValue_->BeginConcurrent();
+        if(NULL!=postings_) {
+            postings_->BeginConcurrent();
+        }
+        concurrent_=true;
+        return true;
+    }
+
+    void EndConcurrentInsert() {
+        if(!concurrent_) {
+            return;
+        }
+        concurrent_=false;
+        docData_->EndConcurrent();
+        hashValue_->EndConcurrent();
+        if(NULL!=postings_) {
+            postings_->EndConcurrent();
+        }
+        //并发期间的修改都用同一个序号,到这里才算完成
+        endWrite();
+        //并发期间bloom filter不重建,这里补上
+        if(NULL!=bloom_ && bloom_->GetKeyCount()>bloom_->GetCapacity()) {
+            RebuildBloom();
+        }
+    }
+
     /*
      *同一份数据insertObj后，可以多次调用insert,把可以和这份数据建立映射
+     *打开了journal时修改成功后追加一条记录,journal写失败时返回-1(修改已经生效,但不保证落盘)
       */
-    inline int map(const string &k,size_t& obj_offset,uint8_t score=0) {
-        if(k.size() > sizeof(en.term)) {
+    inline int map(std::string_view k,size_t obj_offset,uint8_t score=0) {
+        int r=applyMap(k,obj_offset,score);
+        endWrite();
+        if(0==r && NULL!=journal_) {
+            char head[sizeof(size_t)+1];
+            memcpy(head,&obj_offset,sizeof(size_t));
+            head[sizeof(size_t)]=score;
+            if(!logJournal(JOURNAL_MAP,head,sizeof(head),k.data(),k.size())) {
+                return -1;
+            }
+        }
+        return r;
+    }
+
+    inline int del(std::string_view key) {
+        int r=applyDel(key);
+        endWrite();
+        if(0==r && NULL!=journal_ && !logJournal(JOURNAL_DEL,key.data(),key.size())) {
             return -1;
         }
-        size_t offset = getBucket(k);
-        size_t entry_offset;
-        const ENTRY* obj=getValue(k,entry_offset);
-        size_t tmp;
-        if(NULL==obj) {
-            ENTRY entry;
-            strcpy(entry.term,k.c_str());
-            entry.item[0].offset = obj_offset;
-            entry.item[0].score=score;
-            entry.item_num=1;
-            if(STO_OK!=hashValue_->InsertData(entry,tmp)) {
-                //std::cout<<"insert  entry failed!"<<std::endl;
-                return -1;
-            }else {
-                size_t tmp_entry;
-                obj=getValueEntry(k,tmp_entry);
-                //std::cout<<"insert entry data offset "<<tmp<<std::endl;
+        return r;
+    }
+
+    /*
+     *把doc从所有引用它的key的item列表中去掉,再删除doc; item全部去掉的key整个删除.
+     *有doc_key_index时只访问引用它的entry,否则扫描全部entry.返回去掉了这个doc的key个数,失败返回-1
+     */
+    int unmapDoc(size_t obj_offset) {
+        int r=applyUnmapDoc(obj_offset);
+        endWrite();
+        if(r>=0 && NULL!=journal_ && !logJournal(JOURNAL_UNMAP,&obj_offset,sizeof(obj_offset))) {
+            return -1;
+        }
+        return r;
+    }
+
+    /*
+     *doc当前被多少个key引用,没有使用doc_refcount(或者只读打开)时返回SIZE_MAX
+     */
+    size_t docRefCount(size_t obj_offset) const {
+        if(NULL==docRefs_) {
+            return SIZE_MAX;
+        }
+        const DocRef* r=docRefs_->FindDataPtr(obj_offset);
+        return NULL==r?0:r->refs;
+    }
+
+    /*
+     *journal: 把缓冲中的记录写入journal.data并fdatasync,返回后之前的insertObj/map/del掉电也不会丢失;
+     *没有打开journal时返回false
+     */
+    bool Commit() {
+        return NULL!=journal_ && journal_->Commit();
+    }
+
+    /*
+     *journal: 数据文件全部同步到磁盘(MS_SYNC)后清空journal,journal超过journal_checkpoint_size时自动调用
+     */
+    bool Checkpoint() {
+        if(NULL==journal_ || !journal_->IsOpen()) {
+            return false;
+        }
+        return syncData() && journal_->Reset();
+    }
+
+    /*
+     *flusher: 最后一次完成的修改(insertObj/map/del/rehashStep)的序号,没有使用flusher时返回0
+     */
+    inline uint64_t writeSeq() const {
+        return NULL==flusher_?0:flusher_->GetWriteSeq();
+    }
+
+    /*
+     *flusher: 等待序号不超过seq的修改写回磁盘,如 map(k,pos); FlushUntil(writeSeq());
+     *返回后这次map掉电也不会丢失(bloom.data除外). 刷盘失败或者没有使用flusher时返回false
+     */
+    bool FlushUntil(uint64_t seq) {
+        return NULL!=flusher_ && flusher_->FlushUntil(seq);
+    }
+
+    CFlushStats getFlushStats() const {
+        return NULL==flusher_?CFlushStats():flusher_->GetStats();
+    }
+
+    /*
+     *map/del的实际修改,不写journal,重放journal时直接调用
+     */
+    inline int applyMap(std::string_view k,size_t obj_offset,uint8_t score) {
+        if(k.size() > UINT32_MAX) {
+            return -1;
+        }
+        if(concurrent_) {
+            return mapConcurrent(k,obj_offset,score);
+        }
+        uint64_t h=hashKey(k.data(),k.size());
+        size_t offset = bucketOf(h);
+        size_t entry_offset;
+        const ENTRY* obj=findEntry(k.data(),k.size(),h,entry_offset);
+        size_t tmp;
+        if(NULL==obj) {
+            ENTRY entry;
+            if(!setEntryKey(entry,k.data(),k.size(),h)) {
+                return -1;
+            }
+            entry.item[0].offset = obj_offset;
+            entry.item[0].score=score;
+            entry.item_num=1;
+            if(STO_OK!=hashValue_->InsertData(entry,tmp)) {
+                //std::cout<<"insert  entry failed!"<<std::endl;
+                return -1;
+            }else if(NULL!=swiss_) {
+                if(!swiss_->insert(h,tmp)) {
+                    hashValue_->DeleteData(tmp);
+                    return -1;
+                }
+                addDocRef(obj_offset,tmp);
+                addBloom(h);
+                return 0;
+            }else {
+                size_t tmp_entry;
+                obj=getBucketEntry(offset,tmp_entry);
+                //std::cout<<"insert entry data offset "<<tmp<<std::endl;
                 if(NULL==obj) {
-                    HashBucket bucket;
-                    bucket.header=tmp;
-                    if(STO_OK!=hashBucket_->InsertAndUpdateData(bucket,offset)) {
+                    if(!publishHeader(offset,tmp)) {
                         //std::cout<<"insert and update bucket failed!"<<std::endl;
                         return -1;
                     }
                     //std::cout<<"upinsert bucket offset "<<offset<<" header "<<tmp<<std::endl;
+                    addDocRef(obj_offset,tmp);
+                    growBuckets();
+                    addBloom(h);
                     return 0;
                 }
 
@@ -267,63 +1121,39 @@ public:
                     }
                 }
                 if(NULL!=pre) {
-                    ENTRY hve;
-                    hve=*pre;
-                    hve.next = tmp;
-                    hashValue_->UpdateData(hve,tmp_pos);
+                    publishNext(tmp_pos,tmp);
                     //std::cout<<"link "<<tmp_pos<<" -> "<<tmp<<std::endl;
                 }
+                addDocRef(obj_offset,tmp);
+                growBuckets();
+                addBloom(h);
             }
         } else {
-            bool repeat=false;
-            for(size_t i=0;i<obj->item_num && i<sizeof(obj->item)/sizeof(obj->item[0]);i++) {
-                if(obj->item[i].offset==obj_offset) {
-                    repeat=true;
-                    continue;
-                }
-            }
-            if(repeat) {
-                //std::cout<<"repeat key="<<k<<" offset="<<obj_offset<<std::endl;
-                return 1;
-            }
-            size_t len=sizeof(obj->item)/sizeof(obj->item[0]);
-            ENTRY hve=*obj;
-            bool change=false;
-            for(int i=obj->item_num-1;i>=0;i--) {
-                if(hve.item[i].score<score || (0==score && hve.item[i].score==score)) {
-                    change=true;
-                    if(i<len-1) {
-                        hve.item[i+1]=hve.item[i];
-                    }
-                    if(i==0) {
-                        hve.item[0].offset=obj_offset;
-                        hve.item[0].score = score;
-                        break;
-                    }
-                }else{
-                    if(i!=len-1){
-                        hve.item[i+1].offset=obj_offset;
-                        hve.item[i+1].score = score;
-                        if(i==obj->item_num-1) {
-                            change=true;
-                        }
-                    }
-
-                    break;
-                }
-            }
-            if(change) {
-                if(hve.item_num < len) {
-                    hve.item_num++;
-                }
-                hashValue_->UpdateData(hve,entry_offset);
-            }
+            return updateEntry(entry_offset,obj_offset,score);
         }
         return 0;
     }
 
-    inline int del(const string &key) {
-        size_t offset = getBucket(key);
+    inline int applyDel(std::string_view key) {
+        if(concurrent_) {
+            return -1;
+        }
+        uint64_t h=hashKey(key.data(),key.size());
+        if(NULL!=swiss_) {
+            size_t entry_offset;
+            const ENTRY* v=findEntry(key.data(),key.size(),h,entry_offset);
+            if(NULL==v) {
+                return 1;
+            }
+            size_t overflow=entryOverflow(*v);
+            dropEntryRefs(entry_offset);
+            swiss_->erase(h,entry_offset);
+            hashValue_->DeleteData(entry_offset);
+            freeOverflow(overflow);
+            delBloom();
+            return 0;
+        }
+        size_t offset = bucketOf(h);
         const HashBucket* b=hashBucket_->FindDataPtr(offset);
         if(NULL==b) {
             return -1;
@@ -335,7 +1165,9 @@ public:
         size_t pre_offset=SIZE_MAX;
         size_t after_offset=SIZE_MAX;
         while(cur_pos!=SIZE_MAX && v!=NULL) {
-            if(v->term == key) {
+            if(keyEqual(v,key.data(),key.size(),h)) {
+                size_t overflow=entryOverflow(*v);
+                dropEntryRefs(cur_pos);
                 //找到after元素
                 if(v->next==SIZE_MAX) {
                     after=NULL;
@@ -350,17 +1182,16 @@ public:
                     hashBucket_->DeleteData(offset);
                 }
                 else if(pre==NULL && after!=NULL) {
-                    //有hash冲突，删除的是第一个元素时,更新bucket header指向,删除当前元素
+                    //有hash冲突，删除的是第一个元素时,先更新bucket header指向,再删除当前元素
+                    publishHeader(offset,after_offset);
                     hashValue_->DeleteData(cur_pos);
-                    HashBucket hb;
-                    hb.header=after_offset;
-                    hashBucket_->UpdateData(hb,offset);
                 }else if(pre!=NULL) {
-                    //有hash冲突，并且删除的不是第一个元素时,更新pre->next到after
-                    ENTRY entry=*pre;
-                    entry.next=after_offset;
-                    hashValue_->UpdateData(entry,pre_offset);
+                    //有hash冲突，并且删除的不是第一个元素时,更新pre->next到after,再删除当前元素
+                    publishNext(pre_offset,after_offset);
+                    hashValue_->DeleteData(cur_pos);
                 }
+                freeOverflow(overflow);
+                delBloom();
                 return 0;
             }
             pre=v;
@@ -371,18 +1202,120 @@ public:
         return 1;
     }
 
+    int applyUnmapDoc(size_t obj_offset) {
+        if(M_READ==mode_ || concurrent_) {
+            return -1;
+        }
+        std::vector<size_t> entries;
+        const DocRef* r=NULL==docKeys_?NULL:docRefs_->FindDataPtr(obj_offset);
+        if(NULL!=docKeys_) {
+            for(size_t cur=NULL==r?SIZE_MAX:r->keys;cur!=SIZE_MAX;) {
+                const DocKeyBlock* b=docKeys_->FindDataPtr(cur);
+                if(NULL==b) {
+                    break;
+                }
+                entries.insert(entries.end(),b->entry,b->entry+std::min(b->num,DOC_KEY_BLOCK_ITEMS));
+                cur=b->next;
+            }
+        }else {
+            for(size_t pos=hashValue_->NextUsedPos(0);pos!=SIZE_MAX;pos=hashValue_->NextUsedPos(pos+1)) {
+                bool hit=false;
+                forEachItem(hashValue_->FindDataPtr(pos),[&](size_t doc) {
+                    hit=hit || doc==obj_offset;
+                });
+                if(hit) {
+                    entries.push_back(pos);
+                }
+            }
+        }
+        int n=0;
+        for(size_t i=0;i<entries.size();i++) {
+            if(removeItem(entries[i],obj_offset)) {
+                n++;
+            }
+        }
+        //没有引用计数,或者计数和索引不一致时,最后一个引用去掉后doc还在
+        freeDocRef(obj_offset);
+        docData_->DeleteData(obj_offset);
+        return n;
+    }
+
     float getLoadFactor() const {
-        size_t bucket_len=bucketSize_;
+        size_t bucket_len=NULL!=swiss_?swiss_->slotCapacity():bucketNum();
         size_t hash_size=hashSize();
         return float(hash_size)/float(bucket_len);
     }
 
+    /*
+     *查找统计: probes--比较过的entry数, fp_skipped--hash或长度不一致而跳过key比较的次数,
+     *full_compares--做了完整key比较的次数; 只在打开SharedHashOptions::lookup_stats时计数
+     */
+    HashLookupStats getLookupStats() const {
+        HashLookupStats st;
+        st.probes=probes_.load(std::memory_order_relaxed);
+        st.fp_skipped=fpSkipped_.load(std::memory_order_relaxed);
+        st.full_compares=fullCompares_.load(std::memory_order_relaxed);
+        return st;
+    }
+
+    void resetLookupStats() {
+        probes_.store(0);
+        fpSkipped_.store(0);
+        fullCompares_.store(0);
+    }
+
     void printStatus() const{
-        size_t bucket_len=bucketSize_;
+        size_t bucket_len=bucketNum();
         size_t hash_size=hashSize();
+        HashLookupStats st=getLookupStats();
         std::cout<<"######################shared hash map status#########################"<<std::endl;
         std::cout<<"Load factor="<<float(hash_size)/float(bucket_len)<<std::endl;
-        for(size_t i=0;i<bucket_len;i++) {
+        std::cout<<"probes="<<st.probes<<" fp_skipped="<<st.fp_skipped
+            <<" full_compares="<<st.full_compares<<std::endl;
+        printExtendStats("doc.data",docData_->GetExtendStats());
+        printExtendStats("value.data",hashValue_->GetExtendStats());
+        if(NULL!=hashBucket_) {
+            printExtendStats("bucket.data",hashBucket_->GetExtendStats());
+        }
+        if(NULL!=postings_) {
+            printExtendStats("posting.data",postings_->GetExtendStats());
+        }
+        printExtendStats("key.data",keys_->GetExtendStats());
+        FragmentInfo fv,fd,fp;
+        getFragmentation(fv,fd,fp);
+        printFragment("value.data",fv);
+        printFragment("doc.data",fd);
+        if(NULL!=postings_) {
+            printFragment("posting.data",fp);
+        }
+        if(NULL!=docRefs_) {
+            printExtendStats("docref.data",docRefs_->GetExtendStats());
+        }
+        if(NULL!=docKeys_) {
+            printExtendStats("dockey.data",docKeys_->GetExtendStats());
+        }
+        if(NULL!=journal_) {
+            std::cout<<"journal size="<<journal_->GetFileSize()<<" pending="<<journal_->GetPendingBytes()
+                <<" seq="<<journal_->GetSeq()<<" synced="<<journal_->GetSyncedSeq()
+                <<" commits="<<journal_->GetCommitCount()<<" checkpoints="<<journal_->GetCheckpointCount()<<std::endl;
+        }
+        if(NULL!=flusher_) {
+            CFlushStats fs=flusher_->GetStats();
+            std::cout<<"flush rounds="<<fs.m_rounds<<" bytes="<<fs.m_bytes<<" seconds="<<fs.m_seconds
+                <<" failures="<<fs.m_failures<<" write_seq="<<flusher_->GetWriteSeq()
+                <<" flushed_seq="<<flusher_->GetFlushedSeq()<<std::endl;
+        }
+        if(NULL!=bloom_) {
+            std::cout<<"bloom keys="<<bloom_->GetKeyCount()<<" deleted="<<bloom_->GetDeletedCount()
+                <<" capacity="<<bloom_->GetCapacity()<<" fpr="<<bloom_->GetFpr()<<std::endl;
+        }
+        if(NULL!=swiss_) {
+            std::cout<<"swiss index size="<<swiss_->size()<<" slots="<<swiss_->slotCapacity()
+                <<" tombstones="<<swiss_->tombstones()<<std::endl;
+            std::cout<<"####################################################################"<<std::endl;
+            return;
+        }
+        for(size_t i=hashBucket_->NextUsedPos(0);i<bucket_len;i=hashBucket_->NextUsedPos(i+1)) {
             const HashBucket* b=hashBucket_->FindDataPtr(i);
             if(NULL==b) {
                 continue;
@@ -392,7 +1325,7 @@ public:
             const ENTRY* v=hashValue_->FindDataPtr(b->header);
             std::set<size_t> offsets;
             while(v!=NULL) {
-                std::cout<<"->"<<cur_pos<<","<<v->term<<","<<v->next;
+                std::cout<<"->"<<cur_pos<<","<<entryKey(v)<<","<<v->next;
                 cur_pos=v->next;
                 if(offsets.find(cur_pos)!=offsets.end()) {
                     std::cout<<" error found circle link ,continue";
@@ -413,25 +1346,1737 @@ public:
         std::cout<<"####################################################################"<<std::endl;
     }
 
-    inline DocResult<V> get(const string key) const {
-        size_t offset;
+    /*
+     *按分数从高到低返回最多topn个结果,entry中的item取完后再顺着overflow块往后取
+     *结果会拷贝到DocResult中,热点路径上可以用getView避免分配内存
+     *entry和overflow块都按seq顺序锁拷贝,其他进程同时写入时读到的也是完整的一份
+     */
+    inline DocResult<V> get(std::string_view key,size_t topn=SIZE_MAX) const {
         DocResult<V> dr;
+        ENTRY v;
+        if(!snapshotEntry(key,v)) {
+            return dr;
+        }
+        size_t num=std::min(v.item_num,sizeof(v.item)/sizeof(v.item[0]));
+        appendDocs(dr,v.item,num,topn);
+        size_t next=NULL==postings_?SIZE_MAX:entryOverflow(v);
+        while(dr.docs.size()<topn && SIZE_MAX!=next) {
+            PostingBlock b;
+            if(!snapshotBlock(next,b)) {
+                break;
+            }
+            appendDocs(dr,b.item,std::min((size_t)b.num,POSTING_BLOCK_ITEMS),topn);
+            next=b.next;
+        }
+        return dr;
+    }
+
+    /*
+     *不分配内存的查询,返回的DocView直接指向mmap中的entry,遍历时才去查doc
+     *在下一次写操作之前有效(写操作可能扩容重新mmap); address_reserve>0时扩容不重新映射,一直有效
+     *不加顺序锁,其他进程同时写入同一个key时可能看到修改了一半的item,需要一致性时用get
+     */
+    inline DocView<V> getView(std::string_view key,size_t topn=SIZE_MAX) const {
+        size_t offset;
         const ENTRY *value= getValue(key,offset);
         if(NULL==value) {
-             //std::cout<<"value is null"<<std::endl;;
-            return dr;
+            return DocView<V>();
+        }
+        return DocView<V>(docData_,value->item,value->item_num,postings_,
+                NULL==postings_?SIZE_MAX:entryOverflow(*value),topn);
+    }
+
+    inline bool has(std::string_view key) const {
+        size_t offset;
+        return NULL!=getValue(key,offset);
+    }
+
+    /*
+     *按顺序锁拷贝key对应的entry,拷贝期间slot被删除复用时重新查找
+     */
+    bool snapshotEntry(std::string_view key,ENTRY &out) const {
+        uint64_t h=hashKey(key.data(),key.size());
+        for(int retry=0;retry<SWMR_MAX_RETRY;retry++) {
+            size_t offset;
+            const ENTRY* v=findEntry(key.data(),key.size(),h,offset);
+            if(NULL==v) {
+                return false;
+            }
+            if(!seqSnapshot(v,out)) {
+                memcpy((void*)&out,(const void*)v,sizeof(ENTRY));
+            }
+            if(keyEqual(&out,key.data(),key.size(),h)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+     *分步查询(手写的协程):lookup算hash并预取bucket,之后每次step访问上一步预取的数据,
+     *发出下一步的prefetch后就返回.调用方同时推进多个查询,或者在两次step之间做别的事情,
+     *内存访问的延迟就能互相重叠
+     *
+     *HashLookup<E> l[8];
+     *for(i...) l[i]=shm->lookup(keys[i]);
+     *while(还有没结束的) { for(i...) shm->step(l[i]); ...其他工作... }
+     *
+     *key只保存string_view,查询结束前调用方要保证key的内存有效
+     */
+    inline HashLookup<ENTRY> lookup(std::string_view key) const {
+        HashLookup<ENTRY> l;
+        l.key=key;
+        l.hash=hashKey(key.data(),key.size());
+        l.stage=LOOKUP_BUCKET;
+        if(NULL!=bloom_ && !bloom_->MayContain(l.hash)) {
+            l.stage=LOOKUP_DONE;
+            return l;
+        }
+        if(NULL!=swiss_) {
+            swiss_->prefetch(l.hash);
+        }else {
+            l.pos=bucketOf(l.hash);
+            hashBucket_->Prefetch(l.pos);
+        }
+        return l;
+    }
+
+    /*
+     *推进一步,返回查询是否已经结束
+     */
+    inline bool step(HashLookup<ENTRY> &l) const {
+        //写进程正在修改冲突链时退回到findEntry,由它负责重试
+        if(LOOKUP_BUCKET==l.stage) {
+            if(NULL!=swiss_) {
+                //先按完整hash找候选entry,key的比较放到下一步
+                l.pos=swiss_->find(l.hash,[](size_t) {
+                    return true;
+                });
+            }else {
+                const HashBucket* b=hashBucket_->FindDataPtr(l.pos);
+                l.pos=NULL==b?SIZE_MAX:b->header;
+            }
+            if(SIZE_MAX==l.pos) {
+                l.stage=LOOKUP_DONE;
+                return true;
+            }
+            hashValue_->Prefetch(l.pos);
+            l.stage=LOOKUP_ENTRY;
+            return false;
+        }
+        if(LOOKUP_ENTRY==l.stage) {
+            const ENTRY* v=hashValue_->FindDataPtr(l.pos);
+            if(NULL!=swiss_) {
+                //64位hash相同但key不同的情况很少,退回到普通查找
+                if(NULL!=v && !keyEqual(v,l.key.data(),l.key.size(),l.hash)) {
+                    v=findEntry(l.key.data(),l.key.size(),l.hash,l.pos);
+                }
+            }else if(NULL==v || bucketOf(v->hash)!=bucketOf(l.hash)) {
+                v=findEntry(l.key.data(),l.key.size(),l.hash,l.pos);
+            }else if(!keyEqual(v,l.key.data(),l.key.size(),l.hash)) {
+                //链表的下一个entry,预取后停在这一步
+                l.pos=__atomic_load_n(&v->next,__ATOMIC_ACQUIRE);
+                if(SIZE_MAX!=l.pos) {
+                    hashValue_->Prefetch(l.pos);
+                    return false;
+                }
+                v=NULL;
+            }
+            l.entry=v;
+            l.stage=LOOKUP_DONE;
+            //预取前几个doc,DocView遍历时就不用再等
+            for(size_t i=0;NULL!=v && i<v->item_num && i<4;i++) {
+                docData_->Prefetch(v->item[i].offset);
+            }
+            return true;
+        }
+        return true;
+    }
+
+    /*
+     *按索引遍历所有key,f(const string &key,DocView<V> docs)
+     *用于导出,遍历期间不能有写操作
+     */
+    template<typename F>
+    void forEach(F f) const {
+        if(NULL!=swiss_) {
+            swiss_->forEach([&](uint64_t,size_t pos) {
+                const ENTRY* v=hashValue_->FindDataPtr(pos);
+                if(NULL!=v) {
+                    f(entryKey(v),DocView<V>(docData_,v->item,v->item_num,postings_,NULL==postings_?SIZE_MAX:entryOverflow(*v),SIZE_MAX));
+                }
+            });
+            return;
+        }
+        size_t bucket_len=bucketNum();
+        for(size_t i=0;i<bucket_len;i++) {
+            size_t tmp;
+            const ENTRY* v=getBucketEntry(i,tmp);
+            while(NULL!=v) {
+                f(entryKey(v),DocView<V>(docData_,v->item,v->item_num,postings_,NULL==postings_?SIZE_MAX:entryOverflow(*v),SIZE_MAX));
+                v=SIZE_MAX==v->next?NULL:hashValue_->FindDataPtr(v->next);
+            }
+        }
+    }
+
+    /*
+     *按索引中的key重建bloom filter,容量取当前key个数的2倍; fpr<=0表示沿用原来的误判率
+     *bloom.data不存在时会新建,可以用来给已有目录加上bloom filter
+     */
+    bool RebuildBloom(double fpr=0) {
+        if(M_READ==mode_ || concurrent_) {
+            return false;
+        }
+        if(NULL==bloom_) {
+            bloom_=new CBloomFilter(bloomfile_,mode_);
+            bloom_->SetMapPolicy(mapPolicy(opt_.index_map));
+            if(!bloom_->Init(hashSize()*2,fpr)) {
+                delete bloom_;
+                bloom_=NULL;
+                return false;
+            }
         }
-        for(size_t i=0;i<value->item_num;i++) {
-            //std::cout<<"doc offset="<<value->item[i].offset<<std::endl;
-            const V* v=docData_->FindDataPtr(value->item[i].offset);
+        if(!bloom_->Reset(hashSize()*2,fpr)) {
+            return false;
+        }
+        if(NULL!=swiss_) {
+            swiss_->forEach([&](uint64_t h,size_t) {
+                bloom_->Add(h);
+            });
+            return bloom_->Publish();
+        }
+        size_t bucket_len=bucketNum();
+        for(size_t i=0;i<bucket_len;i++) {
+            size_t tmp;
+            const ENTRY* v=getBucketEntry(i,tmp);
+            while(NULL!=v) {
+                bloom_->Add(v->hash);
+                v=SIZE_MAX==v->next?NULL:hashValue_->FindDataPtr(v->next);
+            }
+        }
+        return bloom_->Publish();
+    }
+
+    /*
+     *value.data/doc.data/posting.data当前的碎片情况,没有posting.data时全为0
+     */
+    void getFragmentation(FragmentInfo &value,FragmentInfo &doc,FragmentInfo &posting) const {
+        value=fragmentOf(hashValue_);
+        doc=fragmentOf(docData_);
+        posting=NULL==postings_?FragmentInfo():fragmentOf(postings_);
+    }
+
+    /*
+     *在线整理: 把value.data/posting.data/doc.data后部的数据搬到前面删除留下的空位,
+     *改好bucket的header,entry的next/overflow/item[].offset,块的next/item[].offset之后再删除旧的位置;
+     *链表上走不到的entry和块(如之前del漏掉没有删除的entry)直接回收.
+     *新的位置先完整写入再原子地(或在seq顺序锁内)改指向,读进程可以同时查询,
+     *正在读旧位置的查询和遇到del时一样重试或读到已删除.
+     *max_moves -- 这一次最多搬动的个数,可以分多次调用做增量整理,返回的done为true时整理完成
+     *sweep_docs -- 同时回收没有被任何key引用的doc(insertObj之后还没有map的doc也会被回收)
+     *只能在写进程非并发写模式下调用;使用journal时前后各做一次checkpoint,journal中不会有指向旧位置的记录.
+     *整理完成后文件末尾的空位用shrink截掉
+     */
+    CompactStats compact(size_t max_moves=SIZE_MAX,bool sweep_docs=false) {
+        CompactStats st;
+        getFragmentation(st.before_value,st.before_doc,st.before_posting);
+        if(M_READ==mode_ || concurrent_ || (NULL!=journal_ && !Checkpoint())) {
+            st.after_value=st.before_value;
+            st.after_doc=st.before_doc;
+            st.after_posting=st.before_posting;
+            return st;
+        }
+        size_t budget=max_moves;
+        st.done=compactEntries(st,budget) && compactBlocks(st,budget) && compactDocs(st,budget,sweep_docs);
+        endWrite();
+        if(NULL!=journal_ && !Checkpoint()) {
+            std::cout<<"journal checkpoint failed!"<<std::endl;
+        }
+        getFragmentation(st.after_value,st.after_doc,st.after_posting);
+        return st;
+    }
+
+    /*
+     *compact完成后把value.data/doc.data/posting.data截短到最后一个有数据的位置(见CDataStorage::Shrink).
+     *读进程访问被截掉的部分会收到SIGBUS,所以和compact分开:
+     *读进程在compact之前开始的查询(以及取得的DocView/DocResult/entry指针)都用完之后再调用,读进程之后调用Refresh
+     */
+    bool shrink() {
+        if(M_READ==mode_ || concurrent_) {
+            return false;
+        }
+        bool ok=hashValue_->Shrink() && docData_->Shrink();
+        if(NULL!=postings_) {
+            ok=postings_->Shrink() && ok;
+        }
+        if(NULL!=docRefs_) {
+            ok=docRefs_->Shrink() && ok;
+        }
+        if(NULL!=docKeys_) {
+            ok=docKeys_->Shrink() && ok;
+        }
+        endWrite();
+        return ok;
+    }
+
+    /*
+     *按索引重新统计每个doc的引用数,有dockey.data时同时重建反向索引;
+     *新建docref.data(给已有的目录加上引用计数)和journal恢复时调用.引用的doc已经不存在的item不计
+     */
+    bool RebuildDocRefs() {
+        if(M_READ==mode_ || concurrent_ || NULL==docRefs_) {
+            return false;
+        }
+        docRefs_->RecountItems();
+        for(size_t pos=docRefs_->NextUsedPos(0);pos!=SIZE_MAX;pos=docRefs_->NextUsedPos(pos+1)) {
+            docRefs_->DeleteData(pos);
+        }
+        if(NULL!=docKeys_) {
+            docKeys_->RecountItems();
+            for(size_t pos=docKeys_->NextUsedPos(0);pos!=SIZE_MAX;pos=docKeys_->NextUsedPos(pos+1)) {
+                docKeys_->DeleteData(pos);
+            }
+        }
+        visitEntries([&](size_t pos) {
+            const ENTRY* v=hashValue_->FindDataPtr(pos);
             if(NULL!=v) {
-                DocValue<V> dv;
-                dv.doc = v;
-                dv.score = value->item[i].score;
-                dr.docs.push_back(dv);
+                forEachItem(v,[&](size_t doc) {
+                    if(docData_->ChangeExist(doc)) {
+                        addDocRef(doc,pos);
+                    }
+                });
+            }
+        });
+        endWrite();
+        return true;
+    }
+
+    inline uint64_t hashSeed() const {
+        return seed_;
+    }
+
+    /*
+     *一写多读: 一个进程以M_READWRITE写入,其他进程以M_READ查询.
+     *写进程扩容文件或者重建swiss索引/bloom filter之后,读进程需要调用Refresh重新映射,
+     *在此之前新写入的超出本地映射范围的数据查询不到(不会访问越界).读进程应当定期调用
+     */
+    bool Refresh() {
+        if(NULL!=warmup_ && 0==opt_.address_reserve) {
+            warmup_->Wait();
+        }
+        bool ok=docData_->Refresh() && hashValue_->Refresh();
+        if(NULL!=hashBucket_) {
+            ok=hashBucket_->Refresh() && ok;
+        }
+        if(NULL!=postings_) {
+            ok=postings_->Refresh() && ok;
+        }
+        if(NULL!=keys_) {
+            ok=keys_->Refresh() && ok;
+        }
+        if(NULL!=swiss_) {
+            ok=swiss_->Refresh() && ok;
+        }
+        if(NULL!=bloom_) {
+            ok=bloom_->Refresh() && ok;
+        }
+        return ok;
+    }
+
+    /*
+     *分步查询结束后取结果
+     */
+    inline DocView<V> view(const HashLookup<ENTRY> &l,size_t topn=SIZE_MAX) const {
+        if(NULL==l.entry) {
+            return DocView<V>();
+        }
+        return DocView<V>(docData_,l.entry->item,l.entry->item_num,postings_,
+                NULL==postings_?SIZE_MAX:entryOverflow(*l.entry),topn);
+    }
+
+    /*
+     *批量查询,每MULTI_LOOKUP_BATCH个key一批,按阶段交错执行:
+     *先算所有key的hash并预取bucket,再统一读bucket预取entry,再比较key预取doc,
+     *一个线程同时有多个内存访问在路上,内存里的表比逐个get快几倍
+     *返回的DocView和keys一一对应,有效期同getView
+     */
+    std::vector<DocView<V> > multi_get(const std::vector<std::string_view> &keys,size_t topn=SIZE_MAX) const {
+        std::vector<DocView<V> > res(keys.size());
+        HashLookup<ENTRY> l[MULTI_LOOKUP_BATCH];
+        for(size_t start=0;start<keys.size();start+=MULTI_LOOKUP_BATCH) {
+            size_t n=std::min(MULTI_LOOKUP_BATCH,keys.size()-start);
+            for(size_t i=0;i<n;i++) {
+                l[i]=lookup(keys[start+i]);
+            }
+            for(bool all_done=false;!all_done;) {
+                all_done=true;
+                for(size_t i=0;i<n;i++) {
+                    if(!l[i].done() && !step(l[i])) {
+                        all_done=false;
+                    }
+                }
+            }
+            for(size_t i=0;i<n;i++) {
+                res[start+i]=view(l[i],topn);
             }
         }
-        return dr;
+        return res;
+    }
+
+private:
+    inline bool hasOverflowItem(const ENTRY *e,size_t obj_offset) const {
+        size_t cur=entryOverflow(*e);
+        while(cur!=SIZE_MAX) {
+            const PostingBlock* b=postings_->FindDataPtr(cur);
+            if(NULL==b) {
+                break;
+            }
+            for(size_t i=0;i<b->num;i++) {
+                if(b->item[i].offset==obj_offset) {
+                    return true;
+                }
+            }
+            cur=b->next;
+        }
+        return false;
+    }
+
+    /*
+     *key已经存在时按分数把obj_offset插入到entry的item中,top列表满了之后挤出来的放到overflow块
+     *整个修改持有entry的seq锁: 读进程据此判断拷贝是否完整,并发写模式下也用它让写同一个key的线程互斥
+     */
+    int updateEntry(size_t entry_offset,size_t obj_offset,uint8_t score) {
+        ENTRY* e=hashValue_->FindWritePtr(entry_offset);
+        if(NULL==e) {
+            return -1;
+        }
+        uint32_t seq=seqLock(e);
+        const ENTRY* obj=e;
+        bool repeat=false;
+        for(size_t i=0;i<obj->item_num && i<sizeof(obj->item)/sizeof(obj->item[0]);i++) {
+            if(obj->item[i].offset==obj_offset) {
+                repeat=true;
+                continue;
+            }
+        }
+        if(!repeat && NULL!=postings_) {
+            repeat=hasOverflowItem(obj,obj_offset);
+        }
+        if(repeat) {
+            //std::cout<<"repeat key="<<k<<" offset="<<obj_offset<<std::endl;
+            seqUnlock(e,seq);
+            return 1;
+        }
+        size_t len=sizeof(obj->item)/sizeof(obj->item[0]);
+        ENTRY hve=*obj;
+        bool change=false;
+        //topk已满且没有overflow块时,新item排进来会挤掉原来的最后一个
+        bool evict=obj->item_num==len && !(NULL!=postings_ && opt_.unbounded_postings);
+        size_t evicted=obj->item[len-1].offset;
+        //下标从后往前减到-1,统一用int比较
+        const int n=(int)len;
+        const int num=(int)obj->item_num;
+        for(int i=num-1;i>=0;i--) {
+            if(hve.item[i].score<score || (0==score && hve.item[i].score==score)) {
+                change=true;
+                if(i<n-1) {
+                    hve.item[i+1]=hve.item[i];
+                }
+                if(i==0) {
+                    hve.item[0].offset=obj_offset;
+                    hve.item[0].score = score;
+                    break;
+                }
+            }else{
+                if(i!=n-1){
+                    hve.item[i+1].offset=obj_offset;
+                    hve.item[i+1].score = score;
+                    if(i==num-1) {
+                        change=true;
+                    }
+                }
+
+                break;
+            }
+        }
+        if(obj->item_num==len && NULL!=postings_ && opt_.unbounded_postings) {
+            //top列表已满,被挤出来的item(原来的最后一个或者新item)放到overflow块中
+            HashValueItem spill;
+            if(change) {
+                spill=obj->item[len-1];
+            }else {
+                spill.offset=obj_offset;
+                spill.score=score;
+            }
+            STO_RESULT r=insertOverflow(hve,spill);
+            if(STO_OK!=r) {
+                seqUnlock(e,seq);
+                return STO_FULL==r?RETRY_EXTEND:-1;
+            }
+            change=true;
+        }
+        if(change) {
+            if(hve.item_num < len) {
+                hve.item_num++;
+            }
+            memcpy(e->item,hve.item,sizeof(e->item));
+            setEntryOverflow(*e,entryOverflow(hve),entryOverflowNum(hve));
+            __atomic_store_n(&e->item_num,hve.item_num,__ATOMIC_RELEASE);
+        }
+        seqUnlock(e,seq);
+        if(change) {
+            addDocRef(obj_offset,entry_offset);
+            if(evict) {
+                dropDocRef(evicted,entry_offset);
+            }
+        }
+        return 0;
+    }
+
+    /*
+     *把x按分数插入到e的overflow块链表中,同分数的排在已有item后面
+     *目标块是第一个最后一个item分数比x低的块,都不低就放到最后一个块;块满时后一半移到新块
+     *并发写模式下posting.data需要扩容时返回STO_FULL,此时没有做任何修改
+     */
+    STO_RESULT insertOverflow(ENTRY &e,const HashValueItem &x) {
+        size_t cur=entryOverflow(e);
+        while(cur!=SIZE_MAX) {
+            const PostingBlock* b=postings_->FindDataPtr(cur);
+            if(NULL==b) {
+                return STO_FAIL;
+            }
+            if(0==b->num || b->item[b->num-1].score<x.score || SIZE_MAX==b->next) {
+                break;
+            }
+            cur=b->next;
+        }
+        if(SIZE_MAX==cur) {
+            PostingBlock nb;
+            nb.item[0]=x;
+            nb.num=1;
+            size_t pos;
+            STO_RESULT r=postings_->InsertData(nb,pos);
+            if(STO_OK!=r) {
+                return r;
+            }
+            setEntryOverflow(e,pos,entryOverflowNum(e)+1);
+            return STO_OK;
+        }
+        PostingBlock b=*postings_->FindDataPtr(cur);
+        size_t i=b.num;
+        while(i>0 && b.item[i-1].score<x.score) {
+            i--;
+        }
+        if(POSTING_BLOCK_ITEMS==b.num) {
+            PostingBlock nb;
+            size_t half=POSTING_BLOCK_ITEMS/2;
+            nb.num=b.num-half;
+            memcpy(nb.item,b.item+half,nb.num*sizeof(HashValueItem));
+            nb.next=b.next;
+            b.num=half;
+            if(i>half) {
+                insertBlockItem(nb,i-half,x);
+            }else {
+                insertBlockItem(b,i,x);
+            }
+            //先写新块再修改链接,遍历到的链表始终是完整的
+            size_t pos;
+            STO_RESULT r=postings_->InsertData(nb,pos);
+            if(STO_OK!=r) {
+                return r;
+            }
+            b.next=pos;
+        }else {
+            insertBlockItem(b,i,x);
+        }
+        seqUpdateBlock(cur,b);
+        setEntryOverflow(e,entryOverflow(e),entryOverflowNum(e)+1);
+        return STO_OK;
+    }
+
+    //一次修改完成,flusher按序号判断它是否已经落盘; 并发写期间不推进序号
+    inline void endWrite() {
+        if(NULL!=flusher_ && !concurrent_) {
+            flusher_->EndWrite();
+        }
+    }
+
+    /*
+     *数据文件全部落盘: 使用flusher时写好文件头后等待刷盘,否则msync(MS_SYNC)整个文件
+     */
+    bool syncData() {
+        if(NULL!=flusher_) {
+            docData_->SaveToDisk();
+            hashValue_->SaveToDisk();
+            keys_->SaveToDisk();
+            if(NULL!=hashBucket_) {
+                hashBucket_->SaveToDisk();
+            }
+            if(NULL!=postings_) {
+                postings_->SaveToDisk();
+            }
+            if(NULL!=docRefs_) {
+                docRefs_->SaveToDisk();
+            }
+            if(NULL!=docKeys_) {
+                docKeys_->SaveToDisk();
+            }
+            return flusher_->FlushUntil(flusher_->EndWrite());
+        }
+        bool ok=STO_OK==docData_->Sync() && STO_OK==hashValue_->Sync() && keys_->Sync();
+        if(NULL!=hashBucket_) {
+            ok=ok && STO_OK==hashBucket_->Sync();
+        }
+        if(NULL!=postings_) {
+            ok=ok && STO_OK==postings_->Sync();
+        }
+        if(NULL!=docRefs_) {
+            ok=ok && STO_OK==docRefs_->Sync();
+        }
+        if(NULL!=docKeys_) {
+            ok=ok && STO_OK==docKeys_->Sync();
+        }
+        return ok;
+    }
+
+    /*
+     *追加一条journal记录,journal文件太大时做checkpoint
+     */
+    bool logJournal(uint8_t type,const void *data1,size_t len1,const void *data2=NULL,size_t len2=0) {
+        if(0==journal_->Append(type,data1,len1,data2,len2)) {
+            std::cout<<"write journal failed!"<<std::endl;
+            return false;
+        }
+        if(journal_->GetFileSize()>=opt_.journal_checkpoint_size && !Checkpoint()) {
+            std::cout<<"journal checkpoint failed!"<<std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool openJournal() {
+        if(NULL!=swiss_) {
+            std::cout<<"journal only supports IDX_CHAIN!"<<std::endl;
+            return false;
+        }
+        if(!journal_->Open()) {
+            return false;
+        }
+        if(journal_->IsDirty() && !recoverJournal()) {
+            return false;
+        }
+        return journal_->MarkDirty();
+    }
+
+    /*
+     *上次没有正常关闭: 先修复索引,再按顺序重放journal中已经提交的记录,最后做一次checkpoint
+     *没有提交的修改可能已经全部或者部分写到了数据文件中,修复之后相当于没做或者做完了;
+     *重放是幂等的,已经生效的记录再做一遍结果不变(map重复的item返回1,del不存在的key返回1)
+     */
+    bool recoverJournal() {
+        size_t swept=repairChains();
+        docData_->RecountItems();
+        //引用计数没有记journal,按修复后的索引重新统计,重放时再跟着map/del/unmapDoc变化
+        if(NULL!=docRefs_ && !RebuildDocRefs()) {
+            return false;
+        }
+        journal_->BeginReplay();
+        uint8_t type;
+        string payload;
+        size_t n=0;
+        while(journal_->ReadNext(type,payload)) {
+            if(!replayRecord(type,payload)) {
+                std::cout<<"replay journal record "<<n<<" failed!"<<std::endl;
+                return false;
+            }
+            n++;
+        }
+        if(NULL!=bloom_ && !RebuildBloom()) {
+            return false;
+        }
+        std::cout<<"journal recovered: swept "<<swept<<" entries, replayed "<<n<<" records"<<std::endl;
+        return Checkpoint();
+    }
+
+    bool replayRecord(uint8_t type,const string &p) {
+        if(JOURNAL_DOC==type && p.size()==sizeof(size_t)+sizeof(V)) {
+            size_t pos,real;
+            V v;
+            memcpy(&pos,p.data(),sizeof(pos));
+            memcpy((void*)&v,p.data()+sizeof(pos),sizeof(V));
+            while(pos>=docData_->GetItemCapacity()) {
+                if(!docData_->ExtendSize()) {
+                    return false;
+                }
+            }
+            STO_RESULT r=docData_->InsertData(v,real,pos);
+            if(STO_EXIST==r) {
+                //.bit和.data分别写回,bit位落盘了doc的内容不一定落盘,按journal中的内容重写
+                r=docData_->UpdateData(v,pos);
+            }
+            return STO_OK==r;
+        }else if(JOURNAL_MAP==type && p.size()>sizeof(size_t)) {
+            size_t obj;
+            memcpy(&obj,p.data(),sizeof(obj));
+            return applyMap(std::string_view(p).substr(sizeof(obj)+1),obj,p[sizeof(obj)])>=0;
+        }else if(JOURNAL_DEL==type) {
+            applyDel(p);
+            return true;
+        }else if(JOURNAL_UNMAP==type && p.size()==sizeof(size_t)) {
+            size_t obj;
+            memcpy(&obj,p.data(),sizeof(obj));
+            return applyUnmapDoc(obj)>=0;
+        }
+        return false;
+    }
+
+    /*
+     *崩溃恢复: 从每个bucket出发遍历链表,走不到的entry(写入了还没挂到链表上,或者已经摘下来还没删除)删除;
+     *走到的entry按当前的bucket个数重新挂到所属bucket的链表头,拆分到一半的bucket也就恢复成完整的链表.
+     *没有释放的seq锁(奇数)恢复成偶数,overflow块同样按是否能从entry走到回收.返回删除的entry个数
+     */
+    size_t repairChains() {
+        //文件头中的数据个数可能不准,先按bit位重新计数,删除时才不会减成负数
+        hashBucket_->RecountItems();
+        hashValue_->RecountItems();
+        if(NULL!=postings_) {
+            postings_->RecountItems();
+        }
+        size_t n=hashBucket_->GetDataHeader()->m_bucketnum;
+        size_t cap=hashValue_->GetItemCapacity();
+        std::vector<bool> reached(cap,false);
+        std::vector<size_t> live;
+        for(size_t i=hashBucket_->NextUsedPos(0);i!=SIZE_MAX;i=hashBucket_->NextUsedPos(i+1)) {
+            const HashBucket* b=hashBucket_->FindDataPtr(i);
+            if(NULL==b) {
+                continue;
+            }
+            size_t cur=b->header;
+            while(cur<cap && !reached[cur]) {
+                const ENTRY* v=hashValue_->FindDataPtr(cur);
+                if(NULL==v) {
+                    break;
+                }
+                reached[cur]=true;
+                live.push_back(cur);
+                cur=v->next;
+            }
+            hashBucket_->DeleteData(i);
+        }
+        size_t swept=0;
+        for(size_t pos=hashValue_->NextUsedPos(0);pos<cap;pos=hashValue_->NextUsedPos(pos+1)) {
+            if(!reached[pos]) {
+                hashValue_->DeleteData(pos);
+                swept++;
+            }
+        }
+        size_t pcap=NULL==postings_?0:postings_->GetItemCapacity();
+        std::vector<bool> blocks(pcap,false);
+        for(size_t i=0;i<live.size();i++) {
+            ENTRY* e=hashValue_->FindWritePtr(live[i]);
+            e->seq+=e->seq & 1;
+            size_t b=bucketOf(e->hash,n);
+            const HashBucket* hb=hashBucket_->FindDataPtr(b);
+            e->next=NULL==hb?SIZE_MAX:hb->header;
+            publishHeader(b,live[i]);
+            for(size_t cur=entryOverflow(*e);cur<pcap && !blocks[cur];) {
+                PostingBlock* pb=postings_->FindWritePtr(cur);
+                if(NULL==pb) {
+                    break;
+                }
+                blocks[cur]=true;
+                pb->seq+=pb->seq & 1;
+                cur=pb->next;
+            }
+        }
+        for(size_t pos=0==pcap?SIZE_MAX:postings_->NextUsedPos(0);pos<pcap;pos=postings_->NextUsedPos(pos+1)) {
+            if(!blocks[pos]) {
+                postings_->DeleteData(pos);
+            }
+        }
+        hashValue_->RecountItems();
+        hashBucket_->RecountItems();
+        if(NULL!=postings_) {
+            postings_->RecountItems();
+        }
+        return swept;
+    }
+
+    void warmRegions(std::vector<CMapRegion> &regions,bool docs) const {
+        if(NULL!=hashBucket_) {
+            hashBucket_->GetMapRegions(regions);
+        }
+        if(NULL!=swiss_) {
+            regions.push_back(swiss_->mapRegion());
+        }
+        hashValue_->GetMapRegions(regions);
+        regions.push_back(keys_->GetMapRegion());
+        if(docs) {
+            docData_->GetMapRegions(regions);
+            if(NULL!=postings_) {
+                postings_->GetMapRegions(regions);
+            }
+        }
+    }
+
+    static CMapPolicy mapPolicy(const MapOptions &o) {
+        CMapPolicy p;
+        p.m_populate=o.populate;
+        p.m_hugepage=o.hugepage;
+        p.m_willneed=o.willneed;
+        p.m_advice=ADVICE_RANDOM==o.advice?MADV_RANDOM:(ADVICE_SEQUENTIAL==o.advice?MADV_SEQUENTIAL:MADV_NORMAL);
+        return p;
+    }
+
+    //扩容次数/字节数/耗时,用来调整扩容策略(SharedHashOptions.growth_*)
+    static void printExtendStats(const char *name,const CExtendStats &st) {
+        std::cout<<name<<" extends="<<st.m_count<<" bytes="<<st.m_bytes<<" seconds="<<st.m_seconds<<std::endl;
+    }
+
+    /*
+     *一写多读的写入顺序: 新的entry/块先完整写入(InsertData写完数据才设置bit位),
+     *再用release原子写把它挂到链表上;已经在链表上的entry只原子地修改next,
+     *item的修改用seq顺序锁保护,读进程据此判断拷贝是否完整
+     */
+    inline void publishNext(size_t pos,size_t next) {
+        ENTRY* e=hashValue_->FindWritePtr(pos);
+        if(NULL!=e) {
+            __atomic_store_n(&e->next,next,__ATOMIC_RELEASE);
+        }
+    }
+
+    inline bool publishHeader(size_t bucket,size_t header) {
+        HashBucket* b=hashBucket_->FindWritePtr(bucket);
+        if(NULL!=b) {
+            __atomic_store_n(&b->header,header,__ATOMIC_RELEASE);
+            return true;
+        }
+        HashBucket hb;
+        hb.header=header;
+        return STO_OK==hashBucket_->InsertAndUpdateData(hb,bucket);
+    }
+
+    /*
+     *seq变成奇数表示entry正在被修改,CAS保证并发写模式下同一时刻只有一个线程修改,
+     *返回加锁后的seq,seqUnlock时再加1变回偶数
+     */
+    static inline uint32_t seqLock(ENTRY* e) {
+        uint32_t seq=__atomic_load_n(&e->seq,__ATOMIC_RELAXED);
+        while((seq & 1) || !__atomic_compare_exchange_n(&e->seq,&seq,seq+1,true,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED)) {
+            if(seq & 1) {
+                sched_yield();
+                seq=__atomic_load_n(&e->seq,__ATOMIC_RELAXED);
+            }
+        }
+        //后面对item的修改不能排到seq变成奇数之前
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        return seq+1;
+    }
+
+    static inline void seqUnlock(ENTRY* e,uint32_t seq) {
+        __atomic_store_n(&e->seq,seq+1,__ATOMIC_RELEASE);
+    }
+
+    inline void seqUpdateBlock(size_t pos,const PostingBlock &v) {
+        PostingBlock* b=postings_->FindWritePtr(pos);
+        if(NULL==b) {
+            return;
+        }
+        uint32_t seq=b->seq;
+        __atomic_store_n(&b->seq,seq+1,__ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(b->item,v.item,sizeof(b->item));
+        b->num=v.num;
+        __atomic_store_n(&b->next,v.next,__ATOMIC_RELEASE);
+        __atomic_store_n(&b->seq,seq+2,__ATOMIC_RELEASE);
+    }
+
+    bool snapshotBlock(size_t pos,PostingBlock &out) const {
+        const PostingBlock* b=postings_->FindDataPtr(pos);
+        if(NULL==b) {
+            return false;
+        }
+        if(!seqSnapshot(b,out)) {
+            memcpy((void*)&out,(const void*)b,sizeof(PostingBlock));
+        }
+        return true;
+    }
+
+    //跳过已经删除的doc,最多取到topn个
+    inline void appendDocs(DocResult<V> &dr,const HashValueItem *items,size_t num,size_t topn) const {
+        for(size_t i=0;i<num && dr.docs.size()<topn;i++) {
+            DocValue<V> d;
+            d.doc=docData_->FindDataPtr(items[i].offset);
+            if(NULL!=d.doc) {
+                d.score=items[i].score;
+                dr.docs.push_back(d);
+            }
+        }
+    }
+
+    /*
+     *读进程按顺序锁拷贝一份完整的数据,写进程正在修改(seq为奇数或者拷贝前后seq不同)时返回false
+     */
+    template<typename T>
+    static inline bool seqCopy(const T* p,T &out) {
+        uint32_t seq=__atomic_load_n(&p->seq,__ATOMIC_ACQUIRE);
+        if(seq & 1) {
+            return false;
+        }
+        memcpy((void*)&out,(const void*)p,sizeof(T));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return __atomic_load_n(&p->seq,__ATOMIC_RELAXED)==seq;
+    }
+
+    template<typename T>
+    static inline bool seqSnapshot(const T* p,T &out) {
+        for(int i=0;i<SWMR_SPIN_LIMIT;i++) {
+            if(seqCopy(p,out)) {
+                return true;
+            }
+            if(i>=SWMR_MAX_RETRY) {
+                sched_yield();
+            }
+        }
+        return false;
+    }
+
+    static inline void insertBlockItem(PostingBlock &b,size_t i,const HashValueItem &x) {
+        memmove(b.item+i+1,b.item+i,(b.num-i)*sizeof(HashValueItem));
+        b.item[i]=x;
+        b.num++;
+    }
+
+    /*
+     *打开docref.data/dockey.data,新建的(包括给已有docref.data新加的dockey.data)按索引统计一遍
+     */
+    bool initDocRefs() {
+        bool exist=IsExistFile(docreffile_) && (NULL==docKeys_ || IsExistFile(dockeyfile_));
+        if(!docRefs_->Init() || (NULL!=docKeys_ && !docKeys_->Init())) {
+            return false;
+        }
+        return exist || RebuildDocRefs();
+    }
+
+    //从bucket(或swiss索引)能走到的每个entry
+    template<typename F>
+    void visitEntries(F f) const {
+        if(NULL!=swiss_) {
+            swiss_->forEach([&](uint64_t,size_t pos) {
+                f(pos);
+            });
+            return;
+        }
+        size_t n=bucketNum();
+        for(size_t i=hashBucket_->NextUsedPos(0);i<n;i=hashBucket_->NextUsedPos(i+1)) {
+            size_t tmp=SIZE_MAX;
+            const ENTRY* v=getBucketEntry(i,tmp);
+            while(NULL!=v) {
+                f(tmp);
+                tmp=v->next;
+                v=SIZE_MAX==tmp?NULL:hashValue_->FindDataPtr(tmp);
+            }
+        }
+    }
+
+    //entry中和overflow块中每个item引用的doc
+    template<typename F>
+    void forEachItem(const ENTRY* v,F f) const {
+        size_t num=std::min(v->item_num,sizeof(v->item)/sizeof(v->item[0]));
+        for(size_t i=0;i<num;i++) {
+            f(v->item[i].offset);
+        }
+        for(size_t cur=NULL==postings_?SIZE_MAX:entryOverflow(*v);cur!=SIZE_MAX;) {
+            const PostingBlock* b=postings_->FindDataPtr(cur);
+            if(NULL==b) {
+                break;
+            }
+            for(size_t i=0;i<b->num && i<POSTING_BLOCK_ITEMS;i++) {
+                f(b->item[i].offset);
+            }
+            cur=b->next;
+        }
+    }
+
+    /*
+     *entry新增了一个引用doc的item; 有反向索引时entry下标加到第一个块,第一个块满时在前面加一个新块
+     */
+    void addDocRef(size_t doc,size_t entrypos) {
+        if(NULL==docRefs_) {
+            return;
+        }
+        while(doc>=docRefs_->GetItemCapacity()) {
+            if(!docRefs_->ExtendSize()) {
+                return;
+            }
+        }
+        DocRef* r=docRefs_->FindWritePtr(doc);
+        if(NULL==r) {
+            DocRef nr;
+            if(STO_OK!=docRefs_->InsertAndUpdateData(nr,doc)) {
+                return;
+            }
+            r=docRefs_->FindWritePtr(doc);
+        }
+        r->refs++;
+        if(NULL==docKeys_) {
+            return;
+        }
+        DocKeyBlock* b=SIZE_MAX==r->keys?NULL:docKeys_->FindWritePtr(r->keys);
+        if(NULL!=b && b->num<DOC_KEY_BLOCK_ITEMS) {
+            b->entry[b->num++]=entrypos;
+            return;
+        }
+        DocKeyBlock nb;
+        nb.next=r->keys;
+        nb.entry[0]=entrypos;
+        nb.num=1;
+        size_t pos;
+        if(STO_OK==docKeys_->InsertData(nb,pos)) {
+            r->keys=pos;
+        }
+    }
+
+    /*
+     *entry去掉了一个引用doc的item,引用数减到0时删除doc
+     *反向索引中找到entry下标后用第一个块的最后一个补上,第一个块空了就去掉
+     */
+    void dropDocRef(size_t doc,size_t entrypos) {
+        DocRef* r=NULL==docRefs_?NULL:docRefs_->FindWritePtr(doc);
+        if(NULL==r) {
+            return;
+        }
+        DocKeyBlock* head=NULL==docKeys_ || SIZE_MAX==r->keys?NULL:docKeys_->FindWritePtr(r->keys);
+        for(size_t cur=NULL==head?SIZE_MAX:r->keys;cur!=SIZE_MAX;) {
+            DocKeyBlock* b=docKeys_->FindWritePtr(cur);
+            if(NULL==b) {
+                break;
+            }
+            size_t i=0;
+            while(i<b->num && b->entry[i]!=entrypos) {
+                i++;
+            }
+            if(i<b->num) {
+                b->entry[i]=head->entry[head->num-1];
+                head->num--;
+                if(0==head->num) {
+                    size_t first=r->keys;
+                    r->keys=head->next;
+                    docKeys_->DeleteData(first);
+                }
+                break;
+            }
+            cur=b->next;
+        }
+        if(r->refs>0) {
+            r->refs--;
+        }
+        if(0==r->refs) {
+            freeDocRef(doc);
+            docData_->DeleteData(doc);
+        }
+    }
+
+    //删除doc的引用记录和反向索引块
+    void freeDocRef(size_t doc) {
+        const DocRef* r=NULL==docRefs_?NULL:docRefs_->FindDataPtr(doc);
+        if(NULL==r) {
+            return;
+        }
+        for(size_t cur=NULL==docKeys_?SIZE_MAX:r->keys;cur!=SIZE_MAX;) {
+            const DocKeyBlock* b=docKeys_->FindDataPtr(cur);
+            if(NULL==b) {
+                break;
+            }
+            size_t next=b->next;
+            docKeys_->DeleteData(cur);
+            cur=next;
+        }
+        docRefs_->DeleteData(doc);
+    }
+
+    //key被删除之前调用,去掉它的所有item的引用
+    void dropEntryRefs(size_t entrypos) {
+        const ENTRY* v=NULL==docRefs_?NULL:hashValue_->FindDataPtr(entrypos);
+        if(NULL!=v) {
+            forEachItem(v,[&](size_t doc) {
+                dropDocRef(doc,entrypos);
+            });
+        }
+    }
+
+    //compact把entry从oldpos搬到newpos之后修改反向索引
+    void moveEntryRefs(size_t oldpos,size_t newpos) {
+        const ENTRY* v=NULL==docKeys_?NULL:hashValue_->FindDataPtr(newpos);
+        if(NULL==v) {
+            return;
+        }
+        forEachItem(v,[&](size_t doc) {
+            const DocRef* r=docRefs_->FindDataPtr(doc);
+            for(size_t cur=NULL==r?SIZE_MAX:r->keys;cur!=SIZE_MAX;) {
+                DocKeyBlock* b=docKeys_->FindWritePtr(cur);
+                if(NULL==b) {
+                    break;
+                }
+                size_t* p=std::find(b->entry,b->entry+b->num,oldpos);
+                if(p!=b->entry+b->num) {
+                    *p=newpos;
+                    break;
+                }
+                cur=b->next;
+            }
+        });
+    }
+
+    //compact把doc从oldpos搬到newpos之后,引用记录跟着搬
+    void moveDocRef(size_t oldpos,size_t newpos) {
+        const DocRef* r=NULL==docRefs_?NULL:docRefs_->FindDataPtr(oldpos);
+        if(NULL==r) {
+            return;
+        }
+        DocRef c=*r;
+        if(STO_OK==docRefs_->InsertAndUpdateData(c,newpos)) {
+            docRefs_->DeleteData(oldpos);
+        }
+    }
+
+    /*
+     *从pos的entry中去掉obj_offset对应的item,没有这个item时返回false.
+     *entry中去掉一个item后用overflow中分数最高的补到最后,保持entry写满之后才用overflow块;
+     *item全部去掉的key整个删除
+     */
+    bool removeItem(size_t pos,size_t obj_offset) {
+        ENTRY* e=hashValue_->FindWritePtr(pos);
+        if(NULL==e) {
+            return false;
+        }
+        size_t num=std::min(e->item_num,sizeof(e->item)/sizeof(e->item[0]));
+        size_t i=0;
+        while(i<num && e->item[i].offset!=obj_offset) {
+            i++;
+        }
+        if(i<num) {
+            ENTRY hve=*e;
+            memmove(hve.item+i,hve.item+i+1,(num-i-1)*sizeof(HashValueItem));
+            hve.item_num=num-1;
+            PostingBlock b;
+            size_t bpos=NULL==postings_?SIZE_MAX:entryOverflow(hve);
+            if(SIZE_MAX!=bpos && snapshotBlock(bpos,b) && b.num>0) {
+                hve.item[hve.item_num++]=b.item[0];
+                memmove(b.item,b.item+1,(b.num-1)*sizeof(HashValueItem));
+                b.num--;
+                size_t onum=entryOverflowNum(hve);
+                setEntryOverflow(hve,0==b.num?b.next:entryOverflow(hve),onum>0?onum-1:0);
+            }else {
+                bpos=SIZE_MAX;
+            }
+            //先改entry再改块,读进程可能短暂地看到补上来的item出现两次,不会漏掉
+            uint32_t seq=seqLock(e);
+            memcpy(e->item,hve.item,sizeof(e->item));
+            setEntryOverflow(*e,entryOverflow(hve),entryOverflowNum(hve));
+            __atomic_store_n(&e->item_num,hve.item_num,__ATOMIC_RELEASE);
+            seqUnlock(e,seq);
+            if(SIZE_MAX!=bpos && 0==b.num) {
+                postings_->DeleteData(bpos);
+            }else if(SIZE_MAX!=bpos) {
+                seqUpdateBlock(bpos,b);
+            }
+        }else if(!removeOverflowItem(e,obj_offset)) {
+            return false;
+        }
+        dropDocRef(obj_offset,pos);
+        if(0==e->item_num) {
+            applyDel(entryKey(e));
+        }
+        return true;
+    }
+
+    bool removeOverflowItem(ENTRY* e,size_t obj_offset) {
+        size_t pre=SIZE_MAX;
+        for(size_t cur=NULL==postings_?SIZE_MAX:entryOverflow(*e);cur!=SIZE_MAX;) {
+            PostingBlock b;
+            if(!snapshotBlock(cur,b)) {
+                return false;
+            }
+            size_t num=std::min((size_t)b.num,POSTING_BLOCK_ITEMS);
+            size_t i=0;
+            while(i<num && b.item[i].offset!=obj_offset) {
+                i++;
+            }
+            if(i==num) {
+                pre=cur;
+                cur=b.next;
+                continue;
+            }
+            memmove(b.item+i,b.item+i+1,(num-i-1)*sizeof(HashValueItem));
+            b.num=num-1;
+            uint32_t seq=seqLock(e);
+            if(0==b.num && SIZE_MAX==pre) {
+                publishEntryOverflow(*e,b.next);
+            }
+            size_t onum=entryOverflowNum(*e);
+            setEntryOverflow(*e,entryOverflow(*e),onum>0?onum-1:0);
+            seqUnlock(e,seq);
+            if(0==b.num) {
+                if(SIZE_MAX!=pre) {
+                    PostingBlock pb;
+                    snapshotBlock(pre,pb);
+                    pb.next=b.next;
+                    seqUpdateBlock(pre,pb);
+                }
+                postings_->DeleteData(cur);
+            }else {
+                seqUpdateBlock(cur,b);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    template<typename T>
+    static FragmentInfo fragmentOf(CDataStorage<T> *s) {
+        FragmentInfo f;
+        f.capacity=s->GetItemCapacity();
+        f.items=s->CountItems();
+        f.used_end=s->GetUsedEnd();
+        return f;
+    }
+
+    static void printFragment(const char *name,const FragmentInfo &f) {
+        std::cout<<name<<" capacity="<<f.capacity<<" items="<<f.items<<" used_end="<<f.used_end
+            <<" holes="<<f.holes()<<std::endl;
+    }
+
+    /*
+     *pos的数据拷贝到最前面的空位(InsertData总是从最小的空位开始写),返回新的位置;
+     *新位置不在pos之前时撤销并返回SIZE_MAX.旧的位置由调用方改好指向之后再删除
+     */
+    template<typename T>
+    static size_t moveSlot(CDataStorage<T> *s,size_t pos) {
+        const T* p=s->FindDataPtr(pos);
+        if(NULL==p) {
+            return SIZE_MAX;
+        }
+        T v;
+        memcpy((void*)&v,(const void*)p,sizeof(T));
+        size_t np=SIZE_MAX;
+        if(STO_OK!=s->InsertData(v,np)) {
+            return SIZE_MAX;
+        }
+        if(np>=pos) {
+            s->DeleteData(np);
+            return SIZE_MAX;
+        }
+        return np;
+    }
+
+    /*
+     *compact第一步: 回收走不到的entry,再把位置不小于entry个数的entry按链表顺序搬到前面的空位.
+     *空位个数正好等于后部的entry个数,搬完后entry都在[0,entry个数)内.预算用完时返回false
+     */
+    bool compactEntries(CompactStats &st,size_t &budget) {
+        size_t cap=hashValue_->GetItemCapacity();
+        std::vector<bool> reached(cap,false);
+        if(NULL!=swiss_) {
+            swiss_->forEach([&](uint64_t,size_t pos) {
+                if(pos<cap) {
+                    reached[pos]=true;
+                }
+            });
+        }else {
+            size_t n=bucketNum();
+            for(size_t i=hashBucket_->NextUsedPos(0);i<n;i=hashBucket_->NextUsedPos(i+1)) {
+                const HashBucket* b=hashBucket_->FindDataPtr(i);
+                for(size_t cur=NULL==b?SIZE_MAX:b->header;cur<cap && !reached[cur];) {
+                    const ENTRY* v=hashValue_->FindDataPtr(cur);
+                    if(NULL==v) {
+                        break;
+                    }
+                    reached[cur]=true;
+                    cur=v->next;
+                }
+            }
+        }
+        for(size_t pos=hashValue_->NextUsedPos(0);pos<cap;pos=hashValue_->NextUsedPos(pos+1)) {
+            if(!reached[pos]) {
+                hashValue_->DeleteData(pos);
+                st.freed_entries++;
+            }
+        }
+        size_t live=hashValue_->CountItems();
+        if(NULL!=swiss_) {
+            std::vector<std::pair<uint64_t,size_t> > tail;
+            swiss_->forEach([&](uint64_t h,size_t pos) {
+                if(pos>=live) {
+                    tail.push_back(std::make_pair(h,pos));
+                }
+            });
+            for(size_t i=0;i<tail.size();i++) {
+                if(0==budget) {
+                    return false;
+                }
+                size_t np=moveSlot(hashValue_,tail[i].second);
+                if(SIZE_MAX==np) {
+                    return false;
+                }
+                swiss_->update(tail[i].first,tail[i].second,np);
+                moveEntryRefs(tail[i].second,np);
+                hashValue_->DeleteData(tail[i].second);
+                budget--;
+                st.moved_entries++;
+            }
+            return true;
+        }
+        size_t n=bucketNum();
+        for(size_t i=hashBucket_->NextUsedPos(0);i<n;i=hashBucket_->NextUsedPos(i+1)) {
+            const HashBucket* b=hashBucket_->FindDataPtr(i);
+            size_t pre=SIZE_MAX;
+            for(size_t cur=NULL==b?SIZE_MAX:b->header;cur!=SIZE_MAX;) {
+                if(cur>=live) {
+                    if(0==budget) {
+                        return false;
+                    }
+                    size_t np=moveSlot(hashValue_,cur);
+                    if(SIZE_MAX==np) {
+                        return false;
+                    }
+                    if(SIZE_MAX==pre) {
+                        publishHeader(i,np);
+                    }else {
+                        publishNext(pre,np);
+                    }
+                    moveEntryRefs(cur,np);
+                    hashValue_->DeleteData(cur);
+                    budget--;
+                    st.moved_entries++;
+                    cur=np;
+                }
+                const ENTRY* v=hashValue_->FindDataPtr(cur);
+                if(NULL==v) {
+                    break;
+                }
+                pre=cur;
+                cur=v->next;
+            }
+        }
+        return true;
+    }
+
+    /*
+     *compact第二步: overflow块,和entry一样先回收走不到的块,再把后部的块搬到前面,
+     *entry的overflow在seq顺序锁内修改,前一个块的next用seqUpdateBlock修改
+     */
+    bool compactBlocks(CompactStats &st,size_t &budget) {
+        if(NULL==postings_) {
+            return true;
+        }
+        size_t pcap=postings_->GetItemCapacity();
+        std::vector<bool> reached(pcap,false);
+        for(size_t pos=hashValue_->NextUsedPos(0);pos!=SIZE_MAX;pos=hashValue_->NextUsedPos(pos+1)) {
+            for(size_t cur=entryOverflow(*hashValue_->FindDataPtr(pos));cur<pcap && !reached[cur];) {
+                const PostingBlock* b=postings_->FindDataPtr(cur);
+                if(NULL==b) {
+                    break;
+                }
+                reached[cur]=true;
+                cur=b->next;
+            }
+        }
+        for(size_t pos=postings_->NextUsedPos(0);pos<pcap;pos=postings_->NextUsedPos(pos+1)) {
+            if(!reached[pos]) {
+                postings_->DeleteData(pos);
+                st.freed_blocks++;
+            }
+        }
+        size_t live=postings_->CountItems();
+        for(size_t pos=hashValue_->NextUsedPos(0);pos!=SIZE_MAX;pos=hashValue_->NextUsedPos(pos+1)) {
+            size_t pre=SIZE_MAX;
+            for(size_t cur=entryOverflow(*hashValue_->FindDataPtr(pos));cur!=SIZE_MAX;) {
+                if(cur>=live) {
+                    if(0==budget) {
+                        return false;
+                    }
+                    size_t np=moveSlot(postings_,cur);
+                    if(SIZE_MAX==np) {
+                        return false;
+                    }
+                    if(SIZE_MAX==pre) {
+                        ENTRY* e=hashValue_->FindWritePtr(pos);
+                        uint32_t seq=seqLock(e);
+                        publishEntryOverflow(*e,np);
+                        seqUnlock(e,seq);
+                    }else {
+                        PostingBlock pb;
+                        memcpy((void*)&pb,(const void*)postings_->FindDataPtr(pre),sizeof(PostingBlock));
+                        pb.next=np;
+                        seqUpdateBlock(pre,pb);
+                    }
+                    postings_->DeleteData(cur);
+                    budget--;
+                    st.moved_blocks++;
+                    cur=np;
+                }
+                const PostingBlock* b=postings_->FindDataPtr(cur);
+                if(NULL==b) {
+                    break;
+                }
+                pre=cur;
+                cur=b->next;
+            }
+        }
+        return true;
+    }
+
+    /*
+     *compact第三步: doc可能被多个key引用,先把后部的doc都拷贝到前面记下新旧位置,
+     *再逐个修改引用了它们的entry(seq顺序锁内)和块(seqUpdateBlock),最后删除旧的doc
+     */
+    bool compactDocs(CompactStats &st,size_t &budget,bool sweep) {
+        const size_t topk=sizeof(en.item)/sizeof(en.item[0]);
+        if(sweep) {
+            size_t cap=docData_->GetItemCapacity();
+            std::vector<bool> refs(cap,false);
+            for(size_t pos=hashValue_->NextUsedPos(0);pos!=SIZE_MAX;pos=hashValue_->NextUsedPos(pos+1)) {
+                const ENTRY* v=hashValue_->FindDataPtr(pos);
+                for(size_t i=0;i<v->item_num && i<topk;i++) {
+                    if(v->item[i].offset<cap) {
+                        refs[v->item[i].offset]=true;
+                    }
+                }
+            }
+            for(size_t pos=NULL==postings_?SIZE_MAX:postings_->NextUsedPos(0);pos!=SIZE_MAX;pos=postings_->NextUsedPos(pos+1)) {
+                const PostingBlock* b=postings_->FindDataPtr(pos);
+                for(size_t i=0;i<b->num && i<POSTING_BLOCK_ITEMS;i++) {
+                    if(b->item[i].offset<cap) {
+                        refs[b->item[i].offset]=true;
+                    }
+                }
+            }
+            for(size_t pos=docData_->NextUsedPos(0);pos<cap;pos=docData_->NextUsedPos(pos+1)) {
+                if(!refs[pos]) {
+                    docData_->DeleteData(pos);
+                    st.freed_docs++;
+                }
+            }
+        }
+        size_t live=docData_->CountItems();
+        bool done=true;
+        std::unordered_map<size_t,size_t> moved;
+        for(size_t pos=docData_->NextUsedPos(live);pos!=SIZE_MAX;pos=docData_->NextUsedPos(pos+1)) {
+            size_t np=0==budget?SIZE_MAX:moveSlot(docData_,pos);
+            if(SIZE_MAX==np) {
+                done=false;
+                break;
+            }
+            moved[pos]=np;
+            budget--;
+            st.moved_docs++;
+        }
+        if(moved.empty()) {
+            return done;
+        }
+        for(size_t pos=hashValue_->NextUsedPos(0);pos!=SIZE_MAX;pos=hashValue_->NextUsedPos(pos+1)) {
+            const ENTRY* v=hashValue_->FindDataPtr(pos);
+            size_t num=std::min(v->item_num,topk);
+            size_t i=0;
+            while(i<num && moved.find(v->item[i].offset)==moved.end()) {
+                i++;
+            }
+            if(i==num) {
+                continue;
+            }
+            ENTRY* e=hashValue_->FindWritePtr(pos);
+            uint32_t seq=seqLock(e);
+            for(;i<num;i++) {
+                std::unordered_map<size_t,size_t>::iterator it=moved.find(e->item[i].offset);
+                if(it!=moved.end()) {
+                    e->item[i].offset=it->second;
+                }
+            }
+            seqUnlock(e,seq);
+        }
+        for(size_t pos=NULL==postings_?SIZE_MAX:postings_->NextUsedPos(0);pos!=SIZE_MAX;pos=postings_->NextUsedPos(pos+1)) {
+            PostingBlock pb;
+            memcpy((void*)&pb,(const void*)postings_->FindDataPtr(pos),sizeof(PostingBlock));
+            bool change=false;
+            for(size_t i=0;i<pb.num && i<POSTING_BLOCK_ITEMS;i++) {
+                std::unordered_map<size_t,size_t>::iterator it=moved.find(pb.item[i].offset);
+                if(it!=moved.end()) {
+                    pb.item[i].offset=it->second;
+                    change=true;
+                }
+            }
+            if(change) {
+                seqUpdateBlock(pos,pb);
+            }
+        }
+        for(std::unordered_map<size_t,size_t>::iterator it=moved.begin();it!=moved.end();++it) {
+            moveDocRef(it->first,it->second);
+            docData_->DeleteData(it->first);
+        }
+        return done;
+    }
+
+    void freeOverflow(size_t cur) {
+        while(NULL!=postings_ && cur!=SIZE_MAX) {
+            const PostingBlock* b=postings_->FindDataPtr(cur);
+            if(NULL==b) {
+                break;
+            }
+            size_t next=b->next;
+            postings_->DeleteData(cur);
+            cur=next;
+        }
+    }
+
+    /*
+     *打开bloom filter; 目录里已经有数据但还没有bloom.data时从索引重建
+     *只读打开时bloom.data不存在就不使用
+     */
+    bool initBloom() {
+        bool exist=IsExistFile(bloomfile_);
+        if(!exist && M_READ==mode_) {
+            delete bloom_;
+            bloom_=NULL;
+            return true;
+        }
+        if(!bloom_->Init(hashSize()*2,opt_.bloom_fpr)) {
+            return false;
+        }
+        return exist || empty() || RebuildBloom();
+    }
+
+    /*
+     *新key写入bloom filter,key个数超过设计容量后误判率会明显升高,按新的大小重建
+     */
+    inline void addBloom(uint64_t h) {
+        if(NULL!=bloom_) {
+            bloom_->Add(h);
+            if(!concurrent_ && bloom_->GetKeyCount()>bloom_->GetCapacity()) {
+                RebuildBloom();
+            }
+        }
+    }
+
+    /*
+     *bloom filter不能删除bit,只记录删除次数,删除的key太多时重建
+     */
+    inline void delBloom() {
+        if(NULL!=bloom_) {
+            bloom_->MarkDeleted();
+            if(bloom_->GetDeletedCount()*2>bloom_->GetCapacity()) {
+                RebuildBloom();
+            }
+        }
+    }
+
+    /*
+     *在共享锁下执行f,f返回RETRY_EXTEND时释放共享锁,加独占锁把满了的文件扩容后重试
+     *keylen是f需要写入key.data的长key长度(不需要时为0)
+     */
+    template<typename F>
+    int concurrentRun(F f,size_t keylen) {
+        while(true) {
+            int ret;
+            {
+                std::shared_lock<std::shared_mutex> lk(growLock_);
+                ret=f();
+            }
+            if(RETRY_EXTEND!=ret) {
+                return ret;
+            }
+            std::unique_lock<std::shared_mutex> lk(growLock_);
+            if(!docData_->EnsureCapacity() || !hashValue_->EnsureCapacity()
+                    || (NULL!=postings_ && !postings_->EnsureCapacity())
+                    || (keylen>0 && !keys_->Reserve(keylen))) {
+                return -1;
+            }
+        }
+    }
+
+    /*
+     *并发写模式的map: 先在链表中找key,不存在就把新entry CAS到链表头;
+     *CAS失败说明其他线程刚挂上了新entry,只需要检查新挂上的这一段有没有同一个key
+     */
+    int mapConcurrent(std::string_view k,size_t obj_offset,uint8_t score) {
+        uint64_t h=hashKey(k.data(),k.size());
+        size_t keylen=k.size()>sizeof(((ENTRY*)0)->term)?k.size():0;
+        size_t tmp=SIZE_MAX;  //已经写入但还没有挂到链表上的entry,扩容重试时接着用
+        bool added=false;
+        int ret=concurrentRun([&]() {
+            HashBucket* b=hashBucket_->FindWritePtr(bucketOf(h));
+            if(NULL==b) {
+                return -1;
+            }
+            size_t head=__atomic_load_n(&b->header,__ATOMIC_ACQUIRE);
+            size_t pos=chainFind(head,SIZE_MAX,k,h);
+            while(SIZE_MAX==pos) {
+                if(SIZE_MAX==tmp) {
+                    ENTRY entry;
+                    if(keylen>0) {
+                        std::lock_guard<std::mutex> kl(keyLock_);
+                        if(!keys_->HasRoom(keylen)) {
+                            return RETRY_EXTEND;
+                        }
+                        if(!setEntryKey(entry,k.data(),k.size(),h)) {
+                            return -1;
+                        }
+                    }else {
+                        setEntryKey(entry,k.data(),k.size(),h);
+                    }
+                    entry.item[0].offset=obj_offset;
+                    entry.item[0].score=score;
+                    entry.item_num=1;
+                    STO_RESULT r=hashValue_->InsertData(entry,tmp);
+                    if(STO_OK!=r) {
+                        tmp=SIZE_MAX;
+                        return STO_FULL==r?RETRY_EXTEND:-1;
+                    }
+                }
+                ENTRY* e=hashValue_->FindWritePtr(tmp);
+                __atomic_store_n(&e->next,head,__ATOMIC_RELAXED);
+                size_t scanned=head;
+                if(__atomic_compare_exchange_n(&b->header,&head,tmp,false,__ATOMIC_RELEASE,__ATOMIC_ACQUIRE)) {
+                    tmp=SIZE_MAX;
+                    added=true;
+                    return 0;
+                }
+                pos=chainFind(head,scanned,k,h);
+            }
+            if(SIZE_MAX!=tmp) {
+                hashValue_->DeleteData(tmp);
+                tmp=SIZE_MAX;
+            }
+            return updateEntry(pos,obj_offset,score);
+        },keylen);
+        if(added) {
+            addBloom(h);
+            growConcurrent();
+        }
+        return ret;
+    }
+
+    //从from开始沿链表找key,遇到stop(之前已经检查过的部分)为止
+    inline size_t chainFind(size_t from,size_t stop,std::string_view k,uint64_t h) const {
+        while(from!=stop && SIZE_MAX!=from) {
+            const ENTRY* v=hashValue_->FindDataPtr(from);
+            if(NULL==v) {
+                break;
+            }
+            //不更新查找统计,多个线程同时累加同一个计数器会成为瓶颈
+            if(v->hash==h && v->term_len==k.size() && keyBytesEqual(v,k.data(),k.size())) {
+                return from;
+            }
+            from=__atomic_load_n(&v->next,__ATOMIC_ACQUIRE);
+        }
+        return SIZE_MAX;
+    }
+
+    /*
+     *并发写模式下负载超过max_load_factor时加独占锁,一次拆分到负载降到一半,
+     *避免每次插入都去抢独占锁
+     */
+    void growConcurrent() {
+        if(opt_.max_load_factor<=0) {
+            return;
+        }
+        {
+            //bucket.data的文件头可能正在被其他线程扩容重新映射,持有共享锁读
+            std::shared_lock<std::shared_mutex> rk(growLock_);
+            if(hashSize() <= opt_.max_load_factor*bucketNum()) {
+                return;
+            }
+        }
+        std::unique_lock<std::shared_mutex> lk(growLock_);
+        while(hashSize() > opt_.max_load_factor*bucketNum()/2) {
+            if(!splitBucket()) {
+                break;
+            }
+        }
+    }
+
+    /*
+     *负载超过max_load_factor时,每次插入顺带拆分几个bucket,不会集中做一次全量rehash
+     */
+    inline void growBuckets() {
+        if(NULL==hashBucket_ || opt_.max_load_factor<=0) {
+            return;
+        }
+        for(size_t i=0;i<opt_.rehash_steps;i++) {
+            if(hashSize() <= opt_.max_load_factor*bucketNum() || !splitBucket()) {
+                break;
+            }
+        }
+    }
+
+    /*
+     *拆分第split个bucket(lo)到lo和lo+base(hi)两个bucket,按hash的第log2(base)位区分
+     *
+     *顺序保证任何时刻从bucket头开始遍历都能找到属于这个bucket的所有entry:
+     *1.hi的header指向链表中第一个属于hi的entry(后面的entry都还在同一个链表上)
+     *2.bucket个数加1,之后新的查找按新的bucket个数定位
+     *3.lo的header指向第一个属于lo的entry
+     *4.从前往后把每个entry的next指向同一类的下一个entry,
+     *  前面的entry已经跳过了当前entry,所以另一类的entry不会因为当前entry的修改而断开
+     */
+    bool splitBucket() {
+        CMmapHeader* hd=hashBucket_->GetDataHeader();
+        size_t n=hd->m_bucketnum;
+        size_t base=round_down_pow2(n);
+        size_t lo=n-base;
+        size_t hi=n;
+        if(hi>=hashBucket_->GetItemCapacity() && !hashBucket_->ExtendSize()) {
+            return false;
+        }
+        hd=hashBucket_->GetDataHeader();
+        splitChain_.clear();
+        size_t firstLo=SIZE_MAX;
+        size_t firstHi=SIZE_MAX;
+        const HashBucket* b=hashBucket_->FindDataPtr(lo);
+        size_t cur=NULL==b?SIZE_MAX:b->header;
+        while(cur!=SIZE_MAX) {
+            const ENTRY* v=hashValue_->FindDataPtr(cur);
+            if(NULL==v) {
+                break;
+            }
+            splitChain_.push_back(cur);
+            if(v->hash & base) {
+                if(SIZE_MAX==firstHi) {
+                    firstHi=cur;
+                }
+            }else if(SIZE_MAX==firstLo) {
+                firstLo=cur;
+            }
+            cur=v->next;
+        }
+        //并发写模式下空bucket也要保留(header为SIZE_MAX),插入时只CAS链表头
+        if((SIZE_MAX!=firstHi || concurrent_) && !publishHeader(hi,firstHi)) {
+            return false;
+        }
+        __atomic_store_n(&hd->m_bucketnum,n+1,__ATOMIC_RELEASE);
+        if(SIZE_MAX==firstHi) {
+            return true;
+        }
+        if(SIZE_MAX==firstLo && !concurrent_) {
+            hashBucket_->DeleteData(lo);
+        }else if(b->header!=firstLo) {
+            publishHeader(lo,firstLo);
+        }
+        for(size_t i=0;i<splitChain_.size();i++) {
+            const ENTRY* v=hashValue_->FindDataPtr(splitChain_[i]);
+            uint64_t cls=v->hash & base;
+            size_t next=SIZE_MAX;
+            for(size_t j=i+1;j<splitChain_.size();j++) {
+                if((hashValue_->FindDataPtr(splitChain_[j])->hash & base)==cls) {
+                    next=splitChain_[j];
+                    break;
+                }
+            }
+            if(v->next!=next) {
+                publishNext(splitChain_[i],next);
+            }
+        }
+        return true;
     }
 };
 }
@@ -0,0 +1,198 @@
+#ifndef SHARED_HASH_MPHF_H
+#define SHARED_HASH_MPHF_H
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "shared_hash_fun.h"
+
+/*最小完美hash(BBHash),n个不同的64位hash映射到[0,n),每个key约3bit
+ *
+ *第i层是一个 gamma*剩余key个数 位的bit数组,key按 mix(hash,i) 落到某一位,
+ *只有自己落在这一位的key留在这一层(位置1),冲突的key进入下一层;
+ *若干层后仍然冲突的key(包括64位hash完全相同的key)放到最后的fallback有序数组里.
+ *key的编号 = 所有层拼起来的bit数组中该位之前1的个数(rank),fallback中的key排在最后.
+ *
+ *序列化后的格式(全部是uint64,可以直接在mmap上查询):
+ *[level_num][fallback_num][total_bits][set_bits]
+ *[level0 起始位][level0 位数] ...
+ *[bit数组 total_bits/64个字] [rank数组 每512位一个,保存之前1的个数]
+ *[fallback: hash 有序]
+ */
+
+namespace shm{
+
+const uint64_t MPHF_MAX_LEVEL = 32;
+const double MPHF_GAMMA = 2.0;
+
+class Mphf {
+public:
+    Mphf():data_(NULL),levels_(0),fallback_(0),totalBits_(0),setBits_(0),
+        levelMeta_(NULL),bits_(NULL),ranks_(NULL),fbHash_(NULL) {
+    }
+
+    /*
+     *在已经序列化好的内存上查询
+     */
+    bool Attach(const uint64_t *data,size_t words) {
+        if(words<4) {
+            return false;
+        }
+        levels_=data[0];
+        fallback_=data[1];
+        totalBits_=data[2];
+        setBits_=data[3];
+        if(levels_>MPHF_MAX_LEVEL || words<serializedWords(levels_,totalBits_,fallback_)) {
+            return false;
+        }
+        data_=data;
+        levelMeta_=data+4;
+        bits_=levelMeta_+2*levels_;
+        ranks_=bits_+totalBits_/64;
+        fbHash_=ranks_+rankWords(totalBits_);
+        return true;
+    }
+
+    /*
+     *hash对应的编号,不在构建集合中的hash也会返回一个[0,size())中的编号(或SIZE_MAX),
+     *调用方需要自己校验; fallback中可能有多个相同的hash,用eq(编号)确认
+     */
+    template<typename EQ>
+    inline size_t find(uint64_t h,EQ eq) const {
+        for(uint64_t i=0;i<levels_;i++) {
+            uint64_t pos=levelMeta_[2*i]+reduce(mix(h,i),levelMeta_[2*i+1]);
+            if(bits_[pos/64] & (1ull<<(pos%64))) {
+                size_t idx=rank(pos);
+                return eq(idx)?idx:SIZE_MAX;
+            }
+        }
+        const uint64_t *p=std::lower_bound(fbHash_,fbHash_+fallback_,h);
+        for(;p!=fbHash_+fallback_ && *p==h;p++) {
+            size_t idx=setBits_+(p-fbHash_);
+            if(eq(idx)) {
+                return idx;
+            }
+        }
+        return SIZE_MAX;
+    }
+
+    inline size_t size() const {
+        return setBits_+fallback_;
+    }
+
+    /*
+     *构建: hashes可以有重复值(不同key的hash相同),输出序列化结果,
+     *order[i]为第i个hash的编号
+     */
+    static void Build(const std::vector<uint64_t> &hashes,std::vector<uint64_t> &out,std::vector<size_t> &order) {
+        std::vector<size_t> cur(hashes.size());
+        for(size_t i=0;i<cur.size();i++) {
+            cur[i]=i;
+        }
+        std::vector<uint64_t> meta;
+        std::vector<uint64_t> bits;
+        order.assign(hashes.size(),SIZE_MAX);
+        std::vector<std::pair<uint64_t,size_t> > placed;  //(全局位置,key下标)
+        uint64_t level=0;
+        for(;level<MPHF_MAX_LEVEL && !cur.empty();level++) {
+            uint64_t nbits=((uint64_t)(cur.size()*MPHF_GAMMA)+63)/64*64;
+            std::vector<uint64_t> seen(nbits/64,0),collide(nbits/64,0);
+            for(size_t i=0;i<cur.size();i++) {
+                uint64_t pos=reduce(mix(hashes[cur[i]],level),nbits);
+                uint64_t m=1ull<<(pos%64);
+                if(seen[pos/64] & m) {
+                    collide[pos/64]|=m;
+                }
+                seen[pos/64]|=m;
+            }
+            uint64_t start=bits.size()*64;
+            meta.push_back(start);
+            meta.push_back(nbits);
+            std::vector<size_t> next;
+            for(size_t i=0;i<cur.size();i++) {
+                uint64_t pos=reduce(mix(hashes[cur[i]],level),nbits);
+                if(collide[pos/64] & (1ull<<(pos%64))) {
+                    next.push_back(cur[i]);
+                }else {
+                    placed.push_back(std::make_pair(start+pos,cur[i]));
+                }
+            }
+            for(size_t w=0;w<seen.size();w++) {
+                bits.push_back(seen[w] & ~collide[w]);
+            }
+            cur.swap(next);
+        }
+        uint64_t total=bits.size()*64;
+        //编号就是rank,按位置排序后依次编号
+        std::sort(placed.begin(),placed.end());
+        for(size_t i=0;i<placed.size();i++) {
+            order[placed[i].second]=i;
+        }
+        std::sort(cur.begin(),cur.end(),[&hashes](size_t a,size_t b) {
+            return hashes[a]<hashes[b];
+        });
+        for(size_t i=0;i<cur.size();i++) {
+            order[cur[i]]=placed.size()+i;
+        }
+        out.clear();
+        out.push_back(level);
+        out.push_back(cur.size());
+        out.push_back(total);
+        out.push_back(placed.size());
+        out.insert(out.end(),meta.begin(),meta.end());
+        out.insert(out.end(),bits.begin(),bits.end());
+        uint64_t ones=0;
+        for(size_t w=0;w<bits.size();w++) {
+            if(0==w%8) {
+                out.push_back(ones);
+            }
+            ones+=__builtin_popcountll(bits[w]);
+        }
+        for(size_t i=0;i<cur.size();i++) {
+            out.push_back(hashes[cur[i]]);
+        }
+    }
+
+private:
+    static inline uint64_t rankWords(uint64_t total_bits) {
+        return (total_bits/64+7)/8;
+    }
+
+    static inline size_t serializedWords(uint64_t levels,uint64_t total_bits,uint64_t fallback) {
+        return 4+2*levels+total_bits/64+rankWords(total_bits)+fallback;
+    }
+
+    static inline uint64_t mix(uint64_t h,uint64_t level) {
+        return WyHasher::wymix(h^(level*0x9e3779b97f4a7c15ull),0xe7037ed1a0b428dbull);
+    }
+
+    //把64位的值映射到[0,n),比取模快
+    static inline uint64_t reduce(uint64_t x,uint64_t n) {
+        return (uint64_t)(((__uint128_t)x*n)>>64);
+    }
+
+    inline size_t rank(uint64_t pos) const {
+        uint64_t w=pos/64;
+        uint64_t r=ranks_[w/8];
+        for(uint64_t i=w/8*8;i<w;i++) {
+            r+=__builtin_popcountll(bits_[i]);
+        }
+        return r+__builtin_popcountll(bits_[w] & ((1ull<<(pos%64))-1));
+    }
+
+private:
+    const uint64_t *data_;
+    uint64_t levels_;
+    uint64_t fallback_;
+    uint64_t totalBits_;
+    uint64_t setBits_;
+    const uint64_t *levelMeta_;
+    const uint64_t *bits_;
+    const uint64_t *ranks_;
+    const uint64_t *fbHash_;
+};
+
+}
+
+#endif
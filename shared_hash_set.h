@@ -2,15 +2,27 @@
 #define SHARED_HASH_SET_H
 
 #include <iostream>
+#include <mutex>
+#include <shared_mutex>
 #include <set>
+#include <vector>
+#include <algorithm>
+#include <string_view>
 #include "type.h"
 #include "./basemmap/include/DataStorage.hpp"
+#include "./basemmap/include/KeyArena.h"
+#include "./basemmap/include/BloomFilter.h"
+#include "./basemmap/include/Warmup.h"
+#include "./basemmap/include/Journal.h"
+#include "./basemmap/include/Flusher.h"
 #include "shared_hash_fun.h"
+#include "shared_hash_swiss.h"
 
 /*基于mmap的hash_set实现，key只支持string,其他类型通过转换为唯一string来存储
  *通过HASH_SET_CONF(entry_name,max_query_len)宏来生成一个配置，
  *第一个参数是hash_entry的name，可以自定义随便起,多个的话不能重复
- *第二个参数是max_query_le,代表支持的query的最大长度
+ *第二个参数是max_query_le,代表entry中直接保存的key长度,更长的key在entry中保存前缀,
+ *  完整的key追加到key.data中,key的长度不受这个参数限制
   *
  *使用示例:
 
@@ -18,22 +30,28 @@
  *
  *string path="/home/test/mmap";
  *size_t bucket_num=10000000;
- *SharedHashSet<test> *shs=new SharedHashSet<test>(path,bucket_num);  //bucket_num可以省略，默认是10000000,
+ *SharedHashSet<test> *shs=new SharedHashSet<test>(path,M_READWRITE,bucket_num);  //bucket_num可以省略，默认是10000000,
  *shs->Init();
  *
+ *第二个模板参数是hash函数,默认是WyHasher,hash函数的ID和seed保存在bucket.data的文件头中
+ *
  *
  *
  *string key="test";
  *shs->insert(key);
  *
+ *key都可以用std::string或std::string_view传入,不会拷贝key,已有(const char*,长度)时用std::string_view(p,len)
  *查询方法：
  *bool ret=shs->has(key);
  *
+ *索引类型通过SharedHashOptions.index_type在创建时指定(见type.h),默认是IDX_CHAIN,
+ *IDX_SWISS使用开放寻址索引index.swiss(见shared_hash_swiss.h),entry的next不再使用
+ *
  *实现原理:
  *
  *
- *bucket   OOOOOOOOOOO     ##bucket 个数从创建后不发生改变,开始时尽量开大一点，可以减少hash冲突，
- *             \           ## 加快访问速度,后续可能加入rehash功能
+ *bucket   OOOOOOOOOOO     ##bucket 初始个数向上取整为2的幂,负载超过max_load_factor后按线性hash
+ *             \           ## 每次插入拆分几个bucket,bucket数组逐步翻倍,不需要停下来全量rehash
  *              \
  *               \
  *hash_entry OOOOOOOOOOOOOOOOOOOOOOOOOOOOOO   ##value in bucket，自动扩容
@@ -42,34 +60,140 @@
 
 namespace shm{
 
+/*
+ *hash/term_len放在entry头部,遍历冲突链时先比较hash和长度,不相等就不需要比较key
+ */
 #define HASH_SET_CONF(entry_name,max_query_len) \
 struct entry_name {                   \
+	uint64_t hash;                    \
 	size_t next;                      \
+	uint32_t term_len;                \
+	size_t term_off;                  \
     char term[max_query_len];         \
 	entry_name() {                    \
+		hash=0;                       \
 		next=SIZE_MAX;                \
+		term_len=0;                   \
+		term_off=SIZE_MAX;            \
 	}                                 \
 }
 
-template<typename ENTRY>
+template<typename ENTRY,typename HASH=WyHasher>
 class SharedHashSet {
 private:
 	CDataStorage<HashBucket> *hashBucket_; //hash数据入口
 	CDataStorage<ENTRY> *hashValue_;  //hash数据
+    SwissIndex *swiss_;  //开放寻址索引,只有IDX_SWISS时使用,此时hashBucket_为NULL
+    CKeyArena *keys_;  //超过term长度的key保存在这里
+    CBloomFilter *bloom_;  //bloom_fpr>0或者bloom.data已存在时使用
     ENTRY en;
+    std::vector<size_t> splitChain_;
+    uint64_t seed_;
+    CModeType mode_;
+    SharedHashOptions opt_;
+    string bkdatafile_;
+    string swissfile_;
+    string bloomfile_;
+    mutable atomic<size_t> probes_;
+    mutable atomic<size_t> fpSkipped_;
+    mutable atomic<size_t> fullCompares_;
+    bool concurrent_;
+    std::shared_mutex growLock_;  //并发写模式: 插入持有共享锁,扩容/拆分bucket持有独占锁
+    std::mutex keyLock_;
+    CWarmup *warmup_;
+    CJournal *journal_;
+    CFlusher *flusher_;
 
 public:
 	SharedHashSet(string &datapath,CModeType m=M_READWRITE,
-					  size_t bucket_num=10000000) {
+					  size_t bucket_num=10000000,uint64_t seed=DEFAULT_HASH_SEED,
+                      const SharedHashOptions &opt=SharedHashOptions())
+        :hashBucket_(NULL),swiss_(NULL),keys_(NULL),bloom_(NULL),seed_(seed),mode_(m),opt_(opt),
+        probes_(0),fpSkipped_(0),fullCompares_(0),concurrent_(false),warmup_(NULL),journal_(NULL),flusher_(NULL) {
 		string bkdatafile=datapath+"/bucket.data";
 		string bkbitfile = datapath+"/bucket.bit";
 		string hmdatafile=datapath+"/value.data";
 		string hmbitfile=datapath+"/value.bit";
-        hashBucket_ = new CDataStorage<HashBucket>(bkdatafile,bkbitfile,bucket_num,m,2);
+        bkdatafile_=bkdatafile;
+        swissfile_=datapath+"/index.swiss";
+        bloomfile_=datapath+"/bloom.data";
+        if(opt_.bloom_fpr>0 || IsExistFile(bloomfile_)) {
+            bloom_ = new CBloomFilter(bloomfile_,m);
+        }
+        keys_ = new CKeyArena(datapath+"/key.data",KEY_ARENA_INIT_SIZE,m);
+        if(IDX_SWISS==opt_.index_type) {
+            swiss_ = new SwissIndex(swissfile_,bucket_num,m);
+        }else {
+            hashBucket_ = new CDataStorage<HashBucket>(bkdatafile,bkbitfile,round_up_pow2(bucket_num),m,2);
+        }
 		hashValue_ = new CDataStorage<ENTRY>(hmdatafile,hmbitfile,bucket_num*3,m);
+        if(opt_.inline_occupancy) {
+            hashValue_->SetInlineTag(true);
+            if(NULL!=hashBucket_) {
+                hashBucket_->SetInlineTag(true);
+            }
+        }
+        if(opt_.address_reserve>0) {
+            keys_->SetReserveSize(opt_.address_reserve);
+            hashValue_->SetReserveSize(opt_.address_reserve);
+            if(NULL!=hashBucket_) {
+                hashBucket_->SetReserveSize(opt_.address_reserve);
+            }
+        }
+        CGrowthPolicy growth;
+        growth.m_factor=opt_.growth_factor;
+        growth.m_minstep=opt_.growth_min_step;
+        growth.m_maxstep=opt_.growth_max_step;
+        growth.m_fallocate=opt_.growth_fallocate;
+        keys_->SetGrowthPolicy(growth);
+        hashValue_->SetGrowthPolicy(growth);
+        if(NULL!=hashBucket_) {
+            hashBucket_->SetGrowthPolicy(growth);
+        }
+        CMapPolicy indexMap=mapPolicy(opt_.index_map);
+        keys_->SetMapPolicy(indexMap);
+        hashValue_->SetMapPolicy(indexMap);
+        if(NULL!=hashBucket_) {
+            hashBucket_->SetMapPolicy(indexMap);
+        }
+        if(NULL!=swiss_) {
+            swiss_->setMapPolicy(indexMap);
+        }
+        if(NULL!=bloom_) {
+            bloom_->SetMapPolicy(indexMap);
+        }
+        if(opt_.journal && M_READWRITE==mode_) {
+            journal_ = new CJournal(datapath+"/journal.data");
+            journal_->SetGroupCommit(opt_.journal_group_bytes,opt_.journal_group_ops);
+        }
+        if((opt_.flush_interval_ms>0 || opt_.flush_bytes>0) && M_READWRITE==mode_) {
+            flusher_ = new CFlusher();
+            keys_->SetFlusher(flusher_);
+            hashValue_->SetFlusher(flusher_);
+            if(NULL!=hashBucket_) {
+                hashBucket_->SetFlusher(flusher_);
+            }
+            if(NULL!=swiss_) {
+                swiss_->setFlusher(flusher_);
+            }
+        }
 	}
 
 	~SharedHashSet() {
+        if(NULL!=warmup_) {
+            delete warmup_;
+            warmup_=NULL;
+        }
+        if(NULL!=journal_) {
+            if(Checkpoint()) {
+                journal_->MarkClean();
+            }
+            delete journal_;
+            journal_=NULL;
+        }
+        if(NULL!=flusher_) {
+            flusher_->Stop();
+        }
 		if(NULL!=hashBucket_) {
 			delete hashBucket_;
 			hashBucket_ = NULL;
@@ -78,10 +202,39 @@ public:
 			delete hashValue_;
 			hashValue_=NULL;
 		}
+        if(NULL!=swiss_) {
+            delete swiss_;
+            swiss_=NULL;
+        }
+        if(NULL!=keys_) {
+            delete keys_;
+            keys_=NULL;
+        }
+        if(NULL!=bloom_) {
+            delete bloom_;
+            bloom_=NULL;
+        }
+        if(NULL!=flusher_) {
+            delete flusher_;
+            flusher_=NULL;
+        }
 	}
 
 	bool Init() {
-		if(!hashBucket_->Init()) {
+        //目录已经用另一种索引创建过时不能打开
+        if((NULL!=swiss_ && IsExistFile(bkdatafile_)) || (NULL==swiss_ && IsExistFile(swissfile_))) {
+            std::cout<<"index type mismatch!"<<std::endl;
+            return false;
+        }
+        if(!keys_->Init()) {
+            std::cout<<"init key arena failed!"<<std::endl;
+            return false;
+        }
+        if(NULL!=swiss_ && !swiss_->Init()) {
+            std::cout<<"init swiss index failed!"<<std::endl;
+            return false;
+        }
+		if(NULL!=hashBucket_ && !hashBucket_->Init()) {
 			std::cout<<"init hash bucket failed!"<<std::endl;
 			return false;
 		}
@@ -89,11 +242,76 @@ public:
 			std::cout<<"init hash value failed!"<<std::endl;
 			return false;
 		}
+        CMmapHeader* hd=NULL!=swiss_?swiss_->GetHeader():hashBucket_->GetDataHeader();
+        if(HASH_ID_NONE==hd->m_hashid) {
+            if(M_READ==mode_) {
+                std::cout<<"hash function not set in bucket header!"<<std::endl;
+                return false;
+            }
+            hd->m_hashid=HASH::ID;
+            hd->m_hashseed=seed_;
+        }else if(hd->m_hashid!=HASH::ID || hd->m_hashseed!=seed_) {
+            std::cout<<"hash function mismatch, file id="<<hd->m_hashid<<" seed="<<hd->m_hashseed
+                <<", expect id="<<HASH::ID<<" seed="<<seed_<<std::endl;
+            return false;
+        }
+        if(NULL!=hashBucket_ && 0==hd->m_bucketnum) {
+            if(M_READ==mode_) {
+                std::cout<<"bucket num not set in bucket header!"<<std::endl;
+                return false;
+            }
+            //文件中bucket的容量按页对齐过,取不超过容量的最大2的幂作为初始bucket个数
+            hd->m_bucketnum=round_down_pow2(hashBucket_->GetItemCapacity());
+        }
+        if(NULL!=bloom_ && !initBloom()) {
+            std::cout<<"init bloom filter failed!"<<std::endl;
+            return false;
+        }
+        if(NULL!=journal_ && !openJournal()) {
+            std::cout<<"open journal failed!"<<std::endl;
+            return false;
+        }
+        if(NULL!=flusher_) {
+            flusher_->Start(opt_.flush_interval_ms,opt_.flush_bytes);
+        }
 		return true;
 	}
 
+    /*
+     *打开后并行预热映射的文件,见WarmupPolicy和SharedHashMap::Init(const WarmupPolicy&)
+     */
+    bool Init(const WarmupPolicy &wp) {
+        if(!Init()) {
+            return false;
+        }
+        std::vector<CMapRegion> regions;
+        warmRegions(regions);
+        if(NULL==warmup_) {
+            warmup_=new CWarmup();
+        }
+        return warmup_->Start(regions,wp.threads,wp.chunk_size,wp.profile,wp.async && M_READ==mode_,wp.verbose);
+    }
+
+    inline bool isReady() const {
+        return NULL==warmup_ || warmup_->IsReady();
+    }
+
+    double warmupProgress() const {
+        return NULL==warmup_?1.0:warmup_->GetProgress();
+    }
+
+    double warmupSeconds() const {
+        return NULL==warmup_?0:warmup_->GetReadySeconds();
+    }
+
+    bool SaveWarmupProfile(const string &path) const {
+        std::vector<CMapRegion> regions;
+        warmRegions(regions);
+        return CWarmup::SaveProfile(path,regions);
+    }
+
 	inline bool empty() const {
-		return 0==hashBucket_->GetStorageItemCount();
+		return 0==hashValue_->GetStorageItemCount();
 	}
 
 	inline size_t hashSize() const {
@@ -101,41 +319,130 @@ public:
 	}
 
 	inline size_t bucketSize() const {
-		return hashBucket_->GetItemCapacity();
+		return NULL!=swiss_?swiss_->slotCapacity():bucketNum();
 	}
 
-	inline const ENTRY* getValue(const string &k,size_t &entry_offset) const{
-        size_t offset = getBucket(k);
-		const HashBucket* b=hashBucket_->FindDataPtr(offset);
-        //std::cout<<"bucket "<<offset<<std::endl;
-        if(NULL==b) {
-            //std::cout<<"bucket "<<offset<<" is null"<<std::endl;
+	inline const ENTRY* getValue(std::string_view k,size_t &entry_offset) const{
+        return findEntry(k.data(),k.size(),hashKey(k.data(),k.size()),entry_offset);
+    }
+
+    /*
+     *先比较entry中保存的hash和key长度,都相等时才做一次完整的key比较
+     *长key先比较term中的前缀,前缀相同再去key.data中比较完整的key
+     */
+    inline bool keyEqual(const ENTRY *v,const char *k,size_t len,uint64_t h) const {
+        if(!opt_.lookup_stats) {
+            return v->hash==h && v->term_len==len && keyBytesEqual(v,k,len);
+        }
+        probes_.fetch_add(1,std::memory_order_relaxed);
+        if(v->hash!=h || v->term_len!=len) {
+            fpSkipped_.fetch_add(1,std::memory_order_relaxed);
+            return false;
+        }
+        fullCompares_.fetch_add(1,std::memory_order_relaxed);
+        return keyBytesEqual(v,k,len);
+    }
+
+    //hash和长度已经相等,比较key的内容
+    inline bool keyBytesEqual(const ENTRY *v,const char *k,size_t len) const {
+        if(len<=sizeof(v->term)) {
+            return 0==memcmp(v->term,k,len);
+        }
+        if(0!=memcmp(v->term,k,sizeof(v->term))) {
+            return false;
+        }
+        const char *full=keys_->Get(v->term_off);
+        return NULL!=full && 0==memcmp(full,k,len);
+    }
+
+    /*
+     *entry中key的完整内容,短key直接在term中,长key在key.data中
+     */
+    inline string entryKey(const ENTRY *v) const {
+        if(v->term_len<=sizeof(v->term)) {
+            return string(v->term,v->term_len);
+        }
+        const char *full=keys_->Get(v->term_off);
+        return NULL==full?string(v->term,sizeof(v->term)):string(full,v->term_len);
+    }
+
+    /*
+     *填充新entry的key,返回false表示长key写入key.data失败
+     */
+    inline bool setEntryKey(ENTRY &entry,const char *k,size_t len,uint64_t h) {
+        entry.hash=h;
+        entry.term_len=len;
+        if(len<=sizeof(entry.term)) {
+            memcpy(entry.term,k,len);
+            return true;
+        }
+        memcpy(entry.term,k,sizeof(entry.term));
+        entry.term_off=keys_->Append(k,len);
+        return SIZE_MAX!=entry.term_off;
+    }
+
+	inline const ENTRY* findEntry(const char *k,size_t len,uint64_t h,size_t &entry_offset) const{
+        //bloom filter判断不存在时不用再访问索引
+        if(NULL!=bloom_ && !bloom_->MayContain(h)) {
             return NULL;
         }
-        //std::cout<<"get value found bucket "<<offset<<"header="<<b->header<<std::endl;
-		const ENTRY* v=hashValue_->FindDataPtr(b->header);
-        entry_offset=b->header;
-		while(v!=NULL) {
-            //std::cout<<"v->term="<<v->term<<" k="<<k<<std::endl;
-			if(v->term==k) {
-                //std::cout<<" get value found value offset "<<entry_offset<<std::endl;
-				break;
-            }else {
-                //std::cout<<"v->term="<<v->term<<" k="<<k<<" not equel"<<std::endl;
+        if(NULL!=swiss_) {
+            const ENTRY* v=NULL;
+            entry_offset=swiss_->find(h,[&](size_t pos) {
+                v=hashValue_->FindDataPtr(pos);
+                return NULL!=v && keyEqual(v,k,len,h);
+            });
+            return SIZE_MAX==entry_offset?NULL:v;
+        }
+        //写进程正在拆分bucket或者删除entry时,读进程可能走到别的链表上,从bucket头重新查
+        for(int retry=0;;retry++) {
+            size_t n=bucketNum();
+            size_t offset = bucketOf(h,n);
+            const HashBucket* b=hashBucket_->FindDataPtr(offset);
+            //std::cout<<"bucket "<<offset<<std::endl;
+            if(NULL==b) {
+                //std::cout<<"bucket "<<offset<<" is null"<<std::endl;
+                if(retry<SWMR_MAX_RETRY && n!=bucketNum()) {
+                    continue;
+                }
+                return NULL;
             }
-			if(v->next!=SIZE_MAX) {
-                entry_offset=v->next;
-                //std::cout<<"value offset "<<entry_offset<<std::endl;
-				v=hashValue_->FindDataPtr(v->next);
-			}else {
-				v=NULL;
-			}
-		}
-		return v;
+            //std::cout<<"get value found bucket "<<offset<<"header="<<b->header<<std::endl;
+            entry_offset=__atomic_load_n(&b->header,__ATOMIC_ACQUIRE);
+            const ENTRY* v=hashValue_->FindDataPtr(entry_offset);
+            bool restart=false;
+            while(v!=NULL) {
+                if(keyEqual(v,k,len,h)) {
+                    //std::cout<<" get value found value offset "<<entry_offset<<std::endl;
+                    return v;
+                }
+                size_t next=__atomic_load_n(&v->next,__ATOMIC_ACQUIRE);
+                if(retry<SWMR_MAX_RETRY && (bucketOf(v->hash,n)!=offset || n!=bucketNum())) {
+                    restart=true;
+                    break;
+                }
+                if(next!=SIZE_MAX) {
+                    entry_offset=next;
+                    //std::cout<<"value offset "<<entry_offset<<std::endl;
+                    v=hashValue_->FindDataPtr(next);
+                    //next指向的entry已经被删除
+                    restart=(NULL==v && retry<SWMR_MAX_RETRY);
+                }else {
+                    v=NULL;
+                }
+            }
+            //查找期间bucket被拆分过,按新的bucket个数再查一次
+            if(!restart && (retry>=SWMR_MAX_RETRY || n==bucketNum())) {
+                return NULL;
+            }
+        }
+	}
+
+	inline const ENTRY* getValueEntry(std::string_view k,size_t &entry_offset) const{
+        return getBucketEntry(getBucket(k),entry_offset);
 	}
 
-	inline const ENTRY* getValueEntry(const string &k,size_t &entry_offset) const{
-      size_t offset = getBucket(k);
+	inline const ENTRY* getBucketEntry(size_t offset,size_t &entry_offset) const{
 		const HashBucket* b=hashBucket_->FindDataPtr(offset);
         if(NULL==b) {
             return NULL;
@@ -145,38 +452,151 @@ public:
 		return v;
 	}
 
-	inline size_t getBucket(const string &k) const{
-		size_t hashCode = hash_code(k);
-		return hashCode % bucketSize();
+    inline uint64_t hashKey(const char *k,size_t len) const {
+        return HASH::hash(k,len,seed_);
+    }
+
+    /*
+     *当前使用的bucket个数,保存在bucket.data的文件头中,拆分bucket时加1
+     */
+    inline size_t bucketNum() const {
+        return NULL==hashBucket_?0:__atomic_load_n(&hashBucket_->GetDataHeader()->m_bucketnum,__ATOMIC_ACQUIRE);
+    }
+
+    /*
+     *线性hash定位bucket: n=base+split,低于split的bucket已经拆分过,需要多用一位hash
+     */
+    inline size_t bucketOf(uint64_t h) const {
+        return bucketOf(h,bucketNum());
+    }
+
+    static inline size_t bucketOf(uint64_t h,size_t n) {
+        size_t base=round_down_pow2(n);
+        size_t b=h & (base-1);
+        if(b < n-base) {
+            b=h & (2*base-1);
+        }
+        return b;
+    }
+
+    /*
+     *增量rehash,最多拆分steps个bucket,返回实际拆分的个数
+     *只对IDX_CHAIN有效,IDX_SWISS的索引自己会扩容
+     */
+    size_t rehashStep(size_t steps=1) {
+        size_t n=0;
+        if(NULL==hashBucket_ || M_READ==mode_ || concurrent_) {
+            return 0;
+        }
+        for(;n<steps;n++) {
+            if(!splitBucket()) {
+                break;
+            }
+        }
+        endWrite();
+        return n;
+    }
+
+	inline size_t getBucket(std::string_view k) const{
+		return bucketOf(hashKey(k.data(),k.size()));
 	}
 
-	inline int insert(const string &k) {
-        if(k.size() > sizeof(en.term)) {
+    /*
+     *打开了journal时成功后追加一条记录,见SharedHashMap::map
+     */
+	inline int insert(std::string_view k) {
+        int r=applyInsert(k);
+        endWrite();
+        if(0==r && NULL!=journal_ && !logJournal(JOURNAL_MAP,k.data(),k.size())) {
+            return -1;
+        }
+        return r;
+    }
+
+	inline int del(std::string_view key) {
+        int r=applyDel(key);
+        endWrite();
+        if(0==r && NULL!=journal_ && !logJournal(JOURNAL_DEL,key.data(),key.size())) {
+            return -1;
+        }
+        return r;
+    }
+
+    /*
+     *见SharedHashMap::Commit
+     */
+    bool Commit() {
+        return NULL!=journal_ && journal_->Commit();
+    }
+
+    /*
+     *见SharedHashMap::Checkpoint
+     */
+    bool Checkpoint() {
+        if(NULL==journal_ || !journal_->IsOpen()) {
+            return false;
+        }
+        return syncData() && journal_->Reset();
+    }
+
+    /*
+     *见SharedHashMap::writeSeq/FlushUntil
+     */
+    inline uint64_t writeSeq() const {
+        return NULL==flusher_?0:flusher_->GetWriteSeq();
+    }
+
+    bool FlushUntil(uint64_t seq) {
+        return NULL!=flusher_ && flusher_->FlushUntil(seq);
+    }
+
+    CFlushStats getFlushStats() const {
+        return NULL==flusher_?CFlushStats():flusher_->GetStats();
+    }
+
+    /*
+     *insert/del的实际修改,不写journal,重放journal时直接调用
+     */
+	inline int applyInsert(std::string_view k) {
+        if(k.size() > UINT32_MAX) {
                 return -1;
         }
-		size_t offset = getBucket(k);
+        if(concurrent_) {
+            return insertConcurrent(k);
+        }
+        uint64_t h=hashKey(k.data(),k.size());
+		size_t offset = bucketOf(h);
         size_t entry_offset;
-		const ENTRY* obj=getValue(k,entry_offset);
+		const ENTRY* obj=findEntry(k.data(),k.size(),h,entry_offset);
 		size_t tmp;
 		if(NULL==obj) {
 		    ENTRY entry;
-		    strcpy(entry.term,k.c_str());
+		    if(!setEntryKey(entry,k.data(),k.size(),h)) {
+		        return -1;
+		    }
 			if(STO_OK!=hashValue_->InsertData(entry,tmp)) {
 				//std::cout<<"insert  entry failed!"<<std::endl;
 				return -1;
+			}else if(NULL!=swiss_) {
+                if(!swiss_->insert(h,tmp)) {
+                    hashValue_->DeleteData(tmp);
+                    return -1;
+                }
+                addBloom(h);
+                return 0;
 			}else {
                 //std::cout<<"insert pos"<<tmp<<std::endl;
                 size_t tmp_entry;
-                obj=getValueEntry(k,tmp_entry);
+                obj=getBucketEntry(offset,tmp_entry);
                 //std::cout<<"insert entry data offset "<<tmp<<std::endl;
                 if(NULL==obj) {
-				    HashBucket bucket;
-				    bucket.header=tmp;
-				    if(STO_OK!=hashBucket_->InsertAndUpdateData(bucket,offset)) {
+				    if(!publishHeader(offset,tmp)) {
 					    //std::cout<<"insert and update bucket failed!"<<std::endl;
 					    return -1;
 				    }
                     //std::cout<<"upinsert bucket offset "<<offset<<" header "<<tmp<<std::endl;
+                    growBuckets();
+                    addBloom(h);
                     return 0;
                 }
 
@@ -192,12 +612,11 @@ public:
 					}
 				}
                 if(NULL!=pre) {
-                    ENTRY hve;
-                    hve=*pre;
-				    hve.next = tmp;
-                    hashValue_->UpdateData(hve,tmp_pos);
+                    publishNext(tmp_pos,tmp);
                     //std::cout<<"link "<<tmp_pos<<" -> "<<tmp<<std::endl;
                 }
+                growBuckets();
+                addBloom(h);
 		    }
         } else {
 			//key已经存在，直接不做插入
@@ -206,8 +625,51 @@ public:
         return 0;
 	}
 
-	inline int del(const string &key) {
-		size_t offset = getBucket(key);
+    /*
+     *并发写模式: BeginConcurrentInsert之后多个线程可以同时调用insert,见SharedHashMap::BeginConcurrentInsert
+     */
+    bool BeginConcurrentInsert() {
+        if(M_READ==mode_ || NULL==hashBucket_ || concurrent_ || NULL!=journal_) {
+            return false;
+        }
+        for(size_t i=0;i<bucketNum();i++) {
+            if(!hashBucket_->ChangeExist(i) && !publishHeader(i,SIZE_MAX)) {
+                return false;
+            }
+        }
+        hashValue_->BeginConcurrent();
+        concurrent_=true;
+        return true;
+    }
+
+    void EndConcurrentInsert() {
+        if(!concurrent_) {
+            return;
+        }
+        concurrent_=false;
+        hashValue_->EndConcurrent();
+        endWrite();
+        if(NULL!=bloom_ && bloom_->GetKeyCount()>bloom_->GetCapacity()) {
+            RebuildBloom();
+        }
+    }
+
+	inline int applyDel(std::string_view key) {
+        if(concurrent_) {
+            return -1;
+        }
+        uint64_t h=hashKey(key.data(),key.size());
+        if(NULL!=swiss_) {
+            size_t entry_offset;
+            if(NULL==findEntry(key.data(),key.size(),h,entry_offset)) {
+                return 1;
+            }
+            swiss_->erase(h,entry_offset);
+            hashValue_->DeleteData(entry_offset);
+            delBloom();
+            return 0;
+        }
+		size_t offset = bucketOf(h);
         const HashBucket* b=hashBucket_->FindDataPtr(offset);
         if(NULL==b) {
             return -1;
@@ -219,7 +681,7 @@ public:
 		size_t pre_offset=SIZE_MAX;
 		size_t after_offset=SIZE_MAX;
 		while(cur_pos!=SIZE_MAX && v!=NULL) {
-			if(v->term == key) {
+			if(keyEqual(v,key.data(),key.size(),h)) {
                 //std::cout<<"del pos "<<cur_pos<<std::endl;
 				//找到after元素
 			    if(v->next==SIZE_MAX) {
@@ -235,17 +697,15 @@ public:
 					hashBucket_->DeleteData(offset);
 				}
 				else if(pre==NULL && after!=NULL) {
-					//有hash冲突，删除的是第一个元素时,更新bucket header指向,删除当前元素
+					//有hash冲突，删除的是第一个元素时,先更新bucket header指向,再删除当前元素
+					publishHeader(offset,after_offset);
 					hashValue_->DeleteData(cur_pos);
-					HashBucket hb;
-					hb.header=after_offset;
-					hashBucket_->UpdateData(hb,offset);
 				}else if(pre!=NULL) {
-					//有hash冲突，并且删除的不是第一个元素时,更新pre->next到after
-					ENTRY entry=*pre;
-					entry.next=after_offset;
-					hashValue_->UpdateData(entry,pre_offset);
+					//有hash冲突，并且删除的不是第一个元素时,更新pre->next到after,再删除当前元素
+					publishNext(pre_offset,after_offset);
+					hashValue_->DeleteData(cur_pos);
 				}
+				delBloom();
 				return 0;
 			}
 			pre=v;
@@ -262,13 +722,36 @@ public:
         return float(hash_size)/float(bucket_len);
     }
 
-    void printOneStatus(const string &k) const {
+    /*
+     *查找统计: probes--比较过的entry数, fp_skipped--hash或长度不一致而跳过key比较的次数,
+     *full_compares--做了完整key比较的次数; 只在打开SharedHashOptions::lookup_stats时计数
+     */
+    HashLookupStats getLookupStats() const {
+        HashLookupStats st;
+        st.probes=probes_.load(std::memory_order_relaxed);
+        st.fp_skipped=fpSkipped_.load(std::memory_order_relaxed);
+        st.full_compares=fullCompares_.load(std::memory_order_relaxed);
+        return st;
+    }
+
+    void resetLookupStats() {
+        probes_.store(0);
+        fpSkipped_.store(0);
+        fullCompares_.store(0);
+    }
+
+    void printOneStatus(std::string_view k) const {
 		size_t bucket_len=bucketSize();
 		size_t hash_size=hashSize();
         std::cout<<"######################shared hash set one status#########################"<<std::endl;
 		std::cout<<"Load factor="<<float(hash_size)/float(bucket_len)<<std::endl;
         size_t i=getBucket(k);
         std::cout<<"key = "<<k<<std::endl;
+        if(NULL!=swiss_) {
+            size_t pos;
+            std::cout<<"swiss entry "<<(NULL==getValue(k,pos)?string("not found"):std::to_string(pos))<<std::endl;
+            return;
+        }
 		const HashBucket* b=hashBucket_->FindDataPtr(i);
 		if(NULL==b) {
             std::cout<<"no bucket "<<i<<std::endl;
@@ -279,7 +762,7 @@ public:
 		const ENTRY* v=hashValue_->FindDataPtr(b->header);
         std::set<size_t> offsets;
 		while(v!=NULL) {
-			std::cout<<"->"<<cur_pos<<","<<v->term<<","<<v->next;
+			std::cout<<"->"<<cur_pos<<","<<entryKey(v)<<","<<v->next;
             cur_pos=v->next;
             if(offsets.find(cur_pos)!=offsets.end()) {
                 std::cout<<"error found circle link";
@@ -299,9 +782,39 @@ public:
     void printStatus() const{
 		size_t bucket_len=bucketSize();
 		size_t hash_size=hashSize();
+        HashLookupStats st=getLookupStats();
         std::cout<<"######################shared hash set status#########################"<<std::endl;
 		std::cout<<"Load factor="<<float(hash_size)/float(bucket_len)<<std::endl;
-		for(size_t i=0;i<bucket_len;i++) {
+        std::cout<<"probes="<<st.probes<<" fp_skipped="<<st.fp_skipped
+            <<" full_compares="<<st.full_compares<<std::endl;
+        printExtendStats("value.data",hashValue_->GetExtendStats());
+        if(NULL!=hashBucket_) {
+            printExtendStats("bucket.data",hashBucket_->GetExtendStats());
+        }
+        printExtendStats("key.data",keys_->GetExtendStats());
+        printFragment("value.data",getFragmentation());
+        if(NULL!=journal_) {
+            std::cout<<"journal size="<<journal_->GetFileSize()<<" pending="<<journal_->GetPendingBytes()
+                <<" seq="<<journal_->GetSeq()<<" synced="<<journal_->GetSyncedSeq()
+                <<" commits="<<journal_->GetCommitCount()<<" checkpoints="<<journal_->GetCheckpointCount()<<std::endl;
+        }
+        if(NULL!=flusher_) {
+            CFlushStats fs=flusher_->GetStats();
+            std::cout<<"flush rounds="<<fs.m_rounds<<" bytes="<<fs.m_bytes<<" seconds="<<fs.m_seconds
+                <<" failures="<<fs.m_failures<<" write_seq="<<flusher_->GetWriteSeq()
+                <<" flushed_seq="<<flusher_->GetFlushedSeq()<<std::endl;
+        }
+        if(NULL!=bloom_) {
+            std::cout<<"bloom keys="<<bloom_->GetKeyCount()<<" deleted="<<bloom_->GetDeletedCount()
+                <<" capacity="<<bloom_->GetCapacity()<<" fpr="<<bloom_->GetFpr()<<std::endl;
+        }
+        if(NULL!=swiss_) {
+            std::cout<<"swiss index size="<<swiss_->size()<<" slots="<<swiss_->slotCapacity()
+                <<" tombstones="<<swiss_->tombstones()<<std::endl;
+            std::cout<<"#####################################################################"<<std::endl;
+            return;
+        }
+		for(size_t i=hashBucket_->NextUsedPos(0);i<bucket_len;i=hashBucket_->NextUsedPos(i+1)) {
 			const HashBucket* b=hashBucket_->FindDataPtr(i);
 			if(NULL==b) {
 				continue;
@@ -311,7 +824,7 @@ public:
 			const ENTRY* v=hashValue_->FindDataPtr(b->header);
             std::set<size_t> offsets;
 			while(v!=NULL) {
-				std::cout<<"->"<<cur_pos<<","<<v->term<<","<<v->next;
+				std::cout<<"->"<<cur_pos<<","<<entryKey(v)<<","<<v->next;
                 cur_pos=v->next;
                 if(offsets.find(cur_pos)!=offsets.end()) {
                     std::cout<<" error found circle link ,continue";
@@ -329,7 +842,7 @@ public:
         std::cout<<"#####################################################################"<<std::endl;
     }
 
-	inline bool has(const string &key) const{
+	inline bool has(std::string_view key) const{
         size_t offset;
         const ENTRY *value= getValue(key,offset);
 		if(NULL==value) {
@@ -337,6 +850,765 @@ public:
 		}
         return true;
     }
+
+    /*
+     *分步查询(手写的协程):lookup算hash并预取bucket,之后每次step访问上一步预取的数据,
+     *发出下一步的prefetch后就返回.调用方同时推进多个查询,或者在两次step之间做别的事情,
+     *内存访问的延迟就能互相重叠
+     *
+     *HashLookup<E> l[8];
+     *for(i...) l[i]=shm->lookup(keys[i]);
+     *while(还有没结束的) { for(i...) shm->step(l[i]); ...其他工作... }
+     *
+     *key只保存string_view,查询结束前调用方要保证key的内存有效
+     */
+    inline HashLookup<ENTRY> lookup(std::string_view key) const {
+        HashLookup<ENTRY> l;
+        l.key=key;
+        l.hash=hashKey(key.data(),key.size());
+        l.stage=LOOKUP_BUCKET;
+        if(NULL!=bloom_ && !bloom_->MayContain(l.hash)) {
+            l.stage=LOOKUP_DONE;
+            return l;
+        }
+        if(NULL!=swiss_) {
+            swiss_->prefetch(l.hash);
+        }else {
+            l.pos=bucketOf(l.hash);
+            hashBucket_->Prefetch(l.pos);
+        }
+        return l;
+    }
+
+    /*
+     *推进一步,返回查询是否已经结束
+     */
+    inline bool step(HashLookup<ENTRY> &l) const {
+        if(LOOKUP_BUCKET==l.stage) {
+            if(NULL!=swiss_) {
+                //先按完整hash找候选entry,key的比较放到下一步
+                l.pos=swiss_->find(l.hash,[](size_t) {
+                    return true;
+                });
+            }else {
+                const HashBucket* b=hashBucket_->FindDataPtr(l.pos);
+                l.pos=NULL==b?SIZE_MAX:b->header;
+            }
+            if(SIZE_MAX==l.pos) {
+                l.stage=LOOKUP_DONE;
+                return true;
+            }
+            hashValue_->Prefetch(l.pos);
+            l.stage=LOOKUP_ENTRY;
+            return false;
+        }
+        if(LOOKUP_ENTRY==l.stage) {
+            const ENTRY* v=hashValue_->FindDataPtr(l.pos);
+            if(NULL!=swiss_) {
+                //64位hash相同但key不同的情况很少,退回到普通查找
+                if(NULL!=v && !keyEqual(v,l.key.data(),l.key.size(),l.hash)) {
+                    v=findEntry(l.key.data(),l.key.size(),l.hash,l.pos);
+                }
+            }else if(NULL==v || bucketOf(v->hash)!=bucketOf(l.hash)) {
+                //写进程正在修改冲突链,退回到findEntry,由它负责重试
+                v=findEntry(l.key.data(),l.key.size(),l.hash,l.pos);
+            }else if(!keyEqual(v,l.key.data(),l.key.size(),l.hash)) {
+                //链表的下一个entry,预取后停在这一步
+                l.pos=__atomic_load_n(&v->next,__ATOMIC_ACQUIRE);
+                if(SIZE_MAX!=l.pos) {
+                    hashValue_->Prefetch(l.pos);
+                    return false;
+                }
+                v=NULL;
+            }
+            l.entry=v;
+            l.stage=LOOKUP_DONE;
+            return true;
+        }
+        return true;
+    }
+
+    /*
+     *按索引遍历所有key,f(const string &key)
+     *用于导出,遍历期间不能有写操作
+     */
+    template<typename F>
+    void forEach(F f) const {
+        if(NULL!=swiss_) {
+            swiss_->forEach([&](uint64_t,size_t pos) {
+                const ENTRY* v=hashValue_->FindDataPtr(pos);
+                if(NULL!=v) {
+                    f(entryKey(v));
+                }
+            });
+            return;
+        }
+        size_t bucket_len=bucketNum();
+        for(size_t i=0;i<bucket_len;i++) {
+            size_t tmp;
+            const ENTRY* v=getBucketEntry(i,tmp);
+            while(NULL!=v) {
+                f(entryKey(v));
+                v=SIZE_MAX==v->next?NULL:hashValue_->FindDataPtr(v->next);
+            }
+        }
+    }
+
+    /*
+     *按索引中的key重建bloom filter,容量取当前key个数的2倍; fpr<=0表示沿用原来的误判率
+     *bloom.data不存在时会新建,可以用来给已有目录加上bloom filter
+     */
+    bool RebuildBloom(double fpr=0) {
+        if(M_READ==mode_ || concurrent_) {
+            return false;
+        }
+        if(NULL==bloom_) {
+            bloom_=new CBloomFilter(bloomfile_,mode_);
+            bloom_->SetMapPolicy(mapPolicy(opt_.index_map));
+            if(!bloom_->Init(hashSize()*2,fpr)) {
+                delete bloom_;
+                bloom_=NULL;
+                return false;
+            }
+        }
+        if(!bloom_->Reset(hashSize()*2,fpr)) {
+            return false;
+        }
+        if(NULL!=swiss_) {
+            swiss_->forEach([&](uint64_t h,size_t) {
+                bloom_->Add(h);
+            });
+            return bloom_->Publish();
+        }
+        size_t bucket_len=bucketNum();
+        for(size_t i=0;i<bucket_len;i++) {
+            size_t tmp;
+            const ENTRY* v=getBucketEntry(i,tmp);
+            while(NULL!=v) {
+                bloom_->Add(v->hash);
+                v=SIZE_MAX==v->next?NULL:hashValue_->FindDataPtr(v->next);
+            }
+        }
+        return bloom_->Publish();
+    }
+
+    /*
+     *value.data当前的碎片情况
+     */
+    FragmentInfo getFragmentation() const {
+        FragmentInfo f;
+        f.capacity=hashValue_->GetItemCapacity();
+        f.items=hashValue_->CountItems();
+        f.used_end=hashValue_->GetUsedEnd();
+        return f;
+    }
+
+    /*
+     *在线整理value.data: 回收走不到的entry,后部的entry搬到前面的空位,见SharedHashMap::compact.
+     *结果中只有value.data的部分
+     */
+    CompactStats compact(size_t max_moves=SIZE_MAX) {
+        CompactStats st;
+        st.before_value=getFragmentation();
+        if(M_READ==mode_ || concurrent_ || (NULL!=journal_ && !Checkpoint())) {
+            st.after_value=st.before_value;
+            return st;
+        }
+        size_t budget=max_moves;
+        st.done=compactEntries(st,budget);
+        endWrite();
+        if(NULL!=journal_ && !Checkpoint()) {
+            std::cout<<"journal checkpoint failed!"<<std::endl;
+        }
+        st.after_value=getFragmentation();
+        return st;
+    }
+
+    /*
+     *compact完成后截短value.data,调用时机见SharedHashMap::shrink
+     */
+    bool shrink() {
+        if(M_READ==mode_ || concurrent_) {
+            return false;
+        }
+        bool ok=hashValue_->Shrink();
+        endWrite();
+        return ok;
+    }
+
+    inline uint64_t hashSeed() const {
+        return seed_;
+    }
+
+    /*
+     *一写多读时读进程定期调用,写进程扩容文件或者重建swiss索引/bloom filter之后重新映射,
+     *见SharedHashMap::Refresh
+     */
+    bool Refresh() {
+        if(NULL!=warmup_ && 0==opt_.address_reserve) {
+            warmup_->Wait();
+        }
+        bool ok=hashValue_->Refresh();
+        if(NULL!=hashBucket_) {
+            ok=hashBucket_->Refresh() && ok;
+        }
+        if(NULL!=keys_) {
+            ok=keys_->Refresh() && ok;
+        }
+        if(NULL!=swiss_) {
+            ok=swiss_->Refresh() && ok;
+        }
+        if(NULL!=bloom_) {
+            ok=bloom_->Refresh() && ok;
+        }
+        return ok;
+    }
+
+    /*
+     *批量查询,每MULTI_LOOKUP_BATCH个key一批,按阶段交错执行:
+     *先算所有key的hash并预取bucket,再统一读bucket预取entry,最后比较key,
+     *一个线程同时有多个内存访问在路上,内存里的表比逐个has快几倍
+     */
+    std::vector<bool> multi_has(const std::vector<std::string_view> &keys) const {
+        std::vector<bool> res(keys.size(),false);
+        HashLookup<ENTRY> l[MULTI_LOOKUP_BATCH];
+        for(size_t start=0;start<keys.size();start+=MULTI_LOOKUP_BATCH) {
+            size_t n=std::min(MULTI_LOOKUP_BATCH,keys.size()-start);
+            for(size_t i=0;i<n;i++) {
+                l[i]=lookup(keys[start+i]);
+            }
+            for(bool all_done=false;!all_done;) {
+                all_done=true;
+                for(size_t i=0;i<n;i++) {
+                    if(!l[i].done() && !step(l[i])) {
+                        all_done=false;
+                    }
+                }
+            }
+            for(size_t i=0;i<n;i++) {
+                res[start+i]=NULL!=l[i].entry;
+            }
+        }
+        return res;
+    }
+private:
+    /*
+     *打开bloom filter; 目录里已经有数据但还没有bloom.data时从索引重建
+     *只读打开时bloom.data不存在就不使用
+     */
+    bool initBloom() {
+        bool exist=IsExistFile(bloomfile_);
+        if(!exist && M_READ==mode_) {
+            delete bloom_;
+            bloom_=NULL;
+            return true;
+        }
+        if(!bloom_->Init(hashSize()*2,opt_.bloom_fpr)) {
+            return false;
+        }
+        return exist || empty() || RebuildBloom();
+    }
+
+    /*
+     *新key写入bloom filter,key个数超过设计容量后误判率会明显升高,按新的大小重建
+     */
+    inline void addBloom(uint64_t h) {
+        if(NULL!=bloom_) {
+            bloom_->Add(h);
+            if(!concurrent_ && bloom_->GetKeyCount()>bloom_->GetCapacity()) {
+                RebuildBloom();
+            }
+        }
+    }
+
+    /*
+     *bloom filter不能删除bit,只记录删除次数,删除的key太多时重建
+     */
+    inline void delBloom() {
+        if(NULL!=bloom_) {
+            bloom_->MarkDeleted();
+            if(bloom_->GetDeletedCount()*2>bloom_->GetCapacity()) {
+                RebuildBloom();
+            }
+        }
+    }
+
+    template<typename F>
+    int concurrentRun(F f,size_t keylen) {
+        while(true) {
+            int ret;
+            {
+                std::shared_lock<std::shared_mutex> lk(growLock_);
+                ret=f();
+            }
+            if(RETRY_EXTEND!=ret) {
+                return ret;
+            }
+            std::unique_lock<std::shared_mutex> lk(growLock_);
+            if(!hashValue_->EnsureCapacity() || (keylen>0 && !keys_->Reserve(keylen))) {
+                return -1;
+            }
+        }
+    }
+
+    /*
+     *新entry CAS到链表头,CAS失败时只检查其他线程新挂上的那一段,见SharedHashMap::mapConcurrent
+     */
+    int insertConcurrent(std::string_view k) {
+        uint64_t h=hashKey(k.data(),k.size());
+        size_t keylen=k.size()>sizeof(en.term)?k.size():0;
+        size_t tmp=SIZE_MAX;
+        bool added=false;
+        int ret=concurrentRun([&]() {
+            HashBucket* b=hashBucket_->FindWritePtr(bucketOf(h));
+            if(NULL==b) {
+                return -1;
+            }
+            size_t head=__atomic_load_n(&b->header,__ATOMIC_ACQUIRE);
+            size_t pos=chainFind(head,SIZE_MAX,k,h);
+            while(SIZE_MAX==pos) {
+                if(SIZE_MAX==tmp) {
+                    ENTRY entry;
+                    if(keylen>0) {
+                        std::lock_guard<std::mutex> kl(keyLock_);
+                        if(!keys_->HasRoom(keylen)) {
+                            return RETRY_EXTEND;
+                        }
+                        if(!setEntryKey(entry,k.data(),k.size(),h)) {
+                            return -1;
+                        }
+                    }else {
+                        setEntryKey(entry,k.data(),k.size(),h);
+                    }
+                    STO_RESULT r=hashValue_->InsertData(entry,tmp);
+                    if(STO_OK!=r) {
+                        tmp=SIZE_MAX;
+                        return STO_FULL==r?RETRY_EXTEND:-1;
+                    }
+                }
+                ENTRY* e=hashValue_->FindWritePtr(tmp);
+                __atomic_store_n(&e->next,head,__ATOMIC_RELAXED);
+                size_t scanned=head;
+                if(__atomic_compare_exchange_n(&b->header,&head,tmp,false,__ATOMIC_RELEASE,__ATOMIC_ACQUIRE)) {
+                    tmp=SIZE_MAX;
+                    added=true;
+                    return 0;
+                }
+                pos=chainFind(head,scanned,k,h);
+            }
+            //其他线程已经插入了同一个key
+            if(SIZE_MAX!=tmp) {
+                hashValue_->DeleteData(tmp);
+                tmp=SIZE_MAX;
+            }
+            return 0;
+        },keylen);
+        if(added) {
+            addBloom(h);
+            growConcurrent();
+        }
+        return ret;
+    }
+
+    inline size_t chainFind(size_t from,size_t stop,std::string_view k,uint64_t h) const {
+        while(from!=stop && SIZE_MAX!=from) {
+            const ENTRY* v=hashValue_->FindDataPtr(from);
+            if(NULL==v) {
+                break;
+            }
+            if(v->hash==h && v->term_len==k.size() && keyBytesEqual(v,k.data(),k.size())) {
+                return from;
+            }
+            from=__atomic_load_n(&v->next,__ATOMIC_ACQUIRE);
+        }
+        return SIZE_MAX;
+    }
+
+    void growConcurrent() {
+        if(opt_.max_load_factor<=0) {
+            return;
+        }
+        {
+            //bucket.data的文件头可能正在被其他线程扩容重新映射,持有共享锁读
+            std::shared_lock<std::shared_mutex> rk(growLock_);
+            if(hashSize() <= opt_.max_load_factor*bucketNum()) {
+                return;
+            }
+        }
+        std::unique_lock<std::shared_mutex> lk(growLock_);
+        while(hashSize() > opt_.max_load_factor*bucketNum()/2) {
+            if(!splitBucket()) {
+                break;
+            }
+        }
+    }
+
+    inline void endWrite() {
+        if(NULL!=flusher_ && !concurrent_) {
+            flusher_->EndWrite();
+        }
+    }
+
+    bool syncData() {
+        if(NULL!=flusher_) {
+            hashValue_->SaveToDisk();
+            keys_->SaveToDisk();
+            if(NULL!=hashBucket_) {
+                hashBucket_->SaveToDisk();
+            }
+            return flusher_->FlushUntil(flusher_->EndWrite());
+        }
+        bool ok=STO_OK==hashValue_->Sync() && keys_->Sync();
+        if(NULL!=hashBucket_) {
+            ok=ok && STO_OK==hashBucket_->Sync();
+        }
+        return ok;
+    }
+
+    bool logJournal(uint8_t type,const void *data,size_t len) {
+        if(0==journal_->Append(type,data,len)) {
+            std::cout<<"write journal failed!"<<std::endl;
+            return false;
+        }
+        if(journal_->GetFileSize()>=opt_.journal_checkpoint_size && !Checkpoint()) {
+            std::cout<<"journal checkpoint failed!"<<std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool openJournal() {
+        if(NULL!=swiss_) {
+            std::cout<<"journal only supports IDX_CHAIN!"<<std::endl;
+            return false;
+        }
+        if(!journal_->Open()) {
+            return false;
+        }
+        if(journal_->IsDirty() && !recoverJournal()) {
+            return false;
+        }
+        return journal_->MarkDirty();
+    }
+
+    /*
+     *见SharedHashMap::recoverJournal
+     */
+    bool recoverJournal() {
+        size_t swept=repairChains();
+        journal_->BeginReplay();
+        uint8_t type;
+        string payload;
+        size_t n=0;
+        while(journal_->ReadNext(type,payload)) {
+            if(JOURNAL_MAP==type) {
+                if(applyInsert(payload)<0) {
+                    std::cout<<"replay journal record "<<n<<" failed!"<<std::endl;
+                    return false;
+                }
+            }else if(JOURNAL_DEL==type) {
+                applyDel(payload);
+            }
+            n++;
+        }
+        if(NULL!=bloom_ && !RebuildBloom()) {
+            return false;
+        }
+        std::cout<<"journal recovered: swept "<<swept<<" entries, replayed "<<n<<" records"<<std::endl;
+        return Checkpoint();
+    }
+
+    /*
+     *崩溃恢复: 走不到的entry删除,走到的entry重新挂到所属bucket,见SharedHashMap::repairChains
+     */
+    size_t repairChains() {
+        //文件头中的数据个数可能不准,先按bit位重新计数,删除时才不会减成负数
+        hashBucket_->RecountItems();
+        hashValue_->RecountItems();
+        size_t n=hashBucket_->GetDataHeader()->m_bucketnum;
+        size_t cap=hashValue_->GetItemCapacity();
+        std::vector<bool> reached(cap,false);
+        std::vector<size_t> live;
+        for(size_t i=hashBucket_->NextUsedPos(0);i!=SIZE_MAX;i=hashBucket_->NextUsedPos(i+1)) {
+            const HashBucket* b=hashBucket_->FindDataPtr(i);
+            if(NULL==b) {
+                continue;
+            }
+            size_t cur=b->header;
+            while(cur<cap && !reached[cur]) {
+                const ENTRY* v=hashValue_->FindDataPtr(cur);
+                if(NULL==v) {
+                    break;
+                }
+                reached[cur]=true;
+                live.push_back(cur);
+                cur=v->next;
+            }
+            hashBucket_->DeleteData(i);
+        }
+        size_t swept=0;
+        for(size_t pos=hashValue_->NextUsedPos(0);pos<cap;pos=hashValue_->NextUsedPos(pos+1)) {
+            if(!reached[pos]) {
+                hashValue_->DeleteData(pos);
+                swept++;
+            }
+        }
+        for(size_t i=0;i<live.size();i++) {
+            ENTRY* e=hashValue_->FindWritePtr(live[i]);
+            size_t b=bucketOf(e->hash,n);
+            const HashBucket* hb=hashBucket_->FindDataPtr(b);
+            e->next=NULL==hb?SIZE_MAX:hb->header;
+            publishHeader(b,live[i]);
+        }
+        hashValue_->RecountItems();
+        hashBucket_->RecountItems();
+        return swept;
+    }
+
+    void warmRegions(std::vector<CMapRegion> &regions) const {
+        if(NULL!=hashBucket_) {
+            hashBucket_->GetMapRegions(regions);
+        }
+        if(NULL!=swiss_) {
+            regions.push_back(swiss_->mapRegion());
+        }
+        hashValue_->GetMapRegions(regions);
+        regions.push_back(keys_->GetMapRegion());
+    }
+
+    static CMapPolicy mapPolicy(const MapOptions &o) {
+        CMapPolicy p;
+        p.m_populate=o.populate;
+        p.m_hugepage=o.hugepage;
+        p.m_willneed=o.willneed;
+        p.m_advice=ADVICE_RANDOM==o.advice?MADV_RANDOM:(ADVICE_SEQUENTIAL==o.advice?MADV_SEQUENTIAL:MADV_NORMAL);
+        return p;
+    }
+
+    static void printFragment(const char *name,const FragmentInfo &f) {
+        std::cout<<name<<" capacity="<<f.capacity<<" items="<<f.items<<" used_end="<<f.used_end
+            <<" holes="<<f.holes()<<std::endl;
+    }
+
+    /*
+     *pos的entry拷贝到最前面的空位,返回新的位置,见SharedHashMap::moveSlot
+     */
+    size_t moveEntry(size_t pos) {
+        const ENTRY* p=hashValue_->FindDataPtr(pos);
+        if(NULL==p) {
+            return SIZE_MAX;
+        }
+        ENTRY v;
+        memcpy((void*)&v,(const void*)p,sizeof(ENTRY));
+        size_t np=SIZE_MAX;
+        if(STO_OK!=hashValue_->InsertData(v,np)) {
+            return SIZE_MAX;
+        }
+        if(np>=pos) {
+            hashValue_->DeleteData(np);
+            return SIZE_MAX;
+        }
+        return np;
+    }
+
+    /*
+     *见SharedHashMap::compactEntries
+     */
+    bool compactEntries(CompactStats &st,size_t &budget) {
+        size_t cap=hashValue_->GetItemCapacity();
+        std::vector<bool> reached(cap,false);
+        if(NULL!=swiss_) {
+            swiss_->forEach([&](uint64_t,size_t pos) {
+                if(pos<cap) {
+                    reached[pos]=true;
+                }
+            });
+        }else {
+            size_t n=bucketNum();
+            for(size_t i=hashBucket_->NextUsedPos(0);i<n;i=hashBucket_->NextUsedPos(i+1)) {
+                const HashBucket* b=hashBucket_->FindDataPtr(i);
+                for(size_t cur=NULL==b?SIZE_MAX:b->header;cur<cap && !reached[cur];) {
+                    const ENTRY* v=hashValue_->FindDataPtr(cur);
+                    if(NULL==v) {
+                        break;
+                    }
+                    reached[cur]=true;
+                    cur=v->next;
+                }
+            }
+        }
+        for(size_t pos=hashValue_->NextUsedPos(0);pos<cap;pos=hashValue_->NextUsedPos(pos+1)) {
+            if(!reached[pos]) {
+                hashValue_->DeleteData(pos);
+                st.freed_entries++;
+            }
+        }
+        size_t live=hashValue_->CountItems();
+        if(NULL!=swiss_) {
+            std::vector<std::pair<uint64_t,size_t> > tail;
+            swiss_->forEach([&](uint64_t h,size_t pos) {
+                if(pos>=live) {
+                    tail.push_back(std::make_pair(h,pos));
+                }
+            });
+            for(size_t i=0;i<tail.size();i++) {
+                if(0==budget) {
+                    return false;
+                }
+                size_t np=moveEntry(tail[i].second);
+                if(SIZE_MAX==np) {
+                    return false;
+                }
+                swiss_->update(tail[i].first,tail[i].second,np);
+                hashValue_->DeleteData(tail[i].second);
+                budget--;
+                st.moved_entries++;
+            }
+            return true;
+        }
+        size_t n=bucketNum();
+        for(size_t i=hashBucket_->NextUsedPos(0);i<n;i=hashBucket_->NextUsedPos(i+1)) {
+            const HashBucket* b=hashBucket_->FindDataPtr(i);
+            size_t pre=SIZE_MAX;
+            for(size_t cur=NULL==b?SIZE_MAX:b->header;cur!=SIZE_MAX;) {
+                if(cur>=live) {
+                    if(0==budget) {
+                        return false;
+                    }
+                    size_t np=moveEntry(cur);
+                    if(SIZE_MAX==np) {
+                        return false;
+                    }
+                    if(SIZE_MAX==pre) {
+                        publishHeader(i,np);
+                    }else {
+                        publishNext(pre,np);
+                    }
+                    hashValue_->DeleteData(cur);
+                    budget--;
+                    st.moved_entries++;
+                    cur=np;
+                }
+                const ENTRY* v=hashValue_->FindDataPtr(cur);
+                if(NULL==v) {
+                    break;
+                }
+                pre=cur;
+                cur=v->next;
+            }
+        }
+        return true;
+    }
+
+    //扩容次数/字节数/耗时,用来调整扩容策略(SharedHashOptions.growth_*)
+    static void printExtendStats(const char *name,const CExtendStats &st) {
+        std::cout<<name<<" extends="<<st.m_count<<" bytes="<<st.m_bytes<<" seconds="<<st.m_seconds<<std::endl;
+    }
+
+    /*
+     *一写多读: 新entry完整写入后再用release原子写挂到链表上,见SharedHashMap::publishNext
+     */
+    inline void publishNext(size_t pos,size_t next) {
+        ENTRY* e=hashValue_->FindWritePtr(pos);
+        if(NULL!=e) {
+            __atomic_store_n(&e->next,next,__ATOMIC_RELEASE);
+        }
+    }
+
+    inline bool publishHeader(size_t bucket,size_t header) {
+        HashBucket* b=hashBucket_->FindWritePtr(bucket);
+        if(NULL!=b) {
+            __atomic_store_n(&b->header,header,__ATOMIC_RELEASE);
+            return true;
+        }
+        HashBucket hb;
+        hb.header=header;
+        return STO_OK==hashBucket_->InsertAndUpdateData(hb,bucket);
+    }
+
+    /*
+     *负载超过max_load_factor时,每次插入顺带拆分几个bucket,不会集中做一次全量rehash
+     */
+    inline void growBuckets() {
+        if(NULL==hashBucket_ || opt_.max_load_factor<=0) {
+            return;
+        }
+        for(size_t i=0;i<opt_.rehash_steps;i++) {
+            if(hashSize() <= opt_.max_load_factor*bucketNum() || !splitBucket()) {
+                break;
+            }
+        }
+    }
+
+    /*
+     *拆分第split个bucket(lo)到lo和lo+base(hi)两个bucket,按hash的第log2(base)位区分
+     *
+     *顺序保证任何时刻从bucket头开始遍历都能找到属于这个bucket的所有entry:
+     *1.hi的header指向链表中第一个属于hi的entry(后面的entry都还在同一个链表上)
+     *2.bucket个数加1,之后新的查找按新的bucket个数定位
+     *3.lo的header指向第一个属于lo的entry
+     *4.从前往后把每个entry的next指向同一类的下一个entry,
+     *  前面的entry已经跳过了当前entry,所以另一类的entry不会因为当前entry的修改而断开
+     */
+    bool splitBucket() {
+        CMmapHeader* hd=hashBucket_->GetDataHeader();
+        size_t n=hd->m_bucketnum;
+        size_t base=round_down_pow2(n);
+        size_t lo=n-base;
+        size_t hi=n;
+        if(hi>=hashBucket_->GetItemCapacity() && !hashBucket_->ExtendSize()) {
+            return false;
+        }
+        hd=hashBucket_->GetDataHeader();
+        splitChain_.clear();
+        size_t firstLo=SIZE_MAX;
+        size_t firstHi=SIZE_MAX;
+        const HashBucket* b=hashBucket_->FindDataPtr(lo);
+        size_t cur=NULL==b?SIZE_MAX:b->header;
+        while(cur!=SIZE_MAX) {
+            const ENTRY* v=hashValue_->FindDataPtr(cur);
+            if(NULL==v) {
+                break;
+            }
+            splitChain_.push_back(cur);
+            if(v->hash & base) {
+                if(SIZE_MAX==firstHi) {
+                    firstHi=cur;
+                }
+            }else if(SIZE_MAX==firstLo) {
+                firstLo=cur;
+            }
+            cur=v->next;
+        }
+        //并发写模式下空bucket也要保留(header为SIZE_MAX),插入时只CAS链表头
+        if((SIZE_MAX!=firstHi || concurrent_) && !publishHeader(hi,firstHi)) {
+            return false;
+        }
+        __atomic_store_n(&hd->m_bucketnum,n+1,__ATOMIC_RELEASE);
+        if(SIZE_MAX==firstHi) {
+            return true;
+        }
+        if(SIZE_MAX==firstLo && !concurrent_) {
+            hashBucket_->DeleteData(lo);
+        }else if(b->header!=firstLo) {
+            publishHeader(lo,firstLo);
+        }
+        for(size_t i=0;i<splitChain_.size();i++) {
+            const ENTRY* v=hashValue_->FindDataPtr(splitChain_[i]);
+            uint64_t cls=v->hash & base;
+            size_t next=SIZE_MAX;
+            for(size_t j=i+1;j<splitChain_.size();j++) {
+                if((hashValue_->FindDataPtr(splitChain_[j])->hash & base)==cls) {
+                    next=splitChain_[j];
+                    break;
+                }
+            }
+            if(v->next!=next) {
+                publishNext(splitChain_[i],next);
+            }
+        }
+        return true;
+    }
 };
 }
 #endif
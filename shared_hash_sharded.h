@@ -0,0 +1,387 @@
+#ifndef SHARED_HASH_SHARDED_H
+#define SHARED_HASH_SHARDED_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <string_view>
+#include "shared_hash_map.h"
+
+/*分片的SharedHashMap
+ *
+ *一个SharedHashMap只有一个写入位置,扩容时整个文件重新mmap,写多了以后单个写进程是瓶颈.
+ *ShardedHashMap把key按hash分到N个子目录,每个子目录是一个完整的SharedHashMap(shard_0 ... shard_N-1),
+ *不同分片的文件互相独立,可以由不同线程同时写,单个文件也更小,扩容的代价更低.
+ *
+ *目录结构:
+ *datapath/shard.meta   分片个数和hash seed,用不同的N打开已有目录时Init()失败
+ *datapath/shard_i/     第i个分片,可以直接用SharedHashMap打开
+ *
+ *使用方法:
+ *ShardedHashMap<entry,A,16> *shm=new ShardedHashMap<entry,A,16>(path,M_READWRITE,bucket_num);
+ *shm->Init();
+ *size_t offset=shm->insertObj(key,a);   //doc保存在key所在的分片中
+ *shm->map(key,offset,score);
+ *DocResult<A> docs=shm->get(key);
+ *
+ *doc的offset只在同一个分片内有效,一个doc要挂到多个key下时,只能用于shardOf相同的key,
+ *不同分片的key需要各自insertObj
+ *
+ *线程: 同一个分片同时只能有一个写线程,不同分片可以并发写(见bulkMap/parallelShards);
+ *读接口都是const的,可以多线程同时查询
+ *
+ *分片用hash重新混合后的高位选择,不直接用原始hash的高位:分片内bloom filter按hash高位选块、
+ *swiss索引用最高7位做tag,直接用高位分片会让同一个分片的key这些位都相同
+ */
+
+namespace shm{
+
+const uint64_t SHARD_META_MAGIC = 0x5348415244454431ull;  //"SHARDED1"
+const uint64_t SHARD_MIX = 0x8ebc6af09c88c6e3ull;
+
+/*
+ *bulkMap的一条输入
+ */
+template<typename V>
+struct ShardedDoc {
+    std::string_view key;
+    V doc;
+    uint8_t score;
+};
+
+template<typename ENTRY,typename V,size_t N,typename HASH=WyHasher>
+class ShardedHashMap {
+public:
+    typedef SharedHashMap<ENTRY,V,HASH> Shard;
+
+    /*
+     *    bucket_num -- 所有分片的bucket总数,平均分到每个分片
+     *    其他参数同SharedHashMap,所有分片使用相同的seed和options
+     */
+    ShardedHashMap(string &datapath,CModeType m=M_READWRITE,
+            size_t bucket_num=10000000,uint64_t seed=DEFAULT_HASH_SEED,
+            const SharedHashOptions &opt=SharedHashOptions())
+        :datapath_(datapath),seed_(seed),mode_(m),opt_(opt) {
+        static_assert(N>0,"ShardedHashMap needs at least one shard");
+        size_t per=(bucket_num+N-1)/N;
+        for(size_t i=0;i<N;i++) {
+            dirs_[i]=shardPath(datapath,i);
+            shards_[i]=new Shard(dirs_[i],m,per>0?per:1,seed,opt);
+        }
+    }
+
+    ~ShardedHashMap() {
+        for(size_t i=0;i<N;i++) {
+            if(NULL!=shards_[i]) {
+                delete shards_[i];
+                shards_[i]=NULL;
+            }
+        }
+    }
+
+    /*
+     *读写模式下目录不存在时自动创建;各分片并行Init
+     */
+    bool Init() {
+        if(!checkMeta()) {
+            return false;
+        }
+        return parallelShards([](size_t i,Shard &s) {
+            if(!s.Init()) {
+                printf("init shard %zu failed\n",i);
+                return false;
+            }
+            return true;
+        });
+    }
+
+    /*
+     *key所在的分片
+     */
+    inline size_t shardOf(std::string_view k) const {
+        return shardOfHash(HASH::hash(k.data(),k.size(),seed_));
+    }
+
+    static inline size_t shardOfHash(uint64_t h) {
+        return (size_t)(((__uint128_t)WyHasher::wymix(h,SHARD_MIX)*N)>>64);
+    }
+
+    inline Shard& shard(size_t i) {
+        return *shards_[i];
+    }
+
+    inline const Shard& shard(size_t i) const {
+        return *shards_[i];
+    }
+
+    static constexpr size_t shardNum() {
+        return N;
+    }
+
+    /*
+     *doc写到key所在的分片,返回值只能用于同一分片的key
+     */
+    inline size_t insertObj(std::string_view k,V &v) {
+        return shards_[shardOf(k)]->insertObj(v);
+    }
+
+    inline int map(std::string_view k,size_t obj_offset,uint8_t score=0) {
+        return shards_[shardOf(k)]->map(k,obj_offset,score);
+    }
+
+    inline int del(std::string_view k) {
+        return shards_[shardOf(k)]->del(k);
+    }
+
+    inline DocResult<V> get(std::string_view k,size_t topn=SIZE_MAX) const {
+        return shards_[shardOf(k)]->get(k,topn);
+    }
+
+    inline DocView<V> getView(std::string_view k,size_t topn=SIZE_MAX) const {
+        return shards_[shardOf(k)]->getView(k,topn);
+    }
+
+    inline bool has(std::string_view k) const {
+        return shards_[shardOf(k)]->has(k);
+    }
+
+    /*
+     *按分片分组后调用各分片的multi_get,结果和keys一一对应
+     */
+    std::vector<DocView<V> > multi_get(const std::vector<std::string_view> &keys,size_t topn=SIZE_MAX) const {
+        std::vector<DocView<V> > res(keys.size());
+        std::vector<std::string_view> group[N];
+        std::vector<size_t> idx[N];
+        for(size_t i=0;i<keys.size();i++) {
+            size_t s=shardOf(keys[i]);
+            group[s].push_back(keys[i]);
+            idx[s].push_back(i);
+        }
+        for(size_t s=0;s<N;s++) {
+            if(group[s].empty()) {
+                continue;
+            }
+            std::vector<DocView<V> > r=shards_[s]->multi_get(group[s],topn);
+            for(size_t i=0;i<r.size();i++) {
+                res[idx[s][i]]=r[i];
+            }
+        }
+        return res;
+    }
+
+    /*
+     *批量写入: 按分片分组,每个分片一个写线程,doc写到key所在的分片再map
+     *threads为0时每个分片一个线程;返回成功map的条数
+     */
+    size_t bulkMap(const std::vector<ShardedDoc<V> > &docs,size_t threads=0) {
+        std::vector<size_t> idx[N];
+        for(size_t i=0;i<docs.size();i++) {
+            idx[shardOf(docs[i].key)].push_back(i);
+        }
+        std::atomic<size_t> ok(0);
+        parallelShards([&](size_t s,Shard &m) {
+            size_t n=0;
+            for(size_t i=0;i<idx[s].size();i++) {
+                const ShardedDoc<V> &d=docs[idx[s][i]];
+                V v=d.doc;
+                size_t off=m.insertObj(v);
+                if(SIZE_MAX!=off && 0==m.map(d.key,off,d.score)) {
+                    n++;
+                }
+            }
+            ok.fetch_add(n);
+            return true;
+        },threads);
+        return ok.load();
+    }
+
+    /*
+     *f(size_t shard_index,Shard &shard)在多个线程中执行,每个分片只被一个线程处理,
+     *f返回false表示失败;threads为0时每个分片一个线程
+     */
+    template<typename F>
+    bool parallelShards(F f,size_t threads=0) {
+        if(0==threads || threads>N) {
+            threads=N;
+        }
+        std::atomic<size_t> next(0);
+        std::atomic<bool> ok(true);
+        auto worker=[&]() {
+            for(size_t i=next.fetch_add(1);i<N;i=next.fetch_add(1)) {
+                if(!f(i,*shards_[i])) {
+                    ok.store(false);
+                }
+            }
+        };
+        std::vector<std::thread> ts;
+        for(size_t t=1;t<threads;t++) {
+            ts.push_back(std::thread(worker));
+        }
+        worker();
+        for(size_t t=0;t<ts.size();t++) {
+            ts[t].join();
+        }
+        return ok.load();
+    }
+
+    /*
+     *离线重新分片: 把当前目录的内容写到dstpath下的M个分片中,当前对象只读
+     *每个目标分片一个线程,依次扫描所有源分片,只取落在自己分片的key;
+     *同一个源doc挂在多个key下时,在同一个目标分片中只写一份
+     */
+    template<size_t M>
+    bool Reshard(string &dstpath,size_t bucket_num,const SharedHashOptions &opt,size_t threads=0) const {
+        ShardedHashMap<ENTRY,V,M,HASH> dst(dstpath,M_READWRITE,bucket_num,seed_,opt);
+        if(!dst.Init()) {
+            return false;
+        }
+        return dst.parallelShards([&](size_t j,typename ShardedHashMap<ENTRY,V,M,HASH>::Shard &d) {
+            std::unordered_map<const V*,size_t> copied;
+            bool ok=true;
+            for(size_t i=0;i<N && ok;i++) {
+                shards_[i]->forEach([&](const string &key,DocView<V> view) {
+                    if(!ok || dst.shardOf(key)!=j) {
+                        return;
+                    }
+                    for(typename DocView<V>::iterator it=view.begin();it!=view.end();++it) {
+                        typename std::unordered_map<const V*,size_t>::iterator c=copied.find(it->doc);
+                        size_t off;
+                        if(c!=copied.end()) {
+                            off=c->second;
+                        }else {
+                            V v=*it->doc;
+                            off=d.insertObj(v);
+                            if(SIZE_MAX==off) {
+                                ok=false;
+                                return;
+                            }
+                            copied[it->doc]=off;
+                        }
+                        if(d.map(key,off,it->score)<0) {
+                            ok=false;
+                            return;
+                        }
+                    }
+                });
+            }
+            return ok;
+        },threads);
+    }
+
+    inline size_t hashSize() const {
+        size_t n=0;
+        for(size_t i=0;i<N;i++) {
+            n+=shards_[i]->hashSize();
+        }
+        return n;
+    }
+
+    inline size_t docSize() const {
+        size_t n=0;
+        for(size_t i=0;i<N;i++) {
+            n+=shards_[i]->docSize();
+        }
+        return n;
+    }
+
+    /*
+     *读进程定期调用,见SharedHashMap::Refresh
+     */
+    bool Refresh() {
+        bool ok=true;
+        for(size_t i=0;i<N;i++) {
+            ok=shards_[i]->Refresh() && ok;
+        }
+        return ok;
+    }
+
+    /*
+     *遍历所有分片,f同SharedHashMap::forEach
+     */
+    template<typename F>
+    void forEach(F f) const {
+        for(size_t i=0;i<N;i++) {
+            shards_[i]->forEach(f);
+        }
+    }
+
+    void printStatus() const {
+        std::cout<<"######################sharded hash map status#########################"<<std::endl;
+        for(size_t i=0;i<N;i++) {
+            std::cout<<"shard "<<i<<" keys="<<shards_[i]->hashSize()<<" docs="<<shards_[i]->docSize()
+                <<" load factor="<<shards_[i]->getLoadFactor()<<std::endl;
+        }
+        std::cout<<"####################################################################"<<std::endl;
+    }
+
+private:
+    static string shardPath(const string &datapath,size_t i) {
+        return datapath+"/shard_"+std::to_string(i);
+    }
+
+    static bool makeDir(const string &path) {
+        return 0==mkdir(path.c_str(),0755) || EEXIST==errno;
+    }
+
+    /*
+     *shard.meta: [magic][分片个数][seed]
+     */
+    bool checkMeta() {
+        string metafile=datapath_+"/shard.meta";
+        uint64_t meta[3]={0,0,0};
+        FILE *fp=fopen(metafile.c_str(),"rb");
+        if(NULL!=fp) {
+            size_t n=fread(meta,sizeof(meta),1,fp);
+            fclose(fp);
+            if(1!=n || SHARD_META_MAGIC!=meta[0]) {
+                printf("invalid shard meta %s\n",metafile.c_str());
+                return false;
+            }
+            if(N!=meta[1] || seed_!=meta[2]) {
+                printf("shard meta mismatch: shards %lu seed %lu\n",(unsigned long)meta[1],(unsigned long)meta[2]);
+                return false;
+            }
+            return true;
+        }
+        if(M_READ==mode_) {
+            printf("shard meta %s not exist\n",metafile.c_str());
+            return false;
+        }
+        if(!makeDir(datapath_)) {
+            printf("mkdir %s failed\n",datapath_.c_str());
+            return false;
+        }
+        for(size_t i=0;i<N;i++) {
+            if(!makeDir(dirs_[i])) {
+                printf("mkdir %s failed\n",dirs_[i].c_str());
+                return false;
+            }
+        }
+        meta[0]=SHARD_META_MAGIC;
+        meta[1]=N;
+        meta[2]=seed_;
+        fp=fopen(metafile.c_str(),"wb");
+        if(NULL==fp) {
+            return false;
+        }
+        bool ok=1==fwrite(meta,sizeof(meta),1,fp);
+        return 0==fclose(fp) && ok;
+    }
+
+private:
+    string datapath_;
+    string dirs_[N];
+    Shard *shards_[N];
+    uint64_t seed_;
+    CModeType mode_;
+    SharedHashOptions opt_;
+};
+
+}
+
+#endif
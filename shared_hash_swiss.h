@@ -0,0 +1,442 @@
+#ifndef SHARED_HASH_SWISS_H
+#define SHARED_HASH_SWISS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "./basemmap/include/BaseMmap.h"
+#include "shared_hash_fun.h"
+
+/*基于mmap的开放寻址索引(SwissTable的分组探测方式),作为bucket->链表结构之外的另一种索引
+ *
+ *文件只有一个(index.swiss),按group组织,每个group包含16个控制字节和16个slot:
+ *
+ *item0     [SwissMeta]                    ##元信息: group个数,key个数,tombstone个数
+ *group1    [ctrl x16][slot x16]           ##slot保存 hash + entry在value.data中的下标
+ *group2    [ctrl x16][slot x16]
+ *...
+ *
+ *控制字节: SWISS_EMPTY--空  SWISS_DELETED--已删除  0~127--hash的高7位
+ *查找时用SSE2一次比较一个group的16个控制字节,匹配上的slot再比较完整hash,
+ *通常只需要访问控制字节和slot所在的一两个cache line
+ *
+ *group个数是2的幂,探测按group做三角探测; 使用率(含tombstone)超过7/8时重建文件
+ */
+
+namespace shm{
+
+const int SWISS_GROUP_WIDTH = 16;
+const int8_t SWISS_EMPTY = -128;
+const int8_t SWISS_DELETED = -2;
+const uint64_t SWISS_MAGIC = 0x5353494d53574953ull;
+
+struct SwissSlot {
+    uint64_t hash;
+    size_t pos;
+};
+
+struct SwissGroup {
+    int8_t ctrl[SWISS_GROUP_WIDTH];
+    SwissSlot slot[SWISS_GROUP_WIDTH];
+};
+
+/*
+ * generation -- 每次重建文件加1,其他进程可以据此判断是否需要重新打开
+ * retired -- 文件已经被重建后的新文件替换,还映射着这个文件的读进程需要Refresh
+ */
+struct SwissMeta {
+    uint64_t magic;
+    size_t group_num;
+    size_t size;
+    size_t tombstones;
+    size_t generation;
+    size_t retired;
+};
+
+class SwissIndex {
+public:
+    /*
+     *    filename -- 索引文件名
+     *    capacity -- 预计的key个数,用来确定初始的group个数
+     */
+    SwissIndex(const string &filename,size_t capacity,CModeType m=M_READWRITE)
+        :filename_(filename),mode_(m),flusher_(NULL),mmap_(NULL),meta_(NULL),groups_(NULL),mask_(0) {
+        initGroups_=round_up_pow2(capacity/SWISS_GROUP_WIDTH);
+    }
+
+    ~SwissIndex() {
+        close();
+    }
+
+    bool Init() {
+        return open(filename_,initGroups_);
+    }
+
+    //当前的映射范围,用于预热
+    CMapRegion mapRegion() const {
+        if(NULL==mmap_) {
+            CMapRegion r;
+            r.m_addr=NULL;
+            r.m_len=0;
+            return r;
+        }
+        return mmap_->GetRegion("index.swiss");
+    }
+
+    //Init之前调用,索引文件(包括rehash后的新文件)的映射方式
+    void setMapPolicy(const CMapPolicy &policy) {
+        mapPolicy_=policy;
+    }
+
+    //Init之前调用,索引文件由flusher在后台写回,只写回修改过的slot/控制字节/元信息所在的范围
+    void setFlusher(CFlusher *flusher) {
+        flusher_=flusher;
+    }
+
+    /*
+     *查找hash对应的entry下标,eq(pos)用来确认pos位置的entry是否就是要找的key
+     *找不到返回SIZE_MAX
+     */
+    template<typename EQ>
+    inline size_t find(uint64_t h,EQ eq) const {
+        int8_t h2=ctrlByte(h);
+        size_t g=h & mask_;
+        for(size_t i=0;i<=mask_;i++) {
+            const SwissGroup *grp=groups_+g;
+            uint32_t m=matchByte(grp->ctrl,h2);
+            //控制字节是在slot写完之后才发布的
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            while(m!=0) {
+                const SwissSlot &s=grp->slot[__builtin_ctz(m)];
+                if(s.hash==h && eq(s.pos)) {
+                    return s.pos;
+                }
+                m&=m-1;
+            }
+            if(matchByte(grp->ctrl,SWISS_EMPTY)!=0) {
+                return SIZE_MAX;
+            }
+            g=(g+i+1) & mask_;
+        }
+        return SIZE_MAX;
+    }
+
+    /*
+     *预取h对应的第一个group的控制字节
+     */
+    inline void prefetch(uint64_t h) const {
+        if(NULL!=groups_) {
+            __builtin_prefetch(groups_+(h & mask_));
+        }
+    }
+
+    /*
+     *插入hash->pos,调用方保证key不存在
+     */
+    bool insert(uint64_t h,size_t pos) {
+        if(M_READ==mode_ || NULL==meta_) {
+            return false;
+        }
+        if((meta_->size+meta_->tombstones+1)*8 > slotCapacity()*7) {
+            //tombstone较多时原大小重建即可,否则扩大一倍
+            size_t groups=meta_->group_num;
+            if((meta_->size+1)*2 > slotCapacity()) {
+                groups*=2;
+            }
+            if(!rehash(groups)) {
+                return false;
+            }
+        }
+        int8_t h2=ctrlByte(h);
+        size_t g=h & mask_;
+        for(size_t i=0;i<=mask_;i++) {
+            SwissGroup *grp=groups_+g;
+            uint32_t m=matchFree(grp->ctrl);
+            if(m!=0) {
+                int j=__builtin_ctz(m);
+                if(SWISS_DELETED==grp->ctrl[j]) {
+                    meta_->tombstones--;
+                }
+                grp->slot[j].hash=h;
+                grp->slot[j].pos=pos;
+                //先写slot再发布控制字节,读进程看到h2时slot一定是完整的
+                __atomic_store_n(&grp->ctrl[j],h2,__ATOMIC_RELEASE);
+                meta_->size++;
+                markDirty(&grp->ctrl[j],1);
+                markDirty(&grp->slot[j],sizeof(SwissSlot));
+                markDirty(meta_,sizeof(SwissMeta));
+                return true;
+            }
+            g=(g+i+1) & mask_;
+        }
+        return false;
+    }
+
+    /*
+     *删除hash->pos,
+     *所在group中还有空位时,说明探测从来没有越过这个group,可以直接置为EMPTY
+     */
+    bool erase(uint64_t h,size_t pos) {
+        if(M_READ==mode_ || NULL==meta_) {
+            return false;
+        }
+        SwissGroup *grp;
+        int j;
+        if(!locate(h,pos,grp,j)) {
+            return false;
+        }
+        if(matchByte(grp->ctrl,SWISS_EMPTY)!=0) {
+            __atomic_store_n(&grp->ctrl[j],SWISS_EMPTY,__ATOMIC_RELEASE);
+        }else {
+            __atomic_store_n(&grp->ctrl[j],SWISS_DELETED,__ATOMIC_RELEASE);
+            meta_->tombstones++;
+        }
+        meta_->size--;
+        markDirty(&grp->ctrl[j],1);
+        markDirty(meta_,sizeof(SwissMeta));
+        return true;
+    }
+
+    /*
+     *entry被移动到新的下标时更新索引
+     */
+    bool update(uint64_t h,size_t oldpos,size_t newpos) {
+        if(M_READ==mode_ || NULL==meta_) {
+            return false;
+        }
+        SwissGroup *grp;
+        int j;
+        if(!locate(h,oldpos,grp,j)) {
+            return false;
+        }
+        __atomic_store_n(&grp->slot[j].pos,newpos,__ATOMIC_RELEASE);
+        markDirty(&grp->slot[j],sizeof(SwissSlot));
+        return true;
+    }
+
+    /*
+     *遍历所有的 hash->pos
+     */
+    template<typename F>
+    void forEach(F f) const {
+        for(size_t g=0;g<=mask_ && NULL!=groups_;g++) {
+            const SwissGroup *grp=groups_+g;
+            for(int j=0;j<SWISS_GROUP_WIDTH;j++) {
+                if(grp->ctrl[j]>=0) {
+                    f(grp->slot[j].hash,grp->slot[j].pos);
+                }
+            }
+        }
+    }
+
+    inline size_t size() const {
+        return NULL==meta_?0:meta_->size;
+    }
+
+    inline size_t tombstones() const {
+        return NULL==meta_?0:meta_->tombstones;
+    }
+
+    inline size_t slotCapacity() const {
+        return NULL==meta_?0:meta_->group_num*SWISS_GROUP_WIDTH;
+    }
+
+    inline CMmapHeader* GetHeader() {
+        return NULL==mmap_?NULL:mmap_->GetHeaderaddr();
+    }
+
+    bool SaveToDisk() {
+        return NULL!=mmap_ && mmap_->SaveAllModifyData();
+    }
+
+    /*
+     *读进程使用: 写进程重建过索引(旧文件被标记为retired)时重新打开
+     */
+    bool Refresh() {
+        if(NULL==meta_ || 0==meta_->retired) {
+            return true;
+        }
+        return open(filename_,initGroups_);
+    }
+
+private:
+    //slot/控制字节/元信息是直接通过指针修改的,改完记录范围(没有flusher时什么都不做)
+    inline void markDirty(const void *p,size_t len) {
+        mmap_->MarkDirty((const char*)p-(const char*)mmap_->GetvmAddr(),len);
+    }
+
+    static inline int8_t ctrlByte(uint64_t h) {
+        return (int8_t)(h>>57);
+    }
+
+    static inline uint32_t matchByte(const int8_t *ctrl,int8_t b) {
+#ifdef __SSE2__
+        __m128i c=_mm_loadu_si128((const __m128i*)ctrl);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(b),c));
+#else
+        uint32_t m=0;
+        for(int i=0;i<SWISS_GROUP_WIDTH;i++) {
+            if(ctrl[i]==b) {
+                m|=1u<<i;
+            }
+        }
+        return m;
+#endif
+    }
+
+    //EMPTY和DELETED的最高位都是1
+    static inline uint32_t matchFree(const int8_t *ctrl) {
+#ifdef __SSE2__
+        return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+#else
+        uint32_t m=0;
+        for(int i=0;i<SWISS_GROUP_WIDTH;i++) {
+            if(ctrl[i]<0) {
+                m|=1u<<i;
+            }
+        }
+        return m;
+#endif
+    }
+
+    bool locate(uint64_t h,size_t pos,SwissGroup *&grp,int &j) {
+        int8_t h2=ctrlByte(h);
+        size_t g=h & mask_;
+        for(size_t i=0;i<=mask_;i++) {
+            grp=groups_+g;
+            uint32_t m=matchByte(grp->ctrl,h2);
+            while(m!=0) {
+                j=__builtin_ctz(m);
+                if(grp->slot[j].hash==h && grp->slot[j].pos==pos) {
+                    return true;
+                }
+                m&=m-1;
+            }
+            if(matchByte(grp->ctrl,SWISS_EMPTY)!=0) {
+                return false;
+            }
+            g=(g+i+1) & mask_;
+        }
+        return false;
+    }
+
+    /*
+     *打开(不存在则创建)索引文件,第0个item保存元信息
+     */
+    bool open(const string &fname,size_t group_num) {
+        CBaseMmap *mm=new CBaseMmap(sizeof(SwissGroup),group_num+1,EXTEND_SIZE,mode_);
+        mm->SetMapPolicy(mapPolicy_);
+        if(NULL!=flusher_) {
+            mm->SetFlusher(flusher_);
+        }
+        if(!mm->SampleMapFile(fname)) {
+            delete mm;
+            return false;
+        }
+        SwissMeta *meta=(SwissMeta*)mm->GetDataStartAddr();
+        if(SWISS_MAGIC!=meta->magic) {
+            if(M_READ==mode_) {
+                delete mm;
+                return false;
+            }
+            SwissGroup *groups=(SwissGroup*)((char*)meta+sizeof(SwissGroup));
+            for(size_t g=0;g<group_num;g++) {
+                memset(groups[g].ctrl,SWISS_EMPTY,sizeof(groups[g].ctrl));
+            }
+            meta->group_num=group_num;
+            meta->size=0;
+            meta->tombstones=0;
+            meta->generation=0;
+            meta->retired=0;
+            meta->magic=SWISS_MAGIC;
+            mm->MarkDirty((char*)meta-(char*)mm->GetvmAddr(),(group_num+1)*sizeof(SwissGroup));
+        }
+        close();
+        mmap_=mm;
+        meta_=meta;
+        groups_=(SwissGroup*)((char*)meta+sizeof(SwissGroup));
+        mask_=meta->group_num-1;
+        return true;
+    }
+
+    void close() {
+        if(NULL!=mmap_) {
+            delete mmap_;
+            mmap_=NULL;
+            meta_=NULL;
+            groups_=NULL;
+            mask_=0;
+        }
+    }
+
+    /*
+     *按group_num个group重建索引: 写临时文件,完成后rename覆盖原文件再重新打开
+     */
+    bool rehash(size_t group_num) {
+        string tmpfile=filename_+".tmp";
+        unlink(tmpfile.c_str());
+        CBaseMmap *mm=new CBaseMmap(sizeof(SwissGroup),group_num+1,EXTEND_SIZE,mode_);
+        mm->SetMapPolicy(mapPolicy_);
+        if(!mm->SampleMapFile(tmpfile)) {
+            delete mm;
+            return false;
+        }
+        SwissMeta *meta=(SwissMeta*)mm->GetDataStartAddr();
+        SwissGroup *groups=(SwissGroup*)((char*)meta+sizeof(SwissGroup));
+        for(size_t g=0;g<group_num;g++) {
+            memset(groups[g].ctrl,SWISS_EMPTY,sizeof(groups[g].ctrl));
+        }
+        size_t mask=group_num-1;
+        size_t n=0;
+        forEach([&](uint64_t h,size_t pos) {
+            size_t g=h & mask;
+            for(size_t i=0;i<=mask;i++) {
+                uint32_t m=matchFree(groups[g].ctrl);
+                if(m!=0) {
+                    int j=__builtin_ctz(m);
+                    groups[g].slot[j].hash=h;
+                    groups[g].slot[j].pos=pos;
+                    groups[g].ctrl[j]=ctrlByte(h);
+                    n++;
+                    break;
+                }
+                g=(g+i+1) & mask;
+            }
+        });
+        meta->group_num=group_num;
+        meta->size=n;
+        meta->tombstones=0;
+        meta->generation=meta_->generation+1;
+        meta->retired=0;
+        meta->magic=SWISS_MAGIC;
+        mm->GetHeaderaddr()->m_hashid=mmap_->GetHeaderaddr()->m_hashid;
+        mm->GetHeaderaddr()->m_hashseed=mmap_->GetHeaderaddr()->m_hashseed;
+        delete mm;
+        if(0!=rename(tmpfile.c_str(),filename_.c_str())) {
+            printf("rename swiss index %s failed\n",tmpfile.c_str());
+            return false;
+        }
+        //其他进程还映射着旧文件,标记之后它们Refresh时会重新打开
+        meta_->retired=1;
+        markDirty(meta_,sizeof(SwissMeta));
+        return open(filename_,group_num);
+    }
+
+private:
+    string filename_;
+    CModeType mode_;
+    size_t initGroups_;
+    CMapPolicy mapPolicy_;
+    CFlusher *flusher_;
+    CBaseMmap *mmap_;
+    SwissMeta *meta_;
+    SwissGroup *groups_;
+    size_t mask_;
+};
+
+}
+
+#endif
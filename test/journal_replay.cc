@@ -0,0 +1,134 @@
+/*
+ *journal重放doc的测试: 写进程insertObj/map并Commit后异常退出(不关闭,journal保留),
+ *然后模拟.bit已经落盘而doc.data的内容没有落盘: bit位保持为1,把doc的字节改掉,
+ *再打开时重放JOURNAL_DOC应该按journal中的内容重写doc
+ *
+ *用法: journal_replay [目录], 默认 /tmp/shm_test_journal_replay, 成功返回0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include "../shared_hash_map.h"
+
+using namespace shm;
+
+struct TestDoc {
+    uint32_t id;
+    char name[28];
+};
+
+HASH_MAP_CONF(TestEntry,16,4);
+
+static const size_t DOCS = 100;
+
+static SharedHashOptions journalOptions() {
+    SharedHashOptions opt;
+    opt.journal=true;
+    return opt;
+}
+
+static TestDoc makeDoc(size_t i) {
+    TestDoc d;
+    memset(&d,0,sizeof(d));
+    d.id=i;
+    snprintf(d.name,sizeof(d.name),"doc_%zu",i);
+    return d;
+}
+
+//子进程写完后直接_exit,不走析构,journal中的记录留给下次打开重放
+static bool writeAndCrash(string path,std::vector<size_t> &offsets) {
+    int fds[2];
+    if(0!=pipe(fds)) {
+        return false;
+    }
+    pid_t pid=fork();
+    if(0==pid) {
+        close(fds[0]);
+        SharedHashMap<TestEntry,TestDoc> m(path,M_READWRITE,64,DEFAULT_HASH_SEED,journalOptions());
+        if(!m.Init()) {
+            _exit(1);
+        }
+        for(size_t i=0;i<DOCS;i++) {
+            TestDoc d=makeDoc(i);
+            size_t pos=m.insertObj(d);
+            if(SIZE_MAX==pos || m.map("key_"+std::to_string(i),pos,1)<0) {
+                _exit(2);
+            }
+            if(write(fds[1],&pos,sizeof(pos))!=sizeof(pos)) {
+                _exit(3);
+            }
+        }
+        if(!m.Commit()) {
+            _exit(4);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    size_t pos;
+    while(read(fds[0],&pos,sizeof(pos))==sizeof(pos)) {
+        offsets.push_back(pos);
+    }
+    close(fds[0]);
+    int status;
+    waitpid(pid,&status,0);
+    return WIFEXITED(status) && 0==WEXITSTATUS(status) && offsets.size()==DOCS;
+}
+
+//bit位不动,直接改doc.data中的内容
+static bool corruptDocs(string path,const std::vector<size_t> &offsets) {
+    int fd=open((path+"/doc.data").c_str(),O_WRONLY);
+    if(fd<0) {
+        return false;
+    }
+    char junk[sizeof(TestDoc)];
+    memset(junk,0xAB,sizeof(junk));
+    bool ok=true;
+    for(size_t i=0;i<offsets.size();i+=2) {
+        off_t off=HEADER_SIZE+offsets[i]*sizeof(TestDoc);
+        ok=ok && pwrite(fd,junk,sizeof(junk),off)==(ssize_t)sizeof(junk);
+    }
+    close(fd);
+    return ok;
+}
+
+int main(int argc,char **argv) {
+    string path=argc>1?argv[1]:"/tmp/shm_test_journal_replay";
+    string cmd="rm -rf "+path;
+    if(0!=system(cmd.c_str())) {
+        return 1;
+    }
+    std::vector<size_t> offsets;
+    if(!writeAndCrash(path,offsets)) {
+        printf("writer failed!\n");
+        return 1;
+    }
+    if(!corruptDocs(path,offsets)) {
+        printf("corrupt doc.data failed!\n");
+        return 1;
+    }
+    SharedHashMap<TestEntry,TestDoc> m(path,M_READWRITE,64,DEFAULT_HASH_SEED,journalOptions());
+    if(!m.Init()) {
+        printf("reopen failed!\n");
+        return 1;
+    }
+    size_t bad=0;
+    for(size_t i=0;i<DOCS;i++) {
+        TestDoc expect=makeDoc(i);
+        DocResult<TestDoc> r=m.get("key_"+std::to_string(i));
+        if(1!=r.docs.size() || 0!=memcmp(r.docs[0].doc,&expect,sizeof(expect))) {
+            printf("doc %zu at %zu not restored from journal\n",i,offsets[i]);
+            bad++;
+        }
+    }
+    if(0!=bad) {
+        printf("FAIL: %zu of %zu docs wrong\n",bad,DOCS);
+        return 1;
+    }
+    printf("OK: %zu docs replayed\n",DOCS);
+    return 0;
+}
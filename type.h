@@ -1,6 +1,11 @@
 #ifndef SHARED_HASH_TYPE_H
 #define SHARED_HASH_TYPE_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+
 namespace shm{
 
 typedef std::basic_string< wchar_t, std::char_traits<wchar_t> > String;
@@ -8,6 +13,288 @@ typedef std::basic_ostringstream< wchar_t, std::char_traits<wchar_t> > StringStr
 
 const std::basic_string< wchar_t, std::char_traits<wchar_t> > EmptyString;
 
+/*
+ *查找统计, 用于观察fingerprint过滤掉了多少次key比较
+ *probes -- 遍历过程中比较过的entry数
+ *fp_skipped -- hash或key长度不一致,没有做key比较的次数
+ *full_compares -- 做了完整key比较的次数
+ */
+struct HashLookupStats {
+    size_t probes;
+    size_t fp_skipped;
+    size_t full_compares;
+    HashLookupStats() {
+        probes=0;
+        fp_skipped=0;
+        full_compares=0;
+    }
+};
+
+/*
+ *一个数据文件的碎片情况(按位置个数)
+ *capacity -- 文件当前能放下的个数
+ *items -- 有数据的位置个数
+ *used_end -- 最后一个有数据的位置加1,之前的空位(used_end-items)是删除留下的碎片,
+ *            之后的部分可以由shrink截掉
+ */
+struct FragmentInfo {
+    size_t capacity;
+    size_t items;
+    size_t used_end;
+    FragmentInfo() {
+        capacity=0;
+        items=0;
+        used_end=0;
+    }
+    inline size_t holes() const {
+        return used_end-items;
+    }
+};
+
+/*
+ *SharedHashMap/SharedHashSet::compact的结果
+ *before/after -- 整理前后value.data/doc.data/posting.data的碎片情况(set只有value)
+ *moved_* -- 搬到前面空位的entry/doc/overflow块个数
+ *freed_* -- 回收的个数: 链表上走不到的entry和块,sweep_docs时没有被引用的doc
+ *done -- true表示已经没有需要搬动的数据(达到max_moves时为false,可以再次调用接着整理)
+ */
+struct CompactStats {
+    FragmentInfo before_value;
+    FragmentInfo before_doc;
+    FragmentInfo before_posting;
+    FragmentInfo after_value;
+    FragmentInfo after_doc;
+    FragmentInfo after_posting;
+    size_t moved_entries;
+    size_t moved_docs;
+    size_t moved_blocks;
+    size_t freed_entries;
+    size_t freed_docs;
+    size_t freed_blocks;
+    bool done;
+    CompactStats() {
+        moved_entries=0;
+        moved_docs=0;
+        moved_blocks=0;
+        freed_entries=0;
+        freed_docs=0;
+        freed_blocks=0;
+        done=false;
+    }
+};
+
+/*
+ *索引类型,创建时指定,之后不能修改
+ *IDX_CHAIN -- bucket->链表(默认),bucket.data/bucket.bit
+ *IDX_SWISS -- 开放寻址(SwissTable分组探测),index.swiss
+ */
+enum IndexType {
+    IDX_CHAIN = 0,
+    IDX_SWISS = 1
+};
+
+/*
+ *数据文件的访问方式,对应madvise的MADV_NORMAL/MADV_RANDOM/MADV_SEQUENTIAL
+ */
+enum MapAdvice {
+    ADVICE_NORMAL = 0,
+    ADVICE_RANDOM = 1,
+    ADVICE_SEQUENTIAL = 2
+};
+
+/*
+ *一组文件的映射方式(见CMapPolicy)
+ *populate -- 映射时把文件全部读入内存(MAP_POPULATE),启动慢一些,之后不再缺页
+ *hugepage -- 使用透明大页(MADV_HUGEPAGE),文件在tmpfs/hugetlbfs上时减少TLB miss
+ *advice -- 随机访问的索引文件用ADVICE_RANDOM关闭预读,顺序扫描用ADVICE_SEQUENTIAL
+ *willneed -- 映射后异步预读(MADV_WILLNEED)
+ */
+struct MapOptions {
+    bool populate;
+    bool hugepage;
+    MapAdvice advice;
+    bool willneed;
+    MapOptions() {
+        populate=false;
+        hugepage=false;
+        advice=ADVICE_NORMAL;
+        willneed=false;
+    }
+};
+
+/*
+ *SharedHashMap/SharedHashSet的可选配置
+ *index_type -- 索引类型
+ *max_load_factor -- IDX_CHAIN时,key个数/bucket个数超过该值后开始逐步增加bucket(线性hash), <=0表示不增长
+ *rehash_steps -- 每次插入新key时最多拆分的bucket个数
+ *unbounded_postings -- 只对SharedHashMap有效,entry中topk个item写满后,分数更低的item放到
+ *                      posting.data的overflow块中,一个key可以对应任意多个value; entry要用HASH_MAP_CONF_UNBOUNDED生成
+ *bloom_fpr -- >0时在bloom.data中维护一个分块bloom filter,查询先查它,不存在的key基本不会访问索引;
+ *             值为期望的误判率,如0.01. 目录中已有bloom.data时总会使用(参数以文件为准)
+ *address_reserve -- >0时每个数据文件预留这么多字节的虚拟地址空间(不占内存),扩容时原地映射,
+ *             doc/entry的指针(DocView/DocResult)在扩容后仍然有效; 64位机器上可以给到文件的最终大小以上,如64G
+ *growth_factor/growth_min_step/growth_max_step/growth_fallocate -- 数据文件的扩容策略(见CGrowthPolicy),
+ *             如1.5/64M/1G/true: 每次扩大到1.5倍,单次在64M和1G之间,用fallocate预分配; 默认按原来的固定步长
+ *index_map -- 索引文件(bucket/value/key/index.swiss/bloom.data)的映射方式
+ *doc_map -- doc.data/posting.data的映射方式
+ *journal -- 只对IDX_CHAIN有效,读写打开时在journal.data中记录insertObj/map/del(见CJournal),
+ *             异常退出后Init先修复索引(回收没有挂到链表上的entry,重新链接bucket,重置seq锁,重新计数)
+ *             再重放最后一次checkpoint之后已经提交的记录; 不能和BeginConcurrentInsert同时使用
+ *journal_group_bytes/journal_group_ops -- group commit: 缓冲的记录达到这么多字节或条数时
+ *             一次write+fdatasync,0表示不按这个条件; 需要立即落盘时调用Commit()
+ *journal_checkpoint_size -- journal文件超过这个大小时做checkpoint: 数据文件全部msync(MS_SYNC)后清空journal
+ *flush_interval_ms/flush_bytes -- 读写打开时任一个>0就启动后台刷盘线程(见CFlusher): 记录每个数据文件修改过的范围,
+ *             每隔flush_interval_ms毫秒,或者新修改的字节数达到flush_bytes时,把这些范围msync(MS_SYNC)写回;
+ *             之后扩容/关闭/SaveToDisk不再msync整个文件,需要落盘时用FlushUntil(writeSeq())等待,
+ *             checkpoint也改为等待刷盘. bloom.data不在其中(可以按索引重建)
+ *inline_occupancy -- 新建时bucket/value/posting数据文件的每个位置带一个8字节的占用标记(见CDataStorage::SetInlineTag),
+ *             查找和遍历冲突链时只访问数据文件,不再读.bit文件,每个位置多8字节;
+ *             已有的文件按创建时的布局打开,和这个参数无关
+ *doc_refcount -- 只对SharedHashMap有效,读写打开时在docref.data中记录每个doc被多少个key引用:
+ *             map新增item时加1,key被删除/item被挤出topk/unmapDoc时减1,减到0时自动删除doc.
+ *             目录中已有docref.data时总会使用,新建时按索引统计一遍; 不能和BeginConcurrentInsert同时使用
+ *doc_key_index -- 在doc_refcount的基础上,在dockey.data中记录每个doc被哪些entry引用,
+ *             unmapDoc只访问这些entry,不再扫描全部entry
+ *lookup_stats -- 查找时累加getLookupStats()的计数器; 计数器是所有线程共享的原子变量,
+ *             多线程读时每次比较都写同一个cache line,默认关闭,只在调试/调参时打开
+ */
+struct SharedHashOptions {
+    IndexType index_type;
+    float max_load_factor;
+    size_t rehash_steps;
+    bool unbounded_postings;
+    double bloom_fpr;
+    size_t address_reserve;
+    double growth_factor;
+    size_t growth_min_step;
+    size_t growth_max_step;
+    bool growth_fallocate;
+    MapOptions index_map;
+    MapOptions doc_map;
+    bool journal;
+    size_t journal_group_bytes;
+    size_t journal_group_ops;
+    size_t journal_checkpoint_size;
+    size_t flush_interval_ms;
+    size_t flush_bytes;
+    bool inline_occupancy;
+    bool doc_refcount;
+    bool doc_key_index;
+    bool lookup_stats;
+    SharedHashOptions() {
+        index_type=IDX_CHAIN;
+        max_load_factor=2.0;
+        rehash_steps=2;
+        unbounded_postings=false;
+        bloom_fpr=0;
+        address_reserve=0;
+        growth_factor=0;
+        growth_min_step=0;
+        growth_max_step=0;
+        growth_fallocate=false;
+        journal=false;
+        journal_group_bytes=1024*1024;
+        journal_group_ops=1024;
+        journal_checkpoint_size=256*1024*1024;
+        flush_interval_ms=0;
+        flush_bytes=0;
+        inline_occupancy=false;
+        doc_refcount=false;
+        doc_key_index=false;
+        lookup_stats=false;
+    }
+};
+
+/*
+ *journal中记录的类型
+ *JOURNAL_DOC -- insertObj: [doc的位置][doc的内容]
+ *JOURNAL_MAP -- map: [doc的位置][score][key], SharedHashSet的insert只有[key]
+ *JOURNAL_DEL -- del: [key]
+ *JOURNAL_UNMAP -- unmapDoc: [doc的位置]
+ */
+enum JournalOp {
+    JOURNAL_DOC = 1,
+    JOURNAL_MAP = 2,
+    JOURNAL_DEL = 3,
+    JOURNAL_UNMAP = 4
+};
+
+/*
+ *Init(WarmupPolicy)的预热方式(见CWarmup)
+ *threads -- 预热线程数, 0表示按cpu个数
+ *chunk_size -- 每个任务的字节数
+ *docs -- 同时预热doc.data/posting.data,默认只预热索引(bucket/value/key/index.swiss)
+ *async -- 只读模式下在后台预热,Init立即返回,用isReady()判断是否完成;读写模式下总是同步预热
+ *verbose -- 打印进度和完成时间
+ *profile -- 非空时只预热上次SaveWarmupProfile记录的热点块,文件不存在时全部预热
+ */
+struct WarmupPolicy {
+    size_t threads;
+    size_t chunk_size;
+    bool docs;
+    bool async;
+    bool verbose;
+    std::string profile;
+    WarmupPolicy() {
+        threads=0;
+        chunk_size=4*1024*1024;
+        docs=false;
+        async=false;
+        verbose=false;
+    }
+};
+
+/*
+ *一写多读时,读进程遍历冲突链遇到正在拆分/删除的位置会从bucket头重新开始,
+ *超过这个次数后按当前看到的链表查完(写进程持续修改同一个bucket的情况很少)
+ */
+const int SWMR_MAX_RETRY = 8;
+
+/*
+ *读进程等待顺序锁的次数上限,超过SWMR_MAX_RETRY次之后每次都让出cpu,写进程在修改中途被调度出去时可以继续执行
+ *超过上限(写进程在修改中途退出)时按当前内容读取
+ */
+const int SWMR_SPIN_LIMIT = 4096;
+
+//并发写模式下某个文件需要扩容,内部先释放共享锁,加独占锁扩容后重试
+const int RETRY_EXTEND = -2;
+
+//key.data的初始大小(字节)
+const size_t KEY_ARENA_INIT_SIZE = 4*1024*1024;
+
+/*
+ *分步查询的状态,见SharedHashMap::lookup/step
+ *LOOKUP_BUCKET -- 已经算好hash,预取了bucket(或swiss的group)
+ *LOOKUP_ENTRY -- 已经找到链表头(或hash匹配的entry),预取了entry
+ *LOOKUP_DONE -- 查询结束,entry为NULL表示不存在
+ */
+enum LookupStage {
+    LOOKUP_BUCKET = 0,
+    LOOKUP_ENTRY = 1,
+    LOOKUP_DONE = 2
+};
+
+//批量查询时每一批同时推进的查询个数
+const size_t MULTI_LOOKUP_BATCH = 16;
+
+template<typename ENTRY>
+struct HashLookup {
+    std::string_view key;
+    uint64_t hash;
+    size_t pos;//bucket下标或entry下标
+    int stage;
+    const ENTRY *entry;
+    HashLookup() {
+        hash=0;
+        pos=SIZE_MAX;
+        stage=LOOKUP_DONE;
+        entry=NULL;
+    }
+    inline bool done() const {
+        return LOOKUP_DONE==stage;
+    }
+};
+
 struct HashBucket {
 	size_t header;//指向hash数据头
 	HashBucket() {